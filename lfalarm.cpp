@@ -0,0 +1,259 @@
+// Fence-break alarm for laser fence application.
+
+#include "lfalarm.h"
+#include <iostream>
+#include <math.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+const char *lfAlarmTypeName(LfAlarmType type)
+{
+    return type == LF_ALARM_CLEARED ? "cleared" : "raised";
+}
+
+int lfFormatAlarm(const LfAlarmEvent &event, char *line, size_t size)
+{
+    return snprintf(line, size, "alarm %s camera=%u seq=%u column=%u run=%u timestamp=%llu latency_us=%llu\n",
+                    lfAlarmTypeName(event.type), event.camera, event.seq, event.column, event.run,
+                    event.timestamp, event.decided > event.timestamp ? event.decided - event.timestamp : 0);
+}
+
+LfSocketSink::LfSocketSink(const char *path)
+    : path(path), fd(-1), sent(0), dropped(0)
+{
+    if (strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+    {
+        throw runtime_error("Alarm socket path too long");
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        throw runtime_error("Can't create alarm socket");
+    }
+}
+
+LfSocketSink::~LfSocketSink()
+{
+    close(fd);
+}
+
+void LfSocketSink::raise(const LfAlarmEvent &event)
+{
+    char line[256];
+    int length = lfFormatAlarm(event, line, sizeof(line));
+
+    // Not connected, so a listener may come and go while we run
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (sendto(fd, line, length, MSG_DONTWAIT, (struct sockaddr *)&address, sizeof(address)) == length)
+    {
+        sent++;
+    }
+    else
+    {
+        dropped++;
+    }
+}
+
+LfFileSink::LfFileSink(const char *path)
+{
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        throw runtime_error("Can't open alarm file");
+    }
+}
+
+LfFileSink::~LfFileSink()
+{
+    close(fd);
+}
+
+void LfFileSink::raise(const LfAlarmEvent &event)
+{
+    char line[256];
+    int length = lfFormatAlarm(event, line, sizeof(line));
+    // One write per line keeps lines whole with other appenders
+    if (write(fd, line, length) != length)
+    {
+        cout << "Failed to write alarm file" << endl;
+    }
+}
+
+
+
+void lfAlarmDefaults(LfAlarmSettings *settings)
+{
+    settings->tolerance = 3.0;
+    settings->minRun = 8;
+    settings->learnPairs = 30;
+    settings->adaptShift = 6;
+    settings->clearPairs = 15;
+    settings->budgetUs = 5000;
+}
+
+LfAlarmDetector::LfAlarmDetector(unsigned int sensorWidth, const LfAlarmSettings &settings)
+    : settings(settings), sensorWidth(sensorWidth), baseline(sensorWidth, 0), seen(sensorWidth, 0), pairs(0),
+      armed(false), alarmed(false), wholePairs(0), alarms(0), overBudget(0)
+{
+    if (this->settings.minRun == 0)
+    {
+        this->settings.minRun = 1;
+    }
+}
+
+void LfAlarmDetector::learn(const LfProfiler &profile)
+{
+    const float *rows = profile.getRows();
+    unsigned int offset = profile.getOffsetX();
+    for (unsigned int x = 0; x < profile.getWidth() && offset + x < sensorWidth; x++)
+    {
+        if (rows[x] != k_lfNoLine)
+        {
+            // Running mean over the pairs the line was seen in
+            unsigned int c = offset + x;
+            seen[c]++;
+            baseline[c] += (rows[x] - baseline[c]) / seen[c];
+        }
+    }
+
+    if (pairs + 1 < settings.learnPairs)
+    {
+        return;
+    }
+    // A column the line was missing from half the time can't be judged
+    unsigned int judged = 0;
+    for (unsigned int c = 0; c < sensorWidth; c++)
+    {
+        if (seen[c] < (settings.learnPairs + 1) / 2)
+        {
+            seen[c] = 0;
+        }
+        else
+        {
+            judged++;
+        }
+    }
+    armed = true;
+    cout << "Alarm armed on " << judged << " of " << sensorWidth << " columns" << endl;
+}
+
+void LfAlarmDetector::record(unsigned long long latencyUs)
+{
+    latency.record(latencyUs * 1000);
+    if (latencyUs > settings.budgetUs)
+    {
+        overBudget++;
+    }
+}
+
+void LfAlarmDetector::emit(LfAlarmType type, unsigned int column, unsigned int run, unsigned int camera,
+                           unsigned int seq, unsigned long long timestamp, unsigned long long decided)
+{
+    LfAlarmEvent event;
+    event.type = type;
+    event.camera = camera;
+    event.seq = seq;
+    event.column = column;
+    event.run = run;
+    event.timestamp = timestamp;
+    event.decided = decided;
+    for (unsigned int i = 0; i < sinks.size(); i++)
+    {
+        sinks[i]->raise(event);
+    }
+}
+
+bool LfAlarmDetector::check(const LfProfiler &profile, unsigned int camera, unsigned int seq,
+                            unsigned long long timestamp)
+{
+    if (!armed)
+    {
+        learn(profile);
+        pairs++;
+        return false;
+    }
+    pairs++;
+
+    const float *rows = profile.getRows();
+    unsigned int offset = profile.getOffsetX();
+    unsigned int width = profile.getWidth();
+    if (offset + width > sensorWidth)
+    {
+        width = offset < sensorWidth ? sensorWidth - offset : 0;
+    }
+    float tolerance = settings.tolerance;
+    float rate = 1.0f / (1 << settings.adaptShift);
+    unsigned int run = 0;
+    unsigned int runStart = 0;
+    bool broken = false;
+    for (unsigned int x = 0; x < width; x++)
+    {
+        unsigned int c = offset + x;
+        if (seen[c] == 0)
+        {
+            run = 0;
+            continue;
+        }
+        float row = rows[x];
+        if (row == k_lfNoLine || fabsf(row - baseline[c]) > tolerance)
+        {
+            if (run++ == 0)
+            {
+                runStart = c;
+            }
+            if (run >= settings.minRun)
+            {
+                broken = true;
+                break;
+            }
+        }
+        else
+        {
+            // Whole columns follow slow drift such as a sagging mount
+            run = 0;
+            baseline[c] += (row - baseline[c]) * rate;
+        }
+    }
+
+    unsigned long long decided = lfTimestampUs();
+    record(decided > timestamp ? decided - timestamp : 0);
+    if (broken)
+    {
+        wholePairs = 0;
+        if (!alarmed)
+        {
+            alarmed = true;
+            alarms++;
+            emit(LF_ALARM_RAISED, runStart, run, camera, seq, timestamp, decided);
+        }
+    }
+    else if (alarmed && ++wholePairs >= settings.clearPairs)
+    {
+        alarmed = false;
+        emit(LF_ALARM_CLEARED, 0, 0, camera, seq, timestamp, decided);
+    }
+    return alarmed;
+}
+
+unsigned long long LfAlarmDetector::getLatency(double fraction) const
+{
+    // Upper edge of the bucket the percentile falls in, rounded up to us
+    return (latency.getPercentile(fraction) + 999) / 1000;
+}
+
+void LfAlarmDetector::printStats()
+{
+    cout << "Alarm " << (armed ? (alarmed ? "raised" : "armed") : "learning") << ": " << alarms << " alarms in "
+         << pairs << " pairs, latency p50 " << getLatency(0.5) << " us, p99 " << getLatency(0.99) << " us, max "
+         << latency.getMax() / 1000 << " us, " << overBudget << " over the " << settings.budgetUs << " us budget" << endl;
+}
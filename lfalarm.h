@@ -0,0 +1,131 @@
+// Fence-break alarm for laser fence application.
+
+#ifndef LFALARM_H
+#define LFALARM_H
+
+#include "stdafx.h"
+#include <string>
+#include <vector>
+#include "lfalg.h"
+#include "lfmetrics.h"
+
+enum LfAlarmType {
+    LF_ALARM_RAISED = 0,    // The line broke
+    LF_ALARM_CLEARED        // It has been whole again for a while
+};
+
+struct LfAlarmEvent {
+    LfAlarmType type;
+    unsigned int camera;
+    unsigned int seq;               // Sequence number of the laser-on frame
+    unsigned int column;            // First broken sensor column
+    unsigned int run;               // Broken columns found next to it
+    unsigned long long timestamp;   // Image timestamp of the pair, us
+    unsigned long long decided;     // When the detector decided, same clock
+};
+
+const char *lfAlarmTypeName(LfAlarmType type);
+
+// Where alarms go.  raise() is called on the processing thread, so sinks
+// must not block on a slow receiver.
+class LfAlarmSink {
+public:
+    virtual ~LfAlarmSink() {}
+    virtual void raise(const LfAlarmEvent &event) = 0;
+};
+
+typedef void (*LfAlarmCallback)(const LfAlarmEvent &event, void *context);
+
+class LfCallbackSink: public LfAlarmSink {
+protected:
+    LfAlarmCallback callback;
+    void *context;
+public:
+    LfCallbackSink(LfAlarmCallback callback, void *context) : callback(callback), context(context) {}
+    virtual void raise(const LfAlarmEvent &event) { callback(event, context); }
+};
+
+// One text line per event as a datagram to a Unix socket path.  Sends
+// never wait: with no listener, or a full one, the event is counted as
+// dropped.
+class LfSocketSink: public LfAlarmSink {
+protected:
+    std::string path;
+    int fd;
+    unsigned long sent;
+    unsigned long dropped;
+public:
+    LfSocketSink(const char *path);
+    virtual ~LfSocketSink();
+    virtual void raise(const LfAlarmEvent &event);
+    unsigned long getSent() const { return sent; }
+    unsigned long getDropped() const { return dropped; }
+};
+
+// One text line per event appended to a file
+class LfFileSink: public LfAlarmSink {
+protected:
+    int fd;
+public:
+    LfFileSink(const char *path);
+    virtual ~LfFileSink();
+    virtual void raise(const LfAlarmEvent &event);
+};
+
+// Formats an event as the line the socket and file sinks write
+int lfFormatAlarm(const LfAlarmEvent &event, char *line, size_t size);
+
+struct LfAlarmSettings {
+    double tolerance;           // Rows the line may move from the baseline
+    unsigned int minRun;        // Adjacent broken columns that make a break
+    unsigned int learnPairs;    // Pairs the baseline is learned over
+    unsigned int adaptShift;    // Whole columns follow drift at 1 / 2^shift per pair
+    unsigned int clearPairs;    // Whole pairs before an alarm clears
+    unsigned int budgetUs;      // Trigger-to-decision latency allowed
+};
+
+void lfAlarmDefaults(LfAlarmSettings *settings);
+
+// Decides from each laser profile whether the fence was crossed.  The
+// first learnPairs pairs learn where the line lies in every column; after
+// that a column is broken when the line is missing or has moved more
+// than the tolerance.  The scan stops at the first run of minRun broken
+// columns, so a break costs no more than the columns before it.  Columns
+// the line never showed in while learning are ignored.
+//
+// Every decision's latency from the image timestamp is kept in a
+// histogram; decisions over budget are counted.
+class LfAlarmDetector {
+protected:
+    LfAlarmSettings settings;
+    unsigned int sensorWidth;
+    std::vector<float> baseline;        // Sensor row of the line per column
+    std::vector<unsigned int> seen;     // Learning pairs the line was in a column
+    std::vector<LfAlarmSink *> sinks;
+    unsigned long pairs;
+    bool armed;
+    bool alarmed;
+    unsigned int wholePairs;
+    unsigned long alarms;
+    unsigned long overBudget;
+    LfLatencyHistogram latency;         // ns from image timestamp to decision
+    void learn(const LfProfiler &profile);
+    void record(unsigned long long latencyUs);
+    void emit(LfAlarmType type, unsigned int column, unsigned int run, unsigned int camera, unsigned int seq,
+              unsigned long long timestamp, unsigned long long decided);
+public:
+    LfAlarmDetector(unsigned int sensorWidth, const LfAlarmSettings &settings);
+    void addSink(LfAlarmSink *sink) { sinks.push_back(sink); }
+    // Judge one pair's profile; timestamp is the laser-on image's.  Returns
+    // true while the fence is broken.
+    bool check(const LfProfiler &profile, unsigned int camera, unsigned int seq, unsigned long long timestamp);
+    bool isArmed() const { return armed; }
+    bool isAlarmed() const { return alarmed; }
+    unsigned long getAlarms() const { return alarms; }
+    unsigned long getOverBudget() const { return overBudget; }
+    // Latency percentile in us from the histogram, 0 <= fraction <= 1
+    unsigned long long getLatency(double fraction) const;
+    void printStats();
+};
+
+#endif
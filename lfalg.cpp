@@ -1,2 +1,1551 @@
 // Laserfence algorithms for image processing
 // 07/16/15 LAJ -- Document created
+
+#include "lfalg.h"
+#include "lfbuf.h"
+#include <math.h>
+#include <string.h>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LF_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+LfCpuLevel lfDetectCpuLevel()
+{
+#ifdef LF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        return LF_CPU_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return LF_CPU_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return LF_CPU_SSE41;
+    }
+#endif
+    return LF_CPU_SCALAR;
+}
+
+const char *lfCpuLevelName(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+        return "avx512";
+    case LF_CPU_AVX2:
+        return "avx2";
+    case LF_CPU_SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+size_t lfDiffScalar(const unsigned char *on, const unsigned char *off,
+                    unsigned char *diff, unsigned char *mask,
+                    size_t n, unsigned char threshold)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char d = on[i] > off[i] ? on[i] - off[i] : off[i] - on[i];
+        unsigned char m = d >= threshold ? 255 : 0;
+        diff[i] = d;
+        mask[i] = m;
+        count += m & 1;
+    }
+    return count;
+}
+
+#ifdef LF_X86
+
+__attribute__((target("sse4.1,popcnt")))
+size_t lfDiffSse41(const unsigned char *on, const unsigned char *off,
+                   unsigned char *diff, unsigned char *mask,
+                   size_t n, unsigned char threshold)
+{
+    const __m128i t = _mm_set1_epi8((char)threshold);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(on + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(off + i));
+        // |a - b| as the OR of both saturating differences
+        __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        // d >= t  <=>  max(d, t) == d
+        __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(d, t), d);
+        _mm_storeu_si128((__m128i *)(diff + i), d);
+        _mm_storeu_si128((__m128i *)(mask + i), m);
+        count += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+
+    return count + lfDiffScalar(on + i, off + i, diff + i, mask + i, n - i, threshold);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t lfDiffAvx2(const unsigned char *on, const unsigned char *off,
+                  unsigned char *diff, unsigned char *mask,
+                  size_t n, unsigned char threshold)
+{
+    const __m256i t = _mm256_set1_epi8((char)threshold);
+    size_t count = 0;
+    size_t i = 0;
+
+    // Two vectors per iteration keeps both load ports busy
+    for (; i + 64 <= n; i += 64)
+    {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(on + i));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(off + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(on + i + 32));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(off + i + 32));
+        __m256i d0 = _mm256_or_si256(_mm256_subs_epu8(a0, b0), _mm256_subs_epu8(b0, a0));
+        __m256i d1 = _mm256_or_si256(_mm256_subs_epu8(a1, b1), _mm256_subs_epu8(b1, a1));
+        __m256i m0 = _mm256_cmpeq_epi8(_mm256_max_epu8(d0, t), d0);
+        __m256i m1 = _mm256_cmpeq_epi8(_mm256_max_epu8(d1, t), d1);
+        _mm256_storeu_si256((__m256i *)(diff + i), d0);
+        _mm256_storeu_si256((__m256i *)(diff + i + 32), d1);
+        _mm256_storeu_si256((__m256i *)(mask + i), m0);
+        _mm256_storeu_si256((__m256i *)(mask + i + 32), m1);
+        count += __builtin_popcount((unsigned int)_mm256_movemask_epi8(m0));
+        count += __builtin_popcount((unsigned int)_mm256_movemask_epi8(m1));
+    }
+
+    return count + lfDiffSse41(on + i, off + i, diff + i, mask + i, n - i, threshold);
+}
+
+#else
+
+size_t lfDiffSse41(const unsigned char *on, const unsigned char *off,
+                   unsigned char *diff, unsigned char *mask,
+                   size_t n, unsigned char threshold)
+{
+    return lfDiffScalar(on, off, diff, mask, n, threshold);
+}
+
+size_t lfDiffAvx2(const unsigned char *on, const unsigned char *off,
+                  unsigned char *diff, unsigned char *mask,
+                  size_t n, unsigned char threshold)
+{
+    return lfDiffScalar(on, off, diff, mask, n, threshold);
+}
+
+#endif
+
+LfDiffKernel lfGetDiffKernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfDiffAvx2;
+    case LF_CPU_SSE41:
+        return lfDiffSse41;
+    default:
+        return lfDiffScalar;
+    }
+}
+
+
+
+// 8-bit value of a sample
+static inline unsigned int sampleByte(unsigned char v, unsigned int)
+{
+    return v;
+}
+
+static inline unsigned int sampleByte(unsigned short v, unsigned int shift)
+{
+    unsigned int b = v >> (4 + shift);
+    return b < 255 ? b : 255;
+}
+
+template <typename Sample>
+static inline size_t frameDiffRow(const Sample *a, const Sample *b, unsigned char *diff, unsigned char *mask,
+                                  unsigned int n, unsigned int shift, unsigned char threshold)
+{
+    size_t count = 0;
+    for (unsigned int x = 0; x < n; x++)
+    {
+        unsigned int u = sampleByte(a[x], shift);
+        unsigned int v = sampleByte(b[x], shift);
+        unsigned int d = u > v ? u - v : v - u;
+        diff[x] = d;
+        mask[x] = d >= threshold ? 255 : 0;
+        count += d >= threshold;
+    }
+    return count;
+}
+
+// Width 0 means the width argument; any other is fixed at compile time
+template <typename Sample, unsigned int Width>
+size_t lfFrameDiffScalar(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                         unsigned int width, unsigned int height, unsigned int shift,
+                         unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    const unsigned int n = Width ? Width : width;
+    size_t count = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        size_t out = (size_t)y * n;
+        count += frameDiffRow((const Sample *)(on + (size_t)y * stride), (const Sample *)(off + (size_t)y * stride),
+                              diff + out, mask + out, n, shift, threshold);
+    }
+    return count;
+}
+
+#ifdef LF_X86
+
+// Loaders returning the next vector of pixels as bytes.  16-bit samples
+// are shifted down, packed with saturation and, across 256- and 512-bit
+// registers, put back in order.
+__attribute__((target("sse4.1")))
+static inline __m128i loadBytesSse41(const unsigned char *p, __m128i)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i loadBytesSse41(const unsigned short *p, __m128i count)
+{
+    __m128i a = _mm_srl_epi16(_mm_loadu_si128((const __m128i *)p), count);
+    __m128i b = _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(p + 8)), count);
+    return _mm_packus_epi16(a, b);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i loadBytesAvx2(const unsigned char *p, __m128i)
+{
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i loadBytesAvx2(const unsigned short *p, __m128i count)
+{
+    __m256i a = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)p), count);
+    __m256i b = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(p + 16)), count);
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i loadBytesAvx512(const unsigned char *p, __m128i)
+{
+    return _mm512_loadu_si512((const void *)p);
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i loadBytesAvx512(const unsigned short *p, __m128i count)
+{
+    const __m512i order = _mm512_set_epi64(7, 5, 3, 1, 6, 4, 2, 0);
+    __m512i a = _mm512_srl_epi16(_mm512_loadu_si512((const void *)p), count);
+    __m512i b = _mm512_srl_epi16(_mm512_loadu_si512((const void *)(p + 32)), count);
+    return _mm512_permutexvar_epi64(order, _mm512_packus_epi16(a, b));
+}
+
+template <typename Sample, unsigned int Width>
+__attribute__((target("sse4.1,popcnt")))
+size_t lfFrameDiffSse41(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                        unsigned int width, unsigned int height, unsigned int shift,
+                        unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    const unsigned int n = Width ? Width : width;
+    const unsigned int whole = n / 16 * 16;
+    const __m128i t = _mm_set1_epi8((char)threshold);
+    const __m128i count = _mm_cvtsi32_si128(4 + shift);
+    size_t hits = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const Sample *a = (const Sample *)(on + (size_t)y * stride);
+        const Sample *b = (const Sample *)(off + (size_t)y * stride);
+        unsigned char *d = diff + (size_t)y * n;
+        unsigned char *m = mask + (size_t)y * n;
+        for (unsigned int x = 0; x < whole; x += 16)
+        {
+            __m128i u = loadBytesSse41(a + x, count);
+            __m128i v = loadBytesSse41(b + x, count);
+            __m128i e = _mm_or_si128(_mm_subs_epu8(u, v), _mm_subs_epu8(v, u));
+            __m128i k = _mm_cmpeq_epi8(_mm_max_epu8(e, t), e);
+            _mm_storeu_si128((__m128i *)(d + x), e);
+            _mm_storeu_si128((__m128i *)(m + x), k);
+            hits += __builtin_popcount(_mm_movemask_epi8(k));
+        }
+        // Never taken for the fixed widths, which are all multiples of 64
+        if (whole < n)
+        {
+            hits += frameDiffRow(a + whole, b + whole, d + whole, m + whole, n - whole, shift, threshold);
+        }
+    }
+    return hits;
+}
+
+template <typename Sample, unsigned int Width>
+__attribute__((target("avx2,popcnt")))
+size_t lfFrameDiffAvx2(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                       unsigned int width, unsigned int height, unsigned int shift,
+                       unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    const unsigned int n = Width ? Width : width;
+    const unsigned int whole = n / 32 * 32;
+    const __m256i t = _mm256_set1_epi8((char)threshold);
+    const __m128i count = _mm_cvtsi32_si128(4 + shift);
+    size_t hits = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const Sample *a = (const Sample *)(on + (size_t)y * stride);
+        const Sample *b = (const Sample *)(off + (size_t)y * stride);
+        unsigned char *d = diff + (size_t)y * n;
+        unsigned char *m = mask + (size_t)y * n;
+        for (unsigned int x = 0; x < whole; x += 32)
+        {
+            __m256i u = loadBytesAvx2(a + x, count);
+            __m256i v = loadBytesAvx2(b + x, count);
+            __m256i e = _mm256_or_si256(_mm256_subs_epu8(u, v), _mm256_subs_epu8(v, u));
+            __m256i k = _mm256_cmpeq_epi8(_mm256_max_epu8(e, t), e);
+            _mm256_storeu_si256((__m256i *)(d + x), e);
+            _mm256_storeu_si256((__m256i *)(m + x), k);
+            hits += __builtin_popcount((unsigned int)_mm256_movemask_epi8(k));
+        }
+        if (whole < n)
+        {
+            hits += frameDiffRow(a + whole, b + whole, d + whole, m + whole, n - whole, shift, threshold);
+        }
+    }
+    return hits;
+}
+
+template <typename Sample, unsigned int Width>
+__attribute__((target("avx512bw,popcnt")))
+size_t lfFrameDiffAvx512(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                         unsigned int width, unsigned int height, unsigned int shift,
+                         unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    const unsigned int n = Width ? Width : width;
+    const unsigned int whole = n / 64 * 64;
+    const __m512i t = _mm512_set1_epi8((char)threshold);
+    const __m128i count = _mm_cvtsi32_si128(4 + shift);
+    size_t hits = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const Sample *a = (const Sample *)(on + (size_t)y * stride);
+        const Sample *b = (const Sample *)(off + (size_t)y * stride);
+        unsigned char *d = diff + (size_t)y * n;
+        unsigned char *m = mask + (size_t)y * n;
+        for (unsigned int x = 0; x < whole; x += 64)
+        {
+            __m512i u = loadBytesAvx512(a + x, count);
+            __m512i v = loadBytesAvx512(b + x, count);
+            __m512i e = _mm512_or_si512(_mm512_subs_epu8(u, v), _mm512_subs_epu8(v, u));
+            // The compare lands in a mask register, one bit per pixel
+            __mmask64 k = _mm512_cmpge_epu8_mask(e, t);
+            _mm512_storeu_si512((void *)(d + x), e);
+            _mm512_storeu_si512((void *)(m + x), _mm512_movm_epi8(k));
+            hits += __builtin_popcountll(k);
+        }
+        if (whole < n)
+        {
+            hits += frameDiffRow(a + whole, b + whole, d + whole, m + whole, n - whole, shift, threshold);
+        }
+    }
+    return hits;
+}
+
+#else
+
+template <typename Sample, unsigned int Width>
+size_t lfFrameDiffSse41(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                        unsigned int width, unsigned int height, unsigned int shift,
+                        unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    return lfFrameDiffScalar<Sample, Width>(on, off, stride, width, height, shift, diff, mask, threshold);
+}
+
+template <typename Sample, unsigned int Width>
+size_t lfFrameDiffAvx2(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                       unsigned int width, unsigned int height, unsigned int shift,
+                       unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    return lfFrameDiffScalar<Sample, Width>(on, off, stride, width, height, shift, diff, mask, threshold);
+}
+
+template <typename Sample, unsigned int Width>
+size_t lfFrameDiffAvx512(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                         unsigned int width, unsigned int height, unsigned int shift,
+                         unsigned char *diff, unsigned char *mask, unsigned char threshold)
+{
+    return lfFrameDiffScalar<Sample, Width>(on, off, stride, width, height, shift, diff, mask, threshold);
+}
+
+#endif
+
+template <typename Sample, unsigned int Width>
+static LfFrameDiffKernel frameDiffAt(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+        return lfFrameDiffAvx512<Sample, Width>;
+    case LF_CPU_AVX2:
+        return lfFrameDiffAvx2<Sample, Width>;
+    case LF_CPU_SSE41:
+        return lfFrameDiffSse41<Sample, Width>;
+    default:
+        return lfFrameDiffScalar<Sample, Width>;
+    }
+}
+
+// Common sensor and ROI widths; each one costs a build per type and level
+template <typename Sample>
+static LfFrameDiffKernel frameDiffFor(LfCpuLevel level, unsigned int width)
+{
+    switch (width)
+    {
+    case 640:
+        return frameDiffAt<Sample, 640>(level);
+    case 1280:
+        return frameDiffAt<Sample, 1280>(level);
+    case 1920:
+        return frameDiffAt<Sample, 1920>(level);
+    case 2048:
+        return frameDiffAt<Sample, 2048>(level);
+    default:
+        return frameDiffAt<Sample, 0>(level);
+    }
+}
+
+bool lfIsSpecialisedWidth(unsigned int width)
+{
+    return width == 640 || width == 1280 || width == 1920 || width == 2048;
+}
+
+LfFrameDiffKernel lfGetFrameDiffKernel(LfCpuLevel level, LfPixelFormat format, unsigned int width)
+{
+    switch (format)
+    {
+    case LF_PIXEL_MONO8:
+        return frameDiffFor<unsigned char>(level, width);
+    case LF_PIXEL_MONO16:
+        return frameDiffFor<unsigned short>(level, width);
+    default:
+        return NULL;
+    }
+}
+
+
+
+void lfTileSadScalar(const unsigned char *a, const unsigned char *b, unsigned int n,
+                     unsigned char noise, unsigned int *sums)
+{
+    for (unsigned int x = 0; x < n; x++)
+    {
+        int d = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+        sums[x / k_lfTileWidth] += d > noise ? d - noise : 0;
+    }
+}
+
+#ifdef LF_X86
+
+__attribute__((target("sse4.1")))
+void lfTileSadSse41(const unsigned char *a, const unsigned char *b, unsigned int n,
+                    unsigned char noise, unsigned int *sums)
+{
+    const __m128i floor = _mm_set1_epi8((char)noise);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int x = 0;
+    for (; x + 64 <= n; x += 64)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (unsigned int k = 0; k < 64; k += 16)
+        {
+            __m128i u = _mm_loadu_si128((const __m128i *)(a + x + k));
+            __m128i v = _mm_loadu_si128((const __m128i *)(b + x + k));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(u, v), _mm_subs_epu8(v, u));
+            // PSADBW against zero adds up the bytes left over the noise
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_subs_epu8(d, floor), zero));
+        }
+        sums[x / 64] += _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+    }
+    if (x < n)
+    {
+        lfTileSadScalar(a + x, b + x, n - x, noise, sums + x / 64);
+    }
+}
+
+__attribute__((target("avx2")))
+void lfTileSadAvx2(const unsigned char *a, const unsigned char *b, unsigned int n,
+                   unsigned char noise, unsigned int *sums)
+{
+    const __m256i floor = _mm256_set1_epi8((char)noise);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned int x = 0;
+    for (; x + 64 <= n; x += 64)
+    {
+        __m256i u0 = _mm256_loadu_si256((const __m256i *)(a + x));
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(b + x));
+        __m256i u1 = _mm256_loadu_si256((const __m256i *)(a + x + 32));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(b + x + 32));
+        __m256i d0 = _mm256_or_si256(_mm256_subs_epu8(u0, v0), _mm256_subs_epu8(v0, u0));
+        __m256i d1 = _mm256_or_si256(_mm256_subs_epu8(u1, v1), _mm256_subs_epu8(v1, u1));
+        __m256i acc = _mm256_add_epi64(_mm256_sad_epu8(_mm256_subs_epu8(d0, floor), zero),
+                                       _mm256_sad_epu8(_mm256_subs_epu8(d1, floor), zero));
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sums[x / 64] += _mm_cvtsi128_si32(half) + _mm_extract_epi32(half, 2);
+    }
+    if (x < n)
+    {
+        lfTileSadScalar(a + x, b + x, n - x, noise, sums + x / 64);
+    }
+}
+
+#else
+
+void lfTileSadSse41(const unsigned char *a, const unsigned char *b, unsigned int n,
+                    unsigned char noise, unsigned int *sums)
+{
+    lfTileSadScalar(a, b, n, noise, sums);
+}
+
+void lfTileSadAvx2(const unsigned char *a, const unsigned char *b, unsigned int n,
+                   unsigned char noise, unsigned int *sums)
+{
+    lfTileSadScalar(a, b, n, noise, sums);
+}
+
+#endif
+
+LfTileSadKernel lfGetTileSadKernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfTileSadAvx2;
+    case LF_CPU_SSE41:
+        return lfTileSadSse41;
+    default:
+        return lfTileSadScalar;
+    }
+}
+
+
+
+LfDiffEngine::LfDiffEngine(unsigned int width, unsigned int height, unsigned char threshold)
+    : width(width), height(height), capacity((size_t)width * height), offsetX(0), offsetY(0),
+      threshold(threshold), diff(NULL), mask(NULL), maskCount(0), pairNumber(0), changeMap(false),
+      changeNoise(16), minChange(256), refOn(NULL), refOff(NULL), refValid(false), tilesX(0), tilesY(0),
+      tilesTotal(0), tilesSkipped(0), sampleShift(4), frameKernel(NULL), frameFormat(LF_PIXEL_MONO8), frameWidth(0)
+{
+    size_t bytes = capacity;
+
+    // 64-byte alignment keeps every AVX2 store within one cache line
+    diff = (unsigned char *)lfAlignedAlloc(bytes);
+    mask = (unsigned char *)lfAlignedAlloc(bytes);
+    if (diff == NULL || mask == NULL)
+    {
+        lfAlignedFree(diff);
+        lfAlignedFree(mask);
+        throw runtime_error("Can't allocate difference planes");
+    }
+
+    setCpuLevel(lfDetectCpuLevel());
+}
+
+LfDiffEngine::~LfDiffEngine()
+{
+    lfAlignedFree(diff);
+    lfAlignedFree(mask);
+    lfAlignedFree(refOn);
+    lfAlignedFree(refOff);
+}
+
+void LfDiffEngine::setCpuLevel(LfCpuLevel level)
+{
+    // Never run a kernel the CPU cannot execute
+    if (level > lfDetectCpuLevel())
+    {
+        level = lfDetectCpuLevel();
+    }
+    cpuLevel = level;
+    kernel = lfGetDiffKernel(level);
+    sadKernel = lfGetTileSadKernel(level);
+    frameKernel = NULL;
+}
+
+int LfDiffEngine::setChangeMap(bool enable, unsigned char noise, unsigned int change)
+{
+    if (enable && refOn == NULL)
+    {
+        refOn = (unsigned char *)lfAlignedAlloc(capacity);
+        refOff = (unsigned char *)lfAlignedAlloc(capacity);
+        if (refOn == NULL || refOff == NULL)
+        {
+            lfAlignedFree(refOn);
+            lfAlignedFree(refOff);
+            refOn = NULL;
+            refOff = NULL;
+            return -1;
+        }
+    }
+    changeMap = enable;
+    changeNoise = noise;
+    minChange = change > 0 ? change : 1;
+    refValid = false;
+    return 0;
+}
+
+size_t LfDiffEngine::processTiles(const unsigned char *on, const unsigned char *off, unsigned int stride)
+{
+    tilesX = (width + k_lfTileWidth - 1) / k_lfTileWidth;
+    tilesY = (height + k_lfTileHeight - 1) / k_lfTileHeight;
+    size_t tiles = (size_t)tilesX * tilesY;
+    if (tileDirty.size() < tiles)
+    {
+        tileDirty.resize(tiles);
+        tileMask.resize(tiles);
+    }
+    if (tileChange.size() < 3 * (size_t)tilesX)
+    {
+        tileChange.resize(3 * tilesX);
+    }
+    if (zeroRow.size() < width)
+    {
+        zeroRow.resize(width);
+    }
+    unsigned int *onChange = tileChange.data();
+    unsigned int *offChange = onChange + tilesX;
+    unsigned int *maskSum = offChange + tilesX;
+
+    maskCount = 0;
+    for (unsigned int ty = 0; ty < tilesY; ty++)
+    {
+        unsigned int y0 = ty * k_lfTileHeight;
+        unsigned int y1 = height - y0 < k_lfTileHeight ? height : y0 + k_lfTileHeight;
+        unsigned char *dirty = &tileDirty[(size_t)ty * tilesX];
+        size_t *counts = &tileMask[(size_t)ty * tilesX];
+
+        // Measure the whole row of tiles first, a pixel row at a time so
+        // memory is read in order.  The laser-off frame is only read where
+        // the laser-on one left tiles clean.
+        if (refValid)
+        {
+            memset(onChange, 0, 2 * tilesX * sizeof(unsigned int));
+            for (unsigned int y = y0; y < y1; y++)
+            {
+                sadKernel(on + (size_t)y * stride, refOn + (size_t)y * width, width, changeNoise, onChange);
+            }
+            unsigned int tx = 0;
+            while (tx < tilesX)
+            {
+                if (onChange[tx] >= minChange)
+                {
+                    tx++;
+                    continue;
+                }
+                unsigned int first = tx;
+                while (tx < tilesX && onChange[tx] < minChange)
+                {
+                    tx++;
+                }
+                unsigned int x0 = first * k_lfTileWidth;
+                unsigned int n = (tx * k_lfTileWidth < width ? tx * k_lfTileWidth : width) - x0;
+                for (unsigned int y = y0; y < y1; y++)
+                {
+                    size_t at = (size_t)y * width + x0;
+                    sadKernel(off + (size_t)y * stride + x0, refOff + at, n, changeNoise, offChange + first);
+                }
+            }
+        }
+        for (unsigned int tx = 0; tx < tilesX; tx++)
+        {
+            dirty[tx] = !refValid || onChange[tx] >= minChange || offChange[tx] >= minChange;
+            tilesSkipped += !dirty[tx];
+        }
+
+        // Redo each span of dirty tiles, then count its mask pixels as the
+        // change of the mask from all zeros
+        unsigned int tx = 0;
+        while (tx < tilesX)
+        {
+            if (!dirty[tx])
+            {
+                maskCount += counts[tx++];
+                continue;
+            }
+            unsigned int first = tx;
+            while (tx < tilesX && dirty[tx])
+            {
+                maskSum[tx++] = 0;
+            }
+            unsigned int x0 = first * k_lfTileWidth;
+            unsigned int n = (tx * k_lfTileWidth < width ? tx * k_lfTileWidth : width) - x0;
+            for (unsigned int y = y0; y < y1; y++)
+            {
+                size_t in = (size_t)y * stride + x0;
+                size_t out = (size_t)y * width + x0;
+                memcpy(refOn + out, on + in, n);
+                memcpy(refOff + out, off + in, n);
+                kernel(on + in, off + in, diff + out, mask + out, n, threshold);
+                sadKernel(mask + out, zeroRow.data(), n, 0, maskSum + first);
+            }
+            for (unsigned int t = first; t < tx; t++)
+            {
+                counts[t] = maskSum[t] / 255;
+                maskCount += counts[t];
+            }
+        }
+    }
+    tilesTotal += tiles;
+    refValid = true;
+    return maskCount;
+}
+
+size_t LfDiffEngine::process(const unsigned char *on, const unsigned char *off, unsigned int stride)
+{
+    pairNumber++;
+    if (changeMap)
+    {
+        return processTiles(on, off, stride);
+    }
+    if (stride == width)
+    {
+        // Contiguous frames are differenced in one pass
+        maskCount = kernel(on, off, diff, mask, (size_t)width * height, threshold);
+        return maskCount;
+    }
+
+    maskCount = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        size_t in = (size_t)y * stride;
+        size_t out = (size_t)y * width;
+        maskCount += kernel(on + in, off + in, diff + out, mask + out, width, threshold);
+    }
+    return maskCount;
+}
+
+size_t LfDiffEngine::process(const LfFrame *on, const LfFrame *off)
+{
+    // A new window has nothing to compare with
+    if (on->width != width || on->height != height || on->offsetX != offsetX || on->offsetY != offsetY)
+    {
+        refValid = false;
+    }
+    width = on->width;
+    height = on->height;
+    offsetX = on->offsetX;
+    offsetY = on->offsetY;
+    if (!takes(on))
+    {
+        maskCount = 0;
+        return 0;
+    }
+    if (changeMap)
+    {
+        return process(on->data, off->data, on->stride);
+    }
+
+    // The format and width stay put for a run, so this is decided once
+    if (frameKernel == NULL || on->format != frameFormat || on->width != frameWidth)
+    {
+        frameKernel = lfGetFrameDiffKernel(cpuLevel, on->format, on->width);
+        frameFormat = on->format;
+        frameWidth = on->width;
+    }
+    pairNumber++;
+    maskCount = frameKernel(on->data, off->data, on->stride, width, height, sampleShift, diff, mask, threshold);
+    return maskCount;
+}
+
+
+
+void lfColumnPeakScalar(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                        unsigned int n, unsigned char *peak, unsigned short *peakRow)
+{
+    memset(peak, 0, n);
+    memset(peakRow, 0, n * sizeof(unsigned short));
+    // Row by row, so the plane is read in order
+    for (unsigned int y = 0; y < rows; y++)
+    {
+        const unsigned char *p = plane + (size_t)y * stride;
+        for (unsigned int x = 0; x < n; x++)
+        {
+            if (p[x] > peak[x])
+            {
+                peak[x] = p[x];
+                peakRow[x] = y;
+            }
+        }
+    }
+}
+
+#ifdef LF_X86
+
+__attribute__((target("sse4.1")))
+void lfColumnPeakSse41(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                       unsigned int n, unsigned char *peak, unsigned short *peakRow)
+{
+    unsigned int x = 0;
+
+    // 32 columns per pass down the plane, with 16-bit row numbers
+    for (; x + 32 <= n; x += 32)
+    {
+        __m128i max0 = _mm_setzero_si128();
+        __m128i max1 = _mm_setzero_si128();
+        __m128i row0 = _mm_setzero_si128();
+        __m128i row1 = _mm_setzero_si128();
+        __m128i row2 = _mm_setzero_si128();
+        __m128i row3 = _mm_setzero_si128();
+        const unsigned char *p = plane + x;
+        for (unsigned int y = 0; y < rows; y++, p += stride)
+        {
+            __m128i r = _mm_set1_epi16((short)y);
+            __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+            __m128i m0 = _mm_max_epu8(max0, v0);
+            __m128i m1 = _mm_max_epu8(max1, v1);
+            // Columns the new row did not beat keep their row number
+            __m128i keep0 = _mm_cmpeq_epi8(m0, max0);
+            __m128i keep1 = _mm_cmpeq_epi8(m1, max1);
+            row0 = _mm_blendv_epi8(r, row0, _mm_unpacklo_epi8(keep0, keep0));
+            row1 = _mm_blendv_epi8(r, row1, _mm_unpackhi_epi8(keep0, keep0));
+            row2 = _mm_blendv_epi8(r, row2, _mm_unpacklo_epi8(keep1, keep1));
+            row3 = _mm_blendv_epi8(r, row3, _mm_unpackhi_epi8(keep1, keep1));
+            max0 = m0;
+            max1 = m1;
+        }
+        _mm_storeu_si128((__m128i *)(peak + x), max0);
+        _mm_storeu_si128((__m128i *)(peak + x + 16), max1);
+        _mm_storeu_si128((__m128i *)(peakRow + x), row0);
+        _mm_storeu_si128((__m128i *)(peakRow + x + 8), row1);
+        _mm_storeu_si128((__m128i *)(peakRow + x + 16), row2);
+        _mm_storeu_si128((__m128i *)(peakRow + x + 24), row3);
+    }
+
+    lfColumnPeakScalar(plane + x, stride, rows, n - x, peak + x, peakRow + x);
+}
+
+__attribute__((target("avx2")))
+void lfColumnPeakAvx2(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                      unsigned int n, unsigned char *peak, unsigned short *peakRow)
+{
+    unsigned int x = 0;
+
+    // 64 columns, one cache line of each row, per pass down the plane
+    for (; x + 64 <= n; x += 64)
+    {
+        __m256i max0 = _mm256_setzero_si256();
+        __m256i max1 = _mm256_setzero_si256();
+        __m256i row0 = _mm256_setzero_si256();
+        __m256i row1 = _mm256_setzero_si256();
+        __m256i row2 = _mm256_setzero_si256();
+        __m256i row3 = _mm256_setzero_si256();
+        const unsigned char *p = plane + x;
+        for (unsigned int y = 0; y < rows; y++, p += stride)
+        {
+            __m256i r = _mm256_set1_epi16((short)y);
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+            __m256i m0 = _mm256_max_epu8(max0, v0);
+            __m256i m1 = _mm256_max_epu8(max1, v1);
+            // Unpacking works within 128-bit lanes, so swap the middle
+            // quarters first to widen columns 0-15 and 16-31 in order
+            __m256i keep0 = _mm256_permute4x64_epi64(_mm256_cmpeq_epi8(m0, max0), 0xD8);
+            __m256i keep1 = _mm256_permute4x64_epi64(_mm256_cmpeq_epi8(m1, max1), 0xD8);
+            row0 = _mm256_blendv_epi8(r, row0, _mm256_unpacklo_epi8(keep0, keep0));
+            row1 = _mm256_blendv_epi8(r, row1, _mm256_unpackhi_epi8(keep0, keep0));
+            row2 = _mm256_blendv_epi8(r, row2, _mm256_unpacklo_epi8(keep1, keep1));
+            row3 = _mm256_blendv_epi8(r, row3, _mm256_unpackhi_epi8(keep1, keep1));
+            max0 = m0;
+            max1 = m1;
+        }
+        _mm256_storeu_si256((__m256i *)(peak + x), max0);
+        _mm256_storeu_si256((__m256i *)(peak + x + 32), max1);
+        _mm256_storeu_si256((__m256i *)(peakRow + x), row0);
+        _mm256_storeu_si256((__m256i *)(peakRow + x + 16), row1);
+        _mm256_storeu_si256((__m256i *)(peakRow + x + 32), row2);
+        _mm256_storeu_si256((__m256i *)(peakRow + x + 48), row3);
+    }
+
+    lfColumnPeakSse41(plane + x, stride, rows, n - x, peak + x, peakRow + x);
+}
+
+#else
+
+void lfColumnPeakSse41(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                       unsigned int n, unsigned char *peak, unsigned short *peakRow)
+{
+    lfColumnPeakScalar(plane, stride, rows, n, peak, peakRow);
+}
+
+void lfColumnPeakAvx2(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                      unsigned int n, unsigned char *peak, unsigned short *peakRow)
+{
+    lfColumnPeakScalar(plane, stride, rows, n, peak, peakRow);
+}
+
+#endif
+
+LfColumnPeakKernel lfGetColumnPeakKernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfColumnPeakAvx2;
+    case LF_CPU_SSE41:
+        return lfColumnPeakSse41;
+    default:
+        return lfColumnPeakScalar;
+    }
+}
+
+
+
+LfProfiler::LfProfiler(unsigned int maxWidth)
+    : capacity(maxWidth), width(0), offsetX(0), method(LF_PROFILE_CENTROID), window(4), minPeak(32),
+      workers(NULL), peak(NULL), peakRow(NULL), row(NULL), found(0),
+      stripeFound((maxWidth + k_lfTileWidth - 1) / k_lfTileWidth),
+      stripeDirty((maxWidth + k_lfTileWidth - 1) / k_lfTileWidth), lastEngine(NULL), lastPair(0), stripes(0),
+      stripesSkipped(0), curEngine(NULL)
+{
+    peak = (unsigned char *)lfAlignedAlloc(capacity);
+    peakRow = (unsigned short *)lfAlignedAlloc(capacity * sizeof(unsigned short));
+    row = (float *)lfAlignedAlloc(capacity * sizeof(float));
+    if (peak == NULL || peakRow == NULL || row == NULL)
+    {
+        lfAlignedFree(peak);
+        lfAlignedFree(peakRow);
+        lfAlignedFree(row);
+        throw runtime_error("Can't allocate laser profile");
+    }
+
+    // The Gaussian fit works on log intensities; zero counts as one
+    for (int v = 0; v < 256; v++)
+    {
+        logTable[v] = logf(v > 1 ? (float)v : 1.0f);
+    }
+    setCpuLevel(lfDetectCpuLevel());
+}
+
+LfProfiler::~LfProfiler()
+{
+    lfAlignedFree(peak);
+    lfAlignedFree(peakRow);
+    lfAlignedFree(row);
+}
+
+void LfProfiler::setCpuLevel(LfCpuLevel level)
+{
+    if (level > lfDetectCpuLevel())
+    {
+        level = lfDetectCpuLevel();
+    }
+    cpuLevel = level;
+    kernel = lfGetColumnPeakKernel(level);
+}
+
+int LfProfiler::extract(const LfDiffEngine &engine)
+{
+    if (engine.getWidth() > capacity)
+    {
+        return -1;
+    }
+    width = engine.getWidth();
+    offsetX = engine.getOffsetX();
+
+    // A stripe is redone if any of its tiles was, or if the last profile
+    // was not of the pair before
+    unsigned int groups = (width + k_lfTileWidth - 1) / k_lfTileWidth;
+    bool keep = engine.hasChangeMap() && lastEngine == &engine && lastPair + 1 == engine.getPairNumber();
+    for (unsigned int g = 0; g < groups; g++)
+    {
+        bool dirty = !keep;
+        for (unsigned int ty = 0; ty < engine.getTilesY() && !dirty; ty++)
+        {
+            dirty = engine.getDirtyTiles()[(size_t)ty * engine.getTilesX() + g] != 0;
+        }
+        stripeDirty[g] = dirty;
+        stripesSkipped += !dirty;
+    }
+    stripes += groups;
+
+    curEngine = &engine;
+    if (workers != NULL)
+    {
+        workers->run(this);
+    }
+    else
+    {
+        runBand(0, 1);
+    }
+    curEngine = NULL;
+    lastEngine = &engine;
+    lastPair = engine.getPairNumber();
+
+    unsigned int count = 0;
+    for (unsigned int g = 0; g < groups; g++)
+    {
+        count += stripeFound[g];
+    }
+    found.store(count, memory_order_relaxed);
+    return count;
+}
+
+void LfProfiler::runBand(unsigned int band, unsigned int bands)
+{
+    const unsigned char *diff = curEngine->getDiff();
+    unsigned int height = curEngine->getHeight();
+    unsigned int offsetY = curEngine->getOffsetY();
+
+    // Stripes are whole 64-column groups, so every kernel pass is full width
+    unsigned int groups = (width + k_lfTileWidth - 1) / k_lfTileWidth;
+    unsigned int firstGroup = LfWorkers::bandStart(groups, band, bands);
+    unsigned int lastGroup = LfWorkers::bandStart(groups, band + 1, bands);
+    for (unsigned int g = firstGroup; g < lastGroup; g++)
+    {
+        if (!stripeDirty[g])
+        {
+            continue;
+        }
+        unsigned int first = g * k_lfTileWidth;
+        unsigned int last = first + k_lfTileWidth < width ? first + k_lfTileWidth : width;
+        if (height == 0)
+        {
+            stripeFound[g] = 0;
+            continue;
+        }
+        kernel(diff + first, width, height, last - first, peak + first, peakRow + first);
+        stripeFound[g] = profileColumns(diff, height, offsetY, first, last);
+    }
+}
+
+unsigned int LfProfiler::profileColumns(const unsigned char *diff, unsigned int height, unsigned int offsetY,
+                                        unsigned int first, unsigned int last)
+{
+    unsigned int count = 0;
+    for (unsigned int x = first; x < last; x++)
+    {
+        if (peak[x] < minPeak)
+        {
+            row[x] = k_lfNoLine;
+            continue;
+        }
+        unsigned int p = peakRow[x];
+        const unsigned char *column = diff + x;
+        float position = p;
+
+        if (method == LF_PROFILE_GAUSSIAN)
+        {
+            // Vertex of the parabola through the three log intensities
+            if (p > 0 && p + 1 < height)
+            {
+                float a = logTable[column[(size_t)(p - 1) * width]];
+                float b = logTable[peak[x]];
+                float c = logTable[column[(size_t)(p + 1) * width]];
+                float curve = a - 2 * b + c;
+                if (curve < 0)
+                {
+                    position += 0.5f * (a - c) / curve;
+                }
+            }
+        }
+        else
+        {
+            // Only what stands above a quarter of the peak counts, so the
+            // noise floor and a window cut off-centre add no bias
+            unsigned int floor = peak[x] / 4;
+            unsigned int top = p > window ? p - window : 0;
+            unsigned int bottom = p + window < height ? p + window : height - 1;
+            unsigned int sum = 0;
+            unsigned int moment = 0;
+            for (unsigned int y = top; y <= bottom; y++)
+            {
+                unsigned int v = column[(size_t)y * width];
+                unsigned int w = v > floor ? v - floor : 0;
+                sum += w;
+                moment += w * (y - top);
+            }
+            position = top + (float)moment / sum;
+        }
+        row[x] = position + offsetY;
+        count++;
+    }
+    return count;
+}
+
+
+
+void lfMaskBitsScalar(const unsigned char *row, unsigned int n, uint64_t *bits)
+{
+    for (unsigned int w = 0; w * 64 < n; w++)
+    {
+        unsigned int count = n - w * 64 < 64 ? n - w * 64 : 64;
+        const unsigned char *p = row + w * 64;
+        uint64_t word = 0;
+        for (unsigned int b = 0; b < count; b++)
+        {
+            word |= (uint64_t)(p[b] != 0) << b;
+        }
+        bits[w] = word;
+    }
+}
+
+#ifdef LF_X86
+
+__attribute__((target("sse4.1")))
+void lfMaskBitsSse41(const unsigned char *row, unsigned int n, uint64_t *bits)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int w = 0;
+    for (; (w + 1) * 64 <= n; w++)
+    {
+        const unsigned char *p = row + w * 64;
+        uint64_t word = 0;
+        for (unsigned int k = 0; k < 4; k++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+            unsigned int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+            word |= (uint64_t)(~zeros & 0xffff) << (16 * k);
+        }
+        bits[w] = word;
+    }
+    if (w * 64 < n)
+    {
+        lfMaskBitsScalar(row + w * 64, n - w * 64, bits + w);
+    }
+}
+
+__attribute__((target("avx2")))
+void lfMaskBitsAvx2(const unsigned char *row, unsigned int n, uint64_t *bits)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned int w = 0;
+    for (; (w + 1) * 64 <= n; w++)
+    {
+        const unsigned char *p = row + w * 64;
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        unsigned int zeros0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero));
+        unsigned int zeros1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, zero));
+        bits[w] = ~((uint64_t)zeros1 << 32 | zeros0);
+    }
+    if (w * 64 < n)
+    {
+        lfMaskBitsSse41(row + w * 64, n - w * 64, bits + w);
+    }
+}
+
+#else
+
+void lfMaskBitsSse41(const unsigned char *row, unsigned int n, uint64_t *bits)
+{
+    lfMaskBitsScalar(row, n, bits);
+}
+
+void lfMaskBitsAvx2(const unsigned char *row, unsigned int n, uint64_t *bits)
+{
+    lfMaskBitsScalar(row, n, bits);
+}
+
+#endif
+
+LfMaskBitsKernel lfGetMaskBitsKernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfMaskBitsAvx2;
+    case LF_CPU_SSE41:
+        return lfMaskBitsSse41;
+    default:
+        return lfMaskBitsScalar;
+    }
+}
+
+
+
+// Slot of a run whose set is not reported
+static const unsigned int k_noBlob = 0xffffffff;
+
+LfBlobLabeler::LfBlobLabeler(unsigned int maxWidth, unsigned int maxHeight, unsigned int maxBlobs,
+                             unsigned int maxRuns)
+    : maxWidth(maxWidth), maxHeight(maxHeight), maxRuns(maxRuns), maxBlobs(maxBlobs), minArea(1),
+      eightConnected(true), workers(NULL), bitWords((maxWidth + 63) / 64), runs(NULL), slot(NULL),
+      blobs(NULL), sums(NULL), bits(NULL), blobCount(0), runCount(0), droppedBlobs(0), truncated(false),
+      lastEngine(NULL), lastPair(0), reused(0), curMask(NULL), curWidth(0), curHeight(0), curStride(0),
+      curTiles(NULL), curTilesX(0)
+{
+    if (this->maxRuns == 0)
+    {
+        this->maxRuns = (unsigned int)((unsigned long long)maxWidth * maxHeight / 8 + 1);
+    }
+    runs = (Run *)lfAlignedAlloc((size_t)this->maxRuns * sizeof(Run));
+    slot = (unsigned int *)lfAlignedAlloc((size_t)this->maxRuns * sizeof(unsigned int));
+    blobs = (LfBlob *)lfAlignedAlloc((size_t)(maxBlobs + 1) * sizeof(LfBlob));
+    sums = (unsigned long long *)lfAlignedAlloc((size_t)(maxBlobs + 1) * 2 * sizeof(unsigned long long));
+    if (runs == NULL || slot == NULL || blobs == NULL || sums == NULL)
+    {
+        lfAlignedFree(runs);
+        lfAlignedFree(slot);
+        lfAlignedFree(blobs);
+        lfAlignedFree(sums);
+        throw runtime_error("Can't allocate blob buffers");
+    }
+
+    setWorkers(NULL);
+    setCpuLevel(lfDetectCpuLevel());
+}
+
+LfBlobLabeler::~LfBlobLabeler()
+{
+    lfAlignedFree(runs);
+    lfAlignedFree(slot);
+    lfAlignedFree(blobs);
+    lfAlignedFree(sums);
+    lfAlignedFree(bits);
+}
+
+void LfBlobLabeler::setCpuLevel(LfCpuLevel level)
+{
+    if (level > lfDetectCpuLevel())
+    {
+        level = lfDetectCpuLevel();
+    }
+    cpuLevel = level;
+    bitsKernel = lfGetMaskBitsKernel(level);
+}
+
+void LfBlobLabeler::setWorkers(LfWorkers *w)
+{
+    workers = w;
+    unsigned int count = w != NULL ? w->getBands() : 1;
+    bandState.resize(count);
+    lfAlignedFree(bits);
+    bits = (uint64_t *)lfAlignedAlloc((size_t)count * bitWords * sizeof(uint64_t));
+    if (bits == NULL)
+    {
+        throw runtime_error("Can't allocate blob bitmaps");
+    }
+}
+
+unsigned int LfBlobLabeler::find(unsigned int i)
+{
+    // Path halving keeps the trees flat without a second pass
+    while (runs[i].parent != i)
+    {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+void LfBlobLabeler::join(unsigned int a, unsigned int b)
+{
+    a = find(a);
+    b = find(b);
+    if (a < b)
+    {
+        runs[b].parent = a;
+    }
+    else if (b < a)
+    {
+        runs[a].parent = b;
+    }
+}
+
+void LfBlobLabeler::joinRows(unsigned int above, unsigned int aboveEnd, unsigned int below, unsigned int belowEnd)
+{
+    // Both rows are sorted by x, so one sweep finds every touching pair
+    unsigned int slack = eightConnected ? 1 : 0;
+    while (above < aboveEnd && below < belowEnd)
+    {
+        const Run &a = runs[above];
+        const Run &b = runs[below];
+        if (a.x0 < b.x1 + slack && b.x0 < a.x1 + slack)
+        {
+            join(above, below);
+        }
+        if (a.x1 < b.x1)
+        {
+            above++;
+        }
+        else
+        {
+            below++;
+        }
+    }
+}
+
+void LfBlobLabeler::runBand(unsigned int band, unsigned int bands)
+{
+    Band &state = bandState[band];
+    unsigned int first = LfWorkers::bandStart(curHeight, band, bands);
+    unsigned int last = LfWorkers::bandStart(curHeight, band + 1, bands);
+    uint64_t *rowBits = bits + (size_t)band * bitWords;
+    unsigned int words = (curWidth + 63) / 64;
+    unsigned int next = state.base;
+    unsigned int previous = state.base;
+    unsigned int previousEnd = state.base;
+    state.overflow = false;
+    state.firstRowEnd = state.base;
+
+    for (unsigned int y = first; y < last && !state.overflow; y++)
+    {
+        const unsigned char *maskRow = curMask + (size_t)y * curStride;
+        if (curTiles == NULL)
+        {
+            bitsKernel(maskRow, curWidth, rowBits);
+        }
+        else
+        {
+            // A bitmap word is one tile wide, so empty tiles are never read
+            const size_t *tiles = curTiles + (size_t)(y / k_lfTileHeight) * curTilesX;
+            for (unsigned int w = 0; w < words; w++)
+            {
+                if (tiles[w] == 0)
+                {
+                    rowBits[w] = 0;
+                    continue;
+                }
+                unsigned int x = w * k_lfTileWidth;
+                bitsKernel(maskRow + x, curWidth - x < k_lfTileWidth ? curWidth - x : k_lfTileWidth, rowBits + w);
+            }
+        }
+
+        // Every change between neighbouring bits starts or ends a run
+        unsigned int rowStart = next;
+        uint64_t carry = 0;
+        unsigned int start = 0;
+        bool open = false;
+        for (unsigned int w = 0; w < words; w++)
+        {
+            uint64_t v = rowBits[w];
+            uint64_t edges = v ^ (v << 1 | carry);
+            carry = v >> 63;
+            while (edges != 0)
+            {
+                unsigned int x = w * 64 + __builtin_ctzll(edges);
+                edges &= edges - 1;
+                if (!open)
+                {
+                    start = x;
+                    open = true;
+                    continue;
+                }
+                open = false;
+                if (next == state.limit)
+                {
+                    state.overflow = true;
+                    break;
+                }
+                Run &run = runs[next];
+                run.x0 = start;
+                run.x1 = x;
+                run.y = y;
+                run.parent = next;
+                next++;
+            }
+        }
+        if (open && !state.overflow)
+        {
+            if (next == state.limit)
+            {
+                state.overflow = true;
+            }
+            else
+            {
+                Run &run = runs[next];
+                run.x0 = start;
+                run.x1 = curWidth;
+                run.y = y;
+                run.parent = next;
+                next++;
+            }
+        }
+
+        joinRows(previous, previousEnd, rowStart, next);
+        if (y == first)
+        {
+            state.firstRowEnd = next;
+        }
+        previous = rowStart;
+        previousEnd = next;
+    }
+
+    state.count = next - state.base;
+    // A band cut short has no last row for the merge to join
+    state.lastRowStart = state.overflow ? next : previous;
+}
+
+int LfBlobLabeler::label(const unsigned char *mask, unsigned int width, unsigned int height, unsigned int stride,
+                         unsigned int offsetX, unsigned int offsetY)
+{
+    if (width > maxWidth || height > maxHeight)
+    {
+        return -1;
+    }
+    lastEngine = NULL;
+    curMask = mask;
+    curWidth = width;
+    curHeight = height;
+    curStride = stride;
+
+    // Each band fills its own share of the run buffer
+    unsigned int count = bandState.size();
+    for (unsigned int b = 0; b < count; b++)
+    {
+        bandState[b].base = LfWorkers::bandStart(maxRuns, b, count);
+        bandState[b].limit = LfWorkers::bandStart(maxRuns, b + 1, count);
+    }
+    if (workers != NULL)
+    {
+        workers->run(this);
+    }
+    else
+    {
+        runBand(0, 1);
+    }
+    curMask = NULL;
+
+    // Join runs across each band edge.  With more bands than rows some
+    // bands have no rows, and so no runs; the band above an edge is the
+    // last one before it that has rows.
+    truncated = bandState[0].overflow;
+    runCount = bandState[0].count;
+    unsigned int aboveBand = 0;
+    for (unsigned int b = 1; b < count; b++)
+    {
+        unsigned int firstRow = LfWorkers::bandStart(height, b, count);
+        if (LfWorkers::bandStart(height, b + 1, count) == firstRow)
+        {
+            continue;
+        }
+        const Band &above = bandState[aboveBand];
+        const Band &below = bandState[b];
+        if (firstRow > 0 && below.count > 0 && above.count > 0 &&
+            runs[above.base + above.count - 1].y + 1 == firstRow)
+        {
+            joinRows(above.lastRowStart, above.base + above.count, below.base, below.firstRowEnd);
+        }
+        truncated = truncated || below.overflow;
+        runCount += below.count;
+        aboveBand = b;
+    }
+
+    // Roots are the smallest index in their set and so come first: total
+    // the areas at the roots, then hand each large enough root a blob
+    for (unsigned int b = 0; b < count; b++)
+    {
+        for (unsigned int i = bandState[b].base; i < bandState[b].base + bandState[b].count; i++)
+        {
+            unsigned int root = find(i);
+            runs[i].parent = root;
+            unsigned int length = runs[i].x1 - runs[i].x0;
+            slot[root] = root == i ? length : slot[root] + length;
+        }
+    }
+    blobCount = 0;
+    droppedBlobs = 0;
+    for (unsigned int b = 0; b < count; b++)
+    {
+        for (unsigned int i = bandState[b].base; i < bandState[b].base + bandState[b].count; i++)
+        {
+            const Run &run = runs[i];
+            if (run.parent == i)
+            {
+                unsigned int area = slot[i];
+                slot[i] = k_noBlob;
+                if (area >= minArea && blobCount < maxBlobs)
+                {
+                    LfBlob &blob = blobs[blobCount];
+                    blob.area = area;
+                    blob.left = run.x0;
+                    blob.right = run.x1 - 1;
+                    blob.top = run.y;
+                    blob.bottom = run.y;
+                    sums[2 * blobCount] = 0;
+                    sums[2 * blobCount + 1] = 0;
+                    slot[i] = blobCount++;
+                }
+                else if (area >= minArea)
+                {
+                    droppedBlobs++;
+                }
+            }
+
+            unsigned int k = slot[run.parent];
+            if (k == k_noBlob)
+            {
+                continue;
+            }
+            LfBlob &blob = blobs[k];
+            unsigned int length = run.x1 - run.x0;
+            blob.left = run.x0 < blob.left ? run.x0 : blob.left;
+            blob.right = run.x1 - 1 > blob.right ? run.x1 - 1 : blob.right;
+            blob.bottom = run.y;
+            // Sum of x0 .. x1 - 1; one of the two factors is always even
+            sums[2 * k] += (unsigned long long)(run.x0 + run.x1 - 1) * length / 2;
+            sums[2 * k + 1] += (unsigned long long)run.y * length;
+        }
+    }
+
+    for (unsigned int k = 0; k < blobCount; k++)
+    {
+        LfBlob &blob = blobs[k];
+        blob.centroidX = (float)((double)sums[2 * k] / blob.area) + offsetX;
+        blob.centroidY = (float)((double)sums[2 * k + 1] / blob.area) + offsetY;
+        blob.left += offsetX;
+        blob.right += offsetX;
+        blob.top += offsetY;
+        blob.bottom += offsetY;
+    }
+    return blobCount;
+}
+
+int LfBlobLabeler::label(const LfDiffEngine &engine)
+{
+    if (!engine.hasChangeMap())
+    {
+        return label(engine.getMask(), engine.getWidth(), engine.getHeight(), engine.getWidth(),
+                     engine.getOffsetX(), engine.getOffsetY());
+    }
+
+    // Nothing redone since the blobs of the pair before
+    if (lastEngine == &engine && lastPair + 1 == engine.getPairNumber())
+    {
+        size_t tiles = (size_t)engine.getTilesX() * engine.getTilesY();
+        const unsigned char *dirty = engine.getDirtyTiles();
+        size_t t = 0;
+        while (t < tiles && dirty[t] == 0)
+        {
+            t++;
+        }
+        if (t == tiles)
+        {
+            lastPair = engine.getPairNumber();
+            reused++;
+            return blobCount;
+        }
+    }
+
+    curTiles = engine.getTileMaskCounts();
+    curTilesX = engine.getTilesX();
+    int found = label(engine.getMask(), engine.getWidth(), engine.getHeight(), engine.getWidth(),
+                      engine.getOffsetX(), engine.getOffsetY());
+    curTiles = NULL;
+    if (found >= 0)
+    {
+        lastEngine = &engine;
+        lastPair = engine.getPairNumber();
+    }
+    return found;
+}
@@ -0,0 +1,384 @@
+// Laserfence algorithms for image processing
+
+#ifndef LFALG_H
+#define LFALG_H
+
+#include "stdafx.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "lfbuf.h"
+#include "lfpar.h"
+
+// Instruction set levels the kernels are built for.  The best level the
+// running CPU supports is picked once at start-up.
+enum LfCpuLevel {
+    LF_CPU_SCALAR = 0,
+    LF_CPU_SSE41,
+    LF_CPU_AVX2,
+    LF_CPU_AVX512       // AVX-512BW; kernels without a build of their own run AVX2
+};
+
+LfCpuLevel lfDetectCpuLevel();
+const char *lfCpuLevelName(LfCpuLevel level);
+
+// Difference kernels: diff = |on - off| (saturating), mask = 255 where
+// diff >= threshold, else 0.  Each returns the number of mask pixels set.
+typedef size_t (*LfDiffKernel)(const unsigned char *on, const unsigned char *off,
+                               unsigned char *diff, unsigned char *mask,
+                               size_t n, unsigned char threshold);
+
+size_t lfDiffScalar(const unsigned char *on, const unsigned char *off,
+                    unsigned char *diff, unsigned char *mask,
+                    size_t n, unsigned char threshold);
+size_t lfDiffSse41(const unsigned char *on, const unsigned char *off,
+                   unsigned char *diff, unsigned char *mask,
+                   size_t n, unsigned char threshold);
+size_t lfDiffAvx2(const unsigned char *on, const unsigned char *off,
+                  unsigned char *diff, unsigned char *mask,
+                  size_t n, unsigned char threshold);
+
+LfDiffKernel lfGetDiffKernel(LfCpuLevel level);
+
+// Whole-frame difference kernels, built at compile time for each sample
+// type and for the common ROI widths, so the row loop has a fixed trip
+// count and no format test.  Samples are taken to 8 bits first, MONO16 as
+// min(255, sample >> (4 + shift)) like LfConverter's shift mode; MONO8
+// ignores shift.  Frame rows are stride bytes apart, diff and mask rows
+// width bytes.  Returns the number of mask pixels set.
+typedef size_t (*LfFrameDiffKernel)(const unsigned char *on, const unsigned char *off, unsigned int stride,
+                                    unsigned int width, unsigned int height, unsigned int shift,
+                                    unsigned char *diff, unsigned char *mask, unsigned char threshold);
+
+// The kernel for a format and width at a level.  A width of 0, or one
+// without its own build, gets the any-width kernel.  NULL for formats
+// with no kernel (MONO12, which is packed).
+LfFrameDiffKernel lfGetFrameDiffKernel(LfCpuLevel level, LfPixelFormat format, unsigned int width);
+bool lfIsSpecialisedWidth(unsigned int width);
+
+// Tiles of the change map.  A tile is as wide as a profile stripe and a
+// mask bitmap word, so skipping a tile skips whole stripes and words.
+static const unsigned int k_lfTileWidth = 64;
+static const unsigned int k_lfTileHeight = 16;
+
+// Tile change kernels: for one row of n pixels, add to sums[k] how far
+// pixels [64k, 64k + 64) of a moved from b beyond noise levels, the sum of
+// max(|a - b| - noise, 0).  Rows are walked whole so memory is read in
+// order.
+typedef void (*LfTileSadKernel)(const unsigned char *a, const unsigned char *b, unsigned int n,
+                                unsigned char noise, unsigned int *sums);
+
+void lfTileSadScalar(const unsigned char *a, const unsigned char *b, unsigned int n,
+                     unsigned char noise, unsigned int *sums);
+void lfTileSadSse41(const unsigned char *a, const unsigned char *b, unsigned int n,
+                    unsigned char noise, unsigned int *sums);
+void lfTileSadAvx2(const unsigned char *a, const unsigned char *b, unsigned int n,
+                   unsigned char noise, unsigned int *sums);
+
+LfTileSadKernel lfGetTileSadKernel(LfCpuLevel level);
+
+// Laser-on/laser-off difference engine for the two MONO8 frames captured
+// per trigger in mode 15.  Owns the difference and mask planes.
+//
+// With the change map on, the engine keeps the pixels each tile was last
+// differenced from and redoes only the tiles whose laser-on or laser-off
+// pixels have moved since; the rest keep their difference and mask.  The
+// map of tiles redone is there for later stages to skip the same work.
+class LfDiffEngine {
+protected:
+    unsigned int width;
+    unsigned int height;
+    size_t capacity;            // Pixels the planes hold
+    unsigned int offsetX;       // Sensor position of the last pair
+    unsigned int offsetY;
+    unsigned char threshold;
+    LfCpuLevel cpuLevel;
+    LfDiffKernel kernel;
+    unsigned char *diff;
+    unsigned char *mask;
+    size_t maskCount;
+    unsigned long pairNumber;
+    bool changeMap;
+    unsigned char changeNoise;
+    unsigned int minChange;
+    LfTileSadKernel sadKernel;
+    unsigned char *refOn;       // Pixels each tile was last differenced from
+    unsigned char *refOff;
+    bool refValid;              // False until the next pair redoes every tile
+    unsigned int tilesX;
+    unsigned int tilesY;
+    std::vector<unsigned char> tileDirty;
+    std::vector<size_t> tileMask;
+    std::vector<unsigned int> tileChange;   // Per tile of a row: laser-on, laser-off, mask
+    std::vector<unsigned char> zeroRow;
+    unsigned long long tilesTotal;
+    unsigned long long tilesSkipped;
+    unsigned int sampleShift;
+    LfFrameDiffKernel frameKernel;  // Picked for the format and width last seen
+    LfPixelFormat frameFormat;
+    unsigned int frameWidth;
+    size_t processTiles(const unsigned char *on, const unsigned char *off, unsigned int stride);
+public:
+    LfDiffEngine(unsigned int width, unsigned int height, unsigned char threshold);
+    ~LfDiffEngine();
+    void setCpuLevel(LfCpuLevel level);
+    LfCpuLevel getCpuLevel() const { return cpuLevel; }
+    void setThreshold(unsigned char t)
+    {
+        threshold = t;
+        refValid = false;
+    }
+    // Turn the change map on or off.  A pixel must move more than noise
+    // levels to count as changed, and a tile is redone once its changes
+    // add up to minChange.  Returns -1 if the reference planes can't be
+    // allocated.
+    int setChangeMap(bool enable, unsigned char noise = 16, unsigned int minChange = 256);
+    // MONO16 pairs are taken to 8 bits as LfConverter::setShift() would
+    void setSampleShift(unsigned int bits) { sampleShift = bits; }
+    unsigned int getSampleShift() const { return sampleShift; }
+    // Frames are width x height MONO8 with the given row stride in bytes.
+    // Returns the number of pixels over threshold.
+    size_t process(const unsigned char *on, const unsigned char *off, unsigned int stride);
+    // A pair of any size that fits(), such as an ROI, in a format it
+    // takes(): MONO8, or MONO16 while the change map is off.  The planes
+    // take the pair's size and its offset is kept for mapping results
+    // back to the sensor.  The kernel is picked for the first pair's format
+    // and width and kept until they change.
+    bool fits(const LfFrame *frame) const { return (size_t)frame->width * frame->height <= capacity; }
+    bool takes(const LfFrame *frame) const
+    {
+        return frame->format == LF_PIXEL_MONO8 || (frame->format == LF_PIXEL_MONO16 && !changeMap);
+    }
+    size_t process(const LfFrame *on, const LfFrame *off);
+    const unsigned char *getDiff() const { return diff; }
+    const unsigned char *getMask() const { return mask; }
+    size_t getMaskCount() const { return maskCount; }
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned int getOffsetX() const { return offsetX; }
+    unsigned int getOffsetY() const { return offsetY; }
+    // Pairs processed so far.  A stage that saw pair n - 1 may keep its
+    // results for the tiles pair n did not redo.
+    unsigned long getPairNumber() const { return pairNumber; }
+    bool hasChangeMap() const { return changeMap; }
+    unsigned int getTilesX() const { return tilesX; }
+    unsigned int getTilesY() const { return tilesY; }
+    // Row-major per tile of the last pair: 1 if it was redone, and the mask
+    // pixels set in it
+    const unsigned char *getDirtyTiles() const { return tileDirty.data(); }
+    const size_t *getTileMaskCounts() const { return tileMask.data(); }
+    unsigned long long getTiles() const { return tilesTotal; }
+    unsigned long long getTilesSkipped() const { return tilesSkipped; }
+};
+
+// Column peak kernels: for each of n columns of a plane, the largest value
+// and the first of the given rows it occurs in
+typedef void (*LfColumnPeakKernel)(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                                   unsigned int n, unsigned char *peak, unsigned short *peakRow);
+
+void lfColumnPeakScalar(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                        unsigned int n, unsigned char *peak, unsigned short *peakRow);
+void lfColumnPeakSse41(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                       unsigned int n, unsigned char *peak, unsigned short *peakRow);
+void lfColumnPeakAvx2(const unsigned char *plane, unsigned int stride, unsigned int rows,
+                      unsigned int n, unsigned char *peak, unsigned short *peakRow);
+
+LfColumnPeakKernel lfGetColumnPeakKernel(LfCpuLevel level);
+
+// Profile row of a column the line was not found in
+static const float k_lfNoLine = -1.0f;
+
+enum LfProfileMethod {
+    LF_PROFILE_CENTROID = 0,    // Centre of mass of the window around the peak
+    LF_PROFILE_GAUSSIAN         // Gaussian through the peak and its two neighbours
+};
+
+// Turns the difference plane of a pair into a laser profile: for every
+// column, the sub-pixel sensor row of the line and its peak intensity.
+// The peak search runs down 64-column stripes, so each pass reads whole
+// cache lines, and the stripes are split over the workers when set.
+// Heights are limited to 65536 rows.
+class LfProfiler: public LfBandJob {
+protected:
+    unsigned int capacity;      // Columns the profile holds
+    unsigned int width;
+    unsigned int offsetX;       // Sensor column of profile column 0
+    LfProfileMethod method;
+    unsigned int window;
+    unsigned char minPeak;
+    LfCpuLevel cpuLevel;
+    LfColumnPeakKernel kernel;
+    LfWorkers *workers;
+    float logTable[256];
+    unsigned char *peak;
+    unsigned short *peakRow;
+    float *row;
+    std::atomic<unsigned int> found;
+    std::vector<unsigned int> stripeFound;
+    std::vector<unsigned char> stripeDirty;
+    const LfDiffEngine *lastEngine;     // Engine and pair of the last profile
+    unsigned long lastPair;
+    unsigned long long stripes;
+    unsigned long long stripesSkipped;
+    const LfDiffEngine *curEngine;
+    // Sub-pixel rows of columns [first, last) from their peaks
+    unsigned int profileColumns(const unsigned char *diff, unsigned int height, unsigned int offsetY,
+                                unsigned int first, unsigned int last);
+public:
+    LfProfiler(unsigned int maxWidth);
+    ~LfProfiler();
+    void setCpuLevel(LfCpuLevel level);
+    LfCpuLevel getCpuLevel() const { return cpuLevel; }
+    void setMethod(LfProfileMethod m)
+    {
+        method = m;
+        lastEngine = NULL;
+    }
+    LfProfileMethod getMethod() const { return method; }
+    // Rows either side of the peak the centroid takes in
+    void setWindow(unsigned int rows)
+    {
+        window = rows;
+        lastEngine = NULL;
+    }
+    // Columns whose peak difference is below this have no line
+    void setMinPeak(unsigned char value)
+    {
+        minPeak = value;
+        lastEngine = NULL;
+    }
+    void setWorkers(LfWorkers *w) { workers = w; }
+    // Profile the engine's last pair.  Returns the number of columns the
+    // line was found in, or -1 if the pair is wider than the profile.
+    // When the engine keeps a change map and this profile is of its
+    // previous pair, stripes without a redone tile are kept as they are.
+    int extract(const LfDiffEngine &engine);
+    unsigned int getWidth() const { return width; }
+    unsigned int getOffsetX() const { return offsetX; }
+    // Sensor row of the line in each column, or k_lfNoLine
+    const float *getRows() const { return row; }
+    const unsigned char *getIntensity() const { return peak; }
+    unsigned int getFound() const { return found.load(std::memory_order_relaxed); }
+    unsigned long long getStripes() const { return stripes; }
+    unsigned long long getStripesSkipped() const { return stripesSkipped; }
+    virtual void runBand(unsigned int band, unsigned int bands);
+};
+
+// Mask packing kernels: bit x of the bitmap is set where row[x] is not 0.
+// Bits past n in the last word are cleared.
+typedef void (*LfMaskBitsKernel)(const unsigned char *row, unsigned int n, uint64_t *bits);
+
+void lfMaskBitsScalar(const unsigned char *row, unsigned int n, uint64_t *bits);
+void lfMaskBitsSse41(const unsigned char *row, unsigned int n, uint64_t *bits);
+void lfMaskBitsAvx2(const unsigned char *row, unsigned int n, uint64_t *bits);
+
+LfMaskBitsKernel lfGetMaskBitsKernel(LfCpuLevel level);
+
+// A connected region of the mask, in sensor coordinates
+struct LfBlob {
+    unsigned int area;
+    unsigned int left;          // Bounding box, inclusive
+    unsigned int top;
+    unsigned int right;
+    unsigned int bottom;
+    float centroidX;
+    float centroidY;
+};
+
+// Connected components of a mask as blob records.  Each row band of the
+// mask is cut into runs of set pixels, and runs touching runs of the row
+// above are joined with union-find, one band per worker.  A single merge
+// pass then joins runs across band edges, and a last pass over the runs
+// (not the pixels) fills in the blobs.  Runs and blobs live in buffers
+// sized at construction; a mask with more runs than fit is labelled up to
+// where its band ran out, and blobs past maxBlobs are counted but dropped.
+class LfBlobLabeler: public LfBandJob {
+protected:
+    struct Run {
+        unsigned int x0;        // First pixel
+        unsigned int x1;        // One past the last
+        unsigned int y;
+        unsigned int parent;    // Union-find link, the smallest index in a set is its root
+    };
+    struct Band {
+        unsigned int base;      // First run slot
+        unsigned int limit;     // One past the last slot
+        unsigned int count;
+        unsigned int firstRowEnd;   // Runs [base, firstRowEnd) are on the band's first row
+        unsigned int lastRowStart;  // Runs [lastRowStart, base + count) on its last row
+        bool overflow;
+    };
+    unsigned int maxWidth;
+    unsigned int maxHeight;
+    unsigned int maxRuns;
+    unsigned int maxBlobs;
+    unsigned int minArea;
+    bool eightConnected;
+    LfCpuLevel cpuLevel;
+    LfMaskBitsKernel bitsKernel;
+    LfWorkers *workers;
+    unsigned int bitWords;      // Bitmap words per row
+    Run *runs;
+    unsigned int *slot;         // Per run: set area at a root, then its blob
+    LfBlob *blobs;
+    unsigned long long *sums;   // Per blob: sum of x, then sum of y
+    uint64_t *bits;             // One bitmap row per band
+    std::vector<Band> bandState;
+    unsigned int blobCount;
+    unsigned int runCount;
+    unsigned int droppedBlobs;
+    bool truncated;
+    const LfDiffEngine *lastEngine;     // Engine and pair of the last blobs
+    unsigned long lastPair;
+    unsigned long reused;
+    const unsigned char *curMask;
+    unsigned int curWidth;
+    unsigned int curHeight;
+    unsigned int curStride;
+    const size_t *curTiles;     // Mask pixels per tile, when known
+    unsigned int curTilesX;
+    unsigned int find(unsigned int i);
+    void join(unsigned int a, unsigned int b);
+    void joinRows(unsigned int above, unsigned int aboveEnd, unsigned int below, unsigned int belowEnd);
+public:
+    // maxRuns of 0 allows one run per eight pixels of the largest mask
+    LfBlobLabeler(unsigned int maxWidth, unsigned int maxHeight, unsigned int maxBlobs, unsigned int maxRuns = 0);
+    ~LfBlobLabeler();
+    void setCpuLevel(LfCpuLevel level);
+    LfCpuLevel getCpuLevel() const { return cpuLevel; }
+    // Blobs smaller than this are speckle and not reported
+    void setMinArea(unsigned int pixels)
+    {
+        minArea = pixels;
+        lastEngine = NULL;
+    }
+    // 4 joins pixels sharing an edge, 8 (the default) corners too
+    void setConnectivity(unsigned int neighbours)
+    {
+        eightConnected = neighbours != 4;
+        lastEngine = NULL;
+    }
+    // Sets up one band per worker; call before labelling, not per frame
+    void setWorkers(LfWorkers *w);
+    // Label a width x height mask with the given stride whose first pixel
+    // is at (offsetX, offsetY) on the sensor.  Returns the number of blobs,
+    // or -1 if the mask is larger than the labeler.
+    int label(const unsigned char *mask, unsigned int width, unsigned int height, unsigned int stride,
+              unsigned int offsetX, unsigned int offsetY);
+    // The engine's last mask.  With a change map, tiles without a mask
+    // pixel are not read, and if this labeler saw the engine's previous
+    // pair and no tile was redone since, the blobs are kept as they are.
+    int label(const LfDiffEngine &engine);
+    const LfBlob *getBlobs() const { return blobs; }
+    unsigned int getBlobCount() const { return blobCount; }
+    unsigned int getRunCount() const { return runCount; }
+    unsigned int getDroppedBlobs() const { return droppedBlobs; }
+    // True if the last mask had more runs than fit
+    bool isTruncated() const { return truncated; }
+    // Masks whose blobs were kept from the pair before
+    unsigned long getReused() const { return reused; }
+    virtual void runBand(unsigned int band, unsigned int bands);
+};
+
+#endif
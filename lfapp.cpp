@@ -4,49 +4,1045 @@
 #include "stdafx.h"
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
 #include "lfcam.h"
+#include "lfalarm.h"
+#include "lfalg.h"
+#include "lfbg.h"
+#include "lfbus.h"
+#include "lfclip.h"
+#include "lfconv.h"
+#include "lflog.h"
+#include "lfmetrics.h"
+#include "lfpar.h"
+#include "lfpipe.h"
+#include "lfmulti.h"
+#include "lfwriter.h"
+#include "lfrec.h"
+#include "lfroi.h"
+#include "lfsynth.h"
 
 using namespace std;
 
-int main(int /*argc*/, char** /*argv*/)
+// Blob records kept per pair, and the smallest blob worth one
+static const unsigned int k_maxBlobs = 256;
+static const unsigned int k_minBlobArea = 4;
+
+// Processing stage: difference each laser-on/laser-off pair with the
+// engine of the camera that captured it, extract the laser profile and
+// judge it for a fence break, then, when enabled, score it against the
+// background model, and label the blobs of the changed pixels.  MONO8
+// and MONO16 pairs are differenced in place; 12-bit pairs, and 16-bit
+// ones the engine can't take as they are, are first unpacked into
+// scratch frames.
+class LfDiffStage: public LfFrameHandler {
+protected:
+    vector<LfDiffEngine *> &engines;
+    vector<LfFramePool *> scratch;
+    vector<LfProfiler *> profilers;
+    vector<LfBlobLabeler *> labelers;
+    vector<LfBackground *> *backgrounds;
+    vector<LfAlarmDetector *> *detectors;
+    LfConverter converter;
+    vector<LfRoiTracker *> *trackers;
+    LfMultiCam *multiCam;
+    unsigned long pairs;
+    unsigned long skipped;
+    unsigned long long columns;
+    unsigned long long columnsFound;
+    unsigned long long blobs;
+    unsigned long truncated;
+    LfLatencyHistogram *convertTime;
+    LfLatencyHistogram *detectTime;
+    // Profile the pair just differenced, alarm first, then let the
+    // background model and ROI tracker see it.  Blobs come from the
+    // background model's mask when there is one.
+    void profile(const LfFrame *on, const LfDiffEngine &engine)
+    {
+        unsigned int camera = on->camera;
+        int columnsHit = profilers[camera]->extract(engine);
+        if (columnsHit >= 0)
+        {
+            columns += engine.getWidth();
+            columnsFound += columnsHit;
+            if (detectors != NULL)
+            {
+                (*detectors)[camera]->check(*profilers[camera], camera, on->seq, on->timestamp);
+            }
+        }
+        int found;
+        if (backgrounds != NULL)
+        {
+            LfBackground *model = (*backgrounds)[camera];
+            model->update(engine);
+            found = labelers[camera]->label(model->getMask(), model->getWidth(), model->getHeight(),
+                                            model->getWidth(), model->getOffsetX(), model->getOffsetY());
+        }
+        else
+        {
+            found = labelers[camera]->label(engine);
+        }
+        if (found >= 0)
+        {
+            blobs += found;
+            truncated += labelers[camera]->isTruncated();
+        }
+        if (trackers != NULL && (*trackers)[camera]->update(engine))
+        {
+            multiCam->requestRoi(camera, (*trackers)[camera]->getRoi());
+        }
+    }
+public:
+    LfDiffStage(vector<LfDiffEngine *> &engines)
+        : engines(engines), backgrounds(NULL), detectors(NULL), trackers(NULL), multiCam(NULL), pairs(0), skipped(0),
+          columns(0), columnsFound(0), blobs(0), truncated(0), convertTime(NULL), detectTime(NULL)
+    {
+        for (unsigned int i = 0; i < engines.size(); i++)
+        {
+            scratch.push_back(new LfFramePool(2, engines[i]->getWidth(), engines[i]->getHeight(),
+                                              LF_PIXEL_MONO8));
+            profilers.push_back(new LfProfiler(engines[i]->getWidth()));
+            labelers.push_back(new LfBlobLabeler(engines[i]->getWidth(), engines[i]->getHeight(), k_maxBlobs));
+            labelers[i]->setMinArea(k_minBlobArea);
+        }
+    }
+    ~LfDiffStage()
+    {
+        for (unsigned int i = 0; i < scratch.size(); i++)
+        {
+            delete scratch[i];
+            delete profilers[i];
+            delete labelers[i];
+        }
+    }
+    LfConverter &getConverter() { return converter; }
+    LfProfiler &getProfiler(unsigned int camera) { return *profilers[camera]; }
+    LfBlobLabeler &getLabeler(unsigned int camera) { return *labelers[camera]; }
+    // Split unpacking, profile extraction and labelling over the workers
+    void setWorkers(LfWorkers *workers)
+    {
+        converter.setWorkers(workers);
+        for (unsigned int i = 0; i < profilers.size(); i++)
+        {
+            profilers[i]->setWorkers(workers);
+            labelers[i]->setWorkers(workers);
+        }
+    }
+    // Time unpacking, and differencing through labelling, of every pair
+    void setMetrics(LfMetricsRegistry &registry)
+    {
+        convertTime = registry.addHistogram("lf_convert_seconds", "Time to unpack both frames of a pair to 8 bits");
+        detectTime = registry.addHistogram("lf_detect_seconds",
+                                           "Time to difference, profile, judge and label one pair");
+    }
+    // Judge every profile for a fence break, one detector per engine
+    void setDetectors(vector<LfAlarmDetector *> *d) { detectors = d; }
+    // Keep a background model per engine and flag pixels that leave it
+    void setBackgrounds(vector<LfBackground *> *models) { backgrounds = models; }
+    // Follow the laser line with each camera's ROI, one tracker per engine
+    void setRoiTracking(vector<LfRoiTracker *> *t, LfMultiCam *feed)
+    {
+        trackers = t;
+        multiCam = feed;
+    }
+    virtual bool handleFrames(LfFrame *on, LfFrame *off)
+    {
+        if (on->camera >= engines.size())
+        {
+            skipped++;
+            return false;
+        }
+        LfDiffEngine *engine = engines[on->camera];
+        // With an ROI the two frames share a window, but not the sensor's
+        if (on->format != off->format || on->width != off->width || on->height != off->height ||
+            !engine->fits(on))
+        {
+            skipped++;
+            return false;
+        }
+        // 16-bit samples go straight to the engine when it brings them to
+        // 8 bits the way the converter would
+        unsigned long long begin = detectTime != NULL ? lfMonotonicNs() : 0;
+        if (on->format == LF_PIXEL_MONO8 ||
+            (engine->takes(on) && converter.getMode() == LF_CONV_SHIFT &&
+             engine->getSampleShift() == converter.getShift()))
+        {
+            engine->process(on, off);
+            profile(on, *engine);
+            pairs++;
+            if (detectTime != NULL)
+            {
+                detectTime->record(lfMonotonicNs() - begin);
+            }
+            return false;
+        }
+
+        LfFramePool *pool = scratch[on->camera];
+        LfFrame *onMono = pool->lease();
+        LfFrame *offMono = pool->lease();
+        if (onMono != NULL && offMono != NULL &&
+            converter.convert(on, onMono) == 0 && converter.convert(off, offMono) == 0)
+        {
+            unsigned long long converted = convertTime != NULL ? lfMonotonicNs() : 0;
+            engine->process(onMono, offMono);
+            profile(on, *engine);
+            pairs++;
+            if (convertTime != NULL)
+            {
+                convertTime->record(converted - begin);
+                detectTime->record(lfMonotonicNs() - converted);
+            }
+        }
+        else
+        {
+            skipped++;
+        }
+        if (onMono != NULL)
+        {
+            pool->release(onMono);
+        }
+        if (offMono != NULL)
+        {
+            pool->release(offMono);
+        }
+        return false;
+    }
+    unsigned long getPairs() const { return pairs; }
+    unsigned long getSkipped() const { return skipped; }
+    // Share of profiled columns the laser line was found in
+    double getLineCoverage() const { return columns > 0 ? (double)columnsFound / columns : 0; }
+    double getBlobsPerPair() const { return pairs > 0 ? (double)blobs / pairs : 0; }
+    // Pairs whose mask had more runs than the labeler holds
+    unsigned long getTruncated() const { return truncated; }
+};
+
+// Storage stage: hand the laser-on frame of each pair to the writer, and
+// the laser-off frame too when the writer keeps pairs
+class LfSaveStage: public LfFrameHandler {
+protected:
+    LfFrameWriter &writer;
+public:
+    LfSaveStage(LfFrameWriter &writer) : writer(writer) {}
+    virtual bool handleFrames(LfFrame *on, LfFrame *off)
+    {
+        if (!writer.takesPairs())
+        {
+            on->pair = NULL;
+            LfFramePool::releaseFrame(off);
+        }
+        writer.submit(on);
+        return true;
+    }
+};
+
+// Storage stage: append both frames of each pair to a .lfr recording
+class LfRecordStage: public LfFrameHandler {
+protected:
+    LfRecorder &recorder;
+public:
+    LfRecordStage(LfRecorder &recorder) : recorder(recorder) {}
+    virtual bool handleFrames(LfFrame *on, LfFrame *off)
+    {
+        recorder.append(on);
+        recorder.append(off);
+        return false;
+    }
+};
+
+// Storage stage: publish each pair on the frame bus for local consumer
+// processes, then hand it to the real storage stage
+class LfBusStage: public LfFrameHandler {
+protected:
+    LfBusPublisher &bus;
+    LfFrameHandler &store;
+public:
+    LfBusStage(LfBusPublisher &bus, LfFrameHandler &store) : bus(bus), store(store) {}
+    virtual bool handleFrames(LfFrame *on, LfFrame *off)
+    {
+        bus.publish(on);
+        return store.handleFrames(on, off);
+    }
+};
+
+// Storage stage: code each pair into its camera's pre-event clip buffer,
+// then hand it to the real storage stage
+class LfClipStage: public LfFrameHandler {
+protected:
+    vector<LfClipBuffer *> &clips;
+    LfFrameHandler &store;
+public:
+    LfClipStage(vector<LfClipBuffer *> &clips, LfFrameHandler &store) : clips(clips), store(store) {}
+    virtual bool handleFrames(LfFrame *on, LfFrame *off)
+    {
+        if (on->camera < clips.size())
+        {
+            clips[on->camera]->append(on, off);
+        }
+        return store.handleFrames(on, off);
+    }
+};
+
+// Alarm callback for the console
+static void printAlarm(const LfAlarmEvent &event, void *)
+{
+    char line[256];
+    lfFormatAlarm(event, line, sizeof(line));
+    cout << line << flush;
+}
+
+// Command-line choices for the detection stages
+struct LfDetectOptions {
+    bool useChangeMap;
+    bool useBackground;
+    bool useAlarm;
+    const char *alarmFile;
+    const char *alarmSocket;
+    LfAlarmSettings alarmSettings;
+};
+
+// The detection stages of a set of cameras: an engine each and, as the
+// options ask, an alarm detector and a background model each, all behind
+// one LfDiffStage.  Live capture and replay build theirs the same way, so
+// a recording is judged as it would have been live.  clips get a sink of
+// their own when there are any.
+class LfDetection {
+protected:
+    vector<LfDiffEngine *> engines;
+    vector<LfAlarmDetector *> detectors;
+    vector<LfAlarmSink *> alarmSinks;
+    vector<LfBackground *> backgrounds;
+    LfDiffStage *diffStage;
+public:
+    LfDetection(const vector<LfFrameSource *> &sources, const LfDetectOptions &options,
+                vector<LfClipBuffer *> &clips)
+    {
+        for (unsigned int i = 0; i < sources.size(); i++)
+        {
+            engines.push_back(new LfDiffEngine(sources[i]->getFrameWidth(), sources[i]->getFrameHeight(), 32));
+            if (options.useChangeMap && engines[i]->setChangeMap(true) != 0)
+            {
+                cout << "Can't allocate change map for camera " << i << endl;
+            }
+        }
+        diffStage = new LfDiffStage(engines);
+
+        if (options.useAlarm)
+        {
+            alarmSinks.push_back(new LfCallbackSink(printAlarm, NULL));
+            if (!clips.empty())
+            {
+                alarmSinks.push_back(new LfClipSink(clips));
+            }
+            if (options.alarmFile != NULL)
+            {
+                alarmSinks.push_back(new LfFileSink(options.alarmFile));
+            }
+            if (options.alarmSocket != NULL)
+            {
+                alarmSinks.push_back(new LfSocketSink(options.alarmSocket));
+            }
+            for (unsigned int i = 0; i < sources.size(); i++)
+            {
+                detectors.push_back(new LfAlarmDetector(sources[i]->getSensorWidth(), options.alarmSettings));
+                for (unsigned int j = 0; j < alarmSinks.size(); j++)
+                {
+                    detectors[i]->addSink(alarmSinks[j]);
+                }
+            }
+            diffStage->setDetectors(&detectors);
+        }
+
+        if (options.useBackground)
+        {
+            for (unsigned int i = 0; i < sources.size(); i++)
+            {
+                backgrounds.push_back(new LfBackground(sources[i]->getSensorWidth(),
+                                                       sources[i]->getSensorHeight()));
+            }
+            diffStage->setBackgrounds(&backgrounds);
+        }
+    }
+    ~LfDetection()
+    {
+        delete diffStage;
+        for (unsigned int i = 0; i < engines.size(); i++)
+        {
+            delete engines[i];
+        }
+        for (unsigned int i = 0; i < detectors.size(); i++)
+        {
+            delete detectors[i];
+        }
+        for (unsigned int i = 0; i < alarmSinks.size(); i++)
+        {
+            delete alarmSinks[i];
+        }
+        for (unsigned int i = 0; i < backgrounds.size(); i++)
+        {
+            delete backgrounds[i];
+        }
+    }
+    LfDiffStage &getStage() { return *diffStage; }
+    LfCpuLevel getCpuLevel() const { return engines.empty() ? LF_CPU_SCALAR : engines[0]->getCpuLevel(); }
+    // Totals over the pairs seen, then each camera's change map, background
+    // model and alarm detector
+    void printStats()
+    {
+        cout << "Pairs differenced: " << diffStage->getPairs()
+             << ", skipped: " << diffStage->getSkipped()
+             << ", line found in " << 100.0 * diffStage->getLineCoverage() << "% of columns, "
+             << diffStage->getBlobsPerPair() << " blobs per pair (" << diffStage->getTruncated() << " truncated)"
+             << endl;
+        for (unsigned int i = 0; i < engines.size(); i++)
+        {
+            if (!engines[i]->hasChangeMap())
+            {
+                continue;
+            }
+            const LfProfiler &profiler = diffStage->getProfiler(i);
+            unsigned long long tiles = engines[i]->getTiles();
+            unsigned long long stripes = profiler.getStripes();
+            cout << "Camera " << i << " change map: "
+                 << (tiles ? 100.0 * engines[i]->getTilesSkipped() / tiles : 0.0) << "% of tiles and "
+                 << (stripes ? 100.0 * profiler.getStripesSkipped() / stripes : 0.0)
+                 << "% of profile stripes skipped, " << diffStage->getLabeler(i).getReused() << " masks' blobs kept"
+                 << endl;
+        }
+        for (unsigned int i = 0; i < backgrounds.size(); i++)
+        {
+            cout << "Camera " << i << " ";
+            backgrounds[i]->printStats();
+        }
+        for (unsigned int i = 0; i < detectors.size(); i++)
+        {
+            cout << "Camera " << i << " ";
+            detectors[i]->printStats();
+        }
+    }
+};
+
+// Cameras a replayed recording may have frames of; a damaged index could
+// name any number
+static const unsigned int k_maxReplayCameras = 64;
+
+// Re-run detection over a recording as fast as it can be read, through the
+// same stages live capture would have used for it
+static int runReplay(const char *path, const LfDetectOptions &options)
+{
+    cout << "Replaying " << path << "..." << endl;
+
+    LfReplay replay(path);
+    const LfrHeader &header = replay.getHeader();
+    cout << replay.getFrameCount() << " frames of " << header.width << "x" << header.height
+         << " from " << replay.getCameraCount() << " camera(s), trigger mode " << header.triggerMode << endl;
+    if (replay.getCameraCount() > k_maxReplayCameras)
+    {
+        cout << "Recording lists more than " << k_maxReplayCameras << " cameras" << endl;
+        return -1;
+    }
+
+    // Replayed frames are views into the mapping, so the pool only holds
+    // frame descriptors in flight
+    const unsigned int queueDepth = 4;
+    LfFramePool pool(2 * (2 * queueDepth + 3), header.width, header.height,
+                     (LfPixelFormat)header.pixelFormat);
+    // Every camera in a recording has its geometry
+    vector<LfFrameSource *> cameras(replay.getCameraCount(), &replay);
+    vector<LfClipBuffer *> noClips;
+    LfDetection detection(cameras, options, noClips);
+    unsigned int numCpus = thread::hardware_concurrency();
+    LfWorkers bandWorkers(numCpus > 2 ? numCpus - 2 : 0);
+    detection.getStage().setWorkers(&bandWorkers);
+
+    // Every pair must be processed, so block rather than drop
+    LfPipeline pipeline(&pool, queueDepth);
+    pipeline.setSource(&replay);
+    pipeline.setProcessor(&detection.getStage(), LF_QUEUE_BLOCK);
+
+    unsigned long long begin = lfTimestampUs();
+    replay.start();
+    pipeline.start();
+    while (!replay.atEnd())
+    {
+        usleep(1000);
+    }
+    pipeline.stop();
+    unsigned long long elapsed = lfTimestampUs() - begin;
+
+    pipeline.printStats();
+    // Alarm latency runs from the recorded image timestamps, so only the
+    // alarms themselves mean anything here
+    detection.printStats();
+    cout << "Replayed in " << elapsed / 1000 << " ms ("
+         << (elapsed ? detection.getStage().getPairs() * 1000000.0 / elapsed : 0.0) << " pairs/s, "
+         << lfCpuLevelName(detection.getCpuLevel()) << " kernels)" << endl;
+    return 0;
+}
+
+// Cameras found and how they were set up last time, so a restart skips
+// discovery and the sensor queries
+static const char *k_camCachePath = "lfcams.cache";
+
+// Bring one camera up for mode-15 capture.  known is its configuration
+// from the last run, if there is one.
+static int setupCamera(LfGigECam &cam, int cameraIndex, LfPixelFormat format, const LfCamConfig *known,
+                       LfCamStartTimes *times)
+{
+    unsigned long long begin = lfTimestampUs();
+    if (cam.connect(cameraIndex) != 0)
+    {
+        return -1;
+    }
+    if (!cam.supportsExternalTrigger()) {
+        cout << "Camera " << cameraIndex << " does not support an external trigger." << endl;
+        return -1;
+    }
+    unsigned long long connected = lfTimestampUs();
+    if (cam.powerOn() != 0)
+    {
+        cout << "Camera " << cameraIndex << " did not power up." << endl;
+        return -1;
+    }
+    unsigned long long powered = lfTimestampUs();
+    cam.printAllStreamChannelsInfo();
+    cam.setTriggerMode15();
+    cam.setGrabTimeout(5000);
+    cam.setCaptureFormat(format);
+    cam.setCameraSettings(known);
+    cam.enableFrameStamps();
+    // Spin briefly for the common short wait, then give the core back
+    cam.setWaitMode(LF_WAIT_SPIN_YIELD);
+    times->connectUs = connected - begin;
+    times->powerUs = powered - connected;
+    times->configureUs = lfTimestampUs() - powered;
+    return 0;
+}
+
+// Brings every camera up at once: each spends most of its time waiting on
+// its own link, so start-up takes about as long as the slowest camera
+static int setupCameras(vector<LfGigECam *> &cams, LfPixelFormat format, const vector<LfCamConfig> &known,
+                        vector<LfCamStartTimes> &times)
+{
+    vector<int> results(cams.size(), -1);
+    times.assign(cams.size(), LfCamStartTimes());
+    vector<thread> threads;
+    for (unsigned int i = 0; i < cams.size(); i++)
+    {
+        threads.push_back(thread([&, i]() {
+            try
+            {
+                results[i] = setupCamera(*cams[i], i, format, i < known.size() ? &known[i] : NULL, &times[i]);
+            }
+            catch (const exception &e)
+            {
+                cout << "Camera " << i << ": " << e.what() << endl;
+            }
+            catch (...)
+            {
+                // Nothing may escape the thread, or the process ends
+                cout << "Camera " << i << ": setup failed" << endl;
+            }
+        }));
+    }
+    int result = 0;
+    for (unsigned int i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+        if (results[i] != 0)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
 {
+    unsigned long long startBegin = lfTimestampUs();
     cout << "Starting Laser Fence application..." << endl;
 
-    // Initialize camera
-    LfGigECam lfcam;
-    lfcam.printBuildInfo();
-    lfcam.connect(0);
-    if (!lfcam.supportsExternalTrigger()) {
-        cout << "This camera does not support an external trigger.";
+    // -p pins each camera's capture thread to its own CPU
+    // -r file.lfr records raw frame pairs instead of saving images
+    // -R file.lfr replays a recording through the detection stages live
+    // capture would use, as -c, -g and the alarm options set them, and
+    // exits; capture, storage and metrics options don't apply to it
+    // -s N uses N synthetic cameras instead of hardware, -f sets their
+    // trigger rate in pairs per second (0 = as fast as possible)
+    // -b 12|16 captures 12- or 16-bit pixels, unpacked to 8 for detection
+    // -t narrows each camera's readout to a band around the laser line
+    // -m /name publishes every pair on a shared-memory frame bus
+    // -g scores every pair against a running background model
+    // -c skips tiles unchanged since the pair before in differencing,
+    // profiling and blob labelling
+    // -a raises fence-break alarms on the console; -A file and -U socket
+    // also send them to a file and a Unix datagram socket, and -L us sets
+    // the trigger-to-alarm latency budget
+    // -e file rewrites Prometheus metrics to a file every second, -E socket
+    // serves them over HTTP on a Unix stream socket
+    // -l debug|info|warn|error|off sets the lowest level logged
+    // -z saves each pair as one lossless .lfc image instead of a PGM of the
+    // laser-on frame
+    // -k s keeps the last s seconds of pairs compressed in memory and saves
+    // them as a .lfr clip when an alarm is raised (implies -a); -K MB sets
+    // each camera's memory for them
+    // -H keeps frame buffers on the heap instead of on huge pages
+    bool pinThreads = false;
+    LfDetectOptions detect;
+    detect.useChangeMap = false;
+    detect.useBackground = false;
+    detect.useAlarm = false;
+    detect.alarmFile = NULL;
+    detect.alarmSocket = NULL;
+    lfAlarmDefaults(&detect.alarmSettings);
+    const char *metricsFile = NULL;
+    const char *metricsSocket = NULL;
+    double clipSeconds = 0;
+    unsigned int clipMegabytes = 256;
+    LfWriteFormat saveFormat = LF_WRITE_PGM;
+    bool trackRoi = false;
+    LfPixelFormat captureFormat = LF_PIXEL_MONO8;
+    const char *recordPath = NULL;
+    const char *busName = NULL;
+    const char *replayPath = NULL;
+    bool captureOptions = false;
+    unsigned int numSynthetic = 0;
+    LfSynthSettings synthSettings;
+    lfSynthDefaults(&synthSettings);
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-p")
+        {
+            pinThreads = true;
+            captureOptions = true;
+        }
+        else if (arg == "-s" && i + 1 < argc)
+        {
+            numSynthetic = atoi(argv[++i]);
+            captureOptions = true;
+        }
+        else if (arg == "-f" && i + 1 < argc)
+        {
+            synthSettings.triggerRate = atof(argv[++i]);
+            captureOptions = true;
+        }
+        else if (arg == "-a")
+        {
+            detect.useAlarm = true;
+        }
+        else if (arg == "-A" && i + 1 < argc)
+        {
+            detect.useAlarm = true;
+            detect.alarmFile = argv[++i];
+        }
+        else if (arg == "-U" && i + 1 < argc)
+        {
+            detect.useAlarm = true;
+            detect.alarmSocket = argv[++i];
+        }
+        else if (arg == "-L" && i + 1 < argc)
+        {
+            detect.alarmSettings.budgetUs = atoi(argv[++i]);
+        }
+        else if (arg == "-e" && i + 1 < argc)
+        {
+            metricsFile = argv[++i];
+            captureOptions = true;
+        }
+        else if (arg == "-E" && i + 1 < argc)
+        {
+            metricsSocket = argv[++i];
+            captureOptions = true;
+        }
+        else if (arg == "-k" && i + 1 < argc)
+        {
+            detect.useAlarm = true;
+            clipSeconds = atof(argv[++i]);
+            captureOptions = true;
+        }
+        else if (arg == "-K" && i + 1 < argc)
+        {
+            clipMegabytes = atoi(argv[++i]);
+            captureOptions = true;
+        }
+        else if (arg == "-l" && i + 1 < argc)
+        {
+            LfLogLevel level;
+            if (lfParseLogLevel(argv[++i], &level) == 0)
+            {
+                lfSetLogLevel(level);
+            }
+            else
+            {
+                cout << "Unknown log level " << argv[i] << endl;
+            }
+        }
+        else if (arg == "-g")
+        {
+            detect.useBackground = true;
+        }
+        else if (arg == "-z")
+        {
+            saveFormat = LF_WRITE_LFC;
+            captureOptions = true;
+        }
+        else if (arg == "-H")
+        {
+            lfSetHugePageMode(LF_HUGE_OFF);
+        }
+        else if (arg == "-c")
+        {
+            detect.useChangeMap = true;
+        }
+        else if (arg == "-t")
+        {
+            trackRoi = true;
+            captureOptions = true;
+        }
+        else if (arg == "-b" && i + 1 < argc)
+        {
+            int bits = atoi(argv[++i]);
+            captureFormat = bits == 12 ? LF_PIXEL_MONO12 : (bits == 16 ? LF_PIXEL_MONO16 : LF_PIXEL_MONO8);
+            captureOptions = true;
+        }
+        else if (arg == "-m" && i + 1 < argc)
+        {
+            busName = argv[++i];
+            captureOptions = true;
+        }
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            recordPath = argv[++i];
+            captureOptions = true;
+        }
+        else if (arg == "-R" && i + 1 < argc)
+        {
+            replayPath = argv[++i];
+        }
+    }
+
+    // Every option is read first, so it applies wherever it was given
+    if (replayPath != NULL)
+    {
+        if (captureOptions)
+        {
+            cout << "Capture, storage and metrics options are ignored when replaying" << endl;
+        }
+        return runReplay(replayPath, detect);
+    }
+
+    // Initialize cameras.  The first one enumerates the bus; every camera
+    // found gets its own object.
+    vector<LfFrameSource *> sources;
+    vector<LfGigECam *> cams;
+    vector<LfSynthCam *> synths;
+    vector<LfCamConfig> knownCams;
+    vector<LfCamStartTimes> camTimes;
+    unsigned long long discoverBegin = lfTimestampUs();
+    if (numSynthetic > 0)
+    {
+        for (unsigned int i = 0; i < numSynthetic; i++)
+        {
+            synthSettings.seed = i + 1;
+            synths.push_back(new LfSynthCam(synthSettings));
+        }
+        sources.assign(synths.begin(), synths.end());
+    }
+    else
+    {
+        lfLoadCamCache(k_camCachePath, knownCams);
+        cams.push_back(new LfGigECam(knownCams));
+        cams[0]->printBuildInfo();
+        for (unsigned int i = 1; i < cams[0]->getNumCameras(); i++)
+        {
+            cams.push_back(new LfGigECam(cams[0]));
+        }
+        sources.assign(cams.begin(), cams.end());
+    }
+    unsigned long long setupBegin = lfTimestampUs();
+    if (setupCameras(cams, captureFormat, knownCams, camTimes) != 0)
+    {
+        for (unsigned int j = 0; j < sources.size(); j++)
+        {
+            delete sources[j];
+        }
         return -1;
     }
-    lfcam.powerOn();
-    lfcam.printAllStreamChannelsInfo();
-    lfcam.setTriggerMode15();
-    lfcam.setGrabTimeout(5000);
-    lfcam.setCameraSettings();
-
-    // Start camera
-    lfcam.start();
-    while (true) {
-        // Capture frames
-        lfcam.pollForTriggerReady();
-        lfcam.retrieveImage();
-        Image convertedImage = lfcam.convertImage();
-        // Save frames
-        ostringstream filename;
-        //filename << "lf" << "blah.pgm";
-        filename << "blah.png";
-        lfcam.saveImage(convertedImage, filename);
-        break;
-    }
-
-    // Stop camera
-    lfcam.stop();
-    lfcam.disconnect();
-
-    cout << "Done! Press Enter to exit..." << endl;
+    unsigned long long buffersBegin = lfTimestampUs();
+
+    // Preallocate every buffer the capture path uses so that steady-state
+    // capture does no heap allocation; lftest checks this with synthetic
+    // cameras, but can't see inside the camera library.  A camera's pairs can sit in its own
+    // queue and in both pipeline queues, and each thread works on one more;
+    // frames waiting for the writer come on top.
+    const unsigned int queueDepth = 4;
+    const unsigned int writerDepth = 8;
+    const unsigned int writerThreads = 2;
+    const unsigned int pairsPerCamera = 3 * queueDepth + 4 + writerDepth + writerThreads;
+    unsigned int numCpus = thread::hardware_concurrency();
+    vector<LfFramePool *> pools;
+    LfMultiCam multiCam(queueDepth);
+    for (unsigned int i = 0; i < sources.size(); i++)
+    {
+        LfFrameSource *src = sources[i];
+        // Leave CPU 0 to the processing and storage stages.  A pinned
+        // camera's frames live on its CPU's node, where they are written.
+        int cpu = pinThreads && numCpus > 1 ? (int)(1 + i % (numCpus - 1)) : -1;
+        pools.push_back(new LfFramePool(2 * pairsPerCamera, src->getFrameWidth(), src->getFrameHeight(),
+                                        src->getFrameFormat(), cpu >= 0 ? lfCpuNode(cpu) : -1));
+        multiCam.addCamera(src, pools[i], cpu);
+    }
+
+    // Clip buffers code pairs on the storage thread and dump on threads of
+    // their own, so neither capture nor detection waits on them
+    vector<LfClipBuffer *> clips;
+    if (clipSeconds > 0)
+    {
+        for (unsigned int i = 0; i < sources.size(); i++)
+        {
+            clips.push_back(new LfClipBuffer(i, sources[i]->getFrameWidth(), sources[i]->getFrameHeight(),
+                                             sources[i]->getFrameFormat(), clipSeconds,
+                                             (size_t)clipMegabytes << 20));
+            clips[i]->start();
+        }
+    }
+
+    LfDetection detection(sources, detect, clips);
+    LfDiffStage &diffStage = detection.getStage();
+    // Unpacking and profiling are split over the CPUs capture leaves idle
+    LfWorkers bandWorkers(numCpus > 2 * sources.size() + 2 ? numCpus - 2 * sources.size() - 2 : 0);
+    diffStage.setWorkers(&bandWorkers);
+
+    // Recordings need one geometry throughout, so they keep the full sensor
+    vector<LfRoiTracker *> trackers;
+    if (trackRoi && recordPath != NULL)
+    {
+        cout << "ROI tracking is off while recording" << endl;
+        trackRoi = false;
+    }
+    if (trackRoi)
+    {
+        LfRoiSettings roiSettings;
+        lfRoiDefaults(&roiSettings);
+        for (unsigned int i = 0; i < sources.size(); i++)
+        {
+            trackers.push_back(new LfRoiTracker(sources[i]->getSensorWidth(), sources[i]->getSensorHeight(),
+                                                roiSettings));
+        }
+        diffStage.setRoiTracking(&trackers, &multiCam);
+    }
+
+    // Raw PGM keeps encoding off the CPU, and .lfc costs about a ns a pixel
+    // for a fraction of the disk; the writer drops frames rather than stall
+    // when the disk falls behind
+    LfFrameWriter writer(".", "lf", saveFormat, writerThreads, writerDepth);
+    writer.setPreallocate(true);
+    size_t maxFrameBytes = 0;
+    for (unsigned int i = 0; i < pools.size(); i++)
+    {
+        if (pools[i]->getBufferSize() > maxFrameBytes)
+        {
+            maxFrameBytes = pools[i]->getBufferSize();
+        }
+    }
+    writer.start(maxFrameBytes);
+    LfSaveStage saveStage(writer);
+
+    // A recording must keep every pair, so it blocks rather than drops when
+    // the disk falls behind.  Frames whose geometry differs from the first
+    // camera's are counted as rejected.
+    LfRecorder recorder;
+    LfRecordStage recordStage(recorder);
+    if (recordPath != NULL &&
+        recorder.open(recordPath, sources[0]->getFrameWidth(), sources[0]->getFrameHeight(),
+                      lfRowBytes(sources[0]->getFrameFormat(), sources[0]->getFrameWidth()),
+                      sources[0]->getFrameFormat(), 15, 2) != 0)
+    {
+        recordPath = NULL;
+    }
+
+    // Bus readers map the pairs straight out of shared memory.  Each pair
+    // is copied in once; readers that fall behind lose pairs, never the
+    // publisher's time.
+    const unsigned int busSlots = 16;
+    LfBusPublisher bus;
+    if (busName != NULL && bus.open(busName, busSlots, maxFrameBytes) != 0)
+    {
+        busName = NULL;
+    }
+
+    // A slow disk or detection stall drops the oldest queued pair rather
+    // than holding up the next grab
+    LfPipeline pipeline(NULL, queueDepth);
+    pipeline.setFeed(&multiCam);
+    pipeline.setProcessor(&diffStage, LF_QUEUE_DROP_OLDEST);
+    LfFrameHandler *store = &saveStage;
+    LfQueuePolicy storePolicy = LF_QUEUE_DROP_OLDEST;
+    if (recordPath != NULL)
+    {
+        store = &recordStage;
+        storePolicy = LF_QUEUE_BLOCK;
+    }
+    LfClipStage clipStage(clips, *store);
+    if (!clips.empty())
+    {
+        store = &clipStage;
+    }
+    LfBusStage busStage(bus, *store);
+    pipeline.setStore(busName != NULL ? &busStage : store, storePolicy);
+
+    // Metrics are registered before anything runs; the exporter reads the
+    // components' own counters only when it renders
+    LfMetricsRegistry metrics;
+    LfMetricsExporter exporter(metrics);
+    bool exportMetrics = metricsFile != NULL || metricsSocket != NULL;
+    if (exportMetrics)
+    {
+        for (unsigned int i = 0; i < cams.size(); i++)
+        {
+            cams[i]->setMetrics(metrics, i);
+        }
+        multiCam.setMetrics(metrics);
+        pipeline.setMetrics(metrics);
+        writer.setMetrics(metrics);
+        diffStage.setMetrics(metrics);
+        if (metricsFile != NULL)
+        {
+            exporter.setFile(metricsFile);
+        }
+        if (metricsSocket != NULL)
+        {
+            exporter.setSocket(metricsSocket);
+        }
+        exportMetrics = exporter.start() == 0;
+    }
+    unsigned long allocsBefore = lfAllocCount();
+    unsigned long long captureBegin = lfTimestampUs();
+
+    // From here on grab and processing threads only queue log records;
+    // a thread of its own formats and writes them
+    lfLogStart(STDOUT_FILENO);
+
+    // Start cameras
+    for (unsigned int i = 0; i < sources.size(); i++)
+    {
+        sources[i]->start();
+    }
+    multiCam.start();
+    pipeline.start();
+    unsigned long long startEnd = lfTimestampUs();
+
+    // The cameras came up, so what they came up with is good for next time
+    if (!cams.empty())
+    {
+        vector<LfCamConfig> configs(cams.size());
+        for (unsigned int i = 0; i < cams.size(); i++)
+        {
+            cams[i]->getConfig(&configs[i]);
+        }
+        if (configs.size() != knownCams.size() ||
+            memcmp(&configs[0], &knownCams[0], configs.size() * sizeof(LfCamConfig)) != 0)
+        {
+            if (lfSaveCamCache(k_camCachePath, configs) != 0)
+            {
+                cout << "Can't write " << k_camCachePath << endl;
+            }
+        }
+    }
+    LfCamStartTimes slowest = { 0, 0, 0 };
+    unsigned long writesSkipped = 0;
+    for (unsigned int i = 0; i < cams.size(); i++)
+    {
+        slowest.connectUs = max(slowest.connectUs, camTimes[i].connectUs);
+        slowest.powerUs = max(slowest.powerUs, camTimes[i].powerUs);
+        slowest.configureUs = max(slowest.configureUs, camTimes[i].configureUs);
+        writesSkipped += cams[i]->getWritesSkipped();
+    }
+    cout << "Start-up took " << (startEnd - startBegin) / 1000.0 << " ms: "
+         << (cams.empty() || cams[0]->wasDiscovered() ? "discovery " : "cached lookup ")
+         << (setupBegin - discoverBegin) / 1000.0 << " ms, cameras " << (buffersBegin - setupBegin) / 1000.0
+         << " ms (slowest connect " << slowest.connectUs / 1000.0 << ", power " << slowest.powerUs / 1000.0
+         << ", configure " << slowest.configureUs / 1000.0 << ", " << writesSkipped << " writes skipped), "
+         << "buffers and stages " << (captureBegin - buffersBegin) / 1000.0 << " ms, capture start "
+         << (startEnd - captureBegin) / 1000.0 << " ms" << endl;
+
+    cout << "Capturing from " << sources.size() << " camera(s) ("
+         << lfCpuLevelName(detection.getCpuLevel()) << " kernels). Press Enter to stop..." << endl;
     cin.ignore();
 
+    pipeline.stop();
+    multiCam.stop();
+    writer.stop();
+    for (unsigned int i = 0; i < clips.size(); i++)
+    {
+        clips[i]->stop();
+    }
+    lfLogStop();
+    if (exportMetrics)
+    {
+        exporter.stop();
+        exporter.printStats();
+    }
+    if (recordPath != NULL)
+    {
+        recorder.close();
+        cout << "Recorded " << recorder.getFrameCount() << " frames to " << recordPath
+             << " (" << recorder.getRejected() << " rejected)" << endl;
+    }
+    multiCam.printStats();
+    pipeline.printStats();
+    writer.printStats();
+    bus.printStats();
+    for (unsigned int i = 0; i < clips.size(); i++)
+    {
+        clips[i]->printStats();
+    }
+    detection.printStats();
+    unsigned long copyFallbacks = 0;
+    for (unsigned int i = 0; i < cams.size(); i++)
+    {
+        cams[i]->getTriggerWait().printStats();
+        copyFallbacks += cams[i]->getCopyFallbacks();
+    }
+    for (unsigned int i = 0; i < synths.size(); i++)
+    {
+        cout << "Synthetic camera " << i << ": " << synths[i]->getFramesDropped()
+             << " frames dropped, " << synths[i]->getIntrusions() << " intrusions" << endl;
+    }
+    for (unsigned int i = 0; i < trackers.size(); i++)
+    {
+        cout << "Camera " << i << " ";
+        trackers[i]->printStats();
+    }
+    lfLogPrintStats();
+    lfPrintAllocStats();
+    cout << "Frame buffer allocations during capture: " << lfAllocCount() - allocsBefore
+         << ", library copy fallbacks: " << copyFallbacks << endl;
+
+    // Stop cameras
+    for (unsigned int i = 0; i < sources.size(); i++)
+    {
+        sources[i]->stop();
+        sources[i]->disconnect();
+        delete sources[i];
+        delete pools[i];
+        if (i < trackers.size())
+        {
+            delete trackers[i];
+        }
+        if (i < clips.size())
+        {
+            delete clips[i];
+        }
+    }
+
+    cout << "Done!" << endl;
+
     return 0;
 }
@@ -0,0 +1,1207 @@
+// Per-stage benchmarks for laser fence application.
+//
+// Runs each processing stage over synthetic frames at several resolutions
+// and prints one JSON document with ns/pixel, frames/s and latency
+// percentiles per stage, so runs from different builds can be diffed.
+// Profile stages also report their RMS error against the synthetic line.
+//
+// The codec stages compare lfcodec with PNG; -r runs them on the first
+// pairs of a recording too.  The trigger_wait stage compares the wait
+// modes on time to ready, register reads and CPU per wait.  The multicam
+// stage captures from 1 to -c synthetic cameras through LfMultiCam and
+// reports the merged pairs/s for each count.
+//
+// Usage: lfbench [-n frames] [-s WxH]... [-c cameras] [-d scratchdir] [-r file.lfr] [-o out.json]
+
+#include "stdafx.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "lfalg.h"
+#include "lfbg.h"
+#include "lfbuf.h"
+#include "lfcodec.h"
+#include "lfconv.h"
+#include "lflog.h"
+#include "lfmetrics.h"
+#include "lfmulti.h"
+#include "lfpar.h"
+#include "lfqueue.h"
+#include "lfrec.h"
+#include "lfsynth.h"
+#include "lfwait.h"
+#include "lfwriter.h"
+
+using namespace std;
+
+// Pairs generated up front and cycled through by every stage
+static const unsigned int k_benchPairs = 4;
+
+// Recordings timed together in the metrics stage, which is too quick to
+// time one at a time
+static const unsigned int k_metricBatch = 1000;
+// Log records per sample; a quarter of a thread's ring, so none are dropped
+static const unsigned int k_logBatch = 256;
+// Cost of one scripted register read, about a GigE round trip on a quiet link
+static const unsigned int k_registerReadUs = 2;
+
+struct BenchSize {
+    unsigned int width;
+    unsigned int height;
+};
+
+struct BenchResult {
+    string stage;
+    string variant;
+    unsigned int width;
+    unsigned int height;
+    unsigned int frames;
+    double nsPerPixel;
+    double fps;
+    double p50Us;
+    double p99Us;
+    double p999Us;
+    double rmsRows;             // Profile error against the true line, or -1
+    double ratio;               // Raw bytes per coded byte, or -1
+    double readsMean;           // Register reads per trigger wait, or -1
+    double readsP99;
+    double cpuUsPerWait;        // Thread CPU time per trigger wait
+    double pairsPerCamera;      // Merged pairs/s over cameras, or -1
+};
+
+static unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double percentileUs(const vector<unsigned long long> &sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t i = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+static BenchResult summarize(const char *stage, const char *variant, const BenchSize &size,
+                             vector<unsigned long long> &samples)
+{
+    BenchResult r;
+    r.stage = stage;
+    r.variant = variant;
+    r.width = size.width;
+    r.height = size.height;
+    r.frames = samples.size();
+
+    unsigned long long total = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        total += samples[i];
+    }
+    double pixels = (double)size.width * size.height * samples.size();
+    r.nsPerPixel = pixels > 0 ? total / pixels : 0;
+    r.fps = total > 0 ? samples.size() * 1e9 / total : 0;
+
+    sort(samples.begin(), samples.end());
+    r.p50Us = percentileUs(samples, 0.50);
+    r.p99Us = percentileUs(samples, 0.99);
+    r.p999Us = percentileUs(samples, 0.999);
+    r.rmsRows = -1;
+    r.ratio = -1;
+    r.readsMean = -1;
+    r.readsP99 = -1;
+    r.cpuUsPerWait = -1;
+    r.pairsPerCamera = -1;
+
+    cerr << "  " << stage << "/" << variant << " " << size.width << "x" << size.height << ": "
+         << r.nsPerPixel << " ns/px, " << r.fps << " fps" << endl;
+    return r;
+}
+
+static void timeConvert(LfConverter &converter, LfFrame **src, LfFrame *dst, unsigned int frames,
+                        const char *variant, const BenchSize &size, vector<BenchResult> &results)
+{
+    vector<unsigned long long> samples;
+    samples.reserve(frames);
+    for (unsigned int i = 0; i < frames + 1; i++)
+    {
+        unsigned long long begin = nowNs();
+        converter.convert(src[i % k_benchPairs], dst);
+        // The first run only warms the caches
+        if (i > 0)
+        {
+            samples.push_back(nowNs() - begin);
+        }
+    }
+    results.push_back(summarize("convert", variant, size, samples));
+}
+
+static void benchConvert(const BenchSize &size, unsigned int frames, LfWorkers &workers,
+                         vector<BenchResult> &results)
+{
+    const LfPixelFormat formats[] = { LF_PIXEL_MONO8, LF_PIXEL_MONO12, LF_PIXEL_MONO16 };
+    const char *names[] = { "mono8", "mono12", "mono16" };
+    LfFramePool out(1, size.width, size.height, LF_PIXEL_MONO8);
+    LfFrame *dst = out.lease();
+    unsigned char lut[k_lfLutSize];
+    lfBuildWindowLut(lut, 256, 3072);
+
+    for (int f = 0; f < 3; f++)
+    {
+        LfFrame *src[k_benchPairs];
+        LfFramePool pool(k_benchPairs, size.width, size.height, formats[f]);
+        for (unsigned int i = 0; i < k_benchPairs; i++)
+        {
+            src[i] = pool.lease();
+            for (size_t j = 0; j < src[i]->capacity; j++)
+            {
+                src[i]->data[j] = (unsigned char)(j * 7 + i);
+            }
+        }
+
+        char variant[64];
+        LfConverter converter;
+        if (formats[f] == LF_PIXEL_MONO8)
+        {
+            // Passed through, so this only measures the bookkeeping.  dst
+            // is left a view of this pool, so take a fresh one.
+            timeConvert(converter, src, dst, frames, names[f], size, results);
+            out.release(dst);
+            dst = out.lease();
+        }
+        else
+        {
+            LfCpuLevel best = lfDetectCpuLevel();
+            for (int level = LF_CPU_SCALAR; level <= best; level++)
+            {
+                converter.setCpuLevel((LfCpuLevel)level);
+                snprintf(variant, sizeof(variant), "%s_%s", names[f], lfCpuLevelName((LfCpuLevel)level));
+                timeConvert(converter, src, dst, frames, variant, size, results);
+            }
+            converter.setLut(lut);
+            snprintf(variant, sizeof(variant), "%s_lut", names[f]);
+            timeConvert(converter, src, dst, frames, variant, size, results);
+            if (workers.getBands() > 1)
+            {
+                converter.setShift(4);
+                converter.setWorkers(&workers);
+                snprintf(variant, sizeof(variant), "%s_%s_x%u", names[f], lfCpuLevelName(best),
+                         workers.getBands());
+                timeConvert(converter, src, dst, frames, variant, size, results);
+            }
+        }
+
+        for (unsigned int i = 0; i < k_benchPairs; i++)
+        {
+            pool.release(src[i]);
+        }
+    }
+    out.release(dst);
+}
+
+static void benchDiff(const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                      vector<BenchResult> &results)
+{
+    LfDiffEngine engine(size.width, size.height, 32);
+    LfCpuLevel best = lfDetectCpuLevel();
+    for (int level = LF_CPU_SCALAR; level <= best; level++)
+    {
+        engine.setCpuLevel((LfCpuLevel)level);
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames + 1; i++)
+        {
+            unsigned int p = i % k_benchPairs;
+            unsigned long long begin = nowNs();
+            engine.process(on[p]->data, off[p]->data, on[p]->stride);
+            if (i > 0)
+            {
+                samples.push_back(nowNs() - begin);
+            }
+        }
+        results.push_back(summarize("diff", lfCpuLevelName((LfCpuLevel)level), size, samples));
+    }
+}
+
+static void timeFrameDiff(LfFrameDiffKernel kernel, LfFrame **on, LfFrame **off, LfDiffEngine &engine,
+                          unsigned int frames, const char *variant, const BenchSize &size,
+                          vector<BenchResult> &results)
+{
+    // The engine only lends its planes
+    unsigned char *diff = (unsigned char *)engine.getDiff();
+    unsigned char *mask = (unsigned char *)engine.getMask();
+    vector<unsigned long long> samples;
+    samples.reserve(frames);
+    for (unsigned int i = 0; i < frames + 1; i++)
+    {
+        const LfFrame *a = on[i % k_benchPairs];
+        const LfFrame *b = off[i % k_benchPairs];
+        unsigned long long begin = nowNs();
+        kernel(a->data, b->data, a->stride, a->width, a->height, 4, diff, mask, 32);
+        if (i > 0)
+        {
+            samples.push_back(nowNs() - begin);
+        }
+    }
+    results.push_back(summarize("frame_diff", variant, size, samples));
+}
+
+static void benchFrameDiff(const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                           vector<BenchResult> &results)
+{
+    // 16-bit copies of the pairs whose top byte is the 8-bit pixel
+    LfFramePool pool16(2 * k_benchPairs, size.width, size.height, LF_PIXEL_MONO16);
+    LfFrame *on16[k_benchPairs];
+    LfFrame *off16[k_benchPairs];
+    for (unsigned int p = 0; p < k_benchPairs; p++)
+    {
+        on16[p] = pool16.lease();
+        off16[p] = pool16.lease();
+        for (size_t j = 0; j < (size_t)size.width * size.height; j++)
+        {
+            on16[p]->data[2 * j] = (unsigned char)(j * 7);
+            on16[p]->data[2 * j + 1] = on[p]->data[j];
+            off16[p]->data[2 * j] = (unsigned char)(j * 5);
+            off16[p]->data[2 * j + 1] = off[p]->data[j];
+        }
+    }
+    LfFramePool scratch(2, size.width, size.height, LF_PIXEL_MONO8);
+    LfFrame *onMono = scratch.lease();
+    LfFrame *offMono = scratch.lease();
+    LfDiffEngine engine(size.width, size.height, 32);
+    LfConverter converter;
+
+    LfCpuLevel best = lfDetectCpuLevel();
+    char variant[64];
+    for (int level = LF_CPU_SCALAR; level <= best; level++)
+    {
+        const char *name = lfCpuLevelName((LfCpuLevel)level);
+        for (int f = 0; f < 2; f++)
+        {
+            LfPixelFormat format = f == 0 ? LF_PIXEL_MONO8 : LF_PIXEL_MONO16;
+            const char *formatName = f == 0 ? "mono8" : "mono16";
+            LfFrame **a = f == 0 ? on : on16;
+            LfFrame **b = f == 0 ? off : off16;
+            snprintf(variant, sizeof(variant), "%s_any_%s", formatName, name);
+            timeFrameDiff(lfGetFrameDiffKernel((LfCpuLevel)level, format, 0), a, b, engine, frames, variant,
+                          size, results);
+            if (lfIsSpecialisedWidth(size.width))
+            {
+                snprintf(variant, sizeof(variant), "%s_%u_%s", formatName, size.width, name);
+                timeFrameDiff(lfGetFrameDiffKernel((LfCpuLevel)level, format, size.width), a, b, engine, frames,
+                              variant, size, results);
+            }
+        }
+
+        // What 16-bit pairs cost without the fused kernel: unpack both, then difference
+        converter.setCpuLevel((LfCpuLevel)level);
+        engine.setCpuLevel((LfCpuLevel)level);
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames + 1; i++)
+        {
+            unsigned long long begin = nowNs();
+            converter.convert(on16[i % k_benchPairs], onMono);
+            converter.convert(off16[i % k_benchPairs], offMono);
+            engine.process(onMono->data, offMono->data, size.width);
+            if (i > 0)
+            {
+                samples.push_back(nowNs() - begin);
+            }
+        }
+        snprintf(variant, sizeof(variant), "mono16_convert_%s", name);
+        results.push_back(summarize("frame_diff", variant, size, samples));
+    }
+
+    scratch.release(onMono);
+    scratch.release(offMono);
+    for (unsigned int p = 0; p < k_benchPairs; p++)
+    {
+        pool16.release(on16[p]);
+        pool16.release(off16[p]);
+    }
+}
+
+static void benchProfile(const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                         const LfSynthCam &cam, LfWorkers &workers, vector<BenchResult> &results)
+{
+    // The scene is fixed, so the last frame's line is every pair's line
+    LfDiffEngine engine(size.width, size.height, 32);
+    engine.process(on[0], off[0]);
+    LfProfiler profiler(size.width);
+    const LfProfileMethod methods[] = { LF_PROFILE_CENTROID, LF_PROFILE_GAUSSIAN };
+    const char *names[] = { "centroid", "gaussian" };
+    LfCpuLevel best = lfDetectCpuLevel();
+
+    for (int m = 0; m < 2; m++)
+    {
+        profiler.setMethod(methods[m]);
+        for (int level = LF_CPU_SCALAR; level <= best + 1; level++)
+        {
+            // One extra run at the best level split over the workers
+            bool banded = level > best;
+            if (banded && workers.getBands() < 2)
+            {
+                break;
+            }
+            profiler.setCpuLevel(banded ? best : (LfCpuLevel)level);
+            profiler.setWorkers(banded ? &workers : NULL);
+
+            vector<unsigned long long> samples;
+            samples.reserve(frames);
+            for (unsigned int i = 0; i < frames + 1; i++)
+            {
+                unsigned long long begin = nowNs();
+                profiler.extract(engine);
+                if (i > 0)
+                {
+                    samples.push_back(nowNs() - begin);
+                }
+            }
+
+            double squares = 0;
+            unsigned int counted = 0;
+            const float *rows = profiler.getRows();
+            for (unsigned int x = 0; x < profiler.getWidth(); x++)
+            {
+                if (rows[x] != k_lfNoLine)
+                {
+                    double e = rows[x] - cam.getLaserRow(x);
+                    squares += e * e;
+                    counted++;
+                }
+            }
+
+            char variant[64];
+            if (banded)
+            {
+                snprintf(variant, sizeof(variant), "%s_%s_x%u", names[m], lfCpuLevelName(best),
+                         workers.getBands());
+            }
+            else
+            {
+                snprintf(variant, sizeof(variant), "%s_%s", names[m], lfCpuLevelName((LfCpuLevel)level));
+            }
+            BenchResult r = summarize("profile", variant, size, samples);
+            r.rmsRows = counted > 0 ? sqrt(squares / counted) : -1;
+            if (counted < profiler.getWidth())
+            {
+                cerr << "  line missed in " << profiler.getWidth() - counted << " columns" << endl;
+            }
+            results.push_back(r);
+        }
+    }
+}
+
+static void benchBackground(const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                            vector<BenchResult> &results)
+{
+    // One engine per pair, so the model sees the scene change
+    LfDiffEngine *engine[k_benchPairs];
+    for (unsigned int p = 0; p < k_benchPairs; p++)
+    {
+        engine[p] = new LfDiffEngine(size.width, size.height, 32);
+        engine[p]->process(on[p], off[p]);
+    }
+
+    LfBackground model(size.width, size.height);
+    LfCpuLevel best = lfDetectCpuLevel();
+    for (int level = LF_CPU_SCALAR; level <= best; level++)
+    {
+        model.setCpuLevel((LfCpuLevel)level);
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        // The first update only seeds the model
+        for (unsigned int i = 0; i < frames + 1; i++)
+        {
+            unsigned long long begin = nowNs();
+            model.update(*engine[i % k_benchPairs]);
+            if (i > 0)
+            {
+                samples.push_back(nowNs() - begin);
+            }
+        }
+        results.push_back(summarize("background", lfCpuLevelName((LfCpuLevel)level), size, samples));
+    }
+
+    for (unsigned int p = 0; p < k_benchPairs; p++)
+    {
+        delete engine[p];
+    }
+}
+
+static void benchBlobs(const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                       LfWorkers &workers, vector<BenchResult> &results)
+{
+    LfDiffEngine engine(size.width, size.height, 32);
+    engine.process(on[0], off[0]);
+    LfBlobLabeler labeler(size.width, size.height, 256);
+    LfCpuLevel best = lfDetectCpuLevel();
+
+    for (int level = LF_CPU_SCALAR; level <= best + 1; level++)
+    {
+        // One extra run at the best level split over the workers
+        bool banded = level > best;
+        if (banded && workers.getBands() < 2)
+        {
+            break;
+        }
+        labeler.setCpuLevel(banded ? best : (LfCpuLevel)level);
+        labeler.setWorkers(banded ? &workers : NULL);
+
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames + 1; i++)
+        {
+            unsigned long long begin = nowNs();
+            labeler.label(engine);
+            if (i > 0)
+            {
+                samples.push_back(nowNs() - begin);
+            }
+        }
+
+        char variant[32];
+        if (banded)
+        {
+            snprintf(variant, sizeof(variant), "%s_x%u", lfCpuLevelName(best), workers.getBands());
+        }
+        else
+        {
+            snprintf(variant, sizeof(variant), "%s", lfCpuLevelName((LfCpuLevel)level));
+        }
+        results.push_back(summarize("blobs", variant, size, samples));
+    }
+    cerr << "  " << labeler.getBlobCount() << " blobs from " << labeler.getRunCount() << " runs" << endl;
+}
+
+static void benchChangeMap(const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                           vector<BenchResult> &results)
+{
+    // The bench scene is still, so the pairs differ by noise alone: the
+    // quiet case the change map is for.  Difference, profile and label
+    // each pair with and without it.
+    for (int useMap = 0; useMap < 2; useMap++)
+    {
+        LfDiffEngine engine(size.width, size.height, 32);
+        engine.setChangeMap(useMap != 0);
+        LfProfiler profiler(size.width);
+        LfBlobLabeler labeler(size.width, size.height, 256);
+
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames + 1; i++)
+        {
+            unsigned long long begin = nowNs();
+            engine.process(on[i % k_benchPairs], off[i % k_benchPairs]);
+            profiler.extract(engine);
+            labeler.label(engine);
+            if (i > 0)
+            {
+                samples.push_back(nowNs() - begin);
+            }
+        }
+        results.push_back(summarize("quiet", useMap ? "change_map" : "full", size, samples));
+        if (useMap)
+        {
+            cerr << "  " << 100.0 * engine.getTilesSkipped() / engine.getTiles() << "% of tiles skipped" << endl;
+        }
+    }
+}
+
+// PNG as libpng writes it by default: each row filtered with whichever of
+// the five filters leaves the smallest sum of residuals, then deflated at
+// the default level.  Chunk framing and CRCs are left out; they cost next
+// to nothing.  Returns the compressed bytes, or 0 on failure.
+static size_t pngEncode(const LfFrame *frame, unsigned int bytesPerPixel, vector<unsigned char> &filtered,
+                        vector<unsigned char> &out)
+{
+    size_t rowBytes = (size_t)frame->width * bytesPerPixel;
+    filtered.resize((rowBytes + 1) * frame->height);
+    vector<unsigned char> zeros(rowBytes, 0);
+    vector<unsigned char> candidates(5 * rowBytes);
+    for (unsigned int y = 0; y < frame->height; y++)
+    {
+        const unsigned char *row = frame->data + (size_t)y * frame->stride;
+        const unsigned char *up = y > 0 ? row - frame->stride : &zeros[0];
+        unsigned long best = ~0UL;
+        unsigned int chosen = 0;
+        for (unsigned int f = 0; f < 5; f++)
+        {
+            unsigned long sum = 0;
+            for (size_t x = 0; x < rowBytes; x++)
+            {
+                int a = x >= bytesPerPixel ? row[x - bytesPerPixel] : 0;
+                int b = up[x];
+                int c = x >= bytesPerPixel ? up[x - bytesPerPixel] : 0;
+                int predicted = 0;
+                if (f == 1)
+                {
+                    predicted = a;
+                }
+                else if (f == 2)
+                {
+                    predicted = b;
+                }
+                else if (f == 3)
+                {
+                    predicted = (a + b) / 2;
+                }
+                else if (f == 4)
+                {
+                    int pa = abs(b - c);
+                    int pb = abs(a - c);
+                    int pc = abs(a + b - 2 * c);
+                    predicted = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+                }
+                unsigned char r = row[x] - predicted;
+                candidates[f * rowBytes + x] = r;
+                sum += r < 128 ? r : 256 - r;
+            }
+            if (sum < best)
+            {
+                best = sum;
+                chosen = f;
+            }
+        }
+        unsigned char *dst = &filtered[y * (rowBytes + 1)];
+        dst[0] = chosen;
+        memcpy(dst + 1, &candidates[chosen * rowBytes], rowBytes);
+    }
+    uLongf bytes = compressBound(filtered.size());
+    out.resize(bytes);
+    if (compress2(&out[0], &bytes, &filtered[0], filtered.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        return 0;
+    }
+    return bytes;
+}
+
+static void reportRatio(BenchResult &r, unsigned long long raw, unsigned long long coded, unsigned long long ns)
+{
+    r.ratio = coded > 0 ? (double)raw / coded : 0;
+    cerr << "  " << r.ratio << ":1, " << (ns > 0 ? raw * 1000.0 / ns : 0.0) << " MB/s" << endl;
+}
+
+static void benchCodec(const char *stage, const BenchSize &size, unsigned int frames, LfFrame **on, LfFrame **off,
+                       LfWorkers &workers, vector<BenchResult> &results)
+{
+    LfPixelFormat format = on[0]->format;
+    size_t rowBytes = lfRowBytes(format, size.width);
+    unsigned int sampleBytes = lfCodecSampleBytes(format);
+    size_t frameBytes = rowBytes * size.height;
+
+    // What the pre-event clip buffer spends per frame: laser-on frames
+    // coded on their own and against the one before
+    LfCpuLevel levels[] = { LF_CPU_SCALAR, LF_CPU_SSE41 };
+    const char *names[] = { "key_scalar", "delta_scalar", "key_sse41", "delta_sse41" };
+    vector<unsigned char> coded(LfPlaneCodec::maxEncodedSize(rowBytes, size.height, 2));
+    for (unsigned int l = 0; l < 2; l++)
+    {
+        if (levels[l] > lfDetectCpuLevel())
+        {
+            continue;
+        }
+        LfPlaneCodec codec;
+        codec.setCpuLevel(levels[l]);
+        for (unsigned int mode = 0; mode < 2; mode++)
+        {
+            vector<unsigned long long> samples;
+            samples.reserve(frames);
+            unsigned long long bytes = 0;
+            unsigned long long total = 0;
+            for (unsigned int i = 0; i < frames + 1; i++)
+            {
+                const LfFrame *cur = on[i % k_benchPairs];
+                const LfFrame *ref = mode > 0 ? on[(i + k_benchPairs - 1) % k_benchPairs] : NULL;
+                unsigned long long begin = nowNs();
+                size_t n = codec.encode(cur->data, cur->stride, ref ? ref->data : NULL, ref ? ref->stride : 0,
+                                        rowBytes, size.height, &coded[0], sampleBytes);
+                if (i > 0)
+                {
+                    samples.push_back(nowNs() - begin);
+                    bytes += n;
+                    total += samples.back();
+                }
+            }
+            results.push_back(summarize(stage, names[2 * l + mode], size, samples));
+            reportRatio(results.back(), frameBytes * frames, bytes, total);
+        }
+    }
+
+    // Whole pairs as saveImage() and the writer save them, in one slice and
+    // in a slice per band, then decoded; each sample is half a pair
+    LfFrameCodec pairCodec;
+    vector<unsigned char> image(pairCodec.maxEncodedSize(size.width, size.height, format, 2));
+    LfFramePool decoded(2, size.width, size.height, format);
+    LfFrame *decodedOn = decoded.lease();
+    LfFrame *decodedOff = decoded.lease();
+    const char *pairNames[] = { "lfc_pair", "lfc_pair_sliced", "lfc_decode" };
+    for (unsigned int mode = 0; mode < 3; mode++)
+    {
+        if (mode == 1 && workers.getBands() < 2)
+        {
+            continue;
+        }
+        pairCodec.setSlices(mode == 0 ? 1 : workers.getBands());
+        pairCodec.setWorkers(mode == 0 ? NULL : &workers);
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        unsigned long long bytes = 0;
+        unsigned long long total = 0;
+        unsigned long mismatches = 0;
+        for (unsigned int i = 0; i < frames + 1; i++)
+        {
+            LfFrame *a = on[i % k_benchPairs];
+            LfFrame *b = off[i % k_benchPairs];
+            unsigned long long begin = nowNs();
+            size_t n = pairCodec.encode(a, b, &image[0], image.size());
+            if (mode == 2)
+            {
+                begin = nowNs();
+                pairCodec.decode(&image[0], n, decodedOn, decodedOff);
+            }
+            unsigned long long elapsed = nowNs() - begin;
+            if (mode == 2 && i == 0)
+            {
+                for (unsigned int y = 0; y < size.height; y++)
+                {
+                    mismatches += memcmp(decodedOn->data + y * rowBytes, a->data + (size_t)y * a->stride,
+                                         rowBytes) != 0;
+                    mismatches += memcmp(decodedOff->data + y * rowBytes, b->data + (size_t)y * b->stride,
+                                         rowBytes) != 0;
+                }
+            }
+            if (i > 0)
+            {
+                samples.push_back(elapsed / 2);
+                samples.push_back(elapsed - elapsed / 2);
+                bytes += n;
+                total += elapsed;
+            }
+        }
+        results.push_back(summarize(stage, pairNames[mode], size, samples));
+        reportRatio(results.back(), 2 * frameBytes * frames, bytes, total);
+        if (mismatches > 0)
+        {
+            cerr << "  " << mismatches << " rows decoded wrong" << endl;
+        }
+    }
+    pairCodec.setWorkers(NULL);
+    decoded.release(decodedOn);
+    decoded.release(decodedOff);
+
+    // Packed 12-bit rows have no PNG form without unpacking
+    if (format == LF_PIXEL_MONO12)
+    {
+        return;
+    }
+    vector<unsigned char> filtered;
+    vector<unsigned char> png;
+    vector<unsigned long long> samples;
+    unsigned long long bytes = 0;
+    unsigned long long total = 0;
+    // Deflate is slow enough that a quarter of the frames will do
+    unsigned int pngFrames = frames / 4 ? frames / 4 : 1;
+    for (unsigned int i = 0; i < 2 * pngFrames; i++)
+    {
+        const LfFrame *frame = i % 2 ? off[i / 2 % k_benchPairs] : on[i / 2 % k_benchPairs];
+        unsigned long long begin = nowNs();
+        bytes += pngEncode(frame, sampleBytes, filtered, png);
+        samples.push_back(nowNs() - begin);
+        total += samples.back();
+    }
+    results.push_back(summarize(stage, "png", size, samples));
+    reportRatio(results.back(), 2 * frameBytes * pngFrames, bytes, total);
+}
+
+// Codec stages again on pairs from a recording, for real sensor noise
+static void benchRecorded(const char *path, unsigned int frames, LfWorkers &workers, vector<BenchResult> &results)
+{
+    LfReplay replay(path);
+    const LfrHeader &header = replay.getHeader();
+    if (replay.getFrameCount() < 2 * k_benchPairs)
+    {
+        cerr << path << " holds too few frames" << endl;
+        return;
+    }
+    cerr << "Benchmarking " << path << endl;
+    BenchSize size;
+    size.width = header.width;
+    size.height = header.height;
+    LfFramePool pool(2 * k_benchPairs, header.width, header.height, (LfPixelFormat)header.pixelFormat);
+    LfFrame *on[k_benchPairs];
+    LfFrame *off[k_benchPairs];
+    replay.start();
+    for (unsigned int i = 0; i < k_benchPairs; i++)
+    {
+        on[i] = pool.lease();
+        off[i] = pool.lease();
+        replay.retrieveImage(on[i]);
+        replay.retrieveImage(off[i]);
+    }
+    benchCodec("codec_recorded", size, frames, on, off, workers, results);
+    for (unsigned int i = 0; i < k_benchPairs; i++)
+    {
+        pool.release(on[i]);
+        pool.release(off[i]);
+    }
+    replay.stop();
+}
+
+static void benchSave(const BenchSize &size, unsigned int frames, const char *directory,
+                      LfFrame **on, vector<BenchResult> &results)
+{
+    // Files are removed as they land so the run needs one frame of disk
+    const LfWriteFormat formats[] = { LF_WRITE_PGM, LF_WRITE_PGM_GZ };
+    const char *names[] = { "pgm", "pgm_gz" };
+    for (int f = 0; f < 2; f++)
+    {
+        LfFramePool pool(1, size.width, size.height, LF_PIXEL_MONO8);
+        LfFrameWriter writer(directory, "lfbench", formats[f], 1, 1);
+        if (writer.start(pool.getBufferSize()) != 0)
+        {
+            cerr << "Can't start writer in " << directory << endl;
+            return;
+        }
+
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames; i++)
+        {
+            LfFrame *frame = pool.lease();
+            memcpy(frame->data, on[i % k_benchPairs]->data, on[i % k_benchPairs]->dataSize);
+            frame->dataSize = on[i % k_benchPairs]->dataSize;
+            frame->camera = 0;
+
+            // Submit to written and released, as the store stage sees it
+            unsigned long long begin = nowNs();
+            writer.submit(frame);
+            unsigned int idle = 0;
+            while (pool.getInUse() > 0)
+            {
+                lfIdleWait(idle);
+            }
+            samples.push_back(nowNs() - begin);
+
+            char path[512];
+            snprintf(path, sizeof(path), "%s/lfbench-c0-%08u.pgm%s", directory, i, f == 1 ? ".gz" : "");
+            unlink(path);
+        }
+        writer.stop();
+        if (writer.getFramesWritten() != frames)
+        {
+            cerr << "Writer lost " << frames - writer.getFramesWritten() << " frames" << endl;
+        }
+        results.push_back(summarize("save", names[f], size, samples));
+    }
+}
+
+static void benchMultiCam(const BenchSize &size, unsigned int frames, unsigned int maxCameras,
+                          vector<BenchResult> &results)
+{
+    // Free-running synthetic cameras, one capture thread each, merged as
+    // lfapp takes them.  Samples are the gaps between merged pairs, so fps
+    // is the aggregate pairs/s, and pairs_per_camera shows how well each
+    // camera keeps up as more are added.
+    const unsigned int queueDepth = 4;
+    for (unsigned int count = 1; count <= maxCameras; count++)
+    {
+        vector<LfSynthCam *> cams;
+        vector<LfFramePool *> pools;
+        LfMultiCam multiCam(queueDepth);
+        for (unsigned int c = 0; c < count; c++)
+        {
+            LfSynthSettings settings;
+            lfSynthDefaults(&settings);
+            settings.width = size.width;
+            settings.height = size.height;
+            settings.laserRow = size.height / 2;
+            settings.triggerRate = 0;
+            settings.seed = c + 1;
+            cams.push_back(new LfSynthCam(settings));
+            pools.push_back(new LfFramePool(2 * (2 * queueDepth + 3), size.width, size.height, LF_PIXEL_MONO8));
+            cams[c]->connect(c);
+            cams[c]->start();
+            multiCam.addCamera(cams[c], pools[c], -1);
+        }
+        multiCam.start();
+
+        // Let every capture thread fill its queue first
+        unsigned int warmup = 2 * count;
+        unsigned long pairs = (unsigned long)frames * count;
+        vector<unsigned long long> samples;
+        samples.reserve(pairs);
+        unsigned long long last = 0;
+        for (unsigned long i = 0; i < warmup + pairs; i++)
+        {
+            LfFrame *on = multiCam.nextPair(1000000);
+            if (on == NULL)
+            {
+                cerr << "  multicam: no pair from " << count << " cameras in 1 s" << endl;
+                break;
+            }
+            unsigned long long now = nowNs();
+            if (i >= warmup)
+            {
+                samples.push_back(now - last);
+            }
+            last = now;
+            LfFrame *off = on->pair;
+            on->pair = NULL;
+            LfFramePool::releaseFrame(off);
+            LfFramePool::releaseFrame(on);
+        }
+        multiCam.stop();
+        for (unsigned int c = 0; c < count; c++)
+        {
+            cams[c]->stop();
+            delete cams[c];
+            delete pools[c];
+        }
+
+        char variant[32];
+        snprintf(variant, sizeof(variant), "cameras_%u", count);
+        BenchResult r = summarize("multicam", variant, size, samples);
+        r.pairsPerCamera = r.fps / count;
+        cerr << "  " << r.fps << " pairs/s, " << r.pairsPerCamera << " per camera" << endl;
+        results.push_back(r);
+    }
+}
+
+static void writeJson(ostream &out, const vector<BenchResult> &results, unsigned int frames)
+{
+    out << "{\n";
+    out << "  \"cpu\": \"" << lfCpuLevelName(lfDetectCpuLevel()) << "\",\n";
+    out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+    out << "  \"frames\": " << frames << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        out << "    {\"stage\": \"" << r.stage << "\", \"variant\": \"" << r.variant
+            << "\", \"width\": " << r.width << ", \"height\": " << r.height
+            << ", \"frames\": " << r.frames
+            << ", \"ns_per_pixel\": " << r.nsPerPixel << ", \"fps\": " << r.fps
+            << ", \"p50_us\": " << r.p50Us << ", \"p99_us\": " << r.p99Us
+            << ", \"p999_us\": " << r.p999Us;
+        if (r.rmsRows >= 0)
+        {
+            out << ", \"rms_error_rows\": " << r.rmsRows;
+        }
+        if (r.ratio >= 0)
+        {
+            out << ", \"ratio\": " << r.ratio;
+        }
+        if (r.readsMean >= 0)
+        {
+            out << ", \"reads_mean\": " << r.readsMean << ", \"reads_p99\": " << r.readsP99
+                << ", \"cpu_us_per_wait\": " << r.cpuUsPerWait;
+        }
+        if (r.pairsPerCamera >= 0)
+        {
+            out << ", \"pairs_per_camera\": " << r.pairsPerCamera;
+        }
+        out << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+static void benchMetrics(unsigned int frames, vector<BenchResult> &results)
+{
+    // What each pair costs the hot path, one batch per sample; reported
+    // with a batch-wide row so ns/px reads as ns per recording.  "pair"
+    // is the app's usual load: two grab counts and a timed stage.
+    LfMetricsRegistry registry;
+    LfCounter *counter = registry.addCounter("bench_total", "Bench counter");
+    LfLatencyHistogram *histogram = registry.addHistogram("bench_seconds", "Bench histogram");
+    const BenchSize size = { k_metricBatch, 1 };
+    const char *variants[3] = { "counter", "histogram", "pair" };
+    for (int v = 0; v < 3; v++)
+    {
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames; i++)
+        {
+            unsigned long long begin = nowNs();
+            for (unsigned int j = 0; j < k_metricBatch; j++)
+            {
+                if (v == 0)
+                {
+                    counter->add();
+                }
+                else if (v == 1)
+                {
+                    histogram->record(j * 977);
+                }
+                else
+                {
+                    counter->add();
+                    counter->add();
+                    unsigned long long start = lfMonotonicNs();
+                    histogram->record(lfMonotonicNs() - start);
+                }
+            }
+            samples.push_back(nowNs() - begin);
+        }
+        results.push_back(summarize("metrics", variants[v], size, samples));
+    }
+
+    // And what one export costs the exporter thread
+    string text;
+    vector<unsigned long long> samples;
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        unsigned long long begin = nowNs();
+        registry.render(text);
+        samples.push_back(nowNs() - begin);
+    }
+    const BenchSize one = { 1, 1 };
+    results.push_back(summarize("metrics", "render", one, samples));
+}
+
+static void benchTriggerWait(unsigned int frames, vector<BenchResult> &results)
+{
+    // Each wait mode against a register that turns ready after a scripted
+    // delay: short, like a camera between exposures, about a frame, and
+    // long, like one still reading out.  Reads cost a little, as on the
+    // link.  Latency is from arming to the wait returning; reads and CPU
+    // come from the wait's own statistics.
+    const unsigned int delaysUs[3] = { 20, 200, 2000 };
+    const LfWaitMode modes[3] = { LF_WAIT_SPIN, LF_WAIT_SPIN_YIELD, LF_WAIT_BACKOFF };
+    const unsigned int k_triggerRegister = 0x62C;
+    const BenchSize one = { 1, 1 };
+    unsigned int waits = frames < 200 ? frames : 200;
+    for (int m = 0; m < 3; m++)
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            LfScriptedRegister reg(k_registerReadUs);
+            LfTriggerWait wait;
+            wait.setMode(modes[m]);
+            vector<unsigned long long> samples;
+            samples.reserve(waits);
+            for (unsigned int i = 0; i < waits; i++)
+            {
+                unsigned long long begin = nowNs();
+                reg.arm(delaysUs[d]);
+                wait.wait(&reg, k_triggerRegister);
+                samples.push_back(nowNs() - begin);
+            }
+            char variant[32];
+            snprintf(variant, sizeof(variant), "%s_%uus", lfWaitModeName(modes[m]), delaysUs[d]);
+            BenchResult r = summarize("trigger_wait", variant, one, samples);
+            r.readsMean = wait.getReadCount().getMean();
+            r.readsP99 = wait.getReadCount().getPercentile(0.99);
+            r.cpuUsPerWait = waits ? wait.getCpuTime() / 1000.0 / waits : 0;
+            cerr << "  " << r.readsMean << " reads, " << r.cpuUsPerWait << " us CPU per wait" << endl;
+            results.push_back(r);
+        }
+    }
+}
+
+static void benchLog(unsigned int frames, vector<BenchResult> &results)
+{
+    // What a log call costs its caller: below the level, where it is a
+    // load and a compare, and queued for the writer thread, here writing
+    // to /dev/null.  Each sample waits for the writer to catch up.
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0 || lfLogStart(fd) != 0)
+    {
+        cerr << "Can't start the logger" << endl;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    LfLogLevel saved = lfGetLogLevel();
+    const BenchSize size = { k_logBatch, 1 };
+    const char *variants[2] = { "filtered", "queued" };
+    for (int v = 0; v < 2; v++)
+    {
+        lfSetLogLevel(v == 0 ? LF_LOG_INFO : LF_LOG_DEBUG);
+        vector<unsigned long long> samples;
+        samples.reserve(frames);
+        for (unsigned int i = 0; i < frames; i++)
+        {
+            unsigned long before = lfLogWritten();
+            unsigned long long begin = nowNs();
+            for (unsigned int j = 0; j < k_logBatch; j++)
+            {
+                lfLog(LF_LOG_DEBUG, "Grabbed image %ux%u at %llu us", size.width, j, begin);
+            }
+            samples.push_back(nowNs() - begin);
+            while (v == 1 && lfLogWritten() < before + k_logBatch && lfLogDropped() == 0)
+            {
+                usleep(100);
+            }
+        }
+        results.push_back(summarize("log", variants[v], size, samples));
+    }
+    lfLogStop();
+    lfSetLogLevel(saved);
+    close(fd);
+    if (lfLogDropped() > 0)
+    {
+        cerr << "  " << lfLogDropped() << " log records dropped" << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int frames = 200;
+    const char *directory = "/tmp";
+    const char *outPath = NULL;
+    const char *recordingPath = NULL;
+    unsigned int maxCameras = 4;
+    vector<BenchSize> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc)
+        {
+            frames = atoi(argv[++i]);
+        }
+        else if (arg == "-s" && i + 1 < argc)
+        {
+            BenchSize size;
+            if (sscanf(argv[++i], "%ux%u", &size.width, &size.height) == 2 && size.width && size.height)
+            {
+                sizes.push_back(size);
+            }
+        }
+        else if (arg == "-c" && i + 1 < argc)
+        {
+            maxCameras = atoi(argv[++i]);
+        }
+        else if (arg == "-d" && i + 1 < argc)
+        {
+            directory = argv[++i];
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            outPath = argv[++i];
+        }
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            recordingPath = argv[++i];
+        }
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [-n frames] [-s WxH]... [-c cameras] [-d scratchdir] [-r file.lfr] [-o out.json]" << endl;
+            return -1;
+        }
+    }
+    if (frames == 0)
+    {
+        frames = 1;
+    }
+    if (sizes.empty())
+    {
+        // VGA, the GigE camera's 1280x1024, and a 4 MP sensor
+        const BenchSize defaults[] = { { 640, 480 }, { 1280, 1024 }, { 2048, 2048 } };
+        sizes.assign(defaults, defaults + 3);
+    }
+
+    // Band workers for the parallel conversion runs, one band per CPU
+    unsigned int numCpus = thread::hardware_concurrency();
+    LfWorkers workers(numCpus > 1 ? numCpus - 1 : 0);
+
+    vector<BenchResult> results;
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        const BenchSize &size = sizes[s];
+        cerr << "Benchmarking " << size.width << "x" << size.height << endl;
+
+        LfSynthSettings settings;
+        lfSynthDefaults(&settings);
+        settings.width = size.width;
+        settings.height = size.height;
+        settings.laserRow = size.height / 2;
+        settings.triggerRate = 0;
+        LfSynthCam cam(settings);
+        LfFramePool pool(2 * k_benchPairs, size.width, size.height, LF_PIXEL_MONO8);
+        LfFrame *on[k_benchPairs];
+        LfFrame *off[k_benchPairs];
+
+        // Generating the scene is a stage of its own for the load tests
+        vector<unsigned long long> samples;
+        cam.start();
+        for (unsigned int i = 0; i < 2 * k_benchPairs; i++)
+        {
+            LfFrame *frame = pool.lease();
+            unsigned long long begin = nowNs();
+            cam.retrieveImage(frame);
+            samples.push_back(nowNs() - begin);
+            if (i % 2 == 0)
+            {
+                on[i / 2] = frame;
+            }
+            else
+            {
+                off[i / 2] = frame;
+            }
+        }
+        cam.stop();
+        results.push_back(summarize("synth", "mono8", size, samples));
+
+        benchConvert(size, frames, workers, results);
+        benchDiff(size, frames, on, off, results);
+        benchFrameDiff(size, frames, on, off, results);
+        benchProfile(size, frames, on, off, cam, workers, results);
+        benchBackground(size, frames, on, off, results);
+        benchBlobs(size, frames, on, off, workers, results);
+        benchChangeMap(size, frames, on, off, results);
+        benchCodec("codec", size, frames, on, off, workers, results);
+        // Disk time dominates; a quarter of the frames is plenty
+        benchSave(size, frames / 4 ? frames / 4 : 1, directory, on, results);
+        benchMultiCam(size, frames, maxCameras, results);
+
+        for (unsigned int i = 0; i < k_benchPairs; i++)
+        {
+            pool.release(on[i]);
+            pool.release(off[i]);
+        }
+    }
+
+    if (recordingPath != NULL)
+    {
+        benchRecorded(recordingPath, frames, workers, results);
+    }
+    benchMetrics(frames, results);
+    benchLog(frames, results);
+    benchTriggerWait(frames, results);
+
+    if (outPath != NULL)
+    {
+        ofstream out(outPath);
+        if (!out)
+        {
+            cerr << "Can't write " << outPath << endl;
+            return -1;
+        }
+        writeJson(out, results, frames);
+    }
+    else
+    {
+        writeJson(cout, results, frames);
+    }
+    return 0;
+}
@@ -0,0 +1,310 @@
+// Background model for laser fence application.
+
+#include "lfbg.h"
+#include <iostream>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LF_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Deviations are clamped here before squaring, which keeps 4 x the
+// deviation within 16 bits: 64 grey levels in Q8.8
+static const unsigned int k_maxDeviation = 16383;
+
+size_t lfBackgroundScalar(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                          unsigned char *mask, unsigned int n,
+                          unsigned int shift, unsigned short factor, unsigned short minVariance)
+{
+    size_t count = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        unsigned int x = (unsigned int)in[i] << 8;
+        unsigned int m = mean[i];
+        unsigned int v = variance[i];
+        unsigned int up = x > m ? x - m : 0;
+        unsigned int down = m > x ? m - x : 0;
+
+        // (4d)^2 / 65536 is d^2 in 1/16 px^2 when d is Q8.8
+        unsigned int d = (up | down) < k_maxDeviation ? (up | down) : k_maxDeviation;
+        unsigned int d2 = ((d << 2) * (d << 2)) >> 16;
+        unsigned int limit = v > minVariance ? v : minVariance;
+        bool hit = ((d2 * factor) >> 16) > limit;
+        mask[i] = hit ? 255 : 0;
+        count += hit;
+
+        mean[i] = m + (up >> shift) - (down >> shift);
+        variance[i] = v + ((d2 > v ? d2 - v : 0) >> shift) - ((v > d2 ? v - d2 : 0) >> shift);
+    }
+    return count;
+}
+
+#ifdef LF_X86
+
+// Eight pixels, widened to Q8.8 in x.  Returns the hit mask as 16-bit lanes.
+// The mean and variance move with saturating differences split into an
+// up and a down part, so unsigned 16-bit lanes never wrap.
+__attribute__((target("sse4.1")))
+static inline __m128i background8(__m128i x, unsigned short *mean, unsigned short *variance,
+                                  __m128i count, __m128i factor, __m128i minVariance, __m128i maxDeviation)
+{
+    __m128i m = _mm_loadu_si128((const __m128i *)mean);
+    __m128i v = _mm_loadu_si128((const __m128i *)variance);
+    __m128i up = _mm_subs_epu16(x, m);
+    __m128i down = _mm_subs_epu16(m, x);
+
+    __m128i d = _mm_slli_epi16(_mm_min_epu16(_mm_or_si128(up, down), maxDeviation), 2);
+    __m128i d2 = _mm_mulhi_epu16(d, d);
+    __m128i scaled = _mm_mulhi_epu16(d2, factor);
+    __m128i limit = _mm_max_epu16(v, minVariance);
+    // Within limit where max(scaled, limit) == limit
+    __m128i within = _mm_cmpeq_epi16(_mm_max_epu16(scaled, limit), limit);
+
+    m = _mm_sub_epi16(_mm_add_epi16(m, _mm_srl_epi16(up, count)), _mm_srl_epi16(down, count));
+    v = _mm_sub_epi16(_mm_add_epi16(v, _mm_srl_epi16(_mm_subs_epu16(d2, v), count)),
+                      _mm_srl_epi16(_mm_subs_epu16(v, d2), count));
+    _mm_storeu_si128((__m128i *)mean, m);
+    _mm_storeu_si128((__m128i *)variance, v);
+    return _mm_xor_si128(within, _mm_set1_epi16(-1));
+}
+
+__attribute__((target("sse4.1,popcnt")))
+size_t lfBackgroundSse41(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                         unsigned char *mask, unsigned int n,
+                         unsigned int shift, unsigned short factor, unsigned short minVariance)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m128i f = _mm_set1_epi16((short)factor);
+    const __m128i fl = _mm_set1_epi16((short)minVariance);
+    const __m128i maxDeviation = _mm_set1_epi16((short)k_maxDeviation);
+    size_t hits = 0;
+    unsigned int i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+        // Interleaving zeros below each byte makes it Q8.8
+        __m128i h0 = background8(_mm_unpacklo_epi8(zero, a), mean + i, variance + i, count, f, fl,
+                                 maxDeviation);
+        __m128i h1 = background8(_mm_unpackhi_epi8(zero, a), mean + i + 8, variance + i + 8, count, f, fl,
+                                 maxDeviation);
+        __m128i hit = _mm_packs_epi16(h0, h1);
+        _mm_storeu_si128((__m128i *)(mask + i), hit);
+        hits += __builtin_popcount(_mm_movemask_epi8(hit));
+    }
+
+    return hits + lfBackgroundScalar(in + i, mean + i, variance + i, mask + i, n - i,
+                                     shift, factor, minVariance);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i background16(__m256i x, unsigned short *mean, unsigned short *variance,
+                                   __m128i count, __m256i factor, __m256i minVariance, __m256i maxDeviation)
+{
+    __m256i m = _mm256_loadu_si256((const __m256i *)mean);
+    __m256i v = _mm256_loadu_si256((const __m256i *)variance);
+    __m256i up = _mm256_subs_epu16(x, m);
+    __m256i down = _mm256_subs_epu16(m, x);
+
+    __m256i d = _mm256_slli_epi16(_mm256_min_epu16(_mm256_or_si256(up, down), maxDeviation), 2);
+    __m256i d2 = _mm256_mulhi_epu16(d, d);
+    __m256i scaled = _mm256_mulhi_epu16(d2, factor);
+    __m256i limit = _mm256_max_epu16(v, minVariance);
+    __m256i within = _mm256_cmpeq_epi16(_mm256_max_epu16(scaled, limit), limit);
+
+    m = _mm256_sub_epi16(_mm256_add_epi16(m, _mm256_srl_epi16(up, count)), _mm256_srl_epi16(down, count));
+    v = _mm256_sub_epi16(_mm256_add_epi16(v, _mm256_srl_epi16(_mm256_subs_epu16(d2, v), count)),
+                         _mm256_srl_epi16(_mm256_subs_epu16(v, d2), count));
+    _mm256_storeu_si256((__m256i *)mean, m);
+    _mm256_storeu_si256((__m256i *)variance, v);
+    return _mm256_xor_si256(within, _mm256_set1_epi16(-1));
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t lfBackgroundAvx2(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                        unsigned char *mask, unsigned int n,
+                        unsigned int shift, unsigned short factor, unsigned short minVariance)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m256i f = _mm256_set1_epi16((short)factor);
+    const __m256i fl = _mm256_set1_epi16((short)minVariance);
+    const __m256i maxDeviation = _mm256_set1_epi16((short)k_maxDeviation);
+    size_t hits = 0;
+    unsigned int i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+        // Widen pixels 0-15 and 16-31 in order, as in the profile kernel
+        __m256i b = _mm256_permute4x64_epi64(a, 0xD8);
+        __m256i zero = _mm256_setzero_si256();
+        __m256i h0 = background16(_mm256_unpacklo_epi8(zero, b), mean + i, variance + i, count, f, fl,
+                                  maxDeviation);
+        __m256i h1 = background16(_mm256_unpackhi_epi8(zero, b), mean + i + 16, variance + i + 16, count, f, fl,
+                                  maxDeviation);
+        // Packing is per 128-bit lane too; put the quarters back in order
+        __m256i hit = _mm256_permute4x64_epi64(_mm256_packs_epi16(h0, h1), 0xD8);
+        _mm256_storeu_si256((__m256i *)(mask + i), hit);
+        hits += __builtin_popcount((unsigned int)_mm256_movemask_epi8(hit));
+    }
+
+    return hits + lfBackgroundSse41(in + i, mean + i, variance + i, mask + i, n - i,
+                                    shift, factor, minVariance);
+}
+
+#else
+
+size_t lfBackgroundSse41(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                         unsigned char *mask, unsigned int n,
+                         unsigned int shift, unsigned short factor, unsigned short minVariance)
+{
+    return lfBackgroundScalar(in, mean, variance, mask, n, shift, factor, minVariance);
+}
+
+size_t lfBackgroundAvx2(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                        unsigned char *mask, unsigned int n,
+                        unsigned int shift, unsigned short factor, unsigned short minVariance)
+{
+    return lfBackgroundScalar(in, mean, variance, mask, n, shift, factor, minVariance);
+}
+
+#endif
+
+LfBackgroundKernel lfGetBackgroundKernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfBackgroundAvx2;
+    case LF_CPU_SSE41:
+        return lfBackgroundSse41;
+    default:
+        return lfBackgroundScalar;
+    }
+}
+
+
+
+LfBackground::LfBackground(unsigned int sensorWidth, unsigned int sensorHeight)
+    : sensorWidth(sensorWidth), sensorHeight(sensorHeight), shift(5), factor(0), minVariance(0),
+      startVariance(16 * k_lfBgVarianceOne), mean(NULL), variance(NULL), mask(NULL), width(0), height(0),
+      offsetX(0), offsetY(0), rowUpdated(sensorHeight, 0), updates(0), deviating(0), deviatingTotal(0),
+      pixelsTotal(0), rowStarts(0)
+{
+    size_t pixels = (size_t)sensorWidth * sensorHeight;
+    mean = (unsigned short *)lfAlignedAlloc(pixels * sizeof(unsigned short));
+    variance = (unsigned short *)lfAlignedAlloc(pixels * sizeof(unsigned short));
+    mask = (unsigned char *)lfAlignedAlloc(pixels);
+    if (mean == NULL || variance == NULL || mask == NULL)
+    {
+        lfAlignedFree(mean);
+        lfAlignedFree(variance);
+        lfAlignedFree(mask);
+        throw runtime_error("Can't allocate background model");
+    }
+
+    setSigmas(3.0);
+    setMinDeviation(2.0);
+    setCpuLevel(lfDetectCpuLevel());
+}
+
+LfBackground::~LfBackground()
+{
+    lfAlignedFree(mean);
+    lfAlignedFree(variance);
+    lfAlignedFree(mask);
+}
+
+void LfBackground::setCpuLevel(LfCpuLevel level)
+{
+    if (level > lfDetectCpuLevel())
+    {
+        level = lfDetectCpuLevel();
+    }
+    cpuLevel = level;
+    kernel = lfGetBackgroundKernel(level);
+}
+
+void LfBackground::setLearningShift(unsigned int bits)
+{
+    shift = bits < 1 ? 1 : (bits > 8 ? 8 : bits);
+}
+
+void LfBackground::setSigmas(double sigmas)
+{
+    // The kernels compare d^2 * factor / 65536 against the variance
+    double f = 65536.0 / (sigmas * sigmas);
+    factor = f > 65535 ? 65535 : (unsigned short)(f + 0.5);
+}
+
+void LfBackground::setMinDeviation(double levels)
+{
+    double v = levels * levels * k_lfBgVarianceOne;
+    minVariance = v > 65535 ? 65535 : (unsigned short)(v + 0.5);
+}
+
+void LfBackground::startRow(const unsigned char *in, unsigned short *meanRow, unsigned short *varianceRow,
+                            unsigned char *maskRow)
+{
+    for (unsigned int x = 0; x < width; x++)
+    {
+        meanRow[x] = in[x] << 8;
+        varianceRow[x] = startVariance;
+        maskRow[x] = 0;
+    }
+    rowStarts++;
+}
+
+int LfBackground::update(const LfDiffEngine &engine)
+{
+    if (engine.getOffsetX() + engine.getWidth() > sensorWidth ||
+        engine.getOffsetY() + engine.getHeight() > sensorHeight)
+    {
+        return -1;
+    }
+    width = engine.getWidth();
+    height = engine.getHeight();
+    offsetX = engine.getOffsetX();
+    offsetY = engine.getOffsetY();
+    updates++;
+
+    // A row away for 8 time constants has kept under 0.1% of what it knew
+    unsigned long stale = 8UL << shift;
+    const unsigned char *diff = engine.getDiff();
+    deviating = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        unsigned int sensorRow = offsetY + y;
+        size_t at = (size_t)sensorRow * sensorWidth + offsetX;
+        const unsigned char *in = diff + (size_t)y * width;
+        unsigned char *maskRow = mask + (size_t)y * width;
+        if (rowUpdated[sensorRow] == 0 || updates - rowUpdated[sensorRow] > stale)
+        {
+            startRow(in, mean + at, variance + at, maskRow);
+        }
+        else
+        {
+            deviating += kernel(in, mean + at, variance + at, maskRow, width, shift, factor, minVariance);
+        }
+        rowUpdated[sensorRow] = updates;
+    }
+    deviatingTotal += deviating;
+    pixelsTotal += (unsigned long long)width * height;
+    return 0;
+}
+
+void LfBackground::printStats()
+{
+    cout << "Background model: " << getFootprint() / 1024 << " KB, " << updates << " updates, "
+         << rowStarts << " row restarts";
+    if (pixelsTotal > 0)
+    {
+        cout << ", " << 100.0 * deviatingTotal / pixelsTotal << "% of pixels deviating";
+    }
+    cout << endl;
+}
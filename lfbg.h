@@ -0,0 +1,95 @@
+// Background model for laser fence application.
+
+#ifndef LFBG_H
+#define LFBG_H
+
+#include "stdafx.h"
+#include <vector>
+#include "lfalg.h"
+
+// Fixed-point formats of the model planes
+static const unsigned int k_lfBgMeanOne = 256;      // Mean is Q8.8
+static const unsigned int k_lfBgVarianceOne = 16;   // Variance is in 1/16 px^2
+
+// Background update kernels.  For each of n difference pixels: flag it in
+// mask (255) when its squared deviation from mean, times factor / 65536,
+// exceeds max(variance, minVariance), then move mean and variance
+// 1 / 2^shift of the way towards the new sample.  Deviations saturate at
+// 64 levels.  Each returns the number of pixels flagged.
+typedef size_t (*LfBackgroundKernel)(const unsigned char *in, unsigned short *mean,
+                                     unsigned short *variance, unsigned char *mask, unsigned int n,
+                                     unsigned int shift, unsigned short factor, unsigned short minVariance);
+
+size_t lfBackgroundScalar(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                          unsigned char *mask, unsigned int n,
+                          unsigned int shift, unsigned short factor, unsigned short minVariance);
+size_t lfBackgroundSse41(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                         unsigned char *mask, unsigned int n,
+                         unsigned int shift, unsigned short factor, unsigned short minVariance);
+size_t lfBackgroundAvx2(const unsigned char *in, unsigned short *mean, unsigned short *variance,
+                        unsigned char *mask, unsigned int n,
+                        unsigned int shift, unsigned short factor, unsigned short minVariance);
+
+LfBackgroundKernel lfGetBackgroundKernel(LfCpuLevel level);
+
+// Running per-pixel mean and variance of the difference plane, so that
+// flicker and shadows a pixel always shows stop looking like a change.
+// The planes cover the whole sensor and an ROI updates its own window of
+// them; rows not seen for a while are restarted from the next sample
+// instead of trusting a stale mean.  The update reads and writes each
+// plane once, and the model takes a fixed 5 bytes per sensor pixel (mean,
+// variance and the deviation mask).
+class LfBackground {
+protected:
+    unsigned int sensorWidth;
+    unsigned int sensorHeight;
+    unsigned int shift;
+    unsigned short factor;
+    unsigned short minVariance;
+    unsigned short startVariance;
+    LfCpuLevel cpuLevel;
+    LfBackgroundKernel kernel;
+    unsigned short *mean;
+    unsigned short *variance;
+    unsigned char *mask;
+    unsigned int width;             // Window of the last update
+    unsigned int height;
+    unsigned int offsetX;
+    unsigned int offsetY;
+    std::vector<unsigned long> rowUpdated;
+    unsigned long updates;
+    size_t deviating;
+    unsigned long long deviatingTotal;
+    unsigned long long pixelsTotal;
+    unsigned long rowStarts;
+    void startRow(const unsigned char *in, unsigned short *meanRow, unsigned short *varianceRow,
+                  unsigned char *maskRow);
+public:
+    LfBackground(unsigned int sensorWidth, unsigned int sensorHeight);
+    ~LfBackground();
+    void setCpuLevel(LfCpuLevel level);
+    LfCpuLevel getCpuLevel() const { return cpuLevel; }
+    // Samples average over about 2^bits pairs, 1 to 8
+    void setLearningShift(unsigned int bits);
+    // Standard deviations a pixel must move to count, more than 1
+    void setSigmas(double sigmas);
+    // Smallest standard deviation assumed, in grey levels, so a pixel that
+    // has been perfectly still does not trip on one level of noise
+    void setMinDeviation(double levels);
+    // Score the engine's last pair against the model, then learn from it.
+    // Returns -1 if the pair does not lie on the sensor.
+    int update(const LfDiffEngine &engine);
+    // Deviation mask of the last update, width x height at the offset
+    const unsigned char *getMask() const { return mask; }
+    size_t getDeviating() const { return deviating; }
+    unsigned int getWidth() const { return width; }
+    unsigned int getHeight() const { return height; }
+    unsigned int getOffsetX() const { return offsetX; }
+    unsigned int getOffsetY() const { return offsetY; }
+    const unsigned short *getMean() const { return mean; }
+    const unsigned short *getVariance() const { return variance; }
+    size_t getFootprint() const { return (size_t)sensorWidth * sensorHeight * 5; }
+    void printStats();
+};
+
+#endif
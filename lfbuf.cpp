@@ -0,0 +1,406 @@
+// Frame buffers for laser fence application.
+
+#include "lfbuf.h"
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+static const size_t k_alignment = 64;
+static const size_t k_hugePageBytes = 2 * 1024 * 1024;
+// mbind() policy: prefer the node, but take another rather than fail
+static const int k_mpolPreferred = 1;
+static atomic<unsigned long> allocCount(0);
+
+// Mapped blocks, so lfAlignedFree() knows how to give them back.  Blocks
+// are allocated at start-up, so a locked list is plenty.
+struct MappedBlock {
+    void *p;
+    size_t bytes;
+    bool huge;
+};
+static mutex mappedLock;
+static vector<MappedBlock> mapped;
+static atomic<int> hugeMode(LF_HUGE_EXPLICIT);
+static atomic<unsigned long> heapBlocks(0);
+static atomic<unsigned long> hugePages(0);
+static atomic<unsigned long> hugeFallbacks(0);
+static atomic<unsigned long long> transparentBytes(0);
+static atomic<unsigned long> nodeBound(0);
+static atomic<unsigned long> nodeFallbacks(0);
+
+unsigned long long lfTimestampUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+size_t lfRowBytes(LfPixelFormat format, unsigned int width)
+{
+    switch (format)
+    {
+    case LF_PIXEL_MONO12:
+        return ((size_t)width * 3 + 1) / 2;
+    case LF_PIXEL_MONO16:
+        return (size_t)width * 2;
+    default:
+        return width;
+    }
+}
+
+void lfSetHugePageMode(LfHugePageMode mode)
+{
+    hugeMode.store(mode);
+}
+
+int lfNumaNodes()
+{
+    // "0" or "0-1", as the kernel lists them
+    static int nodes = -1;
+    if (nodes < 0)
+    {
+        int last = 0;
+        FILE *file = fopen("/sys/devices/system/node/online", "r");
+        if (file != NULL)
+        {
+            int first;
+            if (fscanf(file, "%d-%d", &first, &last) < 1)
+            {
+                last = 0;
+            }
+            else if (last < first)
+            {
+                last = first;
+            }
+            fclose(file);
+        }
+        nodes = last + 1;
+    }
+    return nodes;
+}
+
+int lfCpuNode(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1)
+        {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// Maps bytes rounded up to whole huge pages, on reserved ones if there are
+// any, else on a 2 MB aligned range of ordinary pages so transparent huge
+// pages can back all of it
+static void *mapBlock(size_t bytes, bool *huge)
+{
+    size_t rounded = (bytes + k_hugePageBytes - 1) & ~(k_hugePageBytes - 1);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugeMode.load() == LF_HUGE_EXPLICIT)
+    {
+        p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            *huge = true;
+            hugePages.fetch_add(rounded / k_hugePageBytes, memory_order_relaxed);
+            return p;
+        }
+        hugeFallbacks.fetch_add(1, memory_order_relaxed);
+    }
+#endif
+    *huge = false;
+    unsigned char *range = (unsigned char *)mmap(NULL, rounded + k_hugePageBytes, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (range == MAP_FAILED)
+    {
+        return NULL;
+    }
+    size_t head = (k_hugePageBytes - (uintptr_t)range % k_hugePageBytes) % k_hugePageBytes;
+    if (head > 0)
+    {
+        munmap(range, head);
+    }
+    munmap(range + head + rounded, k_hugePageBytes - head);
+    p = range + head;
+#ifdef MADV_HUGEPAGE
+    madvise(p, rounded, MADV_HUGEPAGE);
+#endif
+    transparentBytes.fetch_add(rounded, memory_order_relaxed);
+    return p;
+}
+
+void *lfAlignedAllocOnNode(size_t bytes, int node)
+{
+    void *p = NULL;
+    if (bytes < k_lfHugeThreshold || hugeMode.load() == LF_HUGE_OFF)
+    {
+        if (posix_memalign(&p, k_alignment, bytes) != 0)
+        {
+            return NULL;
+        }
+        heapBlocks.fetch_add(1, memory_order_relaxed);
+        allocCount.fetch_add(1, memory_order_relaxed);
+        return p;
+    }
+
+    bool huge;
+    p = mapBlock(bytes, &huge);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    size_t rounded = (bytes + k_hugePageBytes - 1) & ~(k_hugePageBytes - 1);
+    // Nothing has touched the pages yet, so the policy decides where all of
+    // them go
+    if (node >= 0)
+    {
+        // One bit per node.  The kernel reads one bit fewer than maxnode,
+        // so it is given the mask's size plus one, as libnuma does.
+        const unsigned int bitsPerWord = 8 * sizeof(unsigned long);
+        unsigned long mask[4] = { 0 };
+        bool fits = node < lfNumaNodes() && node < (int)(sizeof(mask) * 8);
+        if (fits)
+        {
+            mask[node / bitsPerWord] |= 1UL << (node % bitsPerWord);
+        }
+        if (fits && syscall(SYS_mbind, p, rounded, k_mpolPreferred, mask, sizeof(mask) * 8 + 1, 0) == 0)
+        {
+            nodeBound.fetch_add(1, memory_order_relaxed);
+        }
+        else
+        {
+            nodeFallbacks.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    {
+        lock_guard<mutex> guard(mappedLock);
+        MappedBlock block = { p, rounded, huge };
+        mapped.push_back(block);
+    }
+    allocCount.fetch_add(1, memory_order_relaxed);
+    return p;
+}
+
+void *lfAlignedAlloc(size_t bytes)
+{
+    return lfAlignedAllocOnNode(bytes, -1);
+}
+
+void lfAlignedFree(void *p)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(mappedLock);
+        for (size_t i = 0; i < mapped.size(); i++)
+        {
+            if (mapped[i].p == p)
+            {
+                munmap(p, mapped[i].bytes);
+                if (mapped[i].huge)
+                {
+                    hugePages.fetch_sub(mapped[i].bytes / k_hugePageBytes, memory_order_relaxed);
+                }
+                else
+                {
+                    transparentBytes.fetch_sub(mapped[i].bytes, memory_order_relaxed);
+                }
+                mapped[i] = mapped.back();
+                mapped.pop_back();
+                return;
+            }
+        }
+    }
+    free(p);
+}
+
+unsigned long lfAllocCount()
+{
+    return allocCount.load(memory_order_relaxed);
+}
+
+void lfGetAllocStats(LfAllocStats *stats)
+{
+    stats->heapBlocks = heapBlocks.load(memory_order_relaxed);
+    {
+        lock_guard<mutex> guard(mappedLock);
+        stats->mappedBlocks = mapped.size();
+    }
+    stats->hugePages = hugePages.load(memory_order_relaxed);
+    stats->hugeFallbacks = hugeFallbacks.load(memory_order_relaxed);
+    stats->transparentBytes = transparentBytes.load(memory_order_relaxed);
+    stats->nodeBound = nodeBound.load(memory_order_relaxed);
+    stats->nodeFallbacks = nodeFallbacks.load(memory_order_relaxed);
+}
+
+void lfPrintAllocStats()
+{
+    LfAllocStats stats;
+    lfGetAllocStats(&stats);
+    // What the kernel actually backs with transparent huge pages, which it
+    // may decline to do even when asked
+    unsigned long anonHugeKb = 0;
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file != NULL)
+    {
+        char line[128];
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            if (sscanf(line, "AnonHugePages: %lu kB", &anonHugeKb) == 1)
+            {
+                break;
+            }
+        }
+        fclose(file);
+    }
+    cout << "Buffers: " << stats.mappedBlocks << " mapped (" << stats.hugePages << " reserved huge pages, "
+         << stats.hugeFallbacks << " fell back, " << stats.transparentBytes / (1024 * 1024) << " MB for "
+         << "transparent huge pages, " << anonHugeKb / 1024 << " MB backed), " << stats.heapBlocks
+         << " from the heap, " << stats.nodeBound << " placed on a NUMA node of " << lfNumaNodes() << " ("
+         << stats.nodeFallbacks << " failed)" << endl;
+}
+
+
+
+LfFramePool::LfFramePool(unsigned int count, unsigned int width, unsigned int height, LfPixelFormat format,
+                         int node)
+    : count(count), block(NULL), frames(NULL), inUse(NULL), cursor(0), leases(0), leaseFailures(0),
+      width(width), height(height), format(format)
+{
+    if (count == 0)
+    {
+        throw runtime_error("Frame pool needs at least one buffer");
+    }
+
+    // Round each buffer up so every frame starts on its own cache line
+    size_t bytes = lfRowBytes(format, width) * height;
+    bufferSize = (bytes + k_alignment - 1) & ~(k_alignment - 1);
+
+    block = (unsigned char *)lfAlignedAllocOnNode(bufferSize * count, node);
+    if (block == NULL)
+    {
+        throw runtime_error("Can't allocate frame pool");
+    }
+
+    frames = new LfFrame[count];
+    inUse = new atomic<int>[count];
+    for (unsigned int i = 0; i < count; i++)
+    {
+        frames[i].index = i;
+        frames[i].pool = this;
+        frames[i].camera = 0;
+        resetFrame(&frames[i]);
+        inUse[i].store(0, memory_order_relaxed);
+    }
+}
+
+LfFramePool::~LfFramePool()
+{
+    delete[] inUse;
+    delete[] frames;
+    lfAlignedFree(block);
+}
+
+void LfFramePool::resetFrame(LfFrame *frame)
+{
+    frame->data = block + (size_t)frame->index * bufferSize;
+    frame->capacity = bufferSize;
+    frame->dataSize = 0;
+    frame->width = width;
+    frame->height = height;
+    frame->stride = lfRowBytes(format, width);
+    frame->offsetX = 0;
+    frame->offsetY = 0;
+    frame->format = format;
+    frame->nativeFormat = 0;
+    frame->timestamp = 0;
+    frame->seq = 0;
+    frame->pair = NULL;
+}
+
+LfFrame *LfFramePool::lease()
+{
+    // Start where the last lease left off so buffers are handed out
+    // round-robin and a free one is usually found on the first probe
+    unsigned int start = cursor.fetch_add(1, memory_order_relaxed);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int slot = (start + i) % count;
+        int expected = 0;
+        if (inUse[slot].load(memory_order_relaxed) == 0 &&
+            inUse[slot].compare_exchange_strong(expected, 1, memory_order_acquire))
+        {
+            leases.fetch_add(1, memory_order_relaxed);
+            return &frames[slot];
+        }
+    }
+
+    leaseFailures.fetch_add(1, memory_order_relaxed);
+    return NULL;
+}
+
+void LfFramePool::release(LfFrame *frame)
+{
+    if (frame == NULL || frame->index < 0 || (unsigned int)frame->index >= count ||
+        &frames[frame->index] != frame)
+    {
+        return;
+    }
+
+    resetFrame(frame);
+    inUse[frame->index].store(0, memory_order_release);
+}
+
+void LfFramePool::releaseFrame(LfFrame *frame)
+{
+    if (frame != NULL && frame->pool != NULL)
+    {
+        frame->pool->release(frame);
+    }
+}
+
+void LfFramePool::restoreBuffer(LfFrame *frame)
+{
+    LfFramePool *pool = frame->pool;
+    if (pool != NULL && frame->index >= 0 && (unsigned int)frame->index < pool->count)
+    {
+        frame->data = pool->block + (size_t)frame->index * pool->bufferSize;
+        frame->capacity = pool->bufferSize;
+    }
+}
+
+unsigned int LfFramePool::getInUse() const
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        n += inUse[i].load(memory_order_relaxed);
+    }
+    return n;
+}
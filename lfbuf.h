@@ -0,0 +1,127 @@
+// Frame buffers for laser fence application.
+
+#ifndef LFBUF_H
+#define LFBUF_H
+
+#include "stdafx.h"
+#include <stddef.h>
+#include <atomic>
+
+enum LfPixelFormat {
+    LF_PIXEL_MONO8 = 0,
+    LF_PIXEL_MONO12,    // 12 bits per pixel, two pixels packed in 3 bytes
+    LF_PIXEL_MONO16,
+    LF_PIXEL_OTHER      // Camera specific, see LfFrame::nativeFormat
+};
+
+// Wall-clock time in microseconds, the clock frame timestamps use
+unsigned long long lfTimestampUs();
+
+// Bytes needed for one row of the given format and width
+size_t lfRowBytes(LfPixelFormat format, unsigned int width);
+
+class LfFramePool;
+
+// One captured image.  data normally points at a pool buffer of capacity
+// bytes; views (e.g. replayed frames) may point elsewhere until released.
+struct LfFrame {
+    unsigned char *data;
+    size_t capacity;
+    size_t dataSize;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;            // bytes per row
+    unsigned int offsetX;           // Sensor position of the first pixel,
+    unsigned int offsetY;           // non-zero when capturing an ROI
+    LfPixelFormat format;
+    unsigned int nativeFormat;      // camera library pixel format code
+    unsigned long long timestamp;   // microseconds
+    unsigned int seq;
+    unsigned int camera;            // Index of the capturing camera
+    LfFrame *pair;                  // Other frame of the same trigger
+    LfFramePool *pool;              // Owning pool, NULL if not pooled
+    int index;                      // pool slot, -1 if not pooled
+};
+
+// Aligned allocation for frame buffers and processing planes.  Every call
+// is counted, so a run can show no buffer was allocated after start-up;
+// other heap use isn't, and lftest checks that separately.
+// Blocks of k_lfHugeThreshold or more are mapped on their own, on 2 MB
+// huge pages reserved with vm.nr_hugepages when there are any, otherwise
+// on ordinary pages the kernel is asked to back with transparent huge
+// pages; smaller blocks, or all with LF_HUGE_OFF, come from the heap.
+// Every block is at least 64-byte aligned.
+void *lfAlignedAlloc(size_t bytes);
+// As lfAlignedAlloc(), with the pages preferring NUMA node node; -1 leaves
+// them to the node of the thread that first touches them
+void *lfAlignedAllocOnNode(size_t bytes, int node);
+void lfAlignedFree(void *p);
+unsigned long lfAllocCount();
+
+static const size_t k_lfHugeThreshold = 1024 * 1024;
+
+enum LfHugePageMode {
+    LF_HUGE_OFF = 0,        // Heap only
+    LF_HUGE_TRANSPARENT,    // Transparent huge pages only
+    LF_HUGE_EXPLICIT        // Reserved huge pages, then transparent ones
+};
+
+// Applies to blocks allocated afterwards; LF_HUGE_EXPLICIT by default
+void lfSetHugePageMode(LfHugePageMode mode);
+
+// NUMA nodes online, and the node a CPU belongs to (0 without NUMA)
+int lfNumaNodes();
+int lfCpuNode(int cpu);
+
+struct LfAllocStats {
+    unsigned long heapBlocks;
+    unsigned long mappedBlocks;
+    unsigned long hugePages;            // Reserved 2 MB pages in use
+    unsigned long hugeFallbacks;        // Blocks that found none reserved
+    unsigned long long transparentBytes; // Mapped on ordinary pages
+    unsigned long nodeBound;
+    unsigned long nodeFallbacks;        // Blocks that could not be placed
+};
+
+void lfGetAllocStats(LfAllocStats *stats);
+// Also reports how much of the process the kernel backs with transparent
+// huge pages right now
+void lfPrintAllocStats();
+
+// Fixed-size pool of aligned frame buffers.  lease() and release() are
+// lock-free and may be called from different threads.
+class LfFramePool {
+protected:
+    unsigned int count;
+    size_t bufferSize;
+    unsigned char *block;
+    LfFrame *frames;
+    std::atomic<int> *inUse;
+    std::atomic<unsigned int> cursor;
+    std::atomic<unsigned long> leases;
+    std::atomic<unsigned long> leaseFailures;
+    unsigned int width;
+    unsigned int height;
+    LfPixelFormat format;
+    void resetFrame(LfFrame *frame);
+public:
+    // node is the NUMA node of the thread filling the buffers, -1 for none
+    LfFramePool(unsigned int count, unsigned int width, unsigned int height, LfPixelFormat format,
+                int node = -1);
+    ~LfFramePool();
+    // Returns NULL when every buffer is leased
+    LfFrame *lease();
+    void release(LfFrame *frame);
+    // Return a frame to whichever pool it came from
+    static void releaseFrame(LfFrame *frame);
+    // Point a leased frame that was made a view of other pixels back at
+    // its own buffer; frames not from a pool are left alone
+    static void restoreBuffer(LfFrame *frame);
+    unsigned int getCount() const { return count; }
+    size_t getBufferSize() const { return bufferSize; }
+    unsigned int getInUse() const;
+    unsigned long getLeases() const { return leases.load(std::memory_order_relaxed); }
+    unsigned long getLeaseFailures() const { return leaseFailures.load(std::memory_order_relaxed); }
+};
+
+#endif
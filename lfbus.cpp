@@ -0,0 +1,344 @@
+// Shared-memory frame bus for laser fence application.
+
+#include "lfbus.h"
+#include <iostream>
+#include <new>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lfqueue.h"
+
+using namespace std;
+
+static uint64_t alignUp(uint64_t n)
+{
+    return (n + k_lfBusAlignment - 1) / k_lfBusAlignment * k_lfBusAlignment;
+}
+
+LfBusPublisher::LfBusPublisher()
+    : fd(-1), map(NULL), mapBytes(0), header(NULL), published(0), oversize(0)
+{
+}
+
+LfBusPublisher::~LfBusPublisher()
+{
+    close();
+}
+
+int LfBusPublisher::open(const char *busName, unsigned int slotCount, size_t maxFrameBytes)
+{
+    if (fd >= 0 || slotCount == 0 || maxFrameBytes == 0)
+    {
+        return -1;
+    }
+
+    // Readers still attached to a bus left by an earlier run see it close
+    int old = shm_open(busName, O_RDWR, 0);
+    if (old >= 0)
+    {
+        void *p = mmap(NULL, sizeof(LfBusHeader), PROT_READ | PROT_WRITE, MAP_SHARED, old, 0);
+        if (p != MAP_FAILED)
+        {
+            ((LfBusHeader *)p)->closed.store(1);
+            munmap(p, sizeof(LfBusHeader));
+        }
+        ::close(old);
+        shm_unlink(busName);
+    }
+
+    uint64_t frameBytes = alignUp(maxFrameBytes);
+    uint64_t slotBytes = k_lfBusAlignment + 2 * frameBytes;
+    mapBytes = k_lfBusAlignment + slotCount * slotBytes;
+
+    fd = shm_open(busName, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+    {
+        cout << "Failed to create frame bus " << busName << endl;
+        return -1;
+    }
+    if (ftruncate(fd, mapBytes) != 0)
+    {
+        cout << "Failed to size frame bus " << busName << endl;
+        ::close(fd);
+        fd = -1;
+        shm_unlink(busName);
+        return -1;
+    }
+    map = (unsigned char *)mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        ::close(fd);
+        fd = -1;
+        shm_unlink(busName);
+        return -1;
+    }
+    name = busName;
+
+    // The object starts zero-filled, so every slot sequence is already 0
+    // (never written).  The magic goes in last so a reader attaching now
+    // never sees a half-made header.
+    header = new (map) LfBusHeader();
+    header->version = 1;
+    header->slotCount = slotCount;
+    header->slotBytes = slotBytes;
+    header->frameBytes = frameBytes;
+    header->epoch = lfTimestampUs();
+    for (unsigned int i = 0; i < slotCount; i++)
+    {
+        new (map + k_lfBusAlignment + i * slotBytes) LfBusSlot();
+    }
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, k_lfBusMagic, sizeof(header->magic));
+
+    published = 0;
+    oversize = 0;
+    return 0;
+}
+
+void LfBusPublisher::close()
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    header->closed.store(1, memory_order_release);
+    munmap(map, mapBytes);
+    ::close(fd);
+    // Attached readers keep their mapping until they let go
+    shm_unlink(name.c_str());
+    fd = -1;
+    map = NULL;
+    header = NULL;
+}
+
+LfBusSlot *LfBusPublisher::slotAt(uint64_t n)
+{
+    return (LfBusSlot *)(map + k_lfBusAlignment + (n % header->slotCount) * header->slotBytes);
+}
+
+void LfBusPublisher::copyFrame(const LfFrame *frame, LfBusFrameInfo *info, unsigned char *data)
+{
+    info->width = frame->width;
+    info->height = frame->height;
+    info->stride = frame->stride;
+    info->format = frame->format;
+    info->offsetX = frame->offsetX;
+    info->offsetY = frame->offsetY;
+    info->seq = frame->seq;
+    info->camera = frame->camera;
+    info->timestamp = frame->timestamp;
+    info->dataSize = frame->dataSize;
+    memcpy(data, frame->data, frame->dataSize);
+}
+
+int LfBusPublisher::publish(const LfFrame *on)
+{
+    const LfFrame *off = on->pair;
+    if (fd < 0 || off == NULL)
+    {
+        return -1;
+    }
+    if (on->dataSize > header->frameBytes || off->dataSize > header->frameBytes)
+    {
+        oversize++;
+        return -1;
+    }
+
+    uint64_t n = header->head.load(memory_order_relaxed);
+    LfBusSlot *slot = slotAt(n);
+    unsigned char *data = (unsigned char *)slot + k_lfBusAlignment;
+
+    // Odd while the pixels change; the fence keeps the pixel stores after it
+    slot->sequence.store(2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    copyFrame(on, &slot->on, data);
+    copyFrame(off, &slot->off, data + header->frameBytes);
+    slot->sequence.store(2 * n + 2, memory_order_release);
+    header->head.store(n + 1, memory_order_release);
+    published++;
+    return 0;
+}
+
+void LfBusPublisher::printStats()
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    cout << "Frame bus " << name << ": " << published << " pairs published in "
+         << header->slotCount << " slots, " << oversize << " too large" << endl;
+}
+
+
+
+LfBusReader::LfBusReader()
+    : fd(-1), map(NULL), mapBytes(0), header(NULL), epoch(0), wanted(0), received(0), skipped(0), torn(0)
+{
+}
+
+LfBusReader::~LfBusReader()
+{
+    close();
+}
+
+int LfBusReader::open(const char *busName)
+{
+    if (fd >= 0)
+    {
+        return -1;
+    }
+    fd = shm_open(busName, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < k_lfBusAlignment)
+    {
+        ::close(fd);
+        fd = -1;
+        return -1;
+    }
+    mapBytes = st.st_size;
+    map = (const unsigned char *)mmap(NULL, mapBytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        ::close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    header = (const LfBusHeader *)map;
+    atomic_thread_fence(memory_order_acquire);
+    if (memcmp(header->magic, k_lfBusMagic, sizeof(header->magic)) != 0 || header->version != 1 ||
+        header->slotCount == 0 ||
+        k_lfBusAlignment + header->slotCount * header->slotBytes > mapBytes)
+    {
+        cout << "Not a laser fence frame bus: " << busName << endl;
+        close();
+        return -1;
+    }
+
+    epoch = header->epoch;
+    wanted = header->head.load(memory_order_acquire);
+    received = 0;
+    skipped = 0;
+    torn = 0;
+    return 0;
+}
+
+void LfBusReader::close()
+{
+    if (fd < 0)
+    {
+        return;
+    }
+    munmap((void *)map, mapBytes);
+    ::close(fd);
+    fd = -1;
+    map = NULL;
+    header = NULL;
+}
+
+const LfBusSlot *LfBusReader::slotAt(uint64_t n) const
+{
+    return (const LfBusSlot *)(map + k_lfBusAlignment + (n % header->slotCount) * header->slotBytes);
+}
+
+int LfBusReader::next(LfBusView *view, unsigned int timeoutUs)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    unsigned long long deadline = lfTimestampUs() + timeoutUs;
+    unsigned int idle = 0;
+    while (true)
+    {
+        // Pairs published before the bus closed are still handed out
+        bool closed = header->closed.load(memory_order_acquire) || header->epoch != epoch;
+        uint64_t head = header->head.load(memory_order_acquire);
+        if (wanted < head)
+        {
+            // The slot of pair head - slotCount may be mid-rewrite already
+            uint64_t oldest = head >= header->slotCount ? head - header->slotCount + 1 : 0;
+            if (wanted < oldest)
+            {
+                skipped += oldest - wanted;
+                wanted = oldest;
+            }
+
+            const LfBusSlot *slot = slotAt(wanted);
+            uint64_t sequence = slot->sequence.load(memory_order_acquire);
+            if (sequence == 2 * wanted + 2)
+            {
+                const unsigned char *data = (const unsigned char *)slot + k_lfBusAlignment;
+                view->number = wanted;
+                view->slot = slot;
+                view->on = &slot->on;
+                view->off = &slot->off;
+                view->onData = data;
+                view->offData = data + header->frameBytes;
+                received++;
+                wanted++;
+                return 0;
+            }
+            // Lapped between reading head and the slot
+            skipped++;
+            wanted++;
+            continue;
+        }
+
+        if (closed)
+        {
+            return -1;
+        }
+        if (lfTimestampUs() >= deadline)
+        {
+            return 1;
+        }
+        lfIdleWait(idle);
+    }
+}
+
+bool LfBusReader::validate(const LfBusView &view)
+{
+    // Order the pixel reads before the second look at the sequence
+    atomic_thread_fence(memory_order_acquire);
+    if (view.slot->sequence.load(memory_order_relaxed) == 2 * view.number + 2)
+    {
+        return true;
+    }
+    torn++;
+    return false;
+}
+
+int LfBusReader::copyOut(const LfBusView &view, bool laserOn, LfFrame *frame)
+{
+    const LfBusFrameInfo *info = laserOn ? view.on : view.off;
+    const unsigned char *data = laserOn ? view.onData : view.offData;
+    uint64_t bytes = info->dataSize;
+    if (bytes > frame->capacity || bytes > header->frameBytes)
+    {
+        return -1;
+    }
+
+    memcpy(frame->data, data, bytes);
+    frame->width = info->width;
+    frame->height = info->height;
+    frame->stride = info->stride;
+    frame->format = (LfPixelFormat)info->format;
+    frame->offsetX = info->offsetX;
+    frame->offsetY = info->offsetY;
+    frame->seq = info->seq;
+    frame->camera = info->camera;
+    frame->timestamp = info->timestamp;
+    frame->dataSize = bytes;
+    return validate(view) ? 0 : -1;
+}
@@ -0,0 +1,126 @@
+// Shared-memory frame bus for laser fence application.
+
+#ifndef LFBUS_H
+#define LFBUS_H
+
+#include "stdafx.h"
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "lfbuf.h"
+
+// Layout of a bus (a POSIX shared memory object):
+//   LfBusHeader, padded to k_lfBusAlignment
+//   slotCount slots of slotBytes each:
+//     LfBusSlot, padded to k_lfBusAlignment
+//     laser-on frame pixels, then laser-off frame pixels, each frameBytes
+// Pair n goes to slot n % slotCount.  Each slot is a seqlock: the
+// publisher makes its sequence odd while writing and sets it to 2n + 2
+// once pair n is complete, so readers can tell a finished pair from one
+// being overwritten without ever taking a lock.
+static const uint32_t k_lfBusAlignment = 4096;
+static const char k_lfBusMagic[4] = { 'L', 'F', 'B', '1' };
+
+struct LfBusHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t slotBytes;
+    uint64_t frameBytes;            // Largest frame a slot holds
+    uint64_t epoch;                 // Changes whenever a publisher recreates the bus
+    std::atomic<uint64_t> head;     // Pairs published so far
+    std::atomic<uint32_t> closed;   // Set when the publisher shuts down
+};
+
+struct LfBusFrameInfo {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;                // LfPixelFormat
+    uint32_t offsetX;
+    uint32_t offsetY;
+    uint32_t seq;
+    uint32_t camera;
+    uint64_t timestamp;
+    uint64_t dataSize;
+};
+
+struct LfBusSlot {
+    std::atomic<uint64_t> sequence;
+    LfBusFrameInfo on;
+    LfBusFrameInfo off;
+};
+
+// One pair as seen by a reader: pointers straight into the shared
+// mapping, valid until the publisher laps the slot.
+struct LfBusView {
+    uint64_t number;                // Pair number on the bus
+    const LfBusFrameInfo *on;
+    const LfBusFrameInfo *off;
+    const unsigned char *onData;
+    const unsigned char *offData;
+    const LfBusSlot *slot;
+};
+
+// Writes each pair once into the ring.  Never waits for readers: a slot
+// is simply overwritten when its turn comes round again.
+class LfBusPublisher {
+protected:
+    std::string name;
+    int fd;
+    unsigned char *map;
+    size_t mapBytes;
+    LfBusHeader *header;
+    unsigned long published;
+    unsigned long oversize;
+    LfBusSlot *slotAt(uint64_t n);
+    static void copyFrame(const LfFrame *frame, LfBusFrameInfo *info, unsigned char *data);
+public:
+    LfBusPublisher();
+    ~LfBusPublisher();
+    // name is a shm_open name such as "/laserfence"
+    int open(const char *name, unsigned int slotCount, size_t maxFrameBytes);
+    void close();
+    // Publish a linked pair; returns -1 if a frame is larger than a slot
+    int publish(const LfFrame *on);
+    unsigned long getPublished() const { return published; }
+    void printStats();
+};
+
+// Follows a bus from another process.  Readers never write to the
+// mapping, so any number can attach; one that falls more than a ring
+// behind skips ahead to the oldest pair still intact and counts the loss.
+class LfBusReader {
+protected:
+    int fd;
+    const unsigned char *map;
+    size_t mapBytes;
+    const LfBusHeader *header;
+    uint64_t epoch;
+    uint64_t wanted;                // Next pair number to read
+    unsigned long received;
+    unsigned long skipped;
+    unsigned long torn;
+    const LfBusSlot *slotAt(uint64_t n) const;
+public:
+    LfBusReader();
+    ~LfBusReader();
+    // Attach at the newest pair, so only pairs published from now on are read
+    int open(const char *name);
+    void close();
+    // Returns 0 with the next pair, 1 on timeout, -1 once the publisher
+    // has closed or restarted the bus and its last pairs have been read
+    int next(LfBusView *view, unsigned int timeoutUs);
+    // True if the view's pixels were not overwritten while in use.  Check
+    // after using them and discard any result if it fails.
+    bool validate(const LfBusView &view);
+    // Copy a pair into a frame of the caller's, for work that outlives
+    // the slot.  Returns -1 if it no longer holds the pair or does not fit.
+    int copyOut(const LfBusView &view, bool laserOn, LfFrame *frame);
+    unsigned long getReceived() const { return received; }
+    unsigned long getSkipped() const { return skipped; }
+    unsigned long getTorn() const { return torn; }
+};
+
+#endif
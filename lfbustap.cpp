@@ -0,0 +1,108 @@
+// Frame bus reader for laser fence application.
+//
+// Attaches to the shared-memory frame bus of a running lfapp and reads
+// every pair in place, optionally differencing it, printing once a second
+// how many pairs arrived, how many were skipped for falling behind and
+// how many were overwritten while in use.
+//
+// Usage: lfbustap [-d] [-n seconds] /name
+
+#include "stdafx.h"
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include "lfalg.h"
+#include "lfbus.h"
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    bool difference = false;
+    unsigned int seconds = 0;
+    const char *busName = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-d")
+        {
+            difference = true;
+        }
+        else if (arg == "-n" && i + 1 < argc)
+        {
+            seconds = atoi(argv[++i]);
+        }
+        else
+        {
+            busName = argv[i];
+        }
+    }
+    if (busName == NULL)
+    {
+        cout << "Usage: lfbustap [-d] [-n seconds] /name" << endl;
+        return -1;
+    }
+
+    LfBusReader reader;
+    if (reader.open(busName) != 0)
+    {
+        cout << "Failed to attach to frame bus " << busName << endl;
+        return -1;
+    }
+    cout << "Attached to frame bus " << busName << endl;
+
+    // The engine follows the pair geometry, which changes with the ROI
+    LfDiffEngine *engine = NULL;
+    unsigned long changedPixels = 0;
+    unsigned long long begin = lfTimestampUs();
+    unsigned long long lastReport = begin;
+    unsigned long lastReceived = 0;
+    int result;
+    LfBusView view;
+    while ((result = reader.next(&view, 100000)) >= 0)
+    {
+        if (result == 0 && difference && view.on->format == LF_PIXEL_MONO8)
+        {
+            if (engine == NULL || engine->getWidth() != view.on->width ||
+                engine->getHeight() != view.on->height)
+            {
+                delete engine;
+                engine = new LfDiffEngine(view.on->width, view.on->height, 32);
+            }
+            size_t changed = engine->process(view.onData, view.offData, view.on->stride);
+            // Work done on pixels the publisher overwrote meanwhile is discarded
+            if (reader.validate(view))
+            {
+                changedPixels += changed;
+            }
+        }
+
+        unsigned long long now = lfTimestampUs();
+        if (now - lastReport >= 1000000)
+        {
+            cout << reader.getReceived() - lastReceived << " pairs/s, " << reader.getSkipped()
+                 << " skipped, " << reader.getTorn() << " torn";
+            if (difference)
+            {
+                cout << ", " << changedPixels << " pixels changed";
+            }
+            cout << endl;
+            lastReceived = reader.getReceived();
+            lastReport = now;
+        }
+        if (seconds > 0 && now - begin >= seconds * 1000000ULL)
+        {
+            break;
+        }
+    }
+    if (result < 0)
+    {
+        cout << "Frame bus closed by the publisher" << endl;
+    }
+
+    cout << "Received " << reader.getReceived() << " pairs, skipped " << reader.getSkipped()
+         << ", torn " << reader.getTorn() << endl;
+    delete engine;
+    reader.close();
+    return 0;
+}
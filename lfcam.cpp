@@ -2,22 +2,123 @@
 // 07/16/15 LAJ -- Document created
 
 #include "lfcam.h"
+#include "lfcodec.h"
+#include "lflog.h"
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+
+static LfPixelFormat toLfPixelFormat(PixelFormat format)
+{
+    switch (format)
+    {
+    case PIXEL_FORMAT_MONO8:
+        return LF_PIXEL_MONO8;
+    case PIXEL_FORMAT_MONO12:
+        return LF_PIXEL_MONO12;
+    case PIXEL_FORMAT_MONO16:
+        return LF_PIXEL_MONO16;
+    default:
+        return LF_PIXEL_OTHER;
+    }
+}
+
+static PixelFormat toNativePixelFormat(LfPixelFormat format)
+{
+    switch (format)
+    {
+    case LF_PIXEL_MONO12:
+        return PIXEL_FORMAT_MONO12;
+    case LF_PIXEL_MONO16:
+        return PIXEL_FORMAT_MONO16;
+    default:
+        return PIXEL_FORMAT_MONO8;
+    }
+}
+
+static PixelFormat toNativePixelFormat(const LfFrame *frame)
+{
+    if (frame->format == LF_PIXEL_OTHER)
+    {
+        return (PixelFormat)frame->nativeFormat;
+    }
+    return toNativePixelFormat(frame->format);
+}
+
+int lfLoadCamCache(const char *path, vector<LfCamConfig> &cameras)
+{
+    cameras.clear();
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    LfCamConfig config;
+    int fields;
+    while ((fields = fscanf(file, "%u %u %u %u %u %u %u", &config.serial, &config.sensorWidth,
+                            &config.sensorHeight, &config.offsetHStep, &config.offsetVStep,
+                            &config.imageHStep, &config.imageVStep)) == 7)
+    {
+        if (config.serial == 0 || config.sensorWidth == 0 || config.sensorHeight == 0 ||
+            config.offsetHStep == 0 || config.offsetVStep == 0 || config.imageHStep == 0 ||
+            config.imageVStep == 0)
+        {
+            break;
+        }
+        cameras.push_back(config);
+    }
+    fclose(file);
+    if (fields != EOF)
+    {
+        cameras.clear();
+        return -1;
+    }
+    return cameras.empty() ? -1 : 0;
+}
+
+int lfSaveCamCache(const char *path, const vector<LfCamConfig> &cameras)
+{
+    // Written aside and renamed, so a crash mid-write leaves the old one
+    string temp = string(path) + ".tmp";
+    FILE *file = fopen(temp.c_str(), "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    for (unsigned int i = 0; i < cameras.size(); i++)
+    {
+        const LfCamConfig &config = cameras[i];
+        fprintf(file, "%u %u %u %u %u %u %u\n", config.serial, config.sensorWidth, config.sensorHeight,
+                config.offsetHStep, config.offsetVStep, config.imageHStep, config.imageVStep);
+    }
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed || rename(temp.c_str(), path) != 0)
+    {
+        remove(temp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+
 
 LfCam::LfCam(void)
+    : numCameras(0), guids(NULL), pcam(NULL), frameWidth(0), frameHeight(0),
+      frameFormat(LF_PIXEL_MONO8), sensorWidth(0), sensorHeight(0), copyFallbacks(0), frameCounter(false),
+      serial(0), writesSkipped(0), grabbed(NULL), grabErrors(NULL), grabTimeouts(NULL)
 {
+    memset(&roi, 0, sizeof(roi));
     cout << "LfCam::LfCam begin..." << endl;
 
     // Since this application saves images in the current folder
     // we must ensure that we have permission to write to this folder.
-    // If we do not have permission, fail right away.
-    FILE* tempFile = fopen("test.txt", "w+");
-    if (tempFile == NULL)
+    // If we do not have permission, fail right away.  Asking is enough;
+    // creating a file to find out costs a sync on some filesystems.
+    if (access(".", W_OK) != 0)
     {
-        cout << "Failed to create file in current folder.  Please check permissions." << endl;
+        cout << "Can't write to the current folder.  Please check permissions." << endl;
         throw runtime_error("No permission to write to current folder.");
     }
-    fclose(tempFile);
-    remove("test.txt");
 }
 
 LfCam::~LfCam(void)
@@ -26,6 +127,7 @@ LfCam::~LfCam(void)
     if (guids) {
         delete[] guids;
     }
+    delete pcam;
 }
 
 void LfCam::printBuildInfo()
@@ -46,7 +148,8 @@ void LfCam::printBuildInfo()
 
 void LfCam::printError( Error error )
 {
-    error.PrintErrorTrace();
+    // Through the logger, as errors come from the grab loop too
+    lfLogText(LF_LOG_ERROR, error.GetDescription());
 }
 
 int LfCam::connect(int cameraIndex)
@@ -60,6 +163,13 @@ int LfCam::connect(int cameraIndex)
         printError( error );
         return -1;
     }
+
+    // The library read this while connecting, so it costs no round trip
+    CameraInfo camInfo;
+    if (pcam->GetCameraInfo(&camInfo) == PGRERROR_OK)
+    {
+        serial = camInfo.serialNumber;
+    }
     return 0;
 }
 
@@ -77,34 +187,156 @@ int LfCam::start()
     return 0;
 }
 
-int LfCam::retrieveImage()
+int LfCam::retrieveImage(LfFrame *frame)
 {
-    // Retrieve an image
-    error = pcam->RetrieveBuffer( &rawImage );
+    // Retrieve an image straight into the leased buffer
+    Image image( frame->height, frame->width, frame->stride, frame->data,
+                 (unsigned int)frame->capacity, toNativePixelFormat(frame) );
+    error = pcam->RetrieveBuffer( &image );
     if (error != PGRERROR_OK)
     {
         printError( error );
+        if (grabErrors != NULL)
+        {
+            (error == PGRERROR_TIMEOUT ? grabTimeouts : grabErrors)->add();
+        }
+        return -1;
+    }
+    if (grabbed != NULL)
+    {
+        grabbed->add();
+    }
+
+    if (image.GetData() != frame->data)
+    {
+        // The library used a buffer of its own, so copy it over
+        if (image.GetDataSize() > frame->capacity)
+        {
+            lfLog(LF_LOG_ERROR, "Grabbed image does not fit the frame buffer");
+            return -1;
+        }
+        memcpy(frame->data, image.GetData(), image.GetDataSize());
+        copyFallbacks++;
+    }
+
+    frame->width = image.GetCols();
+    frame->height = image.GetRows();
+    frame->offsetX = roi.offsetX;
+    frame->offsetY = roi.offsetY;
+    frame->stride = image.GetStride();
+    frame->dataSize = image.GetDataSize();
+    frame->nativeFormat = image.GetPixelFormat();
+    frame->format = toLfPixelFormat(image.GetPixelFormat());
+    TimeStamp timeStamp = image.GetTimeStamp();
+    frame->timestamp = (unsigned long long)timeStamp.seconds * 1000000ULL + timeStamp.microSeconds;
+    if (frameCounter)
+    {
+        frame->seq = image.GetMetadata().embeddedFrameCounter;
     }
 
-    cout << "Grabbed image" << endl;
+    lfLog(LF_LOG_DEBUG, "Grabbed image %ux%u at %llu us", frame->width, frame->height, frame->timestamp);
 
     return 0;
 }
 
-Image LfCam::convertImage()
+int LfCam::enableFrameStamps()
 {
-    // Create a converted image
-    Image convertedImage;
+    EmbeddedImageInfo info;
+    error = pcam->GetEmbeddedImageInfo( &info );
+    if (error != PGRERROR_OK)
+    {
+        printError( error );
+        return -1;
+    }
+    if (!info.frameCounter.available)
+    {
+        cout << "Camera has no embedded frame counter; pairs are checked by timestamp only" << endl;
+        frameCounter = false;
+        return -1;
+    }
+
+    // Only the counter.  The seconds and microseconds GetTimeStamp() gives
+    // are the host's time of arrival whether or not the camera embeds its
+    // own cycle time, and nothing reads that, so embedding it would only
+    // overwrite four more pixels.
+    info.frameCounter.onOff = true;
+    error = pcam->SetEmbeddedImageInfo( &info );
+    if (error != PGRERROR_OK)
+    {
+        printError( error );
+        frameCounter = false;
+        return -1;
+    }
+    frameCounter = true;
+    return 0;
+}
+
+void LfCam::setMetrics(LfMetricsRegistry &registry, unsigned int camera)
+{
+    char labels[32];
+    snprintf(labels, sizeof(labels), "camera=\"%u\"", camera);
+    grabbed = registry.addCounter("lf_frames_grabbed_total", "Frames retrieved from the camera", labels);
+    grabErrors = registry.addCounter("lf_retrieve_errors_total", "RetrieveBuffer failures other than timeouts", labels);
+    grabTimeouts = registry.addCounter("lf_retrieve_timeouts_total", "RetrieveBuffer timeouts", labels);
+    triggerWait.setMetrics(registry.addHistogram("lf_trigger_wait_seconds",
+                                                 "Time from trigger wait start to camera ready", labels));
+}
+
+int LfCam::convertImage(const LfFrame *src, LfFrame *dst)
+{
+    // Formats the converter knows skip the library entirely; MONO8 is
+    // passed through without a copy
+    if (src->format != LF_PIXEL_OTHER)
+    {
+        if (converter.convert(src, dst) != 0)
+        {
+            lfLog(LF_LOG_ERROR, "Converted image does not fit the frame buffer");
+            return -1;
+        }
+        dst->nativeFormat = PIXEL_FORMAT_MONO8;
+        return 0;
+    }
+
+    size_t bytes = (size_t)src->width * src->height;
+    if (bytes > dst->capacity)
+    {
+        lfLog(LF_LOG_ERROR, "Converted image does not fit the frame buffer");
+        return -1;
+    }
+
+    // Wrap both buffers so the conversion writes into the caller's frame
+    Image rawImage( src->height, src->width, src->stride, src->data,
+                    (unsigned int)src->dataSize, toNativePixelFormat(src) );
+    Image convertedImage( src->height, src->width, src->width, dst->data,
+                          (unsigned int)dst->capacity, PIXEL_FORMAT_MONO8 );
 
     // Convert the raw image
     error = rawImage.Convert( PIXEL_FORMAT_MONO8, &convertedImage );
     if (error != PGRERROR_OK)
     {
         printError( error );
-        throw runtime_error("Can't convert raw image");
+        return -1;
     }
 
-    return convertedImage;
+    if (convertedImage.GetData() != dst->data)
+    {
+        memcpy(dst->data, convertedImage.GetData(), bytes);
+        copyFallbacks++;
+    }
+
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->offsetX = src->offsetX;
+    dst->offsetY = src->offsetY;
+    dst->stride = src->width;
+    dst->dataSize = bytes;
+    dst->format = LF_PIXEL_MONO8;
+    dst->nativeFormat = PIXEL_FORMAT_MONO8;
+    dst->timestamp = src->timestamp;
+    dst->seq = src->seq;
+    dst->camera = src->camera;
+
+    return 0;
 }
 
 int LfCam::saveImage(Image &img, ostringstream &filename)
@@ -115,17 +347,48 @@ int LfCam::saveImage(Image &img, ostringstream &filename)
 
     // Save the image. If a file format is not passed in, then the file
     // extension is parsed to attempt to determine the file format.
-    error = img.Save( filename.str().c_str() );
+    // Saving may run on a storage thread, so keep its error local
+    Error saveError = img.Save( filename.str().c_str() );
     //error = img.Save( filename->str().c_str() );
-    if (error != PGRERROR_OK)
+    if (saveError != PGRERROR_OK)
     {
-        printError( error );
+        printError( saveError );
         return -1;
     }
 
     return 0;
 }
 
+int LfCam::saveImage(const LfFrame *frame, ostringstream &filename)
+{
+    // .lfc images are coded here, with the frame's pair if it is linked;
+    // anything else goes to the library, which PNG encodes far slower
+    string path = filename.str();
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".lfc") == 0)
+    {
+        LfFrameCodec codec;
+        vector<unsigned char> coded(codec.maxEncodedSize(frame->width, frame->height, frame->format, 2));
+        size_t bytes = codec.encode(frame, frame->pair, &coded[0], coded.size());
+        FILE *file = bytes > 0 ? fopen(path.c_str(), "wb") : NULL;
+        if (file == NULL)
+        {
+            lfLog(LF_LOG_ERROR, "Can't save camera %u frame %u", frame->camera, frame->seq);
+            return -1;
+        }
+        bool written = fwrite(&coded[0], 1, bytes, file) == bytes;
+        if (fclose(file) != 0 || !written)
+        {
+            lfLog(LF_LOG_ERROR, "Can't save camera %u frame %u", frame->camera, frame->seq);
+            return -1;
+        }
+        return 0;
+    }
+
+    Image img( frame->height, frame->width, frame->stride, frame->data,
+               (unsigned int)frame->dataSize, toNativePixelFormat(frame) );
+    return saveImage(img, filename);
+}
+
 int LfCam::stop()
 {
     // Stop capturing images
@@ -175,20 +438,24 @@ bool LfCam::checkSoftwareTriggerPresence()
 bool LfCam::pollForTriggerReady()
 {
     const unsigned int k_softwareTrigger = 0x62C;
-    unsigned int regVal = 0;
 
-    do
-    {
-        error = pcam->ReadRegister( k_softwareTrigger, &regVal );
-        if (error != PGRERROR_OK)
-        {
-            printError( error );
-            return false;
-        }
+    return triggerWait.wait( this, k_softwareTrigger ) == 0;
+}
 
-    } while ( (regVal >> 31) != 0 );
+int LfCam::readRegister(unsigned int address, unsigned int *value)
+{
+    error = pcam->ReadRegister( address, value );
+    if (error != PGRERROR_OK)
+    {
+        printError( error );
+        return -1;
+    }
+    return 0;
+}
 
-    return true;
+void LfCam::setWaitMode(LfWaitMode mode, unsigned int spinReads, unsigned int maxBackoffUs)
+{
+    triggerWait.setMode(mode, spinReads, maxBackoffUs);
 }
 
 bool LfCam::fireSoftwareTrigger()
@@ -210,9 +477,19 @@ int LfCam::powerOn()
 {
     cout << "LfCam::powerOn" << endl;
 
-    // Power on the camera
+    // A camera the last run left powered needs neither the write nor the
+    // wait for it
     const unsigned int k_cameraPower = 0x610;
     const unsigned int k_powerVal = 0x80000000;
+    unsigned int regVal = 0;
+    error = pcam->ReadRegister(k_cameraPower, &regVal);
+    if (error == PGRERROR_OK && (regVal & k_powerVal) != 0)
+    {
+        writesSkipped++;
+        return 0;
+    }
+
+    // Power on the camera
     error  = pcam->WriteRegister( k_cameraPower, k_powerVal );
     if (error != PGRERROR_OK)
     {
@@ -220,9 +497,10 @@ int LfCam::powerOn()
         return -1;
     }
 
-    const unsigned int millisecondsToSleep = 100;
-    unsigned int regVal = 0;
-    unsigned int retries = 10;
+    // Poll in short steps so a camera that is up quickly isn't kept
+    // waiting; still give up after a second
+    const unsigned int millisecondsToSleep = 10;
+    unsigned int retries = 100;
 
     // Wait for camera to complete power-up
     do
@@ -254,6 +532,13 @@ int LfCam::powerOn()
         return -1;
     }
 
+    // Reads that succeed but never show the bit are a camera that stayed off
+    if ((regVal & k_powerVal) == 0)
+    {
+        cout << "Camera did not report power-up after retries." << endl;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -289,6 +574,7 @@ int LfCam::setTriggerMode15()
     }
 
     // Set camera to trigger mode 15, multishot
+    TriggerMode current = triggerMode;
     triggerMode.onOff = true;
     triggerMode.mode = 15;
     triggerMode.parameter = 2;  // Capture 2 frames per trigger event
@@ -300,11 +586,19 @@ int LfCam::setTriggerMode15()
     // Triggering the camera externally using source 0.
     triggerMode.source = 0;
 
-    error = pcam->SetTriggerMode( &triggerMode );
-    if (error != PGRERROR_OK)
+    if (current.onOff && current.mode == triggerMode.mode && current.parameter == triggerMode.parameter &&
+        current.polarity == triggerMode.polarity && current.source == triggerMode.source)
     {
-        printError( error );
-        return -1;
+        writesSkipped++;
+    }
+    else
+    {
+        error = pcam->SetTriggerMode( &triggerMode );
+        if (error != PGRERROR_OK)
+        {
+            printError( error );
+            return -1;
+        }
     }
 
     // Poll to ensure camera is ready
@@ -330,6 +624,12 @@ int LfCam::setGrabTimeout(int ms)
         return -1;
     }
 
+    if (config.grabTimeout == ms)
+    {
+        writesSkipped++;
+        return 0;
+    }
+
     // Set the grab timeout to 5 seconds
     config.grabTimeout = ms;
 
@@ -432,9 +732,72 @@ void LfUsbCam::printCameraInfo()
 
 
 LfGigECam::LfGigECam()
+    : offsetHStep(1), offsetVStep(1), imageHStep(1), imageVStep(1), discovered(true)
 {
     cout << "LfGigECam::LfGigECam begin..." << endl;
 
+    discover();
+    GigECamera *pgigecam = new GigECamera();
+    pcam = (Camera *) pgigecam;
+}
+
+LfGigECam::LfGigECam(const vector<LfCamConfig> &known)
+    : offsetHStep(1), offsetVStep(1), imageHStep(1), imageVStep(1), discovered(false)
+{
+    cout << "LfGigECam::LfGigECam begin..." << endl;
+
+    if (!findKnown(known))
+    {
+        if (!known.empty())
+        {
+            cout << "Cameras changed since the last run; discovering them" << endl;
+        }
+        discovered = true;
+        discover();
+    }
+    GigECamera *pgigecam = new GigECamera();
+    pcam = (Camera *) pgigecam;
+}
+
+LfGigECam::LfGigECam(const LfGigECam *first)
+    : offsetHStep(1), offsetVStep(1), imageHStep(1), imageVStep(1), discovered(first->discovered)
+{
+    numCameras = first->numCameras;
+    guids = new PGRGuid[numCameras];
+    for (unsigned int i = 0; i < numCameras; i++)
+    {
+        guids[i] = first->guids[i];
+    }
+    GigECamera *pgigecam = new GigECamera();
+    pcam = (Camera *) pgigecam;
+}
+
+// Cameras are normally where they were last time, and looking each up by
+// serial number answers without waiting out a discovery broadcast
+bool LfGigECam::findKnown(const vector<LfCamConfig> &known)
+{
+    unsigned int enumerated = 0;
+    if (known.empty() || busMgr.GetNumOfCameras(&enumerated) != PGRERROR_OK || enumerated != known.size())
+    {
+        return false;
+    }
+    PGRGuid *found = new PGRGuid[known.size()];
+    for (unsigned int i = 0; i < known.size(); i++)
+    {
+        if (busMgr.GetCameraFromSerialNumber(known[i].serial, &found[i]) != PGRERROR_OK)
+        {
+            delete[] found;
+            return false;
+        }
+    }
+    numCameras = known.size();
+    guids = found;
+    cout << "Number of cameras found from cache: " << numCameras << endl;
+    return true;
+}
+
+void LfGigECam::discover()
+{
     CameraInfo camInfo[10];
     unsigned int numCamInfo = 10;
     error = BusManager::DiscoverGigECameras( camInfo, &numCamInfo );
@@ -480,9 +843,6 @@ LfGigECam::LfGigECam()
             throw runtime_error("GetInterfaceTypeFromGuid failed.");
         }
     }
-
-    GigECamera *pgigecam = new GigECamera();
-    pcam = (Camera *) pgigecam;
 }
 
 void LfGigECam::printCameraInfo(CameraInfo *pCamInfo)
@@ -556,16 +916,20 @@ void LfGigECam::printAllStreamChannelsInfo()
             throw runtime_error("Error getting GigE stream channel info");
         }
 
-        streamChannel.destinationIpAddress.octets[0] = 224;
-        streamChannel.destinationIpAddress.octets[1] = 0;
-        streamChannel.destinationIpAddress.octets[2] = 0;
-        streamChannel.destinationIpAddress.octets[3] = 1;
-
-        error = ((GigECamera *)pcam)->SetGigEStreamChannelInfo( i, &streamChannel );
-        if (error != PGRERROR_OK)
+        const unsigned char k_multicast[4] = { 224, 0, 0, 1 };
+        if (memcmp(streamChannel.destinationIpAddress.octets, k_multicast, sizeof(k_multicast)) == 0)
         {
-            printError( error );
-            throw runtime_error("Error setting GigE stream channel info");
+            writesSkipped++;
+        }
+        else
+        {
+            memcpy(streamChannel.destinationIpAddress.octets, k_multicast, sizeof(k_multicast));
+            error = ((GigECamera *)pcam)->SetGigEStreamChannelInfo( i, &streamChannel );
+            if (error != PGRERROR_OK)
+            {
+                printError( error );
+                throw runtime_error("Error setting GigE stream channel info");
+            }
         }
 
         cout << "Printing stream channel information for channel " << i << endl;
@@ -593,16 +957,29 @@ void LfGigECam::printStreamChannelInfo( GigEStreamChannel* pStreamChannel )
     cout << "Source port (on camera): " << pStreamChannel->sourcePort << endl << endl;
 }
 
-void LfGigECam::setCameraSettings()
+void LfGigECam::setCameraSettings(const LfCamConfig *known)
 {
-    cout << "Querying GigE image setting information..." << endl;
-
     GigEImageSettingsInfo imageSettingsInfo;
-    error = ((GigECamera *)pcam)->GetGigEImageSettingsInfo( &imageSettingsInfo );
-    if (error != PGRERROR_OK)
+    if (known != NULL && known->serial == serial && serial != 0)
     {
-        printError( error );
-        throw runtime_error("Error getting GigE image settings info");
+        memset(&imageSettingsInfo, 0, sizeof(imageSettingsInfo));
+        imageSettingsInfo.maxWidth = known->sensorWidth;
+        imageSettingsInfo.maxHeight = known->sensorHeight;
+        imageSettingsInfo.offsetHStepSize = known->offsetHStep;
+        imageSettingsInfo.offsetVStepSize = known->offsetVStep;
+        imageSettingsInfo.imageHStepSize = known->imageHStep;
+        imageSettingsInfo.imageVStepSize = known->imageVStep;
+    }
+    else
+    {
+        cout << "Querying GigE image setting information..." << endl;
+
+        error = ((GigECamera *)pcam)->GetGigEImageSettingsInfo( &imageSettingsInfo );
+        if (error != PGRERROR_OK)
+        {
+            printError( error );
+            throw runtime_error("Error getting GigE image settings info");
+        }
     }
 
     GigEImageSettings imageSettings;
@@ -610,7 +987,33 @@ void LfGigECam::setCameraSettings()
     imageSettings.offsetY = 0;
     imageSettings.height = imageSettingsInfo.maxHeight;
     imageSettings.width = imageSettingsInfo.maxWidth;
-    imageSettings.pixelFormat = PIXEL_FORMAT_MONO8;
+    imageSettings.pixelFormat = toNativePixelFormat(frameFormat);
+
+    frameWidth = imageSettings.width;
+    frameHeight = imageSettings.height;
+    frameFormat = toLfPixelFormat(imageSettings.pixelFormat);
+    sensorWidth = imageSettingsInfo.maxWidth;
+    sensorHeight = imageSettingsInfo.maxHeight;
+    roi.offsetX = 0;
+    roi.offsetY = 0;
+    roi.width = frameWidth;
+    roi.height = frameHeight;
+    offsetHStep = imageSettingsInfo.offsetHStepSize ? imageSettingsInfo.offsetHStepSize : 1;
+    offsetVStep = imageSettingsInfo.offsetVStepSize ? imageSettingsInfo.offsetVStepSize : 1;
+    imageHStep = imageSettingsInfo.imageHStepSize ? imageSettingsInfo.imageHStepSize : 1;
+    imageVStep = imageSettingsInfo.imageVStepSize ? imageSettingsInfo.imageVStepSize : 1;
+
+    // Writing image settings makes the camera reallocate its stream, so
+    // leave them if it still has them from the last run
+    GigEImageSettings current;
+    if (((GigECamera *)pcam)->GetGigEImageSettings( &current ) == PGRERROR_OK &&
+        current.offsetX == imageSettings.offsetX && current.offsetY == imageSettings.offsetY &&
+        current.width == imageSettings.width && current.height == imageSettings.height &&
+        current.pixelFormat == imageSettings.pixelFormat)
+    {
+        writesSkipped++;
+        return;
+    }
 
     cout << "Setting GigE image settings..." << endl;
 
@@ -622,3 +1025,84 @@ void LfGigECam::setCameraSettings()
     }
 
 }
+
+void LfGigECam::getConfig(LfCamConfig *config) const
+{
+    config->serial = serial;
+    config->sensorWidth = sensorWidth;
+    config->sensorHeight = sensorHeight;
+    config->offsetHStep = offsetHStep;
+    config->offsetVStep = offsetVStep;
+    config->imageHStep = imageHStep;
+    config->imageVStep = imageVStep;
+}
+
+// Round [start, start + size) out to the given steps within limit
+static void alignSpan(unsigned int &start, unsigned int &size, unsigned int offsetStep,
+                      unsigned int sizeStep, unsigned int limit)
+{
+    unsigned int end = start + size > limit ? limit : start + size;
+    start = start / offsetStep * offsetStep;
+    size = (end - start + sizeStep - 1) / sizeStep * sizeStep;
+    if (start + size > limit)
+    {
+        size = (limit - start) / sizeStep * sizeStep;
+    }
+}
+
+int LfGigECam::setRoi(const LfRoi &request)
+{
+    if (request.width == 0 || request.height == 0 ||
+        request.offsetX >= sensorWidth || request.offsetY >= sensorHeight)
+    {
+        return -1;
+    }
+
+    GigEImageSettings imageSettings;
+    imageSettings.offsetX = request.offsetX;
+    imageSettings.offsetY = request.offsetY;
+    imageSettings.width = request.width;
+    imageSettings.height = request.height;
+    imageSettings.pixelFormat = toNativePixelFormat(frameFormat);
+    alignSpan(imageSettings.offsetX, imageSettings.width, offsetHStep, imageHStep, sensorWidth);
+    alignSpan(imageSettings.offsetY, imageSettings.height, offsetVStep, imageVStep, sensorHeight);
+    if (imageSettings.width == 0 || imageSettings.height == 0)
+    {
+        return -1;
+    }
+    if (imageSettings.offsetX == roi.offsetX && imageSettings.offsetY == roi.offsetY &&
+        imageSettings.width == roi.width && imageSettings.height == roi.height)
+    {
+        return 0;
+    }
+
+    // Image settings can only change while the camera is not streaming
+    error = pcam->StopCapture();
+    if (error != PGRERROR_OK)
+    {
+        printError( error );
+        return -1;
+    }
+    error = ((GigECamera *)pcam)->SetGigEImageSettings( &imageSettings );
+    if (error != PGRERROR_OK)
+    {
+        printError( error );
+        // Carry on with the old window rather than stop the camera
+        pcam->StartCapture();
+        return -1;
+    }
+    roi.offsetX = imageSettings.offsetX;
+    roi.offsetY = imageSettings.offsetY;
+    roi.width = imageSettings.width;
+    roi.height = imageSettings.height;
+    frameWidth = roi.width;
+    frameHeight = roi.height;
+
+    error = pcam->StartCapture();
+    if (error != PGRERROR_OK)
+    {
+        printError( error );
+        return -1;
+    }
+    return 0;
+}
@@ -10,41 +10,114 @@
 #include <stdexcept>
 #include <unistd.h>
 #include <iomanip>
+#include <vector>
 #include "FlyCapture2.h"
+#include "lfbuf.h"
+#include "lfconv.h"
+#include "lfmetrics.h"
+#include "lfsrc.h"
+#include "lfwait.h"
 
 using namespace FlyCapture2;
 using namespace std;
 
-class LfCam {
+// What a camera was last brought up with.  Kept between runs, so a restart
+// can find the cameras by serial number instead of discovering them and
+// skip querying what the sensor can do.
+struct LfCamConfig {
+    unsigned int serial;
+    unsigned int sensorWidth;
+    unsigned int sensorHeight;
+    unsigned int offsetHStep;
+    unsigned int offsetVStep;
+    unsigned int imageHStep;
+    unsigned int imageVStep;
+};
+
+// The last configuration every camera started with, in enumeration order,
+// one line per camera.  Load returns -1 if there is none or it is damaged.
+int lfLoadCamCache(const char *path, vector<LfCamConfig> &cameras);
+int lfSaveCamCache(const char *path, const vector<LfCamConfig> &cameras);
+
+// Where a camera's bring-up spent its time
+struct LfCamStartTimes {
+    unsigned long long connectUs;
+    unsigned long long powerUs;
+    unsigned long long configureUs;
+};
+
+class LfCam: public LfFrameSource, public LfRegisterSource {
 protected:
     Error error;
     BusManager busMgr;
     unsigned int numCameras;
     PGRGuid *guids;  // Array of camera identifiers
-    Image rawImage;
     Camera *pcam;
+    unsigned int frameWidth;
+    unsigned int frameHeight;
+    LfPixelFormat frameFormat;
+    unsigned int sensorWidth;
+    unsigned int sensorHeight;
+    LfRoi roi;                    // Window being read out
+    unsigned long copyFallbacks;  // Frames the library did not place in our buffer
+    bool frameCounter;            // Images carry the camera's frame counter
+    unsigned int serial;          // Known once connected
+    unsigned long writesSkipped;  // Settings the camera already had
+    LfTriggerWait triggerWait;
+    LfConverter converter;
+    LfCounter *grabbed;           // Metrics, NULL until setMetrics()
+    LfCounter *grabErrors;
+    LfCounter *grabTimeouts;
 public:
     LfCam();
-    ~LfCam();
+    virtual ~LfCam();
     // Debug info
     void printBuildInfo();
     void printError( Error error );
     // Start camera
-    int connect(int cameraIndex);
-    int start();
+    virtual int connect(int cameraIndex);
+    virtual int start();
     // Run camera
-    int retrieveImage();
-    Image convertImage();
+    virtual int retrieveImage(LfFrame *frame);
+    // To MONO8; a MONO8 source is not copied, dst becomes a view of it
+    int convertImage(const LfFrame *src, LfFrame *dst);
+    LfConverter &getConverter() { return converter; }
     int saveImage(Image &img, ostringstream &filename);
+    int saveImage(const LfFrame *frame, ostringstream &filename);
+    // Have the camera embed its frame counter in every image, so lost and
+    // reordered frames can be told apart.  Frame timestamps are still the
+    // host's, taken when the image arrived.
+    int enableFrameStamps();
+    virtual bool hasFrameCounter() const { return frameCounter; }
+    // Pixel format setCameraSettings() asks for: MONO8, MONO12 or MONO16
+    void setCaptureFormat(LfPixelFormat format) { frameFormat = format; }
+    // Frame geometry requested from the camera
+    virtual unsigned int getFrameWidth() const { return frameWidth; }
+    virtual unsigned int getFrameHeight() const { return frameHeight; }
+    virtual LfPixelFormat getFrameFormat() const { return frameFormat; }
+    virtual unsigned int getSensorWidth() const { return sensorWidth; }
+    virtual unsigned int getSensorHeight() const { return sensorHeight; }
+    unsigned long getCopyFallbacks() const { return copyFallbacks; }
+    unsigned int getSerial() const { return serial; }
+    unsigned long getWritesSkipped() const { return writesSkipped; }
+    unsigned int getNumCameras() const { return numCameras; }
+    // Count grabs, RetrieveBuffer errors and timeouts, and trigger-ready
+    // waits in the registry, labelled with the camera index
+    void setMetrics(LfMetricsRegistry &registry, unsigned int camera);
     // Stop camera
-    int stop();
-    int disconnect();
+    virtual int stop();
+    virtual int disconnect();
     // Trigger functions
     bool checkSoftwareTriggerPresence();
-    bool pollForTriggerReady();
+    virtual bool pollForTriggerReady();
+    virtual int readRegister(unsigned int address, unsigned int *value);
+    void setWaitMode(LfWaitMode mode, unsigned int spinReads = 64, unsigned int maxBackoffUs = 500);
+    LfTriggerWait &getTriggerWait() { return triggerWait; }
     bool fireSoftwareTrigger();
+    // Returns at once if the camera is already powered
     int powerOn();
     bool supportsExternalTrigger();
+    // These two leave a camera that already has the setting alone
     int setTriggerMode15();
     int setGrabTimeout(int ms); // 5000 ms
     int setTriggerModeOff();
@@ -57,12 +130,32 @@ public:
 };
 
 class LfGigECam: public LfCam {
+protected:
+    // Granularity of ROI offsets and sizes
+    unsigned int offsetHStep;
+    unsigned int offsetVStep;
+    unsigned int imageHStep;
+    unsigned int imageVStep;
+    bool discovered;    // Found by discovery rather than by serial number
+    void discover();
+    bool findKnown(const vector<LfCamConfig> &known);
 public:
     LfGigECam();
+    // Finds the cameras by their cached serial numbers, which needs no
+    // discovery broadcast; discovers them if any has gone
+    explicit LfGigECam(const vector<LfCamConfig> &known);
+    // Another camera on the bus first found, without looking again
+    explicit LfGigECam(const LfGigECam *first);
+    bool wasDiscovered() const { return discovered; }
     void printCameraInfo(CameraInfo *);
     void printAllStreamChannelsInfo();
     void printStreamChannelInfo(GigEStreamChannel*);
-    void setCameraSettings();
+    // With the camera's cached configuration the sensor isn't queried, and
+    // image settings it already has aren't written again
+    void setCameraSettings(const LfCamConfig *known = NULL);
+    void getConfig(LfCamConfig *config) const;
+    // Reprograms the image settings, which restarts capture
+    virtual int setRoi(const LfRoi &roi);
 };
 
 #endif
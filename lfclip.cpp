@@ -0,0 +1,396 @@
+// Pre-event clip buffer for laser fence application.
+
+#include "lfclip.h"
+#include <iostream>
+#include <stdexcept>
+#include <string.h>
+#include <limits.h>
+#include "lflog.h"
+#include "lfmetrics.h"
+#include "lfrec.h"
+
+using namespace std;
+
+static const unsigned long k_notPinned = ULONG_MAX;
+
+LfClipBuffer::LfClipBuffer(unsigned int camera, unsigned int maxWidth, unsigned int maxHeight,
+                           LfPixelFormat maxFormat, double windowSeconds, size_t arenaBytes, unsigned int maxPairs)
+    : camera(camera), directory("."), windowUs((unsigned long long)(windowSeconds * 1000000)), keyInterval(64),
+      arena(NULL), arenaBytes(arenaBytes), writeOffset(0), usedBytes(0), entries(maxPairs ? maxPairs : 1),
+      first(0), next(0), pinFrom(k_notPinned), maxRowBytes(lfRowBytes(maxFormat, maxWidth)), maxHeight(maxHeight),
+      coded(NULL), havePrev(false), sinceKey(0), dumpWanted(false), dumpSeq(0), running(false),
+      pairs(0), keys(0), dropped(0), rawBytes(0), codedBytes(0), encodeTime(0), dumps(0), dumpErrors(0),
+      framesDumped(0)
+{
+    // Everything is allocated here so that append() never allocates
+    size_t planeBytes = maxRowBytes * maxHeight;
+    arena = (unsigned char *)lfAlignedAlloc(arenaBytes);
+    // Sized for 2-byte samples, which is the larger bound for any format
+    coded = (unsigned char *)lfAlignedAlloc(2 * LfPlaneCodec::maxEncodedSize(maxRowBytes, maxHeight, 2));
+    prev[0] = (unsigned char *)lfAlignedAlloc(planeBytes);
+    prev[1] = (unsigned char *)lfAlignedAlloc(planeBytes);
+    bool allocated = arena != NULL && coded != NULL && prev[0] != NULL && prev[1] != NULL;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        dumpPlanes[i] = (unsigned char *)lfAlignedAlloc(planeBytes);
+        allocated = allocated && dumpPlanes[i] != NULL;
+    }
+    if (!allocated)
+    {
+        throw runtime_error("Can't allocate clip buffer");
+    }
+    memset(&last, 0, sizeof(last));
+}
+
+LfClipBuffer::~LfClipBuffer()
+{
+    stop();
+    lfAlignedFree(arena);
+    lfAlignedFree(coded);
+    lfAlignedFree(prev[0]);
+    lfAlignedFree(prev[1]);
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        lfAlignedFree(dumpPlanes[i]);
+    }
+}
+
+int LfClipBuffer::start()
+{
+    if (running)
+    {
+        return -1;
+    }
+    running = true;
+    dumper = thread(&LfClipBuffer::dumpLoop, this);
+    return 0;
+}
+
+void LfClipBuffer::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if (!running)
+        {
+            return;
+        }
+        running = false;
+    }
+    wake.notify_one();
+    dumper.join();
+}
+
+// Called with the lock held
+bool LfClipBuffer::evictOldest()
+{
+    if (first == next || first >= pinFrom)
+    {
+        return false;
+    }
+    Entry &e = entry(first);
+    usedBytes -= e.bytes[0] + e.bytes[1];
+    first++;
+    return true;
+}
+
+// Finds bytes of contiguous space after the newest pair, wrapping to the
+// start of the arena when the end is too short, and evicts the oldest pairs
+// until there is.  Called with the lock held.
+bool LfClipBuffer::reserve(size_t bytes, size_t *offset)
+{
+    for (;;)
+    {
+        if (first == next)
+        {
+            writeOffset = 0;
+            *offset = 0;
+            return bytes <= arenaBytes;
+        }
+        if (next - first < entries.size())
+        {
+            size_t tail = entry(first).offset;
+            if (writeOffset > tail)
+            {
+                if (arenaBytes - writeOffset >= bytes)
+                {
+                    *offset = writeOffset;
+                    return true;
+                }
+                if (tail >= bytes)
+                {
+                    *offset = 0;
+                    return true;
+                }
+            }
+            else if (writeOffset < tail && tail - writeOffset >= bytes)
+            {
+                *offset = writeOffset;
+                return true;
+            }
+        }
+        if (!evictOldest())
+        {
+            return false;
+        }
+    }
+}
+
+int LfClipBuffer::append(const LfFrame *on, const LfFrame *off)
+{
+    size_t rowBytes = lfRowBytes(on->format, on->width);
+    if (rowBytes > maxRowBytes || on->height > maxHeight || off->format != on->format ||
+        off->width != on->width || off->height != on->height)
+    {
+        dropped.store(dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return -1;
+    }
+
+    // A new geometry can't be coded against the old one, and a clip can
+    // only start on a pair coded on its own
+    bool key = !havePrev || sinceKey + 1 >= keyInterval || on->width != last.width || on->height != last.height ||
+               on->format != last.format || on->offsetX != last.offsetX || on->offsetY != last.offsetY;
+    unsigned int sampleBytes = lfCodecSampleBytes(on->format);
+    unsigned long long begin = lfMonotonicNs();
+    size_t onBytes = codec.encode(on->data, on->stride, key ? NULL : prev[0], rowBytes, rowBytes, on->height, coded,
+                                  sampleBytes);
+    size_t offBytes = codec.encode(off->data, off->stride, key ? NULL : prev[1], rowBytes, rowBytes, off->height,
+                                   coded + onBytes, sampleBytes);
+    encodeTime.store(encodeTime.load(memory_order_relaxed) + lfMonotonicNs() - begin, memory_order_relaxed);
+
+    size_t offset;
+    bool fits;
+    {
+        lock_guard<mutex> guard(lock);
+        while (first != next && entry(first).timestamp[0] + windowUs < on->timestamp && evictOldest())
+        {
+        }
+        fits = reserve(onBytes + offBytes, &offset);
+    }
+    if (!fits)
+    {
+        // The next pair has nothing stored to be coded against
+        havePrev = false;
+        dropped.store(dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return -1;
+    }
+
+    // Only this thread writes the arena, and a dump reads no further than
+    // the pairs added before it began
+    memcpy(arena + offset, coded, onBytes + offBytes);
+    for (unsigned int y = 0; y < on->height; y++)
+    {
+        memcpy(prev[0] + y * rowBytes, on->data + y * on->stride, rowBytes);
+        memcpy(prev[1] + y * rowBytes, off->data + y * off->stride, rowBytes);
+    }
+    havePrev = true;
+    sinceKey = key ? 0 : sinceKey + 1;
+
+    Entry e;
+    e.offset = offset;
+    e.bytes[0] = onBytes;
+    e.bytes[1] = offBytes;
+    e.timestamp[0] = on->timestamp;
+    e.timestamp[1] = off->timestamp;
+    e.seq[0] = on->seq;
+    e.seq[1] = off->seq;
+    e.width = on->width;
+    e.height = on->height;
+    e.offsetX = on->offsetX;
+    e.offsetY = on->offsetY;
+    e.format = on->format;
+    e.nativeFormat = on->nativeFormat;
+    e.key = key;
+    last = e;
+    {
+        lock_guard<mutex> guard(lock);
+        entry(next) = e;
+        next++;
+        writeOffset = offset + onBytes + offBytes;
+        usedBytes += onBytes + offBytes;
+    }
+
+    pairs.store(pairs.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    keys.store(keys.load(memory_order_relaxed) + key, memory_order_relaxed);
+    rawBytes.store(rawBytes.load(memory_order_relaxed) + 2 * rowBytes * on->height, memory_order_relaxed);
+    codedBytes.store(codedBytes.load(memory_order_relaxed) + onBytes + offBytes, memory_order_relaxed);
+    return 0;
+}
+
+void LfClipBuffer::requestDump(unsigned int seq)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        // Alarms raised while one is pending share its clip
+        if (dumpWanted)
+        {
+            return;
+        }
+        dumpWanted = true;
+        dumpSeq = seq;
+    }
+    wake.notify_one();
+}
+
+void LfClipBuffer::dumpLoop()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!dumpWanted && running)
+        {
+            wake.wait(guard);
+        }
+        if (!dumpWanted)
+        {
+            break;
+        }
+        dumpWanted = false;
+        unsigned int seq = dumpSeq;
+
+        // Start at the oldest pair a clip can be decoded from
+        unsigned long from = first;
+        while (from != next && !entry(from).key)
+        {
+            from++;
+        }
+        unsigned long to = next;
+        if (from == to)
+        {
+            continue;
+        }
+        pinFrom = from;
+        guard.unlock();
+        int result = writeClip(from, to, seq);
+        guard.lock();
+        pinFrom = k_notPinned;
+        if (result == 0)
+        {
+            dumps.fetch_add(1, memory_order_relaxed);
+        }
+        else
+        {
+            dumpErrors.fetch_add(1, memory_order_relaxed);
+        }
+    }
+}
+
+// Decodes pinned pairs [from, to) into recordings.  A recording holds one
+// geometry, so a geometry change starts another file.
+int LfClipBuffer::writeClip(unsigned long from, unsigned long to, unsigned int seq)
+{
+    LfRecorder recorder;
+    bool open = false;
+    unsigned int part = 0;
+    Entry current;
+    memset(&current, 0, sizeof(current));
+    unsigned char *cur[2] = { dumpPlanes[0], dumpPlanes[1] };
+    unsigned char *ref[2] = { dumpPlanes[2], dumpPlanes[3] };
+    unsigned long written = 0;
+    for (unsigned long n = from; n < to; n++)
+    {
+        // Pinned entries are neither evicted nor overwritten
+        const Entry &e = entry(n);
+        size_t rowBytes = lfRowBytes(e.format, e.width);
+        if (!open || e.width != current.width || e.height != current.height || e.format != current.format)
+        {
+            if (open)
+            {
+                recorder.close();
+                part++;
+            }
+            char name[64];
+            if (part == 0)
+            {
+                snprintf(name, sizeof(name), "/clip_cam%u_%u.lfr", camera, seq);
+            }
+            else
+            {
+                snprintf(name, sizeof(name), "/clip_cam%u_%u_%u.lfr", camera, seq, part);
+            }
+            string path = directory + name;
+            if (recorder.open(path.c_str(), e.width, e.height, rowBytes, e.format, 15, 2) != 0)
+            {
+                return -1;
+            }
+            open = true;
+            current = e;
+        }
+
+        const unsigned char *stream = arena + e.offset;
+        for (unsigned int k = 0; k < 2; k++)
+        {
+            if (codec.decode(stream, e.bytes[k], e.key ? NULL : ref[k], rowBytes, rowBytes, e.height,
+                             cur[k], rowBytes, lfCodecSampleBytes(e.format)) != 0)
+            {
+                lfLog(LF_LOG_ERROR, "Clip of camera %u is corrupt at frame %u", camera, e.seq[k]);
+                recorder.close();
+                return -1;
+            }
+            stream += e.bytes[k];
+
+            LfFrame frame;
+            memset(&frame, 0, sizeof(frame));
+            frame.data = cur[k];
+            frame.capacity = maxRowBytes * maxHeight;
+            frame.dataSize = rowBytes * e.height;
+            frame.width = e.width;
+            frame.height = e.height;
+            frame.stride = rowBytes;
+            frame.offsetX = e.offsetX;
+            frame.offsetY = e.offsetY;
+            frame.format = e.format;
+            frame.nativeFormat = e.nativeFormat;
+            frame.timestamp = e.timestamp[k];
+            frame.seq = e.seq[k];
+            frame.camera = camera;
+            frame.index = -1;
+            if (recorder.append(&frame) != 0)
+            {
+                recorder.close();
+                return -1;
+            }
+            swap(cur[k], ref[k]);
+        }
+        written += 2;
+    }
+    recorder.close();
+    framesDumped.fetch_add(written, memory_order_relaxed);
+    lfLog(LF_LOG_INFO, "Saved %lu frames of camera %u before alarm at frame %u", written, camera, seq);
+    return 0;
+}
+
+double LfClipBuffer::getRatio() const
+{
+    unsigned long long c = codedBytes.load(memory_order_relaxed);
+    return c > 0 ? (double)rawBytes.load(memory_order_relaxed) / c : 0;
+}
+
+double LfClipBuffer::getBufferedSeconds()
+{
+    lock_guard<mutex> guard(lock);
+    if (next - first < 2)
+    {
+        return 0;
+    }
+    return (entry(next - 1).timestamp[0] - entry(first).timestamp[0]) / 1000000.0;
+}
+
+size_t LfClipBuffer::getBufferedBytes()
+{
+    lock_guard<mutex> guard(lock);
+    return usedBytes;
+}
+
+void LfClipBuffer::printStats()
+{
+    unsigned long n = pairs.load(memory_order_relaxed);
+    double seconds = getBufferedSeconds();
+    size_t bytes = getBufferedBytes();
+    cout << "Clip buffer " << camera << ": " << n << " pairs (" << keys.load(memory_order_relaxed) << " key), "
+         << getRatio() << ":1, " << (n ? encodeTime.load(memory_order_relaxed) / n / 1000 : 0) << " us/pair to code, "
+         << seconds << " s held in " << bytes / (1024.0 * 1024.0) << " MB ("
+         << (seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0) << " MB per second of " << windowUs / 1000000.0
+         << "), " << dumps.load(memory_order_relaxed) << " clips of " << framesDumped.load(memory_order_relaxed)
+         << " frames, " << dumpErrors.load(memory_order_relaxed) << " failed, "
+         << dropped.load(memory_order_relaxed) << " pairs dropped" << endl;
+}
@@ -0,0 +1,130 @@
+// Pre-event clip buffer for laser fence application.
+
+#ifndef LFCLIP_H
+#define LFCLIP_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lfalarm.h"
+#include "lfbuf.h"
+#include "lfcodec.h"
+
+// Keeps the last few seconds of one camera's pairs, compressed, so that an
+// alarm can be saved with what led up to it.  Each frame is coded against
+// the previous frame of its kind, so a still scene costs little more than
+// the noise in it; every keyInterval pairs, and whenever the geometry
+// changes, a pair is coded on its own so a clip can start there.
+//
+// append() runs on the storage thread and only codes into a scratch buffer
+// and copies into a byte ring, evicting the oldest pairs past the window or
+// when the ring is full.  requestDump() only flags the clip; a thread of its
+// own decodes and writes it as a .lfr recording, while appends go on.
+// Pairs the dump still needs are pinned, so if the ring fills during a dump
+// new pairs are dropped from the buffer (never from capture).
+class LfClipBuffer {
+protected:
+    struct Entry {
+        size_t offset;
+        size_t bytes[2];                // Laser-on then laser-off stream
+        unsigned long long timestamp[2];
+        unsigned int seq[2];
+        unsigned int width;
+        unsigned int height;
+        unsigned int offsetX;
+        unsigned int offsetY;
+        LfPixelFormat format;
+        unsigned int nativeFormat;
+        bool key;
+    };
+    unsigned int camera;
+    std::string directory;
+    unsigned long long windowUs;
+    unsigned int keyInterval;
+    LfPlaneCodec codec;
+    unsigned char *arena;
+    size_t arenaBytes;
+    size_t writeOffset;
+    size_t usedBytes;
+    std::vector<Entry> entries;
+    unsigned long first;                // Number of the oldest entry kept
+    unsigned long next;                 // Number the next entry gets
+    unsigned long pinFrom;              // Oldest entry a dump needs
+    size_t maxRowBytes;
+    unsigned int maxHeight;
+    unsigned char *coded;               // Both streams of the pair being added
+    unsigned char *prev[2];             // Last pair added, raw, as references
+    Entry last;                         // Geometry of the last pair added
+    bool havePrev;
+    unsigned int sinceKey;
+    unsigned char *dumpPlanes[4];       // Decoded pair and the one before it
+    bool dumpWanted;
+    unsigned int dumpSeq;
+    bool running;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread dumper;
+    std::atomic<unsigned long> pairs;
+    std::atomic<unsigned long> keys;
+    std::atomic<unsigned long> dropped;
+    std::atomic<unsigned long long> rawBytes;
+    std::atomic<unsigned long long> codedBytes;
+    std::atomic<unsigned long long> encodeTime;
+    std::atomic<unsigned long> dumps;
+    std::atomic<unsigned long> dumpErrors;
+    std::atomic<unsigned long> framesDumped;
+    Entry &entry(unsigned long number) { return entries[number % entries.size()]; }
+    bool evictOldest();
+    bool reserve(size_t bytes, size_t *offset);
+    void dumpLoop();
+    int writeClip(unsigned long from, unsigned long to, unsigned int seq);
+public:
+    // maxWidth and maxHeight bound the frames appended; arenaBytes is the
+    // memory for coded pairs and maxPairs the most pairs indexed at once
+    LfClipBuffer(unsigned int camera, unsigned int maxWidth, unsigned int maxHeight, LfPixelFormat maxFormat,
+                 double windowSeconds, size_t arenaBytes, unsigned int maxPairs = 4096);
+    ~LfClipBuffer();
+    // Directory clips are written to, the working directory by default
+    void setDirectory(const char *path) { directory = path; }
+    // Pairs between self-contained pairs; a clip starts at the first one
+    void setKeyInterval(unsigned int n) { keyInterval = n ? n : 1; }
+    void setCpuLevel(LfCpuLevel level) { codec.setCpuLevel(level); }
+    int start();
+    // Waits for a dump in progress
+    void stop();
+    // Codes a pair into the buffer.  Returns -1 if it was not kept.
+    int append(const LfFrame *on, const LfFrame *off);
+    // Saves the buffered pairs up to now; seq names the clip.  Never
+    // blocks on the dump itself.
+    void requestDump(unsigned int seq);
+    unsigned long getPairs() const { return pairs.load(std::memory_order_relaxed); }
+    unsigned long getDropped() const { return dropped.load(std::memory_order_relaxed); }
+    unsigned long getDumps() const { return dumps.load(std::memory_order_relaxed); }
+    // Raw bytes per coded byte over every pair added
+    double getRatio() const;
+    // Time and arena bytes the pairs held now span
+    double getBufferedSeconds();
+    size_t getBufferedBytes();
+    void printStats();
+};
+
+// Alarm sink that saves each raised alarm's camera's clip
+class LfClipSink: public LfAlarmSink {
+protected:
+    std::vector<LfClipBuffer *> &buffers;
+public:
+    LfClipSink(std::vector<LfClipBuffer *> &buffers) : buffers(buffers) {}
+    virtual void raise(const LfAlarmEvent &event)
+    {
+        if (event.type == LF_ALARM_RAISED && event.camera < buffers.size())
+        {
+            buffers[event.camera]->requestDump(event.seq);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,648 @@
+// Lossless frame codec for laser fence application.
+
+#include "lfcodec.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LF_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Longest run one header byte holds
+static const unsigned int k_maxRun = 128;
+// 16-bit samples split into byte planes per row at a time
+static const unsigned int k_splitSamples = 1024;
+
+size_t lfFlushZeroRun(unsigned char *out, unsigned int *run)
+{
+    size_t bytes = 0;
+    while (*run > 0)
+    {
+        unsigned int n = *run < k_maxRun ? *run : k_maxRun;
+        out[bytes++] = 0x80 | (n - 1);
+        *run -= n;
+    }
+    return bytes;
+}
+
+// Codes one block of zigzagged residuals; a zero block only extends the run
+static size_t encodeBlock(const unsigned char *z, unsigned char *out, unsigned int *run)
+{
+    unsigned int planes[8] = { 0 };
+    unsigned int any = 0;
+    for (unsigned int i = 0; i < k_lfCodecBlock; i++)
+    {
+        any |= z[i];
+        for (unsigned int k = 0; k < 8; k++)
+        {
+            planes[k] |= ((z[i] >> k) & 1u) << i;
+        }
+    }
+    if (any == 0)
+    {
+        (*run)++;
+        return 0;
+    }
+
+    size_t bytes = lfFlushZeroRun(out, run);
+    unsigned int width = 32 - __builtin_clz(any);
+    out[bytes++] = width;
+    for (unsigned int k = 0; k < width; k++)
+    {
+        out[bytes++] = planes[k] & 0xff;
+        out[bytes++] = planes[k] >> 8;
+    }
+    return bytes;
+}
+
+size_t lfEncodeRowScalar(const unsigned char *cur, const unsigned char *ref, unsigned int n,
+                         unsigned char *out, unsigned int *run)
+{
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < n; i += k_lfCodecBlock)
+    {
+        unsigned char z[k_lfCodecBlock];
+        for (unsigned int j = 0; j < k_lfCodecBlock; j++)
+        {
+            // Zigzag on the unsigned byte: shifting a negative value left
+            // is undefined, and the top bit is the sign either way
+            unsigned char d = i + j < n ? (unsigned char)(cur[i + j] - (ref != NULL ? ref[i + j] : 0)) : 0;
+            z[j] = (unsigned char)((d << 1) ^ -(d >> 7));
+        }
+        bytes += encodeBlock(z, out + bytes, run);
+    }
+    return bytes;
+}
+
+// Applies one block: zero residuals copy the reference
+static void decodeBlock(const unsigned char *z, const unsigned char *ref, unsigned int n, unsigned char *out)
+{
+    for (unsigned int j = 0; j < n; j++)
+    {
+        unsigned char d = (z[j] >> 1) ^ (unsigned char)-(z[j] & 1);
+        out[j] = (ref != NULL ? ref[j] : 0) + d;
+    }
+}
+
+const unsigned char *lfDecodeRowScalar(const unsigned char *in, const unsigned char *end,
+                                       const unsigned char *ref, unsigned int n,
+                                       unsigned char *out, unsigned int *run)
+{
+    static const unsigned char zeros[k_lfCodecBlock] = { 0 };
+    for (unsigned int i = 0; i < n; i += k_lfCodecBlock)
+    {
+        unsigned int count = n - i < k_lfCodecBlock ? n - i : k_lfCodecBlock;
+        const unsigned char *blockRef = ref != NULL ? ref + i : NULL;
+        if (*run == 0)
+        {
+            if (in >= end)
+            {
+                return NULL;
+            }
+            unsigned int header = *in++;
+            if (header & 0x80)
+            {
+                *run = (header & 0x7f) + 1;
+            }
+            else
+            {
+                if (header == 0 || header > 8 || end - in < 2 * (ptrdiff_t)header)
+                {
+                    return NULL;
+                }
+                unsigned char z[k_lfCodecBlock] = { 0 };
+                for (unsigned int k = 0; k < header; k++, in += 2)
+                {
+                    unsigned int plane = in[0] | (unsigned int)in[1] << 8;
+                    for (unsigned int j = 0; j < k_lfCodecBlock; j++)
+                    {
+                        z[j] |= ((plane >> j) & 1u) << k;
+                    }
+                }
+                decodeBlock(z, blockRef, count, out + i);
+                continue;
+            }
+        }
+        decodeBlock(zeros, blockRef, count, out + i);
+        (*run)--;
+    }
+    return in;
+}
+
+#ifdef LF_X86
+
+// Zigzag: 2d for d >= 0, -2d - 1 below, so bit widths follow |d|
+__attribute__((target("sse4.1")))
+static inline __m128i zigzag(__m128i d)
+{
+    return _mm_xor_si128(_mm_add_epi8(d, d), _mm_cmpgt_epi8(_mm_setzero_si128(), d));
+}
+
+__attribute__((target("sse4.1")))
+static inline size_t encodeBlockSse41(__m128i z, unsigned char *out, unsigned int *run)
+{
+    if (_mm_testz_si128(z, z))
+    {
+        (*run)++;
+        return 0;
+    }
+
+    // Shifting bit k up to bit 7 of each byte lets movemask collect plane k
+    unsigned int planes[8];
+    planes[7] = _mm_movemask_epi8(z);
+    planes[6] = _mm_movemask_epi8(_mm_slli_epi64(z, 1));
+    planes[5] = _mm_movemask_epi8(_mm_slli_epi64(z, 2));
+    planes[4] = _mm_movemask_epi8(_mm_slli_epi64(z, 3));
+    planes[3] = _mm_movemask_epi8(_mm_slli_epi64(z, 4));
+    planes[2] = _mm_movemask_epi8(_mm_slli_epi64(z, 5));
+    planes[1] = _mm_movemask_epi8(_mm_slli_epi64(z, 6));
+    planes[0] = _mm_movemask_epi8(_mm_slli_epi64(z, 7));
+    unsigned int width = 8;
+    while (planes[width - 1] == 0)
+    {
+        width--;
+    }
+
+    size_t bytes = lfFlushZeroRun(out, run);
+    out[bytes++] = width;
+    for (unsigned int k = 0; k < width; k++)
+    {
+        out[bytes++] = planes[k] & 0xff;
+        out[bytes++] = planes[k] >> 8;
+    }
+    return bytes;
+}
+
+__attribute__((target("sse4.1")))
+size_t lfEncodeRowSse41(const unsigned char *cur, const unsigned char *ref, unsigned int n,
+                        unsigned char *out, unsigned int *run)
+{
+    size_t bytes = 0;
+    unsigned int i = 0;
+    for (; i + k_lfCodecBlock <= n; i += k_lfCodecBlock)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(cur + i));
+        __m128i d = ref != NULL ? _mm_sub_epi8(c, _mm_loadu_si128((const __m128i *)(ref + i))) : c;
+        bytes += encodeBlockSse41(zigzag(d), out + bytes, run);
+    }
+    if (i < n)
+    {
+        bytes += lfEncodeRowScalar(cur + i, ref != NULL ? ref + i : NULL, n - i, out + bytes, run);
+    }
+    return bytes;
+}
+
+__attribute__((target("sse4.1")))
+const unsigned char *lfDecodeRowSse41(const unsigned char *in, const unsigned char *end,
+                                      const unsigned char *ref, unsigned int n,
+                                      unsigned char *out, unsigned int *run)
+{
+    // Byte j of a plane mask lives in byte j / 8 of the mask and bit j % 8
+    const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i low7 = _mm_set1_epi8(0x7f);
+    unsigned int i = 0;
+    for (; i + k_lfCodecBlock <= n; i += k_lfCodecBlock)
+    {
+        __m128i r = ref != NULL ? _mm_loadu_si128((const __m128i *)(ref + i)) : _mm_setzero_si128();
+        if (*run == 0)
+        {
+            if (in >= end)
+            {
+                return NULL;
+            }
+            unsigned int header = *in++;
+            if (header & 0x80)
+            {
+                *run = (header & 0x7f) + 1;
+            }
+            else
+            {
+                if (header == 0 || header > 8 || end - in < 2 * (ptrdiff_t)header)
+                {
+                    return NULL;
+                }
+                __m128i z = _mm_setzero_si128();
+                __m128i weight = one;
+                for (unsigned int k = 0; k < header; k++, in += 2)
+                {
+                    unsigned int plane = in[0] | (unsigned int)in[1] << 8;
+                    __m128i m = _mm_shuffle_epi8(_mm_cvtsi32_si128(plane), spread);
+                    __m128i set = _mm_cmpeq_epi8(_mm_and_si128(m, bits), bits);
+                    z = _mm_or_si128(z, _mm_and_si128(set, weight));
+                    weight = _mm_add_epi8(weight, weight);
+                }
+                __m128i d = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(z, 1), low7),
+                                          _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(z, one)));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(r, d));
+                continue;
+            }
+        }
+        _mm_storeu_si128((__m128i *)(out + i), r);
+        (*run)--;
+    }
+    if (i < n)
+    {
+        return lfDecodeRowScalar(in, end, ref != NULL ? ref + i : NULL, n - i, out + i, run);
+    }
+    return in;
+}
+
+#else
+
+size_t lfEncodeRowSse41(const unsigned char *cur, const unsigned char *ref, unsigned int n,
+                        unsigned char *out, unsigned int *run)
+{
+    return lfEncodeRowScalar(cur, ref, n, out, run);
+}
+
+const unsigned char *lfDecodeRowSse41(const unsigned char *in, const unsigned char *end,
+                                      const unsigned char *ref, unsigned int n,
+                                      unsigned char *out, unsigned int *run)
+{
+    return lfDecodeRowScalar(in, end, ref, n, out, run);
+}
+
+#endif
+
+// One 16-byte block is all the SSE version works on; wider registers
+// would only split it again for the header
+LfEncodeRowKernel lfGetEncodeRowKernel(LfCpuLevel level)
+{
+    return level >= LF_CPU_SSE41 ? lfEncodeRowSse41 : lfEncodeRowScalar;
+}
+
+LfDecodeRowKernel lfGetDecodeRowKernel(LfCpuLevel level)
+{
+    return level >= LF_CPU_SSE41 ? lfDecodeRowSse41 : lfDecodeRowScalar;
+}
+
+
+
+LfPlaneCodec::LfPlaneCodec()
+{
+    setCpuLevel(lfDetectCpuLevel());
+}
+
+void LfPlaneCodec::setCpuLevel(LfCpuLevel level)
+{
+    cpuLevel = level;
+    encodeRow = lfGetEncodeRowKernel(level);
+    decodeRow = lfGetDecodeRowKernel(level);
+}
+
+size_t LfPlaneCodec::maxEncodedSize(size_t rowBytes, unsigned int height, unsigned int sampleBytes)
+{
+    size_t blocks = sampleBytes == 2 ? 2 * ((rowBytes / 2 + k_lfCodecBlock - 1) / k_lfCodecBlock)
+                                     : (rowBytes + k_lfCodecBlock - 1) / k_lfCodecBlock;
+    return blocks * height * (1 + 2 * 8) + 1;
+}
+
+// The low byte is the residual as a signed byte and the high byte what is
+// left, so a difference in -128..127 leaves the high byte zero
+size_t LfPlaneCodec::encodeRow16(const unsigned char *cur, const unsigned char *ref, unsigned int samples,
+                                 unsigned char *out, unsigned int *run)
+{
+    const uint16_t *c = (const uint16_t *)cur;
+    const uint16_t *r = (const uint16_t *)ref;
+    unsigned char low[k_splitSamples];
+    unsigned char high[k_splitSamples];
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < samples; i += k_splitSamples)
+    {
+        unsigned int n = samples - i < k_splitSamples ? samples - i : k_splitSamples;
+        for (unsigned int j = 0; j < n; j++)
+        {
+            uint16_t d = c[i + j] - (r != NULL ? r[i + j] : 0);
+            signed char l = (signed char)(d & 0xff);
+            low[j] = (unsigned char)l;
+            high[j] = (uint16_t)(d - l) >> 8;
+        }
+        bytes += encodeRow(low, NULL, n, out + bytes, run);
+        bytes += encodeRow(high, NULL, n, out + bytes, run);
+    }
+    return bytes;
+}
+
+const unsigned char *LfPlaneCodec::decodeRow16(const unsigned char *in, const unsigned char *end,
+                                               const unsigned char *ref, unsigned int samples,
+                                               unsigned char *out, unsigned int *run)
+{
+    const uint16_t *r = (const uint16_t *)ref;
+    uint16_t *o = (uint16_t *)out;
+    unsigned char low[k_splitSamples];
+    unsigned char high[k_splitSamples];
+    for (unsigned int i = 0; i < samples && in != NULL; i += k_splitSamples)
+    {
+        unsigned int n = samples - i < k_splitSamples ? samples - i : k_splitSamples;
+        in = decodeRow(in, end, NULL, n, low, run);
+        if (in != NULL)
+        {
+            in = decodeRow(in, end, NULL, n, high, run);
+        }
+        if (in == NULL)
+        {
+            break;
+        }
+        for (unsigned int j = 0; j < n; j++)
+        {
+            o[i + j] = (r != NULL ? r[i + j] : 0) + (uint16_t)(high[j] << 8) + (signed char)low[j];
+        }
+    }
+    return in;
+}
+
+size_t LfPlaneCodec::encode(const unsigned char *cur, size_t curStride, const unsigned char *ref, size_t refStride,
+                            size_t rowBytes, unsigned int height, unsigned char *out, unsigned int sampleBytes)
+{
+    size_t bytes = 0;
+    unsigned int run = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const unsigned char *row = cur + y * curStride;
+        const unsigned char *refRow;
+        if (ref != NULL)
+        {
+            refRow = ref + y * refStride;
+        }
+        else
+        {
+            refRow = y > 0 ? row - curStride : NULL;
+        }
+        if (sampleBytes == 2)
+        {
+            bytes += encodeRow16(row, refRow, rowBytes / 2, out + bytes, &run);
+        }
+        else
+        {
+            bytes += encodeRow(row, refRow, rowBytes, out + bytes, &run);
+        }
+    }
+    return bytes + lfFlushZeroRun(out + bytes, &run);
+}
+
+int LfPlaneCodec::decode(const unsigned char *in, size_t inBytes, const unsigned char *ref, size_t refStride,
+                         size_t rowBytes, unsigned int height, unsigned char *out, size_t outStride,
+                         unsigned int sampleBytes)
+{
+    const unsigned char *end = in + inBytes;
+    unsigned int run = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        unsigned char *row = out + y * outStride;
+        const unsigned char *refRow;
+        if (ref != NULL)
+        {
+            refRow = ref + y * refStride;
+        }
+        else
+        {
+            refRow = y > 0 ? row - outStride : NULL;
+        }
+        if (sampleBytes == 2)
+        {
+            in = decodeRow16(in, end, refRow, rowBytes / 2, row, &run);
+        }
+        else
+        {
+            in = decodeRow(in, end, refRow, rowBytes, row, &run);
+        }
+        if (in == NULL)
+        {
+            return -1;
+        }
+    }
+    return run == 0 && in == end ? 0 : -1;
+}
+
+unsigned int lfCodecSampleBytes(LfPixelFormat format)
+{
+    return format == LF_PIXEL_MONO16 ? 2 : 1;
+}
+
+
+
+LfFrameCodec::LfFrameCodec()
+    : workers(NULL), slices(8), decoding(false), jobCount(0), jobSlices(1), jobRowBytes(0), jobSampleBytes(1),
+      jobOut(NULL), jobSlot(0), jobIn(NULL), jobFailed(0)
+{
+}
+
+void LfFrameCodec::setSlices(unsigned int n)
+{
+    slices = n < 1 ? 1 : (n > k_lfcMaxSlices ? k_lfcMaxSlices : n);
+}
+
+// Packed 12-bit rows are coded as bytes: lossless, if not as tight
+static bool codable(LfPixelFormat format)
+{
+    return format == LF_PIXEL_MONO8 || format == LF_PIXEL_MONO12 || format == LF_PIXEL_MONO16;
+}
+
+static size_t headerBytes(unsigned int frames, unsigned int slices)
+{
+    return sizeof(LfcHeader) + frames * sizeof(LfcFrameInfo) + frames * slices * sizeof(uint32_t);
+}
+
+size_t LfFrameCodec::maxEncodedSize(unsigned int width, unsigned int height, LfPixelFormat format,
+                                    unsigned int frames) const
+{
+    unsigned int s = slices < height ? slices : height;
+    size_t slot = LfPlaneCodec::maxEncodedSize(lfRowBytes(format, width), (height + s - 1) / s,
+                                               lfCodecSampleBytes(format));
+    return headerBytes(frames, s) + frames * s * slot;
+}
+
+size_t LfFrameCodec::encode(const LfFrame *frame, const LfFrame *pair, unsigned char *out, size_t capacity)
+{
+    if (!codable(frame->format) || frame->height == 0)
+    {
+        return 0;
+    }
+    if (pair != NULL && (pair->format != frame->format || pair->width != frame->width ||
+                         pair->height != frame->height))
+    {
+        pair = NULL;
+    }
+    unsigned int count = pair != NULL ? 2 : 1;
+    if (capacity < maxEncodedSize(frame->width, frame->height, frame->format, count))
+    {
+        return 0;
+    }
+
+    // Each slice is coded into room for its worst case, then packed down
+    decoding = false;
+    jobFrames[0] = frame;
+    jobFrames[1] = pair;
+    jobCount = count;
+    jobSlices = slices < frame->height ? slices : frame->height;
+    jobRowBytes = lfRowBytes(frame->format, frame->width);
+    jobSampleBytes = lfCodecSampleBytes(frame->format);
+    size_t head = headerBytes(count, jobSlices);
+    jobSlot = LfPlaneCodec::maxEncodedSize(jobRowBytes, (frame->height + jobSlices - 1) / jobSlices, jobSampleBytes);
+    jobOut = out + head;
+    if (workers != NULL)
+    {
+        workers->run(this);
+    }
+    else
+    {
+        runBand(0, 1);
+    }
+
+    size_t bytes = head;
+    for (unsigned int k = 0; k < count * jobSlices; k++)
+    {
+        memmove(out + bytes, jobOut + k * jobSlot, jobBytes[k]);
+        bytes += jobBytes[k];
+    }
+
+    LfcHeader header;
+    memcpy(header.magic, k_lfcMagic, sizeof(header.magic));
+    header.version = 1;
+    header.width = frame->width;
+    header.height = frame->height;
+    header.pixelFormat = frame->format;
+    header.nativeFormat = frame->nativeFormat;
+    header.frames = count;
+    header.slices = jobSlices;
+    memcpy(out, &header, sizeof(header));
+    unsigned char *p = out + sizeof(header);
+    for (unsigned int f = 0; f < count; f++, p += sizeof(LfcFrameInfo))
+    {
+        LfcFrameInfo info;
+        info.timestamp = jobFrames[f]->timestamp;
+        info.seq = jobFrames[f]->seq;
+        info.camera = jobFrames[f]->camera;
+        info.offsetX = jobFrames[f]->offsetX;
+        info.offsetY = jobFrames[f]->offsetY;
+        memcpy(p, &info, sizeof(info));
+    }
+    memcpy(p, jobBytes, count * jobSlices * sizeof(uint32_t));
+    return bytes;
+}
+
+int LfFrameCodec::readHeader(const unsigned char *in, size_t bytes, LfcHeader *header, LfcFrameInfo *info)
+{
+    if (bytes < sizeof(LfcHeader))
+    {
+        return -1;
+    }
+    memcpy(header, in, sizeof(LfcHeader));
+    if (memcmp(header->magic, k_lfcMagic, sizeof(header->magic)) != 0 || header->version != 1 ||
+        header->frames < 1 || header->frames > 2 || header->slices < 1 || header->slices > k_lfcMaxSlices ||
+        header->slices > header->height || header->width == 0 || header->width > 65536 ||
+        header->height > 65536 || !codable((LfPixelFormat)header->pixelFormat) ||
+        bytes < headerBytes(header->frames, header->slices))
+    {
+        return -1;
+    }
+    memcpy(info, in + sizeof(LfcHeader), header->frames * sizeof(LfcFrameInfo));
+    return 0;
+}
+
+int LfFrameCodec::decode(const unsigned char *in, size_t bytes, LfFrame *frame, LfFrame *pair)
+{
+    LfcHeader header;
+    LfcFrameInfo info[2];
+    if (readHeader(in, bytes, &header, info) != 0)
+    {
+        return -1;
+    }
+    LfPixelFormat format = (LfPixelFormat)header.pixelFormat;
+    unsigned int count = pair != NULL ? header.frames : 1;
+    size_t rowBytes = lfRowBytes(format, header.width);
+    LfFrame *dst[2] = { frame, pair };
+    for (unsigned int f = 0; f < count; f++)
+    {
+        if (dst[f]->capacity < rowBytes * header.height)
+        {
+            return -1;
+        }
+    }
+
+    // Every slice's stream must lie within the image
+    unsigned int streams = header.frames * header.slices;
+    memcpy(jobBytes, in + sizeof(LfcHeader) + header.frames * sizeof(LfcFrameInfo), streams * sizeof(uint32_t));
+    jobOffsets[0] = headerBytes(header.frames, header.slices);
+    for (unsigned int k = 0; k < streams; k++)
+    {
+        jobOffsets[k + 1] = jobOffsets[k] + jobBytes[k];
+    }
+    if (jobOffsets[streams] > bytes)
+    {
+        return -1;
+    }
+
+    decoding = true;
+    jobIn = in;
+    jobDst[0] = frame;
+    jobDst[1] = pair;
+    jobCount = count;
+    jobSlices = header.slices;
+    jobRowBytes = rowBytes;
+    jobSampleBytes = lfCodecSampleBytes(format);
+    jobFailed.store(0, memory_order_relaxed);
+    for (unsigned int f = 0; f < count; f++)
+    {
+        LfFrame *d = dst[f];
+        d->width = header.width;
+        d->height = header.height;
+        d->stride = rowBytes;
+        d->dataSize = rowBytes * header.height;
+        d->format = format;
+        d->nativeFormat = header.nativeFormat;
+        d->timestamp = info[f].timestamp;
+        d->seq = info[f].seq;
+        d->camera = info[f].camera;
+        d->offsetX = info[f].offsetX;
+        d->offsetY = info[f].offsetY;
+    }
+    if (workers != NULL)
+    {
+        workers->run(this);
+    }
+    else
+    {
+        runBand(0, 1);
+    }
+    return jobFailed.load(memory_order_relaxed) ? -1 : 0;
+}
+
+// Slice j of the second frame only needs slice j of the first, so each
+// band takes whole slices of both
+void LfFrameCodec::runBand(unsigned int band, unsigned int bands)
+{
+    unsigned int first = LfWorkers::bandStart(jobSlices, band, bands);
+    unsigned int last = LfWorkers::bandStart(jobSlices, band + 1, bands);
+    unsigned int height = decoding ? jobDst[0]->height : jobFrames[0]->height;
+    for (unsigned int j = first; j < last; j++)
+    {
+        unsigned int top = LfWorkers::bandStart(height, j, jobSlices);
+        unsigned int rows = LfWorkers::bandStart(height, j + 1, jobSlices) - top;
+        for (unsigned int f = 0; f < jobCount; f++)
+        {
+            unsigned int k = f * jobSlices + j;
+            if (decoding)
+            {
+                const unsigned char *ref = f > 0 ? jobDst[0]->data + top * jobRowBytes : NULL;
+                if (planes.decode(jobIn + jobOffsets[k], jobBytes[k], ref, jobRowBytes, jobRowBytes, rows,
+                                  jobDst[f]->data + top * jobRowBytes, jobRowBytes, jobSampleBytes) != 0)
+                {
+                    jobFailed.store(1, memory_order_relaxed);
+                }
+            }
+            else
+            {
+                const LfFrame *cur = jobFrames[f];
+                const LfFrame *ref = jobFrames[0];
+                jobBytes[k] = planes.encode(cur->data + (size_t)top * cur->stride, cur->stride,
+                                            f > 0 ? ref->data + (size_t)top * ref->stride : NULL, ref->stride,
+                                            jobRowBytes, rows, jobOut + k * jobSlot, jobSampleBytes);
+            }
+        }
+    }
+}
@@ -0,0 +1,164 @@
+// Lossless frame codec for laser fence application.
+
+#ifndef LFCODEC_H
+#define LFCODEC_H
+
+#include "stdafx.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "lfalg.h"
+#include "lfbuf.h"
+#include "lfpar.h"
+
+// Pixels coded together.  A row is coded as the byte residuals against a
+// reference row, zigzagged so small differences either way are small
+// numbers, in blocks of k_lfCodecBlock.  Each block starts with a header
+// byte: 0x80 | (n - 1) stands for n blocks of zero residual (n up to
+// 128, and runs carry on across rows); 1..8 is the bit width b of the
+// block, followed by b 16-bit masks, one per bit plane from the lowest.
+// A still scene costs one byte per 2 KB of zero blocks, and noise costs
+// only the bits it needs.  The last block of a row is padded with zero
+// residuals.
+static const unsigned int k_lfCodecBlock = 16;
+
+// Codes n bytes of cur against ref (NULL for zeros), appending to out.
+// *run carries zero blocks not yet written; lfFlushZeroRun() ends them.
+// Returns the bytes appended.
+typedef size_t (*LfEncodeRowKernel)(const unsigned char *cur, const unsigned char *ref, unsigned int n,
+                                    unsigned char *out, unsigned int *run);
+// Rebuilds n bytes into out from ref (NULL for zeros) and the coded
+// stream; *run holds zero blocks still owed from the last header.
+// Returns the first byte not consumed, or NULL if the stream ends early
+// or is corrupt.
+typedef const unsigned char *(*LfDecodeRowKernel)(const unsigned char *in, const unsigned char *end,
+                                                  const unsigned char *ref, unsigned int n,
+                                                  unsigned char *out, unsigned int *run);
+
+size_t lfEncodeRowScalar(const unsigned char *cur, const unsigned char *ref, unsigned int n,
+                         unsigned char *out, unsigned int *run);
+size_t lfEncodeRowSse41(const unsigned char *cur, const unsigned char *ref, unsigned int n,
+                        unsigned char *out, unsigned int *run);
+const unsigned char *lfDecodeRowScalar(const unsigned char *in, const unsigned char *end,
+                                       const unsigned char *ref, unsigned int n,
+                                       unsigned char *out, unsigned int *run);
+const unsigned char *lfDecodeRowSse41(const unsigned char *in, const unsigned char *end,
+                                      const unsigned char *ref, unsigned int n,
+                                      unsigned char *out, unsigned int *run);
+
+LfEncodeRowKernel lfGetEncodeRowKernel(LfCpuLevel level);
+LfDecodeRowKernel lfGetDecodeRowKernel(LfCpuLevel level);
+size_t lfFlushZeroRun(unsigned char *out, unsigned int *run);
+
+// Codes whole planes of rowBytes x height bytes.  With a reference plane,
+// such as the previous frame of the same kind, each row is coded against
+// the same row of it; without one (a key frame) against the row above.
+// With 2-byte samples the residual is taken per sample and split into a
+// low byte, signed, and the high byte that remains, coded one after the
+// other, so a small 16-bit difference costs no more than an 8-bit one.
+class LfPlaneCodec {
+protected:
+    LfCpuLevel cpuLevel;
+    LfEncodeRowKernel encodeRow;
+    LfDecodeRowKernel decodeRow;
+    size_t encodeRow16(const unsigned char *cur, const unsigned char *ref, unsigned int samples,
+                       unsigned char *out, unsigned int *run);
+    const unsigned char *decodeRow16(const unsigned char *in, const unsigned char *end, const unsigned char *ref,
+                                     unsigned int samples, unsigned char *out, unsigned int *run);
+public:
+    LfPlaneCodec();
+    void setCpuLevel(LfCpuLevel level);
+    LfCpuLevel getCpuLevel() const { return cpuLevel; }
+    // Largest stream a plane can code to
+    static size_t maxEncodedSize(size_t rowBytes, unsigned int height, unsigned int sampleBytes = 1);
+    // Returns the bytes written to out, which must hold maxEncodedSize()
+    size_t encode(const unsigned char *cur, size_t curStride, const unsigned char *ref, size_t refStride,
+                  size_t rowBytes, unsigned int height, unsigned char *out, unsigned int sampleBytes = 1);
+    // Returns 0, or -1 if the stream is corrupt or not exactly one plane
+    int decode(const unsigned char *in, size_t inBytes, const unsigned char *ref, size_t refStride,
+               size_t rowBytes, unsigned int height, unsigned char *out, size_t outStride,
+               unsigned int sampleBytes = 1);
+};
+
+// Sample bytes LfPlaneCodec should code a format's rows with
+unsigned int lfCodecSampleBytes(LfPixelFormat format);
+
+// Layout of a .lfc file, one frame or a trigger's pair:
+//   LfcHeader
+//   LfcFrameInfo for every frame
+//   uint32_t coded bytes of every slice, frame by frame
+//   the slices' streams in the same order
+// A frame is cut into bands of rows, each coded on its own, so slices can
+// be coded and decoded on different threads.  The first frame is coded
+// within itself, the row above predicting each row; the second, the other
+// frame of the pair, against the first, so only the laser line and what
+// moved between the two exposures costs anything.  Samples are stored in
+// the byte order they were captured in (little-endian).
+static const char k_lfcMagic[4] = { 'L', 'F', 'C', '1' };
+static const unsigned int k_lfcMaxSlices = 64;
+
+struct LfcHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelFormat;       // LfPixelFormat
+    uint32_t nativeFormat;
+    uint32_t frames;            // 1, or 2 for a pair
+    uint32_t slices;            // Per frame
+};
+
+struct LfcFrameInfo {
+    uint64_t timestamp;
+    uint32_t seq;
+    uint32_t camera;
+    uint32_t offsetX;
+    uint32_t offsetY;
+};
+
+// Codes frames and pairs to and from .lfc images in memory
+class LfFrameCodec: public LfBandJob {
+protected:
+    LfPlaneCodec planes;
+    LfWorkers *workers;
+    unsigned int slices;
+    // The job runBand() works on
+    bool decoding;
+    const LfFrame *jobFrames[2];
+    LfFrame *jobDst[2];
+    unsigned int jobCount;
+    unsigned int jobSlices;
+    size_t jobRowBytes;
+    unsigned int jobSampleBytes;
+    unsigned char *jobOut;
+    size_t jobSlot;
+    const unsigned char *jobIn;
+    size_t jobOffsets[2 * k_lfcMaxSlices + 1];
+    uint32_t jobBytes[2 * k_lfcMaxSlices];
+    std::atomic<int> jobFailed;
+public:
+    LfFrameCodec();
+    void setCpuLevel(LfCpuLevel level) { planes.setCpuLevel(level); }
+    LfCpuLevel getCpuLevel() const { return planes.getCpuLevel(); }
+    // Slices per frame, 1 to k_lfcMaxSlices; frames shorter than that get
+    // one per row
+    void setSlices(unsigned int n);
+    unsigned int getSlices() const { return slices; }
+    // Code slices in parallel
+    void setWorkers(LfWorkers *w) { workers = w; }
+    // Room encode() needs for frames of this geometry
+    size_t maxEncodedSize(unsigned int width, unsigned int height, LfPixelFormat format, unsigned int frames) const;
+    // Codes frame, and pair too if it has the same geometry.  Returns the
+    // bytes written to out, or 0 for an unsupported format or too little
+    // room.
+    size_t encode(const LfFrame *frame, const LfFrame *pair, unsigned char *out, size_t capacity);
+    // Checks an image's header and reads it and the frames' info
+    static int readHeader(const unsigned char *in, size_t bytes, LfcHeader *header, LfcFrameInfo *info);
+    // Decodes the first frame into frame, and the second, if there is one,
+    // into pair (which may be NULL to skip it).  Decoded rows are packed.
+    // Returns -1 if the image is corrupt or a frame's buffer too small.
+    int decode(const unsigned char *in, size_t bytes, LfFrame *frame, LfFrame *pair);
+    virtual void runBand(unsigned int band, unsigned int bands);
+};
+
+#endif
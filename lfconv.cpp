@@ -0,0 +1,359 @@
+// Pixel format conversion for laser fence application.
+
+#include "lfconv.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LF_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Smallest band worth waking a helper for
+static const unsigned int k_minBandRows = 64;
+
+static inline unsigned char saturate(unsigned int v)
+{
+    return v > 255 ? 255 : v;
+}
+
+void lfUnpack12Scalar(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2, in += 3)
+    {
+        out[i] = saturate(((unsigned int)in[0] << 4 | (in[1] & 0x0f)) >> shift);
+        out[i + 1] = saturate(((unsigned int)in[2] << 4 | in[1] >> 4) >> shift);
+    }
+    if (i < n)
+    {
+        out[i] = saturate(((unsigned int)in[0] << 4 | (in[1] & 0x0f)) >> shift);
+    }
+}
+
+void lfUnpack16Scalar(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    const unsigned short *samples = (const unsigned short *)in;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        out[i] = saturate(samples[i] >> (4 + shift));
+    }
+}
+
+#ifdef LF_X86
+
+// Spreads four packed pairs (12 bytes) over eight 16-bit lanes.  Even
+// lanes get byte 0 high and byte 1 low, odd lanes byte 2 high and byte 1
+// low; a 4-bit shift then lines odd pixels up, and even pixels take their
+// low nibble from the unshifted lane.
+#define LF_UNPACK12_SHUFFLE 1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11
+
+__attribute__((target("sse4.1")))
+static inline __m128i unpack12Lanes(__m128i bytes, __m128i shuffle, __m128i evenHigh, __m128i evenLow)
+{
+    __m128i w = _mm_shuffle_epi8(bytes, shuffle);
+    return _mm_or_si128(_mm_and_si128(_mm_srli_epi16(w, 4), evenHigh), _mm_and_si128(w, evenLow));
+}
+
+__attribute__((target("sse4.1")))
+void lfUnpack12Sse41(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    const __m128i shuffle = _mm_setr_epi8(LF_UNPACK12_SHUFFLE);
+    const __m128i evenHigh = _mm_setr_epi16(0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1);
+    const __m128i evenLow = _mm_setr_epi16(0x000f, 0, 0x000f, 0, 0x000f, 0, 0x000f, 0);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    unsigned int i = 0;
+
+    // Each 16-byte load uses 12 bytes; stop while the overread stays in the row
+    for (; i + 20 <= n; i += 16, in += 24)
+    {
+        __m128i a = unpack12Lanes(_mm_loadu_si128((const __m128i *)in), shuffle, evenHigh, evenLow);
+        __m128i b = unpack12Lanes(_mm_loadu_si128((const __m128i *)(in + 12)), shuffle, evenHigh, evenLow);
+        // Samples are at most 12 bits, so the signed pack saturates at 255
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(_mm_srl_epi16(a, count), _mm_srl_epi16(b, count)));
+    }
+
+    lfUnpack12Scalar(in, out + i, n - i, shift);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i unpack12Lanes(const unsigned char *in, __m256i shuffle, __m256i evenHigh, __m256i evenLow)
+{
+    // Lane 0 takes pairs 0-3, lane 1 pairs 4-7
+    __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+                                            _mm_loadu_si128((const __m128i *)(in + 12)), 1);
+    __m256i w = _mm256_shuffle_epi8(bytes, shuffle);
+    return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(w, 4), evenHigh), _mm256_and_si256(w, evenLow));
+}
+
+__attribute__((target("avx2")))
+void lfUnpack12Avx2(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    const __m256i shuffle = _mm256_setr_epi8(LF_UNPACK12_SHUFFLE, LF_UNPACK12_SHUFFLE);
+    const __m256i evenHigh = _mm256_setr_epi16(0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1,
+                                               0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1, 0x0ff0, -1);
+    const __m256i evenLow = _mm256_setr_epi16(0x000f, 0, 0x000f, 0, 0x000f, 0, 0x000f, 0,
+                                              0x000f, 0, 0x000f, 0, 0x000f, 0, 0x000f, 0);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    unsigned int i = 0;
+
+    for (; i + 36 <= n; i += 32, in += 48)
+    {
+        __m256i a = _mm256_srl_epi16(unpack12Lanes(in, shuffle, evenHigh, evenLow), count);
+        __m256i b = _mm256_srl_epi16(unpack12Lanes(in + 24, shuffle, evenHigh, evenLow), count);
+        // The pack interleaves lanes; put the four quarters back in order
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), p);
+    }
+
+    lfUnpack12Sse41(in, out + i, n - i, shift);
+}
+
+__attribute__((target("sse4.1")))
+void lfUnpack16Sse41(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    const __m128i count = _mm_cvtsi32_si128(4 + shift);
+    unsigned int i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(_mm_srl_epi16(a, count), _mm_srl_epi16(b, count)));
+    }
+
+    lfUnpack16Scalar(in + 2 * i, out + i, n - i, shift);
+}
+
+__attribute__((target("avx2")))
+void lfUnpack16Avx2(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    const __m128i count = _mm_cvtsi32_si128(4 + shift);
+    unsigned int i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(in + 2 * i)), count);
+        __m256i b = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(in + 2 * i + 32)), count);
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), p);
+    }
+
+    lfUnpack16Sse41(in + 2 * i, out + i, n - i, shift);
+}
+
+#else
+
+void lfUnpack12Sse41(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    lfUnpack12Scalar(in, out, n, shift);
+}
+
+void lfUnpack12Avx2(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    lfUnpack12Scalar(in, out, n, shift);
+}
+
+void lfUnpack16Sse41(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    lfUnpack16Scalar(in, out, n, shift);
+}
+
+void lfUnpack16Avx2(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift)
+{
+    lfUnpack16Scalar(in, out, n, shift);
+}
+
+#endif
+
+LfUnpackKernel lfGetUnpack12Kernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfUnpack12Avx2;
+    case LF_CPU_SSE41:
+        return lfUnpack12Sse41;
+    default:
+        return lfUnpack12Scalar;
+    }
+}
+
+LfUnpackKernel lfGetUnpack16Kernel(LfCpuLevel level)
+{
+    switch (level)
+    {
+    case LF_CPU_AVX512:
+    case LF_CPU_AVX2:
+        return lfUnpack16Avx2;
+    case LF_CPU_SSE41:
+        return lfUnpack16Sse41;
+    default:
+        return lfUnpack16Scalar;
+    }
+}
+
+void lfUnpack12Lut(const unsigned char *in, unsigned char *out, unsigned int n, const unsigned char *lut)
+{
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2, in += 3)
+    {
+        out[i] = lut[(unsigned int)in[0] << 4 | (in[1] & 0x0f)];
+        out[i + 1] = lut[(unsigned int)in[2] << 4 | in[1] >> 4];
+    }
+    if (i < n)
+    {
+        out[i] = lut[(unsigned int)in[0] << 4 | (in[1] & 0x0f)];
+    }
+}
+
+void lfUnpack16Lut(const unsigned char *in, unsigned char *out, unsigned int n, const unsigned char *lut)
+{
+    const unsigned short *samples = (const unsigned short *)in;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        out[i] = lut[samples[i] >> 4];
+    }
+}
+
+void lfBuildWindowLut(unsigned char *lut, unsigned int low, unsigned int high)
+{
+    if (high <= low)
+    {
+        high = low + 1;
+    }
+    for (unsigned int v = 0; v < k_lfLutSize; v++)
+    {
+        if (v <= low)
+        {
+            lut[v] = 0;
+        }
+        else if (v >= high)
+        {
+            lut[v] = 255;
+        }
+        else
+        {
+            lut[v] = (unsigned char)((v - low) * 255 / (high - low));
+        }
+    }
+}
+
+
+
+LfConverter::LfConverter()
+    : mode(LF_CONV_SHIFT), shift(4), workers(NULL), curSrc(NULL), curDst(NULL)
+{
+    lfBuildWindowLut(lut, 0, k_lfLutSize - 1);
+    setCpuLevel(lfDetectCpuLevel());
+}
+
+void LfConverter::setCpuLevel(LfCpuLevel level)
+{
+    if (level > lfDetectCpuLevel())
+    {
+        level = lfDetectCpuLevel();
+    }
+    cpuLevel = level;
+    unpack12 = lfGetUnpack12Kernel(level);
+    unpack16 = lfGetUnpack16Kernel(level);
+}
+
+void LfConverter::setShift(unsigned int bits)
+{
+    shift = bits > 4 ? 4 : bits;
+    mode = LF_CONV_SHIFT;
+}
+
+void LfConverter::setLut(const unsigned char *table)
+{
+    memcpy(lut, table, k_lfLutSize);
+    mode = LF_CONV_LUT;
+}
+
+int LfConverter::convert(const LfFrame *src, LfFrame *dst)
+{
+    if (src->format == LF_PIXEL_MONO8)
+    {
+        // Already what detection wants: hand out the source's pixels
+        dst->data = src->data;
+        dst->capacity = src->capacity;
+        dst->dataSize = src->dataSize;
+        dst->stride = src->stride;
+    }
+    else if (src->format == LF_PIXEL_MONO12 || src->format == LF_PIXEL_MONO16)
+    {
+        // dst may still be a view of the last MONO8 source, which must not
+        // be written to and may be gone
+        LfFramePool::restoreBuffer(dst);
+        size_t bytes = (size_t)src->width * src->height;
+        if (bytes > dst->capacity)
+        {
+            return -1;
+        }
+
+        curSrc = src;
+        curDst = dst;
+        if (workers != NULL && src->height >= workers->getBands() * k_minBandRows)
+        {
+            workers->run(this);
+        }
+        else
+        {
+            runBand(0, 1);
+        }
+        curSrc = NULL;
+        curDst = NULL;
+
+        dst->dataSize = bytes;
+        dst->stride = src->width;
+    }
+    else
+    {
+        return -1;
+    }
+
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->offsetX = src->offsetX;
+    dst->offsetY = src->offsetY;
+    dst->format = LF_PIXEL_MONO8;
+    dst->nativeFormat = 0;
+    dst->timestamp = src->timestamp;
+    dst->seq = src->seq;
+    dst->camera = src->camera;
+    return 0;
+}
+
+void LfConverter::runBand(unsigned int band, unsigned int bands)
+{
+    const LfFrame *src = curSrc;
+    unsigned char *out = curDst->data;
+    unsigned int width = src->width;
+    unsigned int first = LfWorkers::bandStart(src->height, band, bands);
+    unsigned int last = LfWorkers::bandStart(src->height, band + 1, bands);
+    bool packed = src->format == LF_PIXEL_MONO12;
+
+    for (unsigned int y = first; y < last; y++)
+    {
+        const unsigned char *row = src->data + (size_t)y * src->stride;
+        unsigned char *outRow = out + (size_t)y * width;
+        if (mode == LF_CONV_LUT)
+        {
+            if (packed)
+            {
+                lfUnpack12Lut(row, outRow, width, lut);
+            }
+            else
+            {
+                lfUnpack16Lut(row, outRow, width, lut);
+            }
+        }
+        else
+        {
+            (packed ? unpack12 : unpack16)(row, outRow, width, shift);
+        }
+    }
+}
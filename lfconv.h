@@ -0,0 +1,84 @@
+// Pixel format conversion for laser fence application.
+
+#ifndef LFCONV_H
+#define LFCONV_H
+
+#include "stdafx.h"
+#include "lfalg.h"
+#include "lfbuf.h"
+#include "lfpar.h"
+
+// Entries in a conversion table, one per 12-bit sample value
+static const unsigned int k_lfLutSize = 4096;
+
+enum LfConvMode {
+    LF_CONV_SHIFT = 0,  // MONO8 = min(255, sample >> shift)
+    LF_CONV_LUT         // MONO8 = lut[sample]
+};
+
+// Row kernels turning n 12-bit samples into MONO8 by shifting each sample
+// right and saturating.  MONO12 rows are packed two pixels in three bytes:
+// byte 0 holds pixel 0 bits 11-4, byte 1 pixel 1 bits 3-0 in its high
+// nibble and pixel 0 bits 3-0 in its low nibble, byte 2 pixel 1 bits 11-4.
+// MONO16 samples are little endian with the 12 bits at the top, and
+// 2-byte aligned.
+typedef void (*LfUnpackKernel)(const unsigned char *in, unsigned char *out,
+                               unsigned int n, unsigned int shift);
+
+void lfUnpack12Scalar(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift);
+void lfUnpack12Sse41(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift);
+void lfUnpack12Avx2(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift);
+void lfUnpack16Scalar(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift);
+void lfUnpack16Sse41(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift);
+void lfUnpack16Avx2(const unsigned char *in, unsigned char *out, unsigned int n, unsigned int shift);
+
+LfUnpackKernel lfGetUnpack12Kernel(LfCpuLevel level);
+LfUnpackKernel lfGetUnpack16Kernel(LfCpuLevel level);
+
+// Table lookups are scalar; a gather costs more than it saves
+void lfUnpack12Lut(const unsigned char *in, unsigned char *out, unsigned int n, const unsigned char *lut);
+void lfUnpack16Lut(const unsigned char *in, unsigned char *out, unsigned int n, const unsigned char *lut);
+
+// Linear table stretching samples low..high over 0..255, to spend the
+// 8 output bits on the range the laser actually occupies
+void lfBuildWindowLut(unsigned char *lut, unsigned int low, unsigned int high);
+
+// Converts camera frames to the MONO8 the detection stages work on.
+// MONO8 input is passed through with no copy: the destination becomes a
+// view of the source's buffer and is only valid while the source is.
+// Other formats are unpacked into the destination's own buffer, split
+// into row bands over the workers when set.  One converter serves one
+// thread at a time.
+class LfConverter: public LfBandJob {
+protected:
+    LfCpuLevel cpuLevel;
+    LfConvMode mode;
+    unsigned int shift;
+    unsigned char lut[k_lfLutSize];
+    LfWorkers *workers;
+    LfUnpackKernel unpack12;
+    LfUnpackKernel unpack16;
+    const LfFrame *curSrc;
+    LfFrame *curDst;
+public:
+    LfConverter();
+    void setCpuLevel(LfCpuLevel level);
+    LfCpuLevel getCpuLevel() const { return cpuLevel; }
+    // Keep sample bits 11..bits; 4 keeps the top byte, less brightens
+    // faint lines at the cost of saturating bright ones
+    void setShift(unsigned int bits);
+    unsigned int getShift() const { return shift; }
+    // Copies a k_lfLutSize-entry table and switches to LF_CONV_LUT
+    void setLut(const unsigned char *table);
+    void setMode(LfConvMode m) { mode = m; }
+    LfConvMode getMode() const { return mode; }
+    void setWorkers(LfWorkers *w) { workers = w; }
+    // Returns -1 for formats it cannot convert or a destination too small.
+    // A MONO8 source isn't copied: dst becomes a view of its pixels until
+    // dst is released, or converted into again, which puts a pooled dst
+    // back on its own buffer first.
+    int convert(const LfFrame *src, LfFrame *dst);
+    virtual void runBand(unsigned int band, unsigned int bands);
+};
+
+#endif
@@ -0,0 +1,140 @@
+// Lossless image decoder for laser fence application.
+//
+// Decodes .lfc images saved by lfapp -z (or LfCam::saveImage()) and
+// writes every frame in them as a PGM, printing each image's geometry and
+// how far it was compressed.  Needs no camera library.
+//
+// Usage: lfdec [-d outdir] [-t] file.lfc...
+
+#include "stdafx.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include "lfbuf.h"
+#include "lfcodec.h"
+#include "lfwriter.h"
+
+using namespace std;
+
+static int readFile(const char *path, vector<unsigned char> &data)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    data.clear();
+    unsigned char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char *directory = ".";
+    bool testOnly = false;
+    vector<const char *> paths;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-d" && i + 1 < argc)
+        {
+            directory = argv[++i];
+        }
+        else if (arg == "-t")
+        {
+            testOnly = true;
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty())
+    {
+        cout << "Usage: lfdec [-d outdir] [-t] file.lfc..." << endl;
+        cout << "  -t decodes without writing anything" << endl;
+        return -1;
+    }
+
+    LfFrameCodec codec;
+    vector<unsigned char> data;
+    int failures = 0;
+    for (size_t p = 0; p < paths.size(); p++)
+    {
+        LfcHeader header;
+        LfcFrameInfo info[2];
+        if (readFile(paths[p], data) != 0 || data.empty() ||
+            LfFrameCodec::readHeader(&data[0], data.size(), &header, info) != 0)
+        {
+            cout << paths[p] << ": not an .lfc image" << endl;
+            failures++;
+            continue;
+        }
+
+        // Decoded rows are packed, so a frame is exactly its rows
+        size_t frameBytes = lfRowBytes((LfPixelFormat)header.pixelFormat, header.width) * header.height;
+        LfFrame frames[2];
+        for (unsigned int f = 0; f < 2; f++)
+        {
+            memset(&frames[f], 0, sizeof(frames[f]));
+            frames[f].data = (unsigned char *)lfAlignedAlloc(frameBytes);
+            frames[f].capacity = frameBytes;
+            frames[f].index = -1;
+        }
+        unsigned long long begin = lfTimestampUs();
+        int result = codec.decode(&data[0], data.size(), &frames[0], header.frames > 1 ? &frames[1] : NULL);
+        unsigned long long elapsed = lfTimestampUs() - begin;
+        if (result != 0)
+        {
+            cout << paths[p] << ": corrupt" << endl;
+            failures++;
+        }
+        else
+        {
+            cout << paths[p] << ": " << header.width << "x" << header.height << ", format " << header.pixelFormat
+                 << ", " << header.frames << " frame(s) from camera " << info[0].camera << " at seq "
+                 << info[0].seq << ", " << header.slices << " slices, "
+                 << (double)frameBytes * header.frames / data.size() << ":1, decoded in " << elapsed << " us"
+                 << endl;
+        }
+
+        // The writer names each frame after the image and its place in it
+        if (result == 0 && !testOnly)
+        {
+            string name = paths[p];
+            size_t slash = name.find_last_of('/');
+            if (slash != string::npos)
+            {
+                name = name.substr(slash + 1);
+            }
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".lfc") == 0)
+            {
+                name.resize(name.size() - 4);
+            }
+            LfFrameWriter writer(directory, name.c_str(), LF_WRITE_PGM, 1, 2);
+            writer.start(frameBytes);
+            for (unsigned int f = 0; f < header.frames; f++)
+            {
+                writer.submit(&frames[f]);
+            }
+            writer.stop();
+            if (writer.getFramesWritten() != header.frames)
+            {
+                cout << paths[p] << ": failed to write frames" << endl;
+                failures++;
+            }
+        }
+        lfAlignedFree(frames[0].data);
+        lfAlignedFree(frames[1].data);
+    }
+    return failures > 0 ? -1 : 0;
+}
@@ -0,0 +1,488 @@
+// Asynchronous logger for laser fence application.
+
+#include "lflog.h"
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Records each thread can have queued before it drops, and threads with a
+// ring of their own; a ring is handed on when its thread exits
+static const unsigned int k_ringSlots = 1024;
+static const unsigned int k_maxRings = 64;
+// Longest text lfLogText() keeps
+static const unsigned int k_maxText = 1023;
+// Writer sleep when every ring is empty
+static const unsigned int k_idleUs = 1000;
+
+// 64 bytes.  Text follows its header in whole slots.
+struct LfLogRecord {
+    unsigned long long timestamp;   // ns since the epoch
+    const char *format;             // NULL for text
+    unsigned char level;
+    unsigned char count;            // Arguments, or slots of text
+    unsigned short length;          // Text bytes
+    unsigned int reserved;
+    LfLogArg args[k_lfLogMaxArgs];
+};
+
+// Single producer, the owning thread; single consumer, the writer
+struct LfLogRing {
+    LfLogRecord slots[k_ringSlots];
+    atomic<unsigned int> head;      // Next slot the writer reads
+    char pad0[64 - sizeof(atomic<unsigned int>)];
+    atomic<unsigned int> tail;      // Next slot the owner fills
+    atomic<unsigned long> dropped;
+    atomic<bool> owned;
+};
+
+// Gives the ring back when its thread exits
+struct LfLogRingHolder {
+    LfLogRing *ring;
+    LfLogRingHolder() : ring(NULL) {}
+    ~LfLogRingHolder()
+    {
+        if (ring != NULL)
+        {
+            ring->owned.store(false, memory_order_release);
+        }
+    }
+};
+
+atomic<int> lfLogThreshold(LF_LOG_INFO);
+
+static LfLogRing *rings[k_maxRings];
+static atomic<unsigned int> ringCount(0);
+static mutex ringLock;
+static atomic<unsigned long> unringed(0);   // Dropped for want of a ring
+static atomic<bool> running(false);
+static int logFd = 1;
+static thread writer;
+static mutex syncLock;                      // Orders direct writes
+static atomic<unsigned long> written(0);
+static thread_local LfLogRingHolder holder;
+
+static const char *k_levelNames[] = { "debug", "info", "warn", "error", "off" };
+
+const char *lfLogLevelName(LfLogLevel level)
+{
+    return level >= LF_LOG_DEBUG && level <= LF_LOG_OFF ? k_levelNames[level] : "unknown";
+}
+
+int lfParseLogLevel(const char *name, LfLogLevel *level)
+{
+    for (int i = LF_LOG_DEBUG; i <= LF_LOG_OFF; i++)
+    {
+        if (strcasecmp(name, k_levelNames[i]) == 0)
+        {
+            *level = (LfLogLevel)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void lfSetLogLevel(LfLogLevel level)
+{
+    lfLogThreshold.store(level, memory_order_relaxed);
+}
+
+LfLogLevel lfGetLogLevel()
+{
+    return (LfLogLevel)lfLogThreshold.load(memory_order_relaxed);
+}
+
+static unsigned long long realtimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Formats one argument for a conversion, widened to match how it was stored
+static void appendArg(string &out, const string &spec, char conversion, const LfLogArg &arg)
+{
+    char text[128];
+    string full = spec;
+    switch (conversion)
+    {
+    case 'd':
+    case 'i':
+        full += "ll";
+        full += conversion;
+        snprintf(text, sizeof(text), full.c_str(), arg.i);
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        full += "ll";
+        full += conversion;
+        snprintf(text, sizeof(text), full.c_str(), arg.u);
+        break;
+    case 'c':
+        full += conversion;
+        snprintf(text, sizeof(text), full.c_str(), (int)arg.i);
+        break;
+    case 's':
+        full += conversion;
+        snprintf(text, sizeof(text), full.c_str(), arg.s != NULL ? arg.s : "(null)");
+        break;
+    case 'p':
+        full += conversion;
+        snprintf(text, sizeof(text), full.c_str(), arg.p);
+        break;
+    default:
+        full += conversion;
+        snprintf(text, sizeof(text), full.c_str(), arg.d);
+        break;
+    }
+    out += text;
+}
+
+static void formatMessage(string &out, const char *format, const LfLogArg *args, unsigned int count)
+{
+    unsigned int next = 0;
+    for (const char *p = format; *p != '\0'; p++)
+    {
+        if (*p != '%')
+        {
+            out += *p;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            out += '%';
+            p++;
+            continue;
+        }
+
+        // Flags, width and precision are kept; length modifiers dropped
+        const char *start = p++;
+        string spec = "%";
+        while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL)
+        {
+            spec += *p++;
+        }
+        while (*p != '\0' && strchr("hlLqjzt", *p) != NULL)
+        {
+            p++;
+        }
+        if (*p == '\0' || strchr("diuoxXcspfFeEgGaA", *p) == NULL || next >= count)
+        {
+            // Not something we can format; show it as written
+            out.append(start, *p == '\0' ? p - start : p - start + 1);
+            if (*p == '\0')
+            {
+                break;
+            }
+            continue;
+        }
+        appendArg(out, spec, *p, args[next++]);
+    }
+}
+
+static void formatRecord(string &out, const LfLogRecord &record, const char *text)
+{
+    time_t seconds = record.timestamp / 1000000000ULL;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char stamp[48];
+    snprintf(stamp, sizeof(stamp), "%02d:%02d:%02d.%06u %-5s ", local.tm_hour, local.tm_min, local.tm_sec,
+             (unsigned int)(record.timestamp % 1000000000ULL / 1000),
+             lfLogLevelName((LfLogLevel)record.level));
+    out += stamp;
+    if (record.format != NULL)
+    {
+        formatMessage(out, record.format, record.args, record.count);
+    }
+    else
+    {
+        out.append(text, record.length);
+    }
+    out += '\n';
+}
+
+static void writeAll(const string &out)
+{
+    size_t done = 0;
+    while (done < out.size())
+    {
+        ssize_t n = write(logFd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+}
+
+// With no writer thread the caller formats and writes the record itself
+static void writeDirect(const LfLogRecord &record, const char *text)
+{
+    string out;
+    formatRecord(out, record, text);
+    lock_guard<mutex> guard(syncLock);
+    writeAll(out);
+    written.fetch_add(1, memory_order_relaxed);
+}
+
+static LfLogRing *ownRing()
+{
+    if (holder.ring != NULL)
+    {
+        return holder.ring;
+    }
+
+    lock_guard<mutex> guard(ringLock);
+    unsigned int n = ringCount.load(memory_order_relaxed);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        bool expected = false;
+        if (rings[i]->owned.compare_exchange_strong(expected, true, memory_order_acquire))
+        {
+            holder.ring = rings[i];
+            return holder.ring;
+        }
+    }
+    if (n == k_maxRings)
+    {
+        return NULL;
+    }
+    LfLogRing *ring = new LfLogRing;
+    ring->head.store(0, memory_order_relaxed);
+    ring->tail.store(0, memory_order_relaxed);
+    ring->dropped.store(0, memory_order_relaxed);
+    ring->owned.store(true, memory_order_relaxed);
+    rings[n] = ring;
+    // The writer only looks at rings below the count, so publish it last
+    ringCount.store(n + 1, memory_order_release);
+    holder.ring = ring;
+    return ring;
+}
+
+// Reserves slots in the caller's ring; NULL, counted as dropped, when full
+static LfLogRecord *reserve(unsigned int slots, LfLogRing **owner)
+{
+    LfLogRing *ring = ownRing();
+    if (ring == NULL)
+    {
+        unringed.fetch_add(1, memory_order_relaxed);
+        return NULL;
+    }
+    unsigned int tail = ring->tail.load(memory_order_relaxed);
+    if (tail - ring->head.load(memory_order_acquire) + slots > k_ringSlots)
+    {
+        // Only this thread writes the count, so no locked add is needed
+        ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        return NULL;
+    }
+    *owner = ring;
+    return &ring->slots[tail % k_ringSlots];
+}
+
+static void commit(LfLogRing *ring, unsigned int slots)
+{
+    ring->tail.store(ring->tail.load(memory_order_relaxed) + slots, memory_order_release);
+}
+
+void lfLogWrite(LfLogLevel level, const char *format, const LfLogArg *args, unsigned int count)
+{
+    LfLogRecord local;
+    LfLogRing *ring = NULL;
+    bool queued = running.load(memory_order_acquire);
+    LfLogRecord *record = queued ? reserve(1, &ring) : &local;
+    if (record == NULL)
+    {
+        return;
+    }
+
+    record->timestamp = realtimeNs();
+    record->format = format;
+    record->level = level;
+    record->count = count;
+    record->length = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        record->args[i] = args[i];
+    }
+
+    if (queued)
+    {
+        commit(ring, 1);
+    }
+    else
+    {
+        writeDirect(local, NULL);
+    }
+}
+
+void lfLogText(LfLogLevel level, const char *text)
+{
+    if ((int)level < lfLogThreshold.load(memory_order_relaxed))
+    {
+        return;
+    }
+    size_t length = strlen(text);
+    if (length > k_maxText)
+    {
+        length = k_maxText;
+    }
+
+    LfLogRecord header;
+    header.timestamp = realtimeNs();
+    header.format = NULL;
+    header.level = level;
+    header.count = (length + sizeof(LfLogRecord) - 1) / sizeof(LfLogRecord);
+    header.length = length;
+    if (!running.load(memory_order_acquire))
+    {
+        writeDirect(header, text);
+        return;
+    }
+
+    LfLogRing *ring = NULL;
+    if (reserve(1 + header.count, &ring) == NULL)
+    {
+        return;
+    }
+    // The text may wrap, so it is copied a slot at a time
+    unsigned int tail = ring->tail.load(memory_order_relaxed);
+    ring->slots[tail % k_ringSlots] = header;
+    for (unsigned int i = 0; i < header.count; i++)
+    {
+        size_t offset = (size_t)i * sizeof(LfLogRecord);
+        size_t bytes = length - offset < sizeof(LfLogRecord) ? length - offset : sizeof(LfLogRecord);
+        memcpy(&ring->slots[(tail + 1 + i) % k_ringSlots], text + offset, bytes);
+    }
+    commit(ring, 1 + header.count);
+}
+
+
+
+struct LfLogPending {
+    LfLogRecord record;
+    string text;
+};
+
+static bool byTime(const LfLogPending &a, const LfLogPending &b)
+{
+    return a.record.timestamp < b.record.timestamp;
+}
+
+// Takes everything queued in every ring and writes it in time order.
+// Returns the records written.
+static size_t drain(vector<LfLogPending> &pending, string &out)
+{
+    pending.clear();
+    unsigned int n = ringCount.load(memory_order_acquire);
+    for (unsigned int r = 0; r < n; r++)
+    {
+        LfLogRing *ring = rings[r];
+        unsigned int head = ring->head.load(memory_order_relaxed);
+        unsigned int tail = ring->tail.load(memory_order_acquire);
+        while (head != tail)
+        {
+            LfLogPending p;
+            p.record = ring->slots[head % k_ringSlots];
+            head++;
+            if (p.record.format == NULL)
+            {
+                char text[k_maxText + 1];
+                for (unsigned int i = 0; i < p.record.count; i++)
+                {
+                    memcpy(text + (size_t)i * sizeof(LfLogRecord), &ring->slots[head % k_ringSlots],
+                           min(sizeof(LfLogRecord), (size_t)(k_maxText + 1) - (size_t)i * sizeof(LfLogRecord)));
+                    head++;
+                }
+                p.text.assign(text, p.record.length);
+            }
+            pending.push_back(p);
+        }
+        ring->head.store(head, memory_order_release);
+    }
+    if (pending.empty())
+    {
+        return 0;
+    }
+
+    stable_sort(pending.begin(), pending.end(), byTime);
+    out.clear();
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        formatRecord(out, pending[i].record, pending[i].text.c_str());
+    }
+    writeAll(out);
+    written.fetch_add(pending.size(), memory_order_relaxed);
+    return pending.size();
+}
+
+static void writerLoop()
+{
+    vector<LfLogPending> pending;
+    string out;
+    while (running.load(memory_order_acquire))
+    {
+        if (drain(pending, out) == 0)
+        {
+            usleep(k_idleUs);
+        }
+    }
+    drain(pending, out);
+}
+
+int lfLogStart(int fd)
+{
+    if (running.load())
+    {
+        return -1;
+    }
+    logFd = fd;
+    running.store(true, memory_order_release);
+    writer = thread(writerLoop);
+    return 0;
+}
+
+void lfLogStop()
+{
+    if (!running.exchange(false))
+    {
+        return;
+    }
+    writer.join();
+}
+
+unsigned long lfLogWritten()
+{
+    return written.load(memory_order_relaxed);
+}
+
+unsigned long lfLogDropped()
+{
+    unsigned long total = unringed.load(memory_order_relaxed);
+    unsigned int n = ringCount.load(memory_order_acquire);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        total += rings[i]->dropped.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void lfLogPrintStats()
+{
+    cout << "Log: " << lfLogWritten() << " records written, " << lfLogDropped() << " dropped" << endl;
+}
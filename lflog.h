@@ -0,0 +1,82 @@
+// Asynchronous logger for laser fence application.
+
+#ifndef LFLOG_H
+#define LFLOG_H
+
+#include "stdafx.h"
+#include <atomic>
+
+enum LfLogLevel {
+    LF_LOG_DEBUG = 0,
+    LF_LOG_INFO,
+    LF_LOG_WARN,
+    LF_LOG_ERROR,
+    LF_LOG_OFF          // As a threshold only: log nothing
+};
+
+const char *lfLogLevelName(LfLogLevel level);
+// Takes a name lfLogLevelName() returns; -1 if there is no such level
+int lfParseLogLevel(const char *name, LfLogLevel *level);
+
+// Most arguments one record holds
+static const unsigned int k_lfLogMaxArgs = 5;
+
+// An argument as the 64 bits it was passed in
+union LfLogArg {
+    long long i;
+    unsigned long long u;
+    double d;
+    const char *s;
+    const void *p;
+};
+
+inline LfLogArg lfLogArg(int v) { LfLogArg a; a.i = v; return a; }
+inline LfLogArg lfLogArg(long v) { LfLogArg a; a.i = v; return a; }
+inline LfLogArg lfLogArg(long long v) { LfLogArg a; a.i = v; return a; }
+inline LfLogArg lfLogArg(unsigned int v) { LfLogArg a; a.u = v; return a; }
+inline LfLogArg lfLogArg(unsigned long v) { LfLogArg a; a.u = v; return a; }
+inline LfLogArg lfLogArg(unsigned long long v) { LfLogArg a; a.u = v; return a; }
+inline LfLogArg lfLogArg(double v) { LfLogArg a; a.d = v; return a; }
+inline LfLogArg lfLogArg(const char *v) { LfLogArg a; a.s = v; return a; }
+inline LfLogArg lfLogArg(const void *v) { LfLogArg a; a.p = v; return a; }
+
+// Records below this level are dropped before anything is queued
+extern std::atomic<int> lfLogThreshold;
+
+void lfLogWrite(LfLogLevel level, const char *format, const LfLogArg *args, unsigned int count);
+
+// Logs a printf-style message.  The caller's thread only copies the
+// format pointer and argument values into its own ring, a few tens of ns;
+// the writer thread formats them later.  So the format and any %s
+// arguments must outlive the call: pass literals or static names, and
+// lfLogText() for anything else.  Length modifiers are ignored, as every
+// argument is formatted from its 64 bits.
+template <typename... Args>
+inline void lfLog(LfLogLevel level, const char *format, Args... args)
+{
+    static_assert(sizeof...(Args) <= k_lfLogMaxArgs, "Too many log arguments");
+    if ((int)level < lfLogThreshold.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    LfLogArg packed[sizeof...(Args) + 1] = { lfLogArg(args)... };
+    lfLogWrite(level, format, packed, (unsigned int)sizeof...(Args));
+}
+
+// Copies up to 1 KB of text into the ring, for strings that don't last
+void lfLogText(LfLogLevel level, const char *text);
+
+void lfSetLogLevel(LfLogLevel level);
+LfLogLevel lfGetLogLevel();
+
+// Starts the writer thread, which formats records to fd in time order.
+// Until then, and after lfLogStop(), records are written as they come.
+int lfLogStart(int fd);
+// Writes out everything queued, then stops the writer thread
+void lfLogStop();
+unsigned long lfLogWritten();
+// Records lost to a full ring
+unsigned long lfLogDropped();
+void lfLogPrintStats();
+
+#endif
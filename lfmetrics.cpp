@@ -0,0 +1,572 @@
+// Metrics for laser fence application.
+
+#include "lfmetrics.h"
+#include "lfbuf.h"
+#include <iostream>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+using namespace std;
+
+// Histogram buckets exported to Prometheus: powers of two from about 1 us
+// to 17 s, which fall exactly on our own bucket boundaries
+static const unsigned int k_firstExportPower = 10;
+static const unsigned int k_lastExportPower = 34;
+
+// Longest the exporter sleeps, so stop() is never kept waiting
+static const unsigned int k_maxPollMs = 100;
+// Time a scraper has to send its request
+static const unsigned int k_requestTimeoutMs = 200;
+
+static atomic<unsigned int> nextShard(0);
+
+unsigned int lfNextMetricShard()
+{
+    return nextShard.fetch_add(1, memory_order_relaxed) % k_lfMetricShards;
+}
+
+unsigned long long lfMonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Shards are cache-line aligned and constructed in place
+template <typename Shard>
+static Shard *allocShards()
+{
+    Shard *shards = (Shard *)lfAlignedAlloc(sizeof(Shard) * k_lfMetricShards);
+    if (shards == NULL)
+    {
+        throw runtime_error("Can't allocate metric");
+    }
+    for (unsigned int i = 0; i < k_lfMetricShards; i++)
+    {
+        new (&shards[i]) Shard;
+    }
+    return shards;
+}
+
+
+
+LfCounter::LfCounter()
+{
+    shards = allocShards<Shard>();
+    for (unsigned int i = 0; i < k_lfMetricShards; i++)
+    {
+        shards[i].value.store(0, memory_order_relaxed);
+    }
+}
+
+LfCounter::~LfCounter()
+{
+    lfAlignedFree(shards);
+}
+
+unsigned long long LfCounter::get() const
+{
+    unsigned long long total = 0;
+    for (unsigned int i = 0; i < k_lfMetricShards; i++)
+    {
+        total += shards[i].value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+
+
+LfLatencyHistogram::LfLatencyHistogram()
+{
+    shards = allocShards<Shard>();
+    reset();
+}
+
+LfLatencyHistogram::~LfLatencyHistogram()
+{
+    lfAlignedFree(shards);
+}
+
+void LfLatencyHistogram::reset()
+{
+    for (unsigned int i = 0; i < k_lfMetricShards; i++)
+    {
+        for (unsigned int b = 0; b < k_buckets; b++)
+        {
+            shards[i].buckets[b].store(0, memory_order_relaxed);
+        }
+        shards[i].sum.store(0, memory_order_relaxed);
+        shards[i].max.store(0, memory_order_relaxed);
+    }
+}
+
+unsigned long long LfLatencyHistogram::bucketLow(unsigned int bucket)
+{
+    if (bucket < (1u << k_subBits))
+    {
+        return bucket;
+    }
+    unsigned int group = bucket >> k_subBits;
+    unsigned long long mantissa = (1u << k_subBits) + (bucket & ((1u << k_subBits) - 1));
+    return mantissa << (group - 1);
+}
+
+unsigned long long LfLatencyHistogram::snapshot(unsigned long long *counts, unsigned long long *sum) const
+{
+    unsigned long long total = 0;
+    *sum = 0;
+    for (unsigned int b = 0; b < k_buckets; b++)
+    {
+        counts[b] = 0;
+        for (unsigned int i = 0; i < k_lfMetricShards; i++)
+        {
+            counts[b] += shards[i].buckets[b].load(memory_order_relaxed);
+        }
+        total += counts[b];
+    }
+    for (unsigned int i = 0; i < k_lfMetricShards; i++)
+    {
+        *sum += shards[i].sum.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+unsigned long long LfLatencyHistogram::getCount() const
+{
+    unsigned long long counts[k_buckets];
+    unsigned long long sum;
+    return snapshot(counts, &sum);
+}
+
+double LfLatencyHistogram::getMean() const
+{
+    unsigned long long counts[k_buckets];
+    unsigned long long sum;
+    unsigned long long total = snapshot(counts, &sum);
+    return total ? (double)sum / total : 0.0;
+}
+
+unsigned long long LfLatencyHistogram::getMax() const
+{
+    unsigned long long max = 0;
+    for (unsigned int i = 0; i < k_lfMetricShards; i++)
+    {
+        unsigned long long value = shards[i].max.load(memory_order_relaxed);
+        max = value > max ? value : max;
+    }
+    return max;
+}
+
+unsigned long long LfLatencyHistogram::getPercentile(double fraction) const
+{
+    unsigned long long counts[k_buckets];
+    unsigned long long sum;
+    unsigned long long total = snapshot(counts, &sum);
+    if (total == 0)
+    {
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(fraction * total);
+    unsigned long long seen = 0;
+    for (unsigned int b = 0; b < k_buckets; b++)
+    {
+        seen += counts[b];
+        if (seen > target)
+        {
+            return bucketHigh(b);
+        }
+    }
+    return bucketHigh(k_buckets - 1);
+}
+
+void LfLatencyHistogram::print(ostream &out, const char *name, const char *unit) const
+{
+    out << name << ": n=" << getCount() << " mean=" << getMean() << unit
+        << " p50<" << getPercentile(0.50) << unit
+        << " p99<" << getPercentile(0.99) << unit
+        << " max=" << getMax() << unit << endl;
+}
+
+
+
+static double loadValue(void *context)
+{
+    return (double)((const atomic<unsigned long> *)context)->load(memory_order_relaxed);
+}
+
+static const char *typeName(LfMetricType type)
+{
+    switch (type)
+    {
+    case LF_METRIC_COUNTER:
+        return "counter";
+    case LF_METRIC_HISTOGRAM:
+        return "histogram";
+    default:
+        return "gauge";
+    }
+}
+
+static bool byName(const pair<string, size_t> &a, const pair<string, size_t> &b)
+{
+    return a.first < b.first || (a.first == b.first && a.second < b.second);
+}
+
+// Appends one sample line; extra is a label to add to the entry's own
+static void appendSample(string &out, const string &name, const char *suffix, const string &labels,
+                         const char *extra, double value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.15g", value);
+    out += name;
+    out += suffix;
+    if (!labels.empty() || extra != NULL)
+    {
+        out += "{";
+        out += labels;
+        if (extra != NULL)
+        {
+            out += labels.empty() ? "" : ",";
+            out += extra;
+        }
+        out += "}";
+    }
+    out += " ";
+    out += number;
+    out += "\n";
+}
+
+LfMetricsRegistry::~LfMetricsRegistry()
+{
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        delete entries[i].counter;
+        delete entries[i].histogram;
+    }
+}
+
+void LfMetricsRegistry::add(const Entry &entry)
+{
+    lock_guard<mutex> guard(lock);
+    entries.push_back(entry);
+}
+
+LfCounter *LfMetricsRegistry::addCounter(const char *name, const char *help, const char *labels)
+{
+    Entry entry = { name, help, labels, LF_METRIC_COUNTER, new LfCounter(), NULL, NULL, NULL };
+    add(entry);
+    return entry.counter;
+}
+
+LfLatencyHistogram *LfMetricsRegistry::addHistogram(const char *name, const char *help, const char *labels)
+{
+    Entry entry = { name, help, labels, LF_METRIC_HISTOGRAM, NULL, new LfLatencyHistogram(), NULL, NULL };
+    add(entry);
+    return entry.histogram;
+}
+
+void LfMetricsRegistry::addCallback(const char *name, const char *help, const char *labels, LfMetricType type,
+                                    LfMetricCallback callback, void *context)
+{
+    Entry entry = { name, help, labels, type, NULL, NULL, callback, context };
+    add(entry);
+}
+
+void LfMetricsRegistry::addValue(const char *name, const char *help, const char *labels, LfMetricType type,
+                                 const atomic<unsigned long> *value)
+{
+    addCallback(name, help, labels, type, loadValue, (void *)value);
+}
+
+void LfMetricsRegistry::render(string &out)
+{
+    lock_guard<mutex> guard(lock);
+
+    // Samples of one metric must be adjacent, under a single HELP and TYPE
+    vector<pair<string, size_t> > order;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        order.push_back(make_pair(entries[i].name, i));
+    }
+    sort(order.begin(), order.end(), byName);
+
+    vector<unsigned long long> counts(LfLatencyHistogram::getBuckets());
+    out.clear();
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const Entry &e = entries[order[i].second];
+        if (i == 0 || order[i - 1].first != e.name)
+        {
+            out += "# HELP " + e.name + " " + e.help + "\n";
+            out += "# TYPE " + e.name + " " + typeName(e.type) + "\n";
+        }
+
+        if (e.counter != NULL)
+        {
+            appendSample(out, e.name, "", e.labels, NULL, (double)e.counter->get());
+        }
+        else if (e.histogram != NULL)
+        {
+            unsigned long long sum;
+            unsigned long long total = e.histogram->snapshot(&counts[0], &sum);
+            unsigned long long below = 0;
+            unsigned int b = 0;
+            for (unsigned int power = k_firstExportPower; power <= k_lastExportPower; power++)
+            {
+                unsigned long long bound = 1ULL << power;
+                while (b < LfLatencyHistogram::getBuckets() && LfLatencyHistogram::bucketHigh(b) <= bound)
+                {
+                    below += counts[b++];
+                }
+                char le[32];
+                snprintf(le, sizeof(le), "le=\"%.9g\"", bound / 1e9);
+                appendSample(out, e.name, "_bucket", e.labels, le, (double)below);
+            }
+            appendSample(out, e.name, "_bucket", e.labels, "le=\"+Inf\"", (double)total);
+            appendSample(out, e.name, "_sum", e.labels, NULL, sum / 1e9);
+            appendSample(out, e.name, "_count", e.labels, NULL, (double)total);
+        }
+        else
+        {
+            appendSample(out, e.name, "", e.labels, NULL, e.callback(e.context));
+        }
+    }
+}
+
+
+
+LfMetricsExporter::LfMetricsExporter(LfMetricsRegistry &registry)
+    : registry(registry), periodMs(1000), listenFd(-1), running(false),
+      fileWrites(0), requests(0), errors(0)
+{
+}
+
+LfMetricsExporter::~LfMetricsExporter()
+{
+    stop();
+}
+
+void LfMetricsExporter::setFile(const char *path, unsigned int periodMs)
+{
+    filePath = path;
+    this->periodMs = periodMs ? periodMs : 1;
+}
+
+void LfMetricsExporter::setSocket(const char *path)
+{
+    socketPath = path;
+}
+
+int LfMetricsExporter::start()
+{
+    if (!socketPath.empty())
+    {
+        struct sockaddr_un address;
+        if (socketPath.size() >= sizeof(address.sun_path))
+        {
+            cout << "Metrics socket path too long" << endl;
+            return -1;
+        }
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0)
+        {
+            cout << "Can't create metrics socket" << endl;
+            return -1;
+        }
+        // A socket left behind by an earlier run would fail the bind
+        unlink(socketPath.c_str());
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, 4) != 0)
+        {
+            cout << "Can't listen on metrics socket " << socketPath << endl;
+            close(listenFd);
+            listenFd = -1;
+            return -1;
+        }
+    }
+
+    running = true;
+    thread = std::thread(&LfMetricsExporter::exportLoop, this);
+    return 0;
+}
+
+void LfMetricsExporter::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+    running = false;
+    thread.join();
+    // Leave a final snapshot behind
+    if (!filePath.empty())
+    {
+        string text;
+        registry.render(text);
+        writeFile(text);
+    }
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+        listenFd = -1;
+        unlink(socketPath.c_str());
+    }
+}
+
+void LfMetricsExporter::exportLoop()
+{
+    string text;
+    unsigned long long nextWrite = lfMonotonicNs();
+    while (running)
+    {
+        unsigned long long now = lfMonotonicNs();
+        unsigned int waitMs = k_maxPollMs;
+        if (!filePath.empty())
+        {
+            if (now >= nextWrite)
+            {
+                registry.render(text);
+                writeFile(text);
+                nextWrite = now + periodMs * 1000000ULL;
+            }
+            unsigned long long untilWrite = (nextWrite - now) / 1000000;
+            if (untilWrite < waitMs)
+            {
+                waitMs = (unsigned int)untilWrite;
+            }
+        }
+
+        if (listenFd < 0)
+        {
+            usleep(waitMs * 1000);
+            continue;
+        }
+        struct pollfd pfd = { listenFd, POLLIN, 0 };
+        if (poll(&pfd, 1, waitMs) > 0)
+        {
+            int client = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                serve(client);
+                close(client);
+            }
+        }
+    }
+}
+
+int LfMetricsExporter::writeFile(const string &text)
+{
+    // Write a sibling and rename it over the old file
+    string tmpPath = filePath + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        errors++;
+        return -1;
+    }
+    size_t done = 0;
+    while (done < text.size())
+    {
+        ssize_t n = write(fd, text.data() + done, text.size() - done);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if (done != text.size() || rename(tmpPath.c_str(), filePath.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+        errors++;
+        return -1;
+    }
+    fileWrites++;
+    return 0;
+}
+
+// One request per connection, answered HTTP/1.0 style and closed.  Only
+// the method is looked at; every path returns the metrics.
+void LfMetricsExporter::serve(int client)
+{
+    char request[1024];
+    size_t length = 0;
+    unsigned long long deadline = lfMonotonicNs() + k_requestTimeoutMs * 1000000ULL;
+    while (length < sizeof(request) - 1)
+    {
+        unsigned long long now = lfMonotonicNs();
+        struct pollfd pfd = { client, POLLIN, 0 };
+        if (now >= deadline || poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) <= 0)
+        {
+            break;
+        }
+        ssize_t n = recv(client, request + length, sizeof(request) - 1 - length, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        length += n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    // Nor may a scraper that stops reading hold up the next export
+    struct timeval timeout = { 0, (long)k_requestTimeoutMs * 1000 };
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    string response;
+    if (length >= 4 && memcmp(request, "GET ", 4) == 0)
+    {
+        string text;
+        registry.render(text);
+        char header[160];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                 text.size());
+        response = header + text;
+        requests++;
+    }
+    else
+    {
+        response = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        errors++;
+    }
+
+    size_t done = 0;
+    while (done < response.size())
+    {
+        ssize_t n = send(client, response.data() + done, response.size() - done, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            errors++;
+            break;
+        }
+        done += n;
+    }
+}
+
+void LfMetricsExporter::printStats()
+{
+    cout << "Metrics: " << fileWrites << " file writes, " << requests << " requests served, "
+         << errors << " errors" << endl;
+}
@@ -0,0 +1,189 @@
+// Metrics for laser fence application.
+
+#ifndef LFMETRICS_H
+#define LFMETRICS_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Every counter and histogram is split into this many cache-line shards.
+// Each thread writes the shard it was given on first use, so threads
+// recording the same metric don't bounce a line between cores.
+static const unsigned int k_lfMetricShards = 16;
+
+unsigned int lfNextMetricShard();
+
+inline unsigned int lfMetricShard()
+{
+    static thread_local unsigned int shard = lfNextMetricShard();
+    return shard;
+}
+
+unsigned long long lfMonotonicNs();
+
+enum LfMetricType {
+    LF_METRIC_COUNTER = 0,  // Only goes up
+    LF_METRIC_GAUGE,        // Current value, may go down
+    LF_METRIC_HISTOGRAM
+};
+
+// Reads a value for export; called on the exporter thread only
+typedef double (*LfMetricCallback)(void *context);
+
+// Callbacks for a queue with getDepth() and getDrops(), e.g. LfSpscQueue
+template <typename Queue>
+double lfQueueDepth(void *context)
+{
+    return (double)((const Queue *)context)->getDepth();
+}
+
+template <typename Queue>
+double lfQueueDrops(void *context)
+{
+    return (double)((const Queue *)context)->getDrops();
+}
+
+// Monotonic count.  add() is one uncontended relaxed add on the calling
+// thread's shard; get() sums the shards.
+class LfCounter {
+protected:
+    struct Shard {
+        std::atomic<unsigned long long> value;
+        char pad[64 - sizeof(std::atomic<unsigned long long>)];
+    };
+    Shard *shards;
+public:
+    LfCounter();
+    ~LfCounter();
+    void add(unsigned long long n = 1)
+    {
+        shards[lfMetricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    unsigned long long get() const;
+};
+
+// Latency histogram in ns with eight sub-buckets per power of two, so any
+// value is placed within 12.5% of its size from 1 ns to over an hour.
+// Values below 16 ns get a bucket each, so small counts such as register
+// reads per trigger fit as well.  The count is the sum of the buckets, so
+// record() costs two relaxed adds, and a compare only while the value is
+// the largest yet.
+class LfLatencyHistogram {
+protected:
+    static const unsigned int k_subBits = 3;
+    static const unsigned int k_buckets = 320;
+    struct Shard {
+        std::atomic<unsigned long long> buckets[k_buckets];
+        std::atomic<unsigned long long> sum;
+        std::atomic<unsigned long long> max;
+        char pad[64 - 2 * sizeof(std::atomic<unsigned long long>)];
+    };
+    Shard *shards;
+    static unsigned int bucketOf(unsigned long long ns)
+    {
+        if (ns < (1u << k_subBits))
+        {
+            return (unsigned int)ns;
+        }
+        unsigned int top = 63 - __builtin_clzll(ns);
+        unsigned int bucket = ((top - k_subBits + 1) << k_subBits) +
+                              (unsigned int)((ns >> (top - k_subBits)) & ((1u << k_subBits) - 1));
+        return bucket < k_buckets ? bucket : k_buckets - 1;
+    }
+public:
+    LfLatencyHistogram();
+    ~LfLatencyHistogram();
+    void record(unsigned long long ns)
+    {
+        Shard &s = shards[lfMetricShard()];
+        s.buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(ns, std::memory_order_relaxed);
+        unsigned long long max = s.max.load(std::memory_order_relaxed);
+        while (ns > max && !s.max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        {
+        }
+    }
+    // Not safe against a concurrent record(), which may be lost
+    void reset();
+    // Smallest value that falls in a bucket, and the first past it
+    static unsigned long long bucketLow(unsigned int bucket);
+    static unsigned long long bucketHigh(unsigned int bucket) { return bucketLow(bucket + 1); }
+    // Sums the shards into counts[k_buckets]; returns the total
+    unsigned long long snapshot(unsigned long long *counts, unsigned long long *sum) const;
+    unsigned long long getCount() const;
+    double getMean() const;
+    unsigned long long getMax() const;
+    // Upper bound of the bucket holding the given fraction (0..1) of values
+    unsigned long long getPercentile(double fraction) const;
+    static unsigned int getBuckets() { return k_buckets; }
+    void print(std::ostream &out, const char *name, const char *unit) const;
+};
+
+// Named metrics, rendered in the Prometheus text exposition format.
+// Counters and histograms are owned by the registry and recorded on the
+// hot path; callback metrics read a component's own counters or queue
+// depths when rendered, so they cost nothing between exports.  Labels
+// are given already formatted, e.g. camera="0".
+class LfMetricsRegistry {
+protected:
+    struct Entry {
+        std::string name;
+        std::string help;
+        std::string labels;
+        LfMetricType type;
+        LfCounter *counter;
+        LfLatencyHistogram *histogram;
+        LfMetricCallback callback;
+        void *context;
+    };
+    std::mutex lock;
+    std::vector<Entry> entries;
+    void add(const Entry &entry);
+public:
+    ~LfMetricsRegistry();
+    LfCounter *addCounter(const char *name, const char *help, const char *labels = "");
+    // Exported as <name>_bucket/_sum/_count in seconds
+    LfLatencyHistogram *addHistogram(const char *name, const char *help, const char *labels = "");
+    void addCallback(const char *name, const char *help, const char *labels, LfMetricType type,
+                     LfMetricCallback callback, void *context);
+    // A counter a component already keeps
+    void addValue(const char *name, const char *help, const char *labels, LfMetricType type,
+                  const std::atomic<unsigned long> *value);
+    void render(std::string &out);
+};
+
+// Publishes a registry: rewrites a file every period, replacing it
+// atomically so readers such as the node exporter's textfile collector
+// never see half of it, and answers HTTP GETs on a Unix stream socket,
+// e.g. curl --unix-socket /tmp/lf.sock http://lf/metrics.
+class LfMetricsExporter {
+protected:
+    LfMetricsRegistry &registry;
+    std::string filePath;
+    std::string socketPath;
+    unsigned int periodMs;
+    int listenFd;
+    std::atomic<bool> running;
+    std::thread thread;
+    unsigned long fileWrites;
+    unsigned long requests;
+    unsigned long errors;
+    void exportLoop();
+    int writeFile(const std::string &text);
+    void serve(int client);
+public:
+    LfMetricsExporter(LfMetricsRegistry &registry);
+    ~LfMetricsExporter();
+    void setFile(const char *path, unsigned int periodMs = 1000);
+    void setSocket(const char *path);
+    int start();
+    void stop();
+    void printStats();
+};
+
+#endif
@@ -0,0 +1,258 @@
+// Multi-camera capture for laser fence application.
+
+#include "lfmulti.h"
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std;
+
+LfMultiCam::LfMultiCam(unsigned int queueDepth, unsigned int reorderWindowUs)
+    : queueDepth(queueDepth), reorderWindowUs(reorderWindowUs), capturing(false),
+      lastEmitted(0), merged(0), outOfOrder(0)
+{
+}
+
+LfMultiCam::~LfMultiCam()
+{
+    stop();
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        delete channels[i]->queue;
+        delete channels[i]->capture;
+        delete channels[i];
+    }
+}
+
+int LfMultiCam::addCamera(LfFrameSource *source, LfFramePool *pool, int cpu)
+{
+    if (capturing.load())
+    {
+        return -1;
+    }
+
+    Channel *channel = new Channel();
+    channel->source = source;
+    channel->pool = pool;
+    channel->cpu = cpu;
+    channel->queue = new LfSpscQueue<LfFrame>(queueDepth);
+    channel->capture = new LfPairCapture(source, pool, channels.size());
+    channel->pending = NULL;
+    channel->captured.store(0);
+    channel->errors.store(0);
+    channel->poolExhausted.store(0);
+    channel->dropped.store(0);
+    channels.push_back(channel);
+    return channels.size() - 1;
+}
+
+unsigned long LfMultiCam::getCaptured() const
+{
+    unsigned long total = 0;
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        total += channels[i]->captured.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+int LfMultiCam::start()
+{
+    if (capturing.load() || channels.empty())
+    {
+        return -1;
+    }
+
+    capturing.store(true);
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        channels[i]->thread = thread(&LfMultiCam::captureLoop, this, channels[i], (unsigned int)i);
+    }
+    return 0;
+}
+
+void LfMultiCam::stop()
+{
+    capturing.store(false);
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        Channel *channel = channels[i];
+        if (channel->thread.joinable())
+        {
+            channel->thread.join();
+        }
+
+        // Hand back everything the merge never delivered
+        if (channel->pending != NULL)
+        {
+            releasePair(channel->pending);
+            channel->pending = NULL;
+        }
+        LfFrame *on;
+        while ((on = channel->queue->tryPop()) != NULL)
+        {
+            releasePair(on);
+        }
+    }
+}
+
+void LfMultiCam::releasePair(LfFrame *on)
+{
+    LfFrame *off = on->pair;
+    on->pair = NULL;
+    LfFramePool::releaseFrame(off);
+    LfFramePool::releaseFrame(on);
+}
+
+void LfMultiCam::requestRoi(unsigned int camera, const LfRoi &roi)
+{
+    if (camera < channels.size())
+    {
+        channels[camera]->capture->requestRoi(roi);
+    }
+}
+
+void LfMultiCam::captureLoop(Channel *channel, unsigned int camera)
+{
+    if (channel->cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(channel->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            cout << "Could not pin camera " << camera << " to CPU " << channel->cpu << endl;
+        }
+    }
+
+    LfPairCapture &pairCapture = *channel->capture;
+    unsigned int idle = 0;
+
+    while (capturing.load(memory_order_relaxed))
+    {
+        LfFrame *on = NULL;
+        int result = pairCapture.capture(&on);
+        if (result == 1)
+        {
+            channel->poolExhausted.fetch_add(1, memory_order_relaxed);
+            lfIdleWait(idle);
+            continue;
+        }
+        idle = 0;
+        if (result != 0)
+        {
+            channel->errors.fetch_add(1, memory_order_relaxed);
+            continue;
+        }
+
+        channel->captured.fetch_add(1, memory_order_relaxed);
+
+        // A slow merge must never hold up this camera's grabs
+        LfFrame *evicted = channel->queue->pushDropOldest(on);
+        if (evicted != NULL)
+        {
+            channel->dropped.fetch_add(1, memory_order_relaxed);
+            releasePair(evicted);
+        }
+    }
+}
+
+LfFrame *LfMultiCam::nextPair(unsigned int timeoutUs)
+{
+    unsigned long long deadline = lfTimestampUs() + timeoutUs;
+    unsigned int idle = 0;
+
+    while (true)
+    {
+        Channel *oldest = NULL;
+        bool complete = true;
+
+        for (size_t i = 0; i < channels.size(); i++)
+        {
+            Channel *channel = channels[i];
+            if (channel->pending == NULL)
+            {
+                channel->pending = channel->queue->tryPop();
+            }
+            if (channel->pending == NULL)
+            {
+                complete = false;
+                continue;
+            }
+            if (oldest == NULL || channel->pending->timestamp < oldest->pending->timestamp)
+            {
+                oldest = channel;
+            }
+        }
+
+        unsigned long long now = lfTimestampUs();
+        if (oldest != NULL &&
+            (complete || now >= oldest->pending->timestamp + reorderWindowUs))
+        {
+            LfFrame *on = oldest->pending;
+            oldest->pending = NULL;
+            if (on->timestamp < lastEmitted)
+            {
+                // A camera delivered later than the reorder window allows
+                outOfOrder++;
+            }
+            else
+            {
+                lastEmitted = on->timestamp;
+            }
+            merged++;
+            return on;
+        }
+
+        if (now >= deadline)
+        {
+            return NULL;
+        }
+        lfIdleWait(idle);
+    }
+}
+
+void LfMultiCam::setMetrics(LfMetricsRegistry &registry)
+{
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        Channel *channel = channels[i];
+        char labels[32];
+        char queueLabels[48];
+        snprintf(labels, sizeof(labels), "camera=\"%u\"", (unsigned int)i);
+        snprintf(queueLabels, sizeof(queueLabels), "queue=\"camera\",camera=\"%u\"", (unsigned int)i);
+        registry.addValue("lf_capture_pairs_total", "Pairs captured from a camera", labels,
+                          LF_METRIC_COUNTER, &channel->captured);
+        registry.addValue("lf_capture_errors_total", "Pairs a camera failed to capture", labels,
+                          LF_METRIC_COUNTER, &channel->errors);
+        registry.addValue("lf_pool_exhausted_total", "Waits for a free frame buffer", labels,
+                          LF_METRIC_COUNTER, &channel->poolExhausted);
+        channel->capture->setMetrics(registry, labels);
+        registry.addCallback("lf_queue_depth", "Items waiting in a queue", queueLabels, LF_METRIC_GAUGE,
+                             lfQueueDepth<LfSpscQueue<LfFrame> >, channel->queue);
+        registry.addValue("lf_queue_dropped_total", "Items dropped by a full queue", queueLabels,
+                          LF_METRIC_COUNTER, &channel->dropped);
+    }
+}
+
+void LfMultiCam::printStats()
+{
+    cout << "Multi-camera: " << channels.size() << " cameras, " << merged << " pairs merged, "
+         << outOfOrder << " out of order" << endl;
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        Channel *channel = channels[i];
+        cout << "  camera " << i << ": captured " << channel->captured.load()
+             << ", errors " << channel->errors.load()
+             << ", dropped " << channel->dropped.load()
+             << ", waits for a free buffer " << channel->poolExhausted.load()
+             << ", queue high water " << channel->queue->getHighWater()
+             << ", lost " << channel->capture->getFramesLost()
+             << " (" << channel->capture->getFramesDiscarded() << " discarded, "
+             << channel->capture->getResyncs() << " resyncs, "
+             << channel->capture->getReanchors() << " re-anchored, "
+             << channel->capture->getReordered() << " reordered)"
+             << ", ROI changes " << channel->capture->getRoiChanges()
+             << " (" << channel->capture->getRoiFailures() << " failed)" << endl;
+    }
+}
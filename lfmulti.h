@@ -0,0 +1,62 @@
+// Multi-camera capture for laser fence application.
+
+#ifndef LFMULTI_H
+#define LFMULTI_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "lfbuf.h"
+#include "lfmetrics.h"
+#include "lfqueue.h"
+#include "lfsrc.h"
+
+// Captures from several cameras at once, one thread per camera, and merges
+// their frame pairs into a single stream in timestamp order.  A pair is
+// handed out once every camera has a pair queued, or once it is older than
+// the reorder window so a stalled camera cannot hold up the rest.
+class LfMultiCam: public LfPairFeed {
+protected:
+    struct Channel {
+        LfFrameSource *source;
+        LfFramePool *pool;
+        int cpu;                        // CPU to pin the thread to, -1 for none
+        LfSpscQueue<LfFrame> *queue;
+        LfPairCapture *capture;
+        LfFrame *pending;               // Head pair held by the merge
+        std::thread thread;
+        std::atomic<unsigned long> captured;
+        std::atomic<unsigned long> errors;
+        std::atomic<unsigned long> poolExhausted;
+        std::atomic<unsigned long> dropped;
+    };
+    std::vector<Channel *> channels;
+    unsigned int queueDepth;
+    unsigned int reorderWindowUs;
+    std::atomic<bool> capturing;
+    unsigned long long lastEmitted;
+    unsigned long merged;
+    unsigned long outOfOrder;
+    void captureLoop(Channel *channel, unsigned int camera);
+    static void releasePair(LfFrame *on);
+public:
+    LfMultiCam(unsigned int queueDepth, unsigned int reorderWindowUs = 20000);
+    ~LfMultiCam();
+    // Returns the camera index assigned to the source
+    int addCamera(LfFrameSource *source, LfFramePool *pool, int cpu = -1);
+    unsigned int getNumCameras() const { return channels.size(); }
+    int start();
+    void stop();
+    // Change a camera's ROI from any thread; applied between its pairs
+    void requestRoi(unsigned int camera, const LfRoi &roi);
+    // Single consumer only
+    virtual LfFrame *nextPair(unsigned int timeoutUs);
+    unsigned long getMerged() const { return merged; }
+    unsigned long getCaptured() const;
+    // Export each camera's capture counts and queue, read when rendered
+    void setMetrics(LfMetricsRegistry &registry);
+    void printStats();
+};
+
+#endif
@@ -0,0 +1,78 @@
+// Row-band worker threads for laser fence application.
+
+#include "lfpar.h"
+#include "lfqueue.h"
+
+using namespace std;
+
+LfWorkers::LfWorkers(unsigned int numHelpers)
+    : job(NULL), bands(numHelpers + 1), generation(0), running(true), remaining(0), jobs(0)
+{
+    for (unsigned int i = 0; i < numHelpers; i++)
+    {
+        threads.push_back(thread(&LfWorkers::workerLoop, this, i + 1));
+    }
+}
+
+LfWorkers::~LfWorkers()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        running = false;
+        wake.notify_all();
+    }
+    for (unsigned int i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
+
+void LfWorkers::run(LfBandJob *j)
+{
+    jobs.fetch_add(1, memory_order_relaxed);
+    if (threads.empty())
+    {
+        j->runBand(0, 1);
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        job = j;
+        remaining.store(threads.size(), memory_order_relaxed);
+        generation++;
+        wake.notify_all();
+    }
+    j->runBand(0, bands);
+
+    // The other bands finish about when ours does, so don't sleep on them
+    unsigned int idle = 0;
+    while (remaining.load(memory_order_acquire) > 0)
+    {
+        lfIdleWait(idle);
+    }
+}
+
+void LfWorkers::workerLoop(unsigned int band)
+{
+    unsigned long seen = 0;
+    while (true)
+    {
+        LfBandJob *j;
+        {
+            unique_lock<mutex> guard(lock);
+            while (running && generation == seen)
+            {
+                wake.wait(guard);
+            }
+            if (!running)
+            {
+                break;
+            }
+            seen = generation;
+            j = job;
+        }
+        j->runBand(band, bands);
+        remaining.fetch_sub(1, memory_order_release);
+    }
+}
@@ -0,0 +1,51 @@
+// Row-band worker threads for laser fence application.
+
+#ifndef LFPAR_H
+#define LFPAR_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A job split into bands, e.g. row ranges of one frame.  runBand() is
+// called once for every band, concurrently from different threads.
+class LfBandJob {
+public:
+    virtual ~LfBandJob() {}
+    virtual void runBand(unsigned int band, unsigned int bands) = 0;
+};
+
+// Helper threads started once and reused for every frame.  run() hands
+// band 0 to the calling thread and one band to each helper, and returns
+// once all of them are done, so per-frame work costs a wake-up instead of
+// a thread start.  run() may only be called from one thread at a time.
+class LfWorkers {
+protected:
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    LfBandJob *job;
+    unsigned int bands;
+    unsigned long generation;
+    bool running;
+    std::atomic<unsigned int> remaining;
+    std::atomic<unsigned long> jobs;
+    void workerLoop(unsigned int band);
+public:
+    // Helpers in addition to the calling thread; 0 runs every job inline
+    LfWorkers(unsigned int numHelpers);
+    ~LfWorkers();
+    unsigned int getBands() const { return threads.size() + 1; }
+    void run(LfBandJob *job);
+    // Band b of n covers [total * b / n, total * (b + 1) / n)
+    static unsigned int bandStart(unsigned int total, unsigned int band, unsigned int bands)
+    {
+        return (unsigned int)((unsigned long long)total * band / bands);
+    }
+    unsigned long getJobs() const { return jobs.load(std::memory_order_relaxed); }
+};
+
+#endif
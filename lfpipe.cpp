@@ -0,0 +1,242 @@
+// Capture -> process -> store pipeline for laser fence application.
+
+#include "lfpipe.h"
+#include <iostream>
+
+using namespace std;
+
+LfPipeline::LfPipeline(LfFramePool *pool, unsigned int queueDepth)
+    : source(NULL), feed(NULL), pool(pool), processor(NULL), store(NULL),
+      processQueue(queueDepth), storeQueue(queueDepth),
+      processPolicy(LF_QUEUE_BLOCK), storePolicy(LF_QUEUE_BLOCK),
+      capturing(false), processing(false), storing(false),
+      captured(0), captureErrors(0), poolExhausted(0)
+{
+}
+
+LfPipeline::~LfPipeline()
+{
+    stop();
+}
+
+void LfPipeline::setProcessor(LfFrameHandler *handler, LfQueuePolicy policy)
+{
+    processor = handler;
+    processPolicy = policy;
+}
+
+void LfPipeline::setStore(LfFrameHandler *handler, LfQueuePolicy policy)
+{
+    store = handler;
+    storePolicy = policy;
+}
+
+int LfPipeline::start()
+{
+    if (capturing.load())
+    {
+        return -1;
+    }
+
+    storing.store(true);
+    processing.store(true);
+    capturing.store(true);
+    storeThread = thread(&LfPipeline::storeLoop, this);
+    processThread = thread(&LfPipeline::processLoop, this);
+    if (source != NULL || feed != NULL)
+    {
+        captureThread = thread(&LfPipeline::captureLoop, this);
+    }
+    return 0;
+}
+
+void LfPipeline::stop()
+{
+    // Shut down front to back so queued pairs are still processed and
+    // every buffer makes it back to the pool
+    capturing.store(false);
+    if (captureThread.joinable())
+    {
+        captureThread.join();
+    }
+    processing.store(false);
+    if (processThread.joinable())
+    {
+        processThread.join();
+    }
+    storing.store(false);
+    if (storeThread.joinable())
+    {
+        storeThread.join();
+    }
+}
+
+void LfPipeline::releasePair(LfFrame *on)
+{
+    LfFrame *off = on->pair;
+    on->pair = NULL;
+    LfFramePool::releaseFrame(off);
+    LfFramePool::releaseFrame(on);
+}
+
+bool LfPipeline::enqueue(LfSpscQueue<LfFrame> &queue, LfFrame *on, LfQueuePolicy policy,
+                         const atomic<bool> &consumerAlive)
+{
+    if (policy == LF_QUEUE_DROP_OLDEST)
+    {
+        LfFrame *evicted = queue.pushDropOldest(on);
+        if (evicted != NULL)
+        {
+            releasePair(evicted);
+        }
+        return true;
+    }
+
+    unsigned int idle = 0;
+    while (!queue.tryPush(on))
+    {
+        if (!consumerAlive.load(memory_order_relaxed))
+        {
+            releasePair(on);
+            return false;
+        }
+        lfIdleWait(idle);
+    }
+    return true;
+}
+
+bool LfPipeline::submit(LfFrame *on)
+{
+    return enqueue(processQueue, on, processPolicy, processing);
+}
+
+void LfPipeline::captureLoop()
+{
+    LfPairCapture pairCapture(source, pool);
+    unsigned int idle = 0;
+
+    while (capturing.load(memory_order_relaxed))
+    {
+        LfFrame *on = NULL;
+
+        if (feed != NULL)
+        {
+            on = feed->nextPair(10000);
+            if (on == NULL)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            int result = pairCapture.capture(&on);
+            if (result == 1)
+            {
+                poolExhausted.fetch_add(1, memory_order_relaxed);
+                lfIdleWait(idle);
+                continue;
+            }
+            idle = 0;
+            if (result != 0)
+            {
+                captureErrors.fetch_add(1, memory_order_relaxed);
+                continue;
+            }
+        }
+
+        captured.fetch_add(1, memory_order_relaxed);
+        enqueue(processQueue, on, processPolicy, processing);
+    }
+}
+
+void LfPipeline::processLoop()
+{
+    unsigned int idle = 0;
+
+    // Keep draining after stop() until the queue is empty
+    while (true)
+    {
+        LfFrame *on = processQueue.tryPop();
+        if (on == NULL)
+        {
+            if (!processing.load(memory_order_acquire) && processQueue.getDepth() == 0)
+            {
+                break;
+            }
+            lfIdleWait(idle);
+            continue;
+        }
+        idle = 0;
+
+        if (processor != NULL && processor->handleFrames(on, on->pair))
+        {
+            continue;
+        }
+
+        if (store != NULL)
+        {
+            enqueue(storeQueue, on, storePolicy, storing);
+        }
+        else
+        {
+            releasePair(on);
+        }
+    }
+}
+
+void LfPipeline::storeLoop()
+{
+    unsigned int idle = 0;
+
+    while (true)
+    {
+        LfFrame *on = storeQueue.tryPop();
+        if (on == NULL)
+        {
+            if (!storing.load(memory_order_acquire) && storeQueue.getDepth() == 0)
+            {
+                break;
+            }
+            lfIdleWait(idle);
+            continue;
+        }
+        idle = 0;
+
+        if (!store->handleFrames(on, on->pair))
+        {
+            releasePair(on);
+        }
+    }
+}
+
+void LfPipeline::setMetrics(LfMetricsRegistry &registry)
+{
+    registry.addValue("lf_pipeline_pairs_total", "Pairs taken in by the pipeline", "",
+                      LF_METRIC_COUNTER, &captured);
+    registry.addValue("lf_pipeline_capture_errors_total", "Pairs the pipeline failed to capture", "",
+                      LF_METRIC_COUNTER, &captureErrors);
+    registry.addValue("lf_pool_exhausted_total", "Waits for a free frame buffer", "stage=\"pipeline\"",
+                      LF_METRIC_COUNTER, &poolExhausted);
+    const char *names[2] = { "queue=\"process\"", "queue=\"store\"" };
+    LfSpscQueue<LfFrame> *queues[2] = { &processQueue, &storeQueue };
+    for (int i = 0; i < 2; i++)
+    {
+        registry.addCallback("lf_queue_depth", "Items waiting in a queue", names[i], LF_METRIC_GAUGE,
+                             lfQueueDepth<LfSpscQueue<LfFrame> >, queues[i]);
+        registry.addCallback("lf_queue_dropped_total", "Items dropped by a full queue", names[i],
+                             LF_METRIC_COUNTER, lfQueueDrops<LfSpscQueue<LfFrame> >, queues[i]);
+    }
+}
+
+void LfPipeline::printStats()
+{
+    cout << "Pipeline: captured " << captured.load() << " pairs, "
+         << captureErrors.load() << " capture errors, "
+         << poolExhausted.load() << " waits for a free buffer" << endl;
+    cout << "  process queue: depth " << processQueue.getDepth() << "/" << processQueue.getCapacity()
+         << ", high water " << processQueue.getHighWater()
+         << ", dropped " << processQueue.getDrops() << endl;
+    cout << "  store queue:   depth " << storeQueue.getDepth() << "/" << storeQueue.getCapacity()
+         << ", high water " << storeQueue.getHighWater()
+         << ", dropped " << storeQueue.getDrops() << endl;
+}
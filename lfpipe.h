@@ -0,0 +1,74 @@
+// Capture -> process -> store pipeline for laser fence application.
+
+#ifndef LFPIPE_H
+#define LFPIPE_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <thread>
+#include "lfbuf.h"
+#include "lfmetrics.h"
+#include "lfqueue.h"
+#include "lfsrc.h"
+
+// Work done by a pipeline stage on each trigger's frame pair.  A handler
+// that keeps the frames returns true and must then return both to their
+// pool itself; otherwise the pipeline passes them on.
+class LfFrameHandler {
+public:
+    virtual ~LfFrameHandler() {}
+    virtual bool handleFrames(LfFrame *on, LfFrame *off) = 0;
+};
+
+// Three threads linked by SPSC queues.  The capture thread grabs both
+// frames of each trigger into pooled buffers and links them through
+// LfFrame::pair; the processing and storage stages run their handlers and
+// the last stage returns the buffers to their pool.  Each queue has its own
+// policy for when its consumer falls behind.
+class LfPipeline {
+protected:
+    LfFrameSource *source;
+    LfPairFeed *feed;
+    LfFramePool *pool;
+    LfFrameHandler *processor;
+    LfFrameHandler *store;
+    LfSpscQueue<LfFrame> processQueue;
+    LfSpscQueue<LfFrame> storeQueue;
+    LfQueuePolicy processPolicy;
+    LfQueuePolicy storePolicy;
+    std::atomic<bool> capturing;
+    std::atomic<bool> processing;
+    std::atomic<bool> storing;
+    std::thread captureThread;
+    std::thread processThread;
+    std::thread storeThread;
+    std::atomic<unsigned long> captured;
+    std::atomic<unsigned long> captureErrors;
+    std::atomic<unsigned long> poolExhausted;
+    void captureLoop();
+    void processLoop();
+    void storeLoop();
+    bool enqueue(LfSpscQueue<LfFrame> &queue, LfFrame *on, LfQueuePolicy policy,
+                 const std::atomic<bool> &consumerAlive);
+    void releasePair(LfFrame *on);
+public:
+    LfPipeline(LfFramePool *pool, unsigned int queueDepth);
+    ~LfPipeline();
+    // The capture stage grabs from a source, or pulls from a feed; with
+    // neither the pipeline is fed through submit()
+    void setSource(LfFrameSource *src) { source = src; }
+    void setFeed(LfPairFeed *f) { feed = f; }
+    void setProcessor(LfFrameHandler *handler, LfQueuePolicy policy);
+    void setStore(LfFrameHandler *handler, LfQueuePolicy policy);
+    int start();
+    void stop();
+    // Hand a linked pair to the processing stage from a single external
+    // producer thread.  Returns false if the pair was dropped.
+    bool submit(LfFrame *on);
+    unsigned long getCaptured() const { return captured.load(std::memory_order_relaxed); }
+    // Export pair counts, queue depths and drops, read when rendered
+    void setMetrics(LfMetricsRegistry &registry);
+    void printStats();
+};
+
+#endif
@@ -0,0 +1,159 @@
+// Bounded lock-free queues for laser fence application.
+
+#ifndef LFQUEUE_H
+#define LFQUEUE_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <stdexcept>
+#include <sched.h>
+#include <unistd.h>
+
+// What a producer does when the queue it feeds is full
+enum LfQueuePolicy {
+    LF_QUEUE_BLOCK = 0,     // Wait for the consumer to make room
+    LF_QUEUE_DROP_OLDEST    // Evict the oldest queued item
+};
+
+// Back off gradually while a queue is empty or full: spin briefly for the
+// common short wait, then yield, then sleep so an idle stage costs nothing.
+// Reset idle to 0 once work turns up.
+inline void lfIdleWait(unsigned int &idle)
+{
+    idle++;
+    if (idle < 64)
+    {
+        return;
+    }
+    if (idle < 1024)
+    {
+        sched_yield();
+        return;
+    }
+    usleep(100);
+}
+
+// Single-producer/single-consumer ring of item pointers.  The producer may
+// also evict the oldest item when full, so the consumer claims items with
+// a compare-and-swap on head rather than a plain store.
+template <class T>
+class LfSpscQueue {
+protected:
+    unsigned long capacity;
+    unsigned long mask;
+    std::atomic<T *> *slots;
+    // Padding keeps the consumer's and producer's indices on separate
+    // cache lines without needing an over-aligned allocation
+    char pad0[64];
+    std::atomic<unsigned long> head;    // Next item to pop
+    char pad1[64];
+    std::atomic<unsigned long> tail;    // Next slot to push
+    char pad2[64];
+    std::atomic<unsigned long> pushes;
+    std::atomic<unsigned long> drops;
+    std::atomic<unsigned long> highWater;
+    void notePush(unsigned long depth)
+    {
+        pushes.store(pushes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (depth > highWater.load(std::memory_order_relaxed))
+        {
+            highWater.store(depth, std::memory_order_relaxed);
+        }
+    }
+public:
+    // capacity is rounded up to a power of two
+    explicit LfSpscQueue(unsigned long requested)
+        : capacity(1), head(0), tail(0), pushes(0), drops(0), highWater(0)
+    {
+        if (requested == 0)
+        {
+            throw std::runtime_error("Queue capacity must be non-zero");
+        }
+        while (capacity < requested)
+        {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        slots = new std::atomic<T *>[capacity];
+        for (unsigned long i = 0; i < capacity; i++)
+        {
+            slots[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    ~LfSpscQueue()
+    {
+        delete[] slots;
+    }
+
+    // Producer side.  Returns false when full.
+    bool tryPush(T *item)
+    {
+        unsigned long t = tail.load(std::memory_order_relaxed);
+        unsigned long h = head.load(std::memory_order_acquire);
+        if (t - h >= capacity)
+        {
+            return false;
+        }
+        slots[t & mask].store(item, std::memory_order_relaxed);
+        tail.store(t + 1, std::memory_order_release);
+        notePush(t + 1 - h);
+        return true;
+    }
+
+    // Producer side.  Always enqueues; returns the evicted item if the
+    // queue was full, NULL otherwise.
+    T *pushDropOldest(T *item)
+    {
+        unsigned long t = tail.load(std::memory_order_relaxed);
+        unsigned long h = head.load(std::memory_order_acquire);
+        T *evicted = NULL;
+
+        while (t - h >= capacity)
+        {
+            T *oldest = slots[h & mask].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                evicted = oldest;
+                h++;
+                drops.store(drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                break;
+            }
+            // Either the consumer popped or the CAS failed spuriously; h was
+            // reloaded, so re-check for room
+        }
+
+        slots[t & mask].store(item, std::memory_order_relaxed);
+        tail.store(t + 1, std::memory_order_release);
+        notePush(t + 1 - h);
+        return evicted;
+    }
+
+    // Consumer side.  Returns NULL when empty.
+    T *tryPop()
+    {
+        unsigned long h = head.load(std::memory_order_acquire);
+        while (h != tail.load(std::memory_order_acquire))
+        {
+            T *item = slots[h & mask].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                return item;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned long getDepth() const
+    {
+        unsigned long h = head.load(std::memory_order_acquire);
+        unsigned long t = tail.load(std::memory_order_acquire);
+        return t - h;
+    }
+    unsigned long getCapacity() const { return capacity; }
+    unsigned long getPushes() const { return pushes.load(std::memory_order_relaxed); }
+    unsigned long getDrops() const { return drops.load(std::memory_order_relaxed); }
+    unsigned long getHighWater() const { return highWater.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,327 @@
+// Raw recording format (.lfr) for laser fence application.
+
+#include "lfrec.h"
+#include <iostream>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static uint64_t alignUp(uint64_t n)
+{
+    return (n + k_lfrAlignment - 1) / k_lfrAlignment * k_lfrAlignment;
+}
+
+static int pwriteAll(int fd, const void *data, size_t bytes, uint64_t offset)
+{
+    const char *p = (const char *)data;
+    while (bytes > 0)
+    {
+        ssize_t n = pwrite(fd, p, bytes, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        bytes -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+LfRecorder::LfRecorder()
+    : fd(-1), nextOffset(0), slotBytes(0), rejected(0)
+{
+    memset(&header, 0, sizeof(header));
+}
+
+LfRecorder::~LfRecorder()
+{
+    close();
+}
+
+int LfRecorder::open(const char *path, unsigned int width, unsigned int height, unsigned int stride,
+                     LfPixelFormat format, unsigned int triggerMode, unsigned int framesPerTrigger)
+{
+    if (fd >= 0)
+    {
+        return -1;
+    }
+
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        cout << "Failed to create recording " << path << endl;
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, k_lfrMagic, sizeof(header.magic));
+    header.version = 1;
+    header.width = width;
+    header.height = height;
+    header.stride = stride;
+    header.pixelFormat = format;
+    header.triggerMode = triggerMode;
+    header.framesPerTrigger = framesPerTrigger;
+    header.alignment = k_lfrAlignment;
+    header.frameBytes = (uint64_t)stride * height;
+
+    if (pwriteAll(fd, &header, sizeof(header), 0) != 0)
+    {
+        ::close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    slotBytes = alignUp(header.frameBytes);
+    nextOffset = k_lfrAlignment;
+    index.clear();
+    // An hour at 60 pairs/s; beyond that the index grows in place
+    index.reserve(60 * 60 * 60 * 2);
+    rejected = 0;
+    return 0;
+}
+
+int LfRecorder::append(const LfFrame *frame)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (frame->width != header.width || frame->height != header.height ||
+        frame->stride != header.stride || (uint32_t)frame->format != header.pixelFormat)
+    {
+        rejected++;
+        return -1;
+    }
+
+    if (header.nativeFormat == 0 && frame->nativeFormat != 0)
+    {
+        header.nativeFormat = frame->nativeFormat;
+    }
+
+    if (pwriteAll(fd, frame->data, header.frameBytes, nextOffset) != 0)
+    {
+        return -1;
+    }
+
+    LfrIndexEntry entry;
+    entry.offset = nextOffset;
+    entry.timestamp = frame->timestamp;
+    entry.seq = frame->seq;
+    entry.camera = frame->camera;
+    index.push_back(entry);
+    nextOffset += slotBytes;
+    return 0;
+}
+
+int LfRecorder::close()
+{
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    LfrTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.indexOffset = nextOffset;
+    trailer.frameCount = index.size();
+    memcpy(trailer.magic, k_lfrIndexMagic, sizeof(trailer.magic));
+
+    size_t indexBytes = index.size() * sizeof(LfrIndexEntry);
+    int result = 0;
+    if ((indexBytes && pwriteAll(fd, &index[0], indexBytes, nextOffset) != 0) ||
+        pwriteAll(fd, &trailer, sizeof(trailer), nextOffset + indexBytes) != 0 ||
+        pwriteAll(fd, &header, sizeof(header), 0) != 0)
+    {
+        result = -1;
+    }
+    if (::close(fd) != 0)
+    {
+        result = -1;
+    }
+    fd = -1;
+    return result;
+}
+
+
+
+LfReplay::LfReplay(const char *path)
+    : fd(-1), map(NULL), mapBytes(0), entries(NULL), frameCount(0), cameras(0), cursor(0),
+      loop(false), realtime(false), firstTimestamp(0), startTime(0)
+{
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Can't open recording");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < k_lfrAlignment)
+    {
+        ::close(fd);
+        throw runtime_error("Recording is too short");
+    }
+    mapBytes = st.st_size;
+
+    map = (unsigned char *)mmap(NULL, mapBytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ::close(fd);
+        throw runtime_error("Can't map recording");
+    }
+    // Replay reads front to back
+    madvise(map, mapBytes, MADV_SEQUENTIAL);
+
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, k_lfrMagic, sizeof(header.magic)) != 0 ||
+        header.alignment != k_lfrAlignment || header.frameBytes == 0 ||
+        header.frameBytes > mapBytes - k_lfrAlignment ||
+        (uint64_t)header.stride * header.height != header.frameBytes)
+    {
+        munmap(map, mapBytes);
+        ::close(fd);
+        throw runtime_error("Not a laser fence recording");
+    }
+
+    // The index is only trusted if it lies inside the file and every frame
+    // it lists does too; sizes are compared by division so a damaged count
+    // can't overflow past the check
+    LfrTrailer trailer;
+    memcpy(&trailer, map + mapBytes - sizeof(trailer), sizeof(trailer));
+    uint64_t framesEnd = mapBytes;
+    bool indexed = false;
+    if (memcmp(trailer.magic, k_lfrIndexMagic, sizeof(trailer.magic)) == 0)
+    {
+        uint64_t indexEnd = mapBytes - sizeof(trailer);
+        indexed = trailer.indexOffset >= k_lfrAlignment && trailer.indexOffset <= indexEnd &&
+                  trailer.frameCount <= (indexEnd - trailer.indexOffset) / sizeof(LfrIndexEntry);
+        if (indexed)
+        {
+            framesEnd = trailer.indexOffset;
+            const LfrIndexEntry *index = (const LfrIndexEntry *)(map + trailer.indexOffset);
+            for (uint64_t i = 0; i < trailer.frameCount && indexed; i++)
+            {
+                indexed = index[i].offset >= k_lfrAlignment && framesEnd >= header.frameBytes &&
+                          index[i].offset <= framesEnd - header.frameBytes;
+            }
+        }
+        if (indexed)
+        {
+            entries = (const LfrIndexEntry *)(map + trailer.indexOffset);
+            frameCount = trailer.frameCount;
+        }
+        else
+        {
+            cout << "Recording index is damaged" << endl;
+            framesEnd = trailer.indexOffset >= k_lfrAlignment && trailer.indexOffset <= mapBytes ?
+                        trailer.indexOffset : mapBytes;
+        }
+    }
+    if (!indexed)
+    {
+        // No usable trailer: every full slot after the header holds a
+        // frame, but their timestamps are lost
+        cout << "Recording has no index, rebuilding from frame slots" << endl;
+        uint64_t slotBytes = alignUp(header.frameBytes);
+        for (uint64_t offset = k_lfrAlignment; offset + header.frameBytes <= framesEnd; offset += slotBytes)
+        {
+            LfrIndexEntry entry;
+            entry.offset = offset;
+            entry.timestamp = 0;
+            entry.seq = rebuilt.size();
+            entry.camera = 0;
+            rebuilt.push_back(entry);
+        }
+        frameCount = rebuilt.size();
+        entries = frameCount ? &rebuilt[0] : NULL;
+    }
+    for (uint64_t i = 0; i < frameCount; i++)
+    {
+        if (entries[i].camera >= cameras)
+        {
+            cameras = (uint64_t)entries[i].camera + 1;
+        }
+    }
+}
+
+LfReplay::~LfReplay()
+{
+    munmap(map, mapBytes);
+    ::close(fd);
+}
+
+int LfReplay::connect(int /*cameraIndex*/)
+{
+    return 0;
+}
+
+int LfReplay::start()
+{
+    cursor = 0;
+    startTime = lfTimestampUs();
+    firstTimestamp = frameCount ? entries[0].timestamp : 0;
+    return 0;
+}
+
+int LfReplay::retrieveImage(LfFrame *frame)
+{
+    uint64_t i = cursor;
+    if (i >= frameCount)
+    {
+        if (!loop || frameCount == 0)
+        {
+            return -1;
+        }
+        i = 0;
+        startTime = lfTimestampUs();
+    }
+    cursor = i + 1;
+
+    const LfrIndexEntry &entry = entries[i];
+    if (realtime && entry.timestamp > firstTimestamp)
+    {
+        unsigned long long due = startTime + (entry.timestamp - firstTimestamp);
+        unsigned long long now = lfTimestampUs();
+        if (due > now)
+        {
+            usleep(due - now);
+        }
+    }
+
+    // Point the frame into the mapping instead of copying
+    frame->data = map + entry.offset;
+    frame->capacity = header.frameBytes;
+    frame->dataSize = header.frameBytes;
+    frame->width = header.width;
+    frame->height = header.height;
+    frame->stride = header.stride;
+    frame->format = (LfPixelFormat)header.pixelFormat;
+    frame->nativeFormat = header.nativeFormat;
+    frame->offsetX = 0;
+    frame->offsetY = 0;
+    frame->timestamp = entry.timestamp;
+    frame->seq = entry.seq;
+    frame->camera = entry.camera;
+    return 0;
+}
+
+int LfReplay::stop()
+{
+    return 0;
+}
+
+int LfReplay::disconnect()
+{
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Raw recording format (.lfr) for laser fence application.
+
+#ifndef LFREC_H
+#define LFREC_H
+
+#include "stdafx.h"
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "lfbuf.h"
+#include "lfsrc.h"
+
+// Layout of a .lfr file:
+//   LfrHeader, padded to k_lfrAlignment
+//   frame payloads, each starting on a k_lfrAlignment boundary
+//   LfrIndexEntry for every frame
+//   LfrTrailer
+// Every frame has the geometry given in the header.  A file without a
+// trailer (recording cut short) can still be replayed from its payloads.
+static const uint32_t k_lfrAlignment = 4096;
+static const char k_lfrMagic[4] = { 'L', 'F', 'R', '1' };
+static const char k_lfrIndexMagic[4] = { 'L', 'F', 'R', 'I' };
+
+struct LfrHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t pixelFormat;       // LfPixelFormat
+    uint32_t nativeFormat;
+    uint32_t triggerMode;
+    uint32_t framesPerTrigger;
+    uint32_t alignment;
+    uint64_t frameBytes;
+};
+
+struct LfrIndexEntry {
+    uint64_t offset;
+    uint64_t timestamp;
+    uint32_t seq;
+    uint32_t camera;
+};
+
+struct LfrTrailer {
+    uint64_t indexOffset;
+    uint64_t frameCount;
+    char magic[4];
+    uint32_t reserved;
+};
+
+// Appends frames to a .lfr file.  Not thread safe; run it on one stage.
+class LfRecorder {
+protected:
+    int fd;
+    LfrHeader header;
+    uint64_t nextOffset;
+    uint64_t slotBytes;
+    std::vector<LfrIndexEntry> index;
+    unsigned long rejected;
+public:
+    LfRecorder();
+    ~LfRecorder();
+    int open(const char *path, unsigned int width, unsigned int height, unsigned int stride,
+             LfPixelFormat format, unsigned int triggerMode, unsigned int framesPerTrigger);
+    int append(const LfFrame *frame);
+    // Writes the index and trailer
+    int close();
+    unsigned long getFrameCount() const { return index.size(); }
+    unsigned long getRejected() const { return rejected; }
+};
+
+// Replays a .lfr recording through the same interface as a live camera.
+// The file is memory mapped and retrieveImage() hands out zero-copy views
+// into the mapping; the frame's own buffer is restored when it goes back
+// to its pool.
+class LfReplay: public LfFrameSource {
+protected:
+    int fd;
+    unsigned char *map;
+    size_t mapBytes;
+    LfrHeader header;
+    const LfrIndexEntry *entries;
+    std::vector<LfrIndexEntry> rebuilt;    // Index for files without a trailer
+    uint64_t frameCount;
+    uint64_t cameras;                   // Highest camera index listed, plus one
+    std::atomic<uint64_t> cursor;
+    bool loop;
+    bool realtime;
+    unsigned long long firstTimestamp;
+    unsigned long long startTime;
+public:
+    LfReplay(const char *path);
+    ~LfReplay();
+    // Start over at the end instead of failing
+    void setLoop(bool on) { loop = on; }
+    // Pace frames by their recorded timestamps instead of as fast as possible
+    void setRealtime(bool on) { realtime = on; }
+    virtual int connect(int cameraIndex);
+    virtual int start();
+    virtual int retrieveImage(LfFrame *frame);
+    virtual int stop();
+    virtual int disconnect();
+    virtual unsigned int getFrameWidth() const { return header.width; }
+    virtual unsigned int getFrameHeight() const { return header.height; }
+    virtual LfPixelFormat getFrameFormat() const { return (LfPixelFormat)header.pixelFormat; }
+    // Frames keep the camera index they were recorded with
+    virtual bool hasCameraIndex() const { return true; }
+    // Cameras the index lists frames of, all with the header's geometry
+    uint64_t getCameraCount() const { return cameras; }
+    bool atEnd() const { return !loop && cursor >= frameCount; }
+    uint64_t getFrameCount() const { return frameCount; }
+    const LfrHeader &getHeader() const { return header; }
+};
+
+#endif
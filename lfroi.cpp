@@ -0,0 +1,246 @@
+// Laser band ROI tracking for laser fence application.
+
+#include "lfroi.h"
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+void lfRoiDefaults(LfRoiSettings *settings)
+{
+    settings->margin = 48;
+    settings->minHeight = 128;
+    settings->columnStep = 16;
+    settings->minPeak = 48;
+    settings->minFound = 0.5;
+    settings->acquirePairs = 8;
+    settings->lostPairs = 15;
+    settings->settlePairs = 30;
+}
+
+const char *lfRoiStateName(LfRoiState state)
+{
+    switch (state)
+    {
+    case LF_ROI_TRACK:
+        return "tracking";
+    case LF_ROI_WIDEN:
+        return "widened";
+    default:
+        return "acquiring";
+    }
+}
+
+LfRoiTracker::LfRoiTracker(unsigned int sensorWidth, unsigned int sensorHeight, const LfRoiSettings &settings)
+    : settings(settings), sensorWidth(sensorWidth), sensorHeight(sensorHeight), state(LF_ROI_ACQUIRE),
+      pending(false), settleLeft(0), goodPairs(0), lostPairs(0), acquireTop(0), acquireBottom(0),
+      bandTop(-1), bandBottom(-1), changes(0), widenings(0), reacquisitions(0), pairsSeen(0), rowsRead(0)
+{
+    if (this->settings.columnStep == 0)
+    {
+        this->settings.columnStep = 1;
+    }
+    roi.offsetX = 0;
+    roi.offsetY = 0;
+    roi.width = sensorWidth;
+    roi.height = sensorHeight;
+    previous = roi;
+
+    // Sized for the full sensor so update() never allocates
+    unsigned int columns = (sensorWidth + this->settings.columnStep - 1) / this->settings.columnStep;
+    peakValue.resize(columns);
+    peakRow.resize(columns);
+    foundRows.reserve(columns);
+}
+
+bool LfRoiTracker::findBand(const LfDiffEngine &engine)
+{
+    const unsigned char *diff = engine.getDiff();
+    unsigned int width = engine.getWidth();
+    unsigned int height = engine.getHeight();
+    unsigned int step = settings.columnStep;
+    unsigned int columns = (width + step - 1) / step;
+    if (columns > peakValue.size())
+    {
+        columns = peakValue.size();
+    }
+
+    // Brightest difference in each sampled column, scanning row by row
+    fill(peakValue.begin(), peakValue.begin() + columns, 0);
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const unsigned char *row = diff + (size_t)y * width;
+        for (unsigned int c = 0; c < columns; c++)
+        {
+            unsigned char v = row[c * step];
+            if (v > peakValue[c])
+            {
+                peakValue[c] = v;
+                peakRow[c] = y;
+            }
+        }
+    }
+
+    foundRows.clear();
+    for (unsigned int c = 0; c < columns; c++)
+    {
+        if (peakValue[c] >= settings.minPeak)
+        {
+            foundRows.push_back(peakRow[c]);
+        }
+    }
+    if (columns == 0 || foundRows.size() < settings.minFound * columns)
+    {
+        return false;
+    }
+
+    // Ignore the odd column whose peak is a glint rather than the line
+    sort(foundRows.begin(), foundRows.end());
+    size_t trim = foundRows.size() / 100;
+    bandTop = foundRows[trim] + engine.getOffsetY();
+    bandBottom = foundRows[foundRows.size() - 1 - trim] + engine.getOffsetY();
+    return true;
+}
+
+bool LfRoiTracker::request(int top, int bottom)
+{
+    int first = top - (int)settings.margin;
+    int last = bottom + (int)settings.margin + 1;
+    if (last - first < (int)settings.minHeight)
+    {
+        int grow = (int)settings.minHeight - (last - first);
+        first -= grow / 2;
+        last += grow - grow / 2;
+    }
+    // Slide rather than shrink a window pushed against the sensor edge
+    if (first < 0)
+    {
+        last -= first;
+        first = 0;
+    }
+    if (last > (int)sensorHeight)
+    {
+        first -= last - (int)sensorHeight;
+        last = sensorHeight;
+        first = first < 0 ? 0 : first;
+    }
+
+    if ((unsigned int)first == roi.offsetY && (unsigned int)(last - first) == roi.height)
+    {
+        return false;
+    }
+    previous = roi;
+    roi.offsetX = 0;
+    roi.offsetY = first;
+    roi.width = sensorWidth;
+    roi.height = last - first;
+    pending = true;
+    settleLeft = settings.settlePairs;
+    changes++;
+    return true;
+}
+
+bool LfRoiTracker::requestFull()
+{
+    return request(0, sensorHeight - 1);
+}
+
+bool LfRoiTracker::update(const LfDiffEngine &engine)
+{
+    pairsSeen++;
+    rowsRead += engine.getHeight();
+
+    if (pending)
+    {
+        // Pairs captured before the switch are still coming through
+        bool arrived = engine.getOffsetY() == roi.offsetY && engine.getHeight() == roi.height;
+        bool left = engine.getOffsetY() != previous.offsetY || engine.getHeight() != previous.height;
+        if (!arrived && !left && settleLeft > 0)
+        {
+            settleLeft--;
+            return false;
+        }
+        // Take whatever window the camera settled on, which may be rounded
+        pending = false;
+        roi.offsetX = engine.getOffsetX();
+        roi.offsetY = engine.getOffsetY();
+        roi.width = engine.getWidth();
+        roi.height = engine.getHeight();
+    }
+
+    bool found = findBand(engine);
+    if (state == LF_ROI_ACQUIRE)
+    {
+        if (!found)
+        {
+            goodPairs = 0;
+            return false;
+        }
+        // The band must cover wherever the line was over the first pairs
+        acquireTop = goodPairs == 0 ? bandTop : min(acquireTop, bandTop);
+        acquireBottom = goodPairs == 0 ? bandBottom : max(acquireBottom, bandBottom);
+        if (++goodPairs < settings.acquirePairs)
+        {
+            return false;
+        }
+        goodPairs = 0;
+        state = LF_ROI_TRACK;
+        return request(acquireTop, acquireBottom);
+    }
+
+    if (found)
+    {
+        lostPairs = 0;
+        if (state == LF_ROI_WIDEN)
+        {
+            state = LF_ROI_TRACK;
+            return request(bandTop, bandBottom);
+        }
+
+        // Re-centre once the line drifts into the outer half of the margin,
+        // and narrow a window left wide by widening or acquisition
+        int slack = settings.margin / 2;
+        int windowTop = roi.offsetY;
+        int windowEnd = roi.offsetY + roi.height;
+        bool nearTop = windowTop > 0 && bandTop < windowTop + slack;
+        bool nearBottom = windowEnd < (int)sensorHeight && bandBottom + slack >= windowEnd;
+        int needed = max(bandBottom - bandTop + 1 + 2 * (int)settings.margin, (int)settings.minHeight);
+        bool tooWide = (int)roi.height > needed + 2 * (int)settings.margin;
+        if (nearTop || nearBottom || tooWide)
+        {
+            return request(bandTop, bandBottom);
+        }
+        return false;
+    }
+
+    if (++lostPairs < settings.lostPairs)
+    {
+        return false;
+    }
+    lostPairs = 0;
+    if (state == LF_ROI_TRACK)
+    {
+        // The line may have jumped just outside the band: look three times as wide
+        state = LF_ROI_WIDEN;
+        widenings++;
+        int centre = roi.offsetY + roi.height / 2;
+        int half = roi.height * 3 / 2;
+        return request(centre - half + (int)settings.margin, centre + half - (int)settings.margin);
+    }
+    state = LF_ROI_ACQUIRE;
+    goodPairs = 0;
+    reacquisitions++;
+    return requestFull();
+}
+
+void LfRoiTracker::printStats()
+{
+    cout << "ROI " << lfRoiStateName(state) << ": rows " << roi.offsetY << "-" << roi.offsetY + roi.height
+         << " of " << sensorHeight << ", " << changes << " changes, " << widenings << " widenings, "
+         << reacquisitions << " reacquisitions";
+    if (pairsSeen > 0)
+    {
+        cout << ", " << 100.0 * rowsRead / ((double)pairsSeen * sensorHeight) << "% of rows read";
+    }
+    cout << endl;
+}
@@ -0,0 +1,80 @@
+// Laser band ROI tracking for laser fence application.
+
+#ifndef LFROI_H
+#define LFROI_H
+
+#include "stdafx.h"
+#include <vector>
+#include "lfalg.h"
+#include "lfsrc.h"
+
+struct LfRoiSettings {
+    unsigned int margin;        // Rows kept above and below the line
+    unsigned int minHeight;     // Smallest window ever requested
+    unsigned int columnStep;    // Look for the line in every n-th column
+    unsigned char minPeak;      // Difference a column's peak must reach
+    double minFound;            // Fraction of columns that must see the line
+    unsigned int acquirePairs;  // Full-sensor pairs to find the band over
+    unsigned int lostPairs;     // Pairs without the line before widening
+    unsigned int settlePairs;   // Most pairs to wait for a new window to arrive
+};
+
+void lfRoiDefaults(LfRoiSettings *settings);
+
+enum LfRoiState {
+    LF_ROI_ACQUIRE = 0,     // Reading the full sensor to find the line
+    LF_ROI_TRACK,           // Reading a band around the line
+    LF_ROI_WIDEN            // Line lost; reading a wider band before giving up
+};
+
+const char *lfRoiStateName(LfRoiState state);
+
+// Finds the rows the laser line occupies from the difference planes and
+// keeps the camera reading only a padded band around them.  The line
+// spans the sensor horizontally, so the window is full width and only
+// its rows change.  The tracker follows drift by re-centring when the
+// line nears the band edge, widens when the line is lost, and goes back
+// to the full sensor if it stays lost.  It only decides; the caller
+// forwards getRoi() to the camera when update() returns true.
+class LfRoiTracker {
+protected:
+    LfRoiSettings settings;
+    unsigned int sensorWidth;
+    unsigned int sensorHeight;
+    LfRoiState state;
+    LfRoi roi;                      // Window last asked for
+    LfRoi previous;                 // Window before that
+    bool pending;                   // Still seeing frames from the old window
+    unsigned int settleLeft;
+    unsigned int goodPairs;
+    unsigned int lostPairs;
+    int acquireTop;
+    int acquireBottom;
+    int bandTop;                    // Line rows in the last pair, sensor coordinates
+    int bandBottom;
+    std::vector<unsigned char> peakValue;
+    std::vector<unsigned int> peakRow;
+    std::vector<unsigned int> foundRows;
+    unsigned long changes;
+    unsigned long widenings;
+    unsigned long reacquisitions;
+    unsigned long pairsSeen;
+    unsigned long long rowsRead;
+    bool findBand(const LfDiffEngine &engine);
+    bool request(int top, int bottom);
+    bool requestFull();
+public:
+    LfRoiTracker(unsigned int sensorWidth, unsigned int sensorHeight, const LfRoiSettings &settings);
+    // Call after the engine has processed a pair.  Returns true when the
+    // camera should be switched to getRoi().
+    bool update(const LfDiffEngine &engine);
+    const LfRoi &getRoi() const { return roi; }
+    LfRoiState getState() const { return state; }
+    int getBandTop() const { return bandTop; }
+    int getBandBottom() const { return bandBottom; }
+    unsigned long getChanges() const { return changes; }
+    unsigned long getReacquisitions() const { return reacquisitions; }
+    void printStats();
+};
+
+#endif
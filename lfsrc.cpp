@@ -0,0 +1,300 @@
+// Frame source interface for laser fence application.
+
+#include "lfsrc.h"
+#include <stdlib.h>
+
+using namespace std;
+
+// Mean change, in 8-bit levels, a row needs for a pair to count as the
+// right or wrong way round
+static const long k_pairContrastLevel = 16;
+// Pairs in a row the wrong way round before pairing moves over
+static const unsigned int k_swapVotes = 3;
+
+// Sign of the row that changed most from off to on, summing the top byte
+// of every eighth pixel; 0 if no row changed by k_pairContrastLevel
+static int lfPairContrast(const LfFrame *on, const LfFrame *off)
+{
+    if (on->format != off->format || on->width != off->width || on->height != off->height)
+    {
+        return 0;
+    }
+
+    size_t first;
+    size_t step;
+    switch (on->format)
+    {
+    case LF_PIXEL_MONO8:
+        first = 0;
+        step = 8;
+        break;
+    case LF_PIXEL_MONO12:
+        // Byte 0 of each three holds bits 11-4 of the first pixel
+        first = 0;
+        step = 12;
+        break;
+    case LF_PIXEL_MONO16:
+        first = 1;
+        step = 16;
+        break;
+    default:
+        return 0;
+    }
+    size_t rowBytes = lfRowBytes(on->format, on->width);
+    if (rowBytes <= first)
+    {
+        return 0;
+    }
+
+    long samples = (long)((rowBytes - first - 1) / step + 1);
+    long best = 0;
+    for (unsigned int y = 0; y < on->height; y++)
+    {
+        const unsigned char *a = on->data + (size_t)y * on->stride;
+        const unsigned char *b = off->data + (size_t)y * off->stride;
+        long change = 0;
+        for (size_t x = first; x < rowBytes; x += step)
+        {
+            change += (long)a[x] - (long)b[x];
+        }
+        if (labs(change) > labs(best))
+        {
+            best = change;
+        }
+    }
+    if (labs(best) < k_pairContrastLevel * samples)
+    {
+        return 0;
+    }
+    return best > 0 ? 1 : -1;
+}
+
+LfPairCapture::LfPairCapture(LfFrameSource *source, LfFramePool *pool, unsigned int camera)
+    : source(source), pool(pool), camera(camera), roiPending(false), roiChanges(0), roiFailures(0),
+      anchored(false), lastSeq(0), onParity(0), swapVotes(0), skipFrame(false), framesLost(0),
+      framesDiscarded(0), reordered(0), resyncs(0), reanchors(0)
+{
+}
+
+void LfPairCapture::requestRoi(const LfRoi &roi)
+{
+    lock_guard<mutex> guard(roiLock);
+    pendingRoi = roi;
+    roiPending.store(true, memory_order_release);
+}
+
+int LfPairCapture::capture(LfFrame **on)
+{
+    LfFrame *first = pool->lease();
+    LfFrame *second = first != NULL ? pool->lease() : NULL;
+    if (second == NULL)
+    {
+        // Every buffer is still queued downstream
+        pool->release(first);
+        return 1;
+    }
+
+    // Only a flag test unless the ROI tracker asked for a change
+    if (roiPending.load(memory_order_acquire))
+    {
+        LfRoi roi;
+        {
+            lock_guard<mutex> guard(roiLock);
+            roi = pendingRoi;
+            roiPending.store(false, memory_order_relaxed);
+        }
+        if (source->setRoi(roi) == 0)
+        {
+            roiChanges.fetch_add(1, memory_order_relaxed);
+            // A restarted camera may count afresh
+            anchored = false;
+        }
+        else
+        {
+            roiFailures.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // Mode 15 delivers both frames of a trigger back to back
+    int result = -1;
+    if (source->pollForTriggerReady())
+    {
+        if (source->hasFrameCounter())
+        {
+            result = captureCounted(&first, &second);
+        }
+        else
+        {
+            if (skipFrame)
+            {
+                // The pairing moves over by the frame this drops
+                skipFrame = false;
+                if (source->retrieveImage(first) == 0)
+                {
+                    count(framesDiscarded);
+                }
+            }
+            if (source->retrieveImage(first) == 0 && source->retrieveImage(second) == 0)
+            {
+                result = 0;
+                if (second->timestamp < first->timestamp)
+                {
+                    count(reordered);
+                    result = -1;
+                }
+            }
+        }
+    }
+    if (result == 0 && source->hasCameraIndex() && first->camera != second->camera)
+    {
+        // Both frames of a pair come from one camera
+        count(framesDiscarded, 2);
+        result = -1;
+    }
+    if (result == 0 && source->getOnParity() < 0 && !checkBrightness(first, second))
+    {
+        // The pair that showed it is the wrong way round too
+        count(framesDiscarded, 2);
+        result = -1;
+    }
+    if (result != 0)
+    {
+        pool->release(second);
+        pool->release(first);
+        return -1;
+    }
+
+    if (!source->hasCameraIndex())
+    {
+        first->camera = camera;
+        second->camera = camera;
+    }
+    first->pair = second;
+    *on = first;
+    return 0;
+}
+
+// Gap accounting against the last frame seen
+void LfPairCapture::noteFrame(const LfFrame *frame)
+{
+    if (!anchored)
+    {
+        int parity = source->getOnParity();
+        onParity = parity >= 0 ? (unsigned int)parity : (frame->seq & 1);
+        lastSeq = frame->seq;
+        swapVotes = 0;
+        anchored = true;
+        return;
+    }
+    int delta = (int)(frame->seq - lastSeq - 1);
+    if (delta > 0)
+    {
+        count(framesLost, delta);
+    }
+    else if (delta < 0)
+    {
+        count(reordered);
+    }
+    lastSeq = frame->seq;
+}
+
+// Fills first and second with an on frame and the frame counted right
+// after it, retrieving more frames while the pairing is broken.  Each
+// lost frame costs at most one more frame to realign.
+int LfPairCapture::captureCounted(LfFrame **on, LfFrame **off)
+{
+    LfFrame *first = *on;
+    LfFrame *second = *off;
+    const unsigned int maxExtra = 4;
+    unsigned int extra = 0;
+    bool broken = false;
+
+    if (source->retrieveImage(first) != 0)
+    {
+        return -1;
+    }
+    noteFrame(first);
+    while (true)
+    {
+        if (!isOn(first))
+        {
+            // Its laser-on frame was lost; the next trigger starts over
+            count(framesDiscarded);
+            broken = true;
+            if (++extra > maxExtra || source->retrieveImage(first) != 0)
+            {
+                return -1;
+            }
+            noteFrame(first);
+            continue;
+        }
+
+        if (source->retrieveImage(second) != 0)
+        {
+            return -1;
+        }
+        noteFrame(second);
+        if (second->seq == first->seq + 1 && second->timestamp >= first->timestamp)
+        {
+            break;
+        }
+
+        // The laser-off frame went missing.  The frame that came instead
+        // may be the next on frame, so it gets a turn as the first.
+        count(framesDiscarded);
+        broken = true;
+        LfFrame *next = second;
+        second = first;
+        first = next;
+        if (++extra > maxExtra)
+        {
+            return -1;
+        }
+    }
+
+    if (broken)
+    {
+        count(resyncs);
+    }
+    // The two buffers may have swapped roles
+    *on = first;
+    *off = second;
+    return 0;
+}
+
+// Votes on whether a pair is the right way round when the source can't
+// say which frames are laser-on.  The laser line only shows in the on
+// frame, so the row that changed most should be brighter there; a scene
+// without a clear change doesn't vote.  Returns false, with the parity
+// flipped, once k_swapVotes pairs in a row were darker in the on frame.
+bool LfPairCapture::checkBrightness(const LfFrame *on, const LfFrame *off)
+{
+    int contrast = lfPairContrast(on, off);
+    if (contrast > 0)
+    {
+        swapVotes = 0;
+    }
+    else if (contrast < 0 && ++swapVotes >= k_swapVotes)
+    {
+        swapVotes = 0;
+        onParity ^= 1;
+        skipFrame = true;
+        count(reanchors);
+        return false;
+    }
+    return true;
+}
+
+void LfPairCapture::setMetrics(LfMetricsRegistry &registry, const char *labels)
+{
+    registry.addValue("lf_frames_lost_total", "Gaps in the camera's frame counter", labels,
+                      LF_METRIC_COUNTER, &framesLost);
+    registry.addValue("lf_frames_discarded_total", "Frames dropped for want of their pair partner", labels,
+                      LF_METRIC_COUNTER, &framesDiscarded);
+    registry.addValue("lf_frames_reordered_total", "Frames older than the one before them", labels,
+                      LF_METRIC_COUNTER, &reordered);
+    registry.addValue("lf_pair_resyncs_total", "Times pairing was found again after a lost frame", labels,
+                      LF_METRIC_COUNTER, &resyncs);
+    registry.addValue("lf_pair_reanchors_total", "Times on and off frames were found swapped", labels,
+                      LF_METRIC_COUNTER, &reanchors);
+}
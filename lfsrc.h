@@ -0,0 +1,124 @@
+// Frame source interface for laser fence application.
+
+#ifndef LFSRC_H
+#define LFSRC_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <mutex>
+#include "lfbuf.h"
+#include "lfmetrics.h"
+
+// Sub-window of the sensor, in sensor pixels
+struct LfRoi {
+    unsigned int offsetX;
+    unsigned int offsetY;
+    unsigned int width;
+    unsigned int height;
+};
+
+// Anything that delivers frames into leased buffers: a live camera, a
+// recording or a synthetic generator.  Calls return 0 on success and -1 on
+// failure, like the rest of LfCam.
+class LfFrameSource {
+public:
+    virtual ~LfFrameSource() {}
+    virtual int connect(int cameraIndex) = 0;
+    virtual int start() = 0;
+    // Block until the source can accept the next trigger
+    virtual bool pollForTriggerReady() { return true; }
+    virtual int retrieveImage(LfFrame *frame) = 0;
+    virtual int stop() = 0;
+    virtual int disconnect() = 0;
+    // Frame geometry the source delivers
+    virtual unsigned int getFrameWidth() const = 0;
+    virtual unsigned int getFrameHeight() const = 0;
+    virtual LfPixelFormat getFrameFormat() const = 0;
+    // Full sensor size, which the ROI is a window of
+    virtual unsigned int getSensorWidth() const { return getFrameWidth(); }
+    virtual unsigned int getSensorHeight() const { return getFrameHeight(); }
+    // Restrict readout to a window of the sensor.  The source may round
+    // the window out to what the hardware supports; frames report the
+    // result in their offset and size.  Call only from the capturing
+    // thread, between frames.  Sources without ROI support return -1.
+    virtual int setRoi(const LfRoi & /*roi*/) { return -1; }
+    // Sources that stamp LfFrame::seq with the sensor's own frame counter
+    // return true, so a gap in it is a lost frame
+    virtual bool hasFrameCounter() const { return false; }
+    // Sources of several cameras' frames, such as a recording, return true
+    // when they stamp LfFrame::camera themselves
+    virtual bool hasCameraIndex() const { return false; }
+    // Counter parity of laser-on frames, or -1 if the source can't tell,
+    // in which case the first frame after start or an ROI change is taken
+    // to be one until the pairs' brightness says otherwise
+    virtual int getOnParity() const { return -1; }
+};
+
+// Anything that hands out ready-made linked frame pairs, such as the merged
+// stream of several cameras.
+class LfPairFeed {
+public:
+    virtual ~LfPairFeed() {}
+    // Returns the next pair, or NULL if none arrived within timeoutUs
+    virtual LfFrame *nextPair(unsigned int timeoutUs) = 0;
+};
+
+// Grabs the two frames of one trigger from a source into leased buffers
+// and links them through LfFrame::pair.  With a frame counter every pair
+// is checked to be an on frame and the one right after it: a frame whose
+// partner was lost is dropped and the next on frame starts the pair, so
+// one lost frame can't swap every pair after it.  Without one, pairs whose
+// timestamps run backwards are dropped.  When the source can't tell which
+// frames are laser-on, each pair's brightest changed row is checked to be
+// brighter in the on frame; a few pairs in a row the other way round mean
+// the first frame was an off frame, and pairing moves over by one frame.
+class LfPairCapture {
+protected:
+    LfFrameSource *source;
+    LfFramePool *pool;
+    unsigned int camera;
+    std::mutex roiLock;
+    LfRoi pendingRoi;
+    std::atomic<bool> roiPending;
+    std::atomic<unsigned long> roiChanges;
+    std::atomic<unsigned long> roiFailures;
+    bool anchored;                  // lastSeq and onParity are known
+    unsigned int lastSeq;
+    unsigned int onParity;
+    unsigned int swapVotes;         // Pairs in a row with the off frame brighter
+    bool skipFrame;                 // Drop a frame to move uncounted pairing over
+    std::atomic<unsigned long> framesLost;      // Gaps in the counter
+    std::atomic<unsigned long> framesDiscarded; // Grabbed, but with no partner
+    std::atomic<unsigned long> reordered;       // Counter or timestamp ran backwards
+    std::atomic<unsigned long> resyncs;         // Pairs found again after a break
+    std::atomic<unsigned long> reanchors;       // On and off frames found swapped
+    void noteFrame(const LfFrame *frame);
+    bool checkBrightness(const LfFrame *on, const LfFrame *off);
+    bool isOn(const LfFrame *frame) const { return (frame->seq & 1) == onParity; }
+    int captureCounted(LfFrame **on, LfFrame **off);
+    static void count(std::atomic<unsigned long> &counter, unsigned long n = 1)
+    {
+        // Only the capturing thread writes these
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+public:
+    LfPairCapture(LfFrameSource *source, LfFramePool *pool, unsigned int camera = 0);
+    // Returns 0 with *on set, 1 if the pool has no free buffers, -1 on a
+    // capture error.  Nothing stays leased unless 0 is returned.
+    int capture(LfFrame **on);
+    // Ask for a new ROI from any thread.  It is applied before the next
+    // pair so the two frames of a trigger always share one window; a
+    // later request replaces one not yet applied.
+    void requestRoi(const LfRoi &roi);
+    unsigned long getRoiChanges() const { return roiChanges.load(std::memory_order_relaxed); }
+    unsigned long getRoiFailures() const { return roiFailures.load(std::memory_order_relaxed); }
+    unsigned long getFramesLost() const { return framesLost.load(std::memory_order_relaxed); }
+    unsigned long getFramesDiscarded() const { return framesDiscarded.load(std::memory_order_relaxed); }
+    unsigned long getReordered() const { return reordered.load(std::memory_order_relaxed); }
+    unsigned long getResyncs() const { return resyncs.load(std::memory_order_relaxed); }
+    unsigned long getReanchors() const { return reanchors.load(std::memory_order_relaxed); }
+    // Export the counts above under the given labels
+    void setMetrics(LfMetricsRegistry &registry, const char *labels);
+};
+
+#endif
@@ -0,0 +1,293 @@
+// Synthetic camera for laser fence application.
+
+#include "lfsynth.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdexcept>
+
+using namespace std;
+
+void lfSynthDefaults(LfSynthSettings *settings)
+{
+    settings->width = 2048;
+    settings->height = 2048;
+    settings->triggerRate = 60.0;
+    settings->intraPairUs = 1000;
+    settings->laserRow = 1024;
+    settings->laserSlope = 0.0;
+    settings->laserIntensity = 160;
+    settings->laserSigma = 1.5;
+    settings->noise = 6;
+    settings->flicker = 0;
+    settings->intrusionRate = 0.0;
+    settings->intrusionPairs = 10;
+    settings->intrusionWidth = 64;
+    settings->dropRate = 0.0;
+    settings->drift = 0.0;
+    settings->seed = 1;
+}
+
+LfSynthCam::LfSynthCam(const LfSynthSettings &settings)
+    : settings(settings), onBase(NULL), offBase(NULL), noiseTable(NULL), noiseBytes(0),
+      rng(settings.seed ? settings.seed : 1), startTime(0), seq(0), intrusionLeft(0),
+      intrusionStart(0), framesDropped(0), intrusions(0), running(false), shift(0)
+{
+    if (settings.width == 0 || settings.height == 0)
+    {
+        throw runtime_error("Synthetic camera needs a frame size");
+    }
+
+    roi.offsetX = 0;
+    roi.offsetY = 0;
+    roi.width = settings.width;
+    roi.height = settings.height;
+
+    size_t pixels = (size_t)settings.width * settings.height;
+    // Extra noise beyond one frame lets every frame start at a new offset
+    noiseBytes = pixels + 65536;
+    onBase = (unsigned char *)lfAlignedAlloc(pixels);
+    offBase = (unsigned char *)lfAlignedAlloc(pixels);
+    noiseTable = (unsigned char *)lfAlignedAlloc(noiseBytes);
+    if (onBase == NULL || offBase == NULL || noiseTable == NULL)
+    {
+        lfAlignedFree(onBase);
+        lfAlignedFree(offBase);
+        lfAlignedFree(noiseTable);
+        throw runtime_error("Can't allocate synthetic scene");
+    }
+
+    buildScene();
+}
+
+LfSynthCam::~LfSynthCam()
+{
+    lfAlignedFree(onBase);
+    lfAlignedFree(offBase);
+    lfAlignedFree(noiseTable);
+}
+
+unsigned int LfSynthCam::random()
+{
+    // xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (unsigned int)((rng * 2685821657736338717ULL) >> 32);
+}
+
+double LfSynthCam::getLaserRow(unsigned int x) const
+{
+    return sceneRow(x) + shift;
+}
+
+double LfSynthCam::sceneRow(unsigned int x) const
+{
+    // A slight wave so the line is not perfectly straight
+    return settings.laserRow + settings.laserSlope * x + 2.0 * sin(x / 60.0);
+}
+
+int LfSynthCam::lineRow(unsigned int x) const
+{
+    return (int)floor(sceneRow(x) + 0.5);
+}
+
+void LfSynthCam::buildScene()
+{
+    unsigned int width = settings.width;
+    unsigned int height = settings.height;
+
+    // Darker sky to brighter ground with fixed texture
+    for (unsigned int y = 0; y < height; y++)
+    {
+        unsigned int shade = 40 + 30 * y / height;
+        for (unsigned int x = 0; x < width; x++)
+        {
+            offBase[(size_t)y * width + x] = shade + random() % 16;
+        }
+    }
+    memcpy(onBase, offBase, (size_t)width * height);
+
+    int reach = (int)ceil(4 * settings.laserSigma);
+    for (unsigned int x = 0; x < width; x++)
+    {
+        double centre = sceneRow(x);
+        for (int y = (int)centre - reach; y <= (int)centre + reach + 1; y++)
+        {
+            if (y < 0 || y >= (int)height)
+            {
+                continue;
+            }
+            double d = (y - centre) / settings.laserSigma;
+            unsigned int v = onBase[(size_t)y * width + x] +
+                             (unsigned int)(settings.laserIntensity * exp(-0.5 * d * d) + 0.5);
+            onBase[(size_t)y * width + x] = v > 255 ? 255 : v;
+        }
+    }
+
+    unsigned int span = 2 * settings.noise + 1;
+    for (size_t i = 0; i < noiseBytes; i++)
+    {
+        noiseTable[i] = random() % span;
+    }
+}
+
+int LfSynthCam::setRoi(const LfRoi &request)
+{
+    if (request.width == 0 || request.height == 0 ||
+        request.offsetX >= settings.width || request.offsetY >= settings.height)
+    {
+        return -1;
+    }
+    roi = request;
+    if (roi.width > settings.width - roi.offsetX)
+    {
+        roi.width = settings.width - roi.offsetX;
+    }
+    if (roi.height > settings.height - roi.offsetY)
+    {
+        roi.height = settings.height - roi.offsetY;
+    }
+    return 0;
+}
+
+int LfSynthCam::connect(int /*cameraIndex*/)
+{
+    return 0;
+}
+
+int LfSynthCam::start()
+{
+    seq = 0;
+    startTime = lfTimestampUs();
+    running = true;
+    return 0;
+}
+
+int LfSynthCam::stop()
+{
+    running = false;
+    return 0;
+}
+
+int LfSynthCam::disconnect()
+{
+    return 0;
+}
+
+int LfSynthCam::retrieveImage(LfFrame *frame)
+{
+    unsigned int width = roi.width;
+    unsigned int height = roi.height;
+    size_t pixels = (size_t)width * height;
+    if (!running || frame->capacity < pixels)
+    {
+        return -1;
+    }
+
+    // Lost frames never reach the host; the sequence moves on regardless
+    while (settings.dropRate > 0 && random() < settings.dropRate * 4294967296.0)
+    {
+        seq++;
+        framesDropped++;
+    }
+    unsigned int n = seq++;
+    bool laserOn = (n % 2) == 0;
+
+    if (laserOn)
+    {
+        if (intrusionLeft > 0)
+        {
+            intrusionLeft--;
+        }
+        if (intrusionLeft == 0 && settings.intrusionRate > 0 &&
+            random() < settings.intrusionRate * 4294967296.0)
+        {
+            intrusionLeft = settings.intrusionPairs;
+            intrusionStart = settings.width > settings.intrusionWidth ?
+                             random() % (settings.width - settings.intrusionWidth) : 0;
+            intrusions++;
+        }
+    }
+
+    // Deliver on the sensor's schedule: pairs at the trigger rate, the two
+    // frames of a pair intraPairUs apart
+    unsigned long long timestamp;
+    if (settings.triggerRate > 0)
+    {
+        timestamp = startTime + (unsigned long long)((n / 2) * 1000000.0 / settings.triggerRate) +
+                    (n % 2) * settings.intraPairUs;
+        unsigned long long now = lfTimestampUs();
+        if (timestamp > now)
+        {
+            usleep(timestamp - now);
+        }
+    }
+    else
+    {
+        timestamp = lfTimestampUs();
+    }
+
+    int bias = -(int)settings.noise;
+    if (settings.flicker)
+    {
+        bias += (int)(random() % (2 * settings.flicker + 1)) - (int)settings.flicker;
+    }
+    // The whole scene moves with the drift; rows pushed in from outside the
+    // scene repeat its edge
+    shift = (int)floor(settings.drift * (n / 2) + 0.5);
+    const unsigned char *base = laserOn ? onBase : offBase;
+    const unsigned char *noise = noiseTable + random() % (noiseBytes - pixels + 1);
+    unsigned char *out = frame->data;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        int sceneY = (int)(roi.offsetY + y) - shift;
+        sceneY = sceneY < 0 ? 0 : (sceneY >= (int)settings.height ? settings.height - 1 : sceneY);
+        const unsigned char *in = base + (size_t)sceneY * settings.width + roi.offsetX;
+        const unsigned char *rowNoise = noise + (size_t)y * width;
+        unsigned char *outRow = out + (size_t)y * width;
+        for (unsigned int x = 0; x < width; x++)
+        {
+            int v = in[x] + rowNoise[x] + bias;
+            outRow[x] = v < 0 ? 0 : (v > 255 ? 255 : v);
+        }
+    }
+
+    // The intruder blocks the laser over its columns
+    if (laserOn && intrusionLeft > 0)
+    {
+        int reach = (int)ceil(4 * settings.laserSigma) + 1;
+        unsigned int end = intrusionStart + settings.intrusionWidth;
+        for (unsigned int x = intrusionStart; x < end && x < settings.width; x++)
+        {
+            if (x < roi.offsetX || x >= roi.offsetX + width)
+            {
+                continue;
+            }
+            int centre = lineRow(x);
+            for (int sceneY = centre - reach; sceneY <= centre + reach; sceneY++)
+            {
+                int y = sceneY + shift - (int)roi.offsetY;
+                if (sceneY >= 0 && sceneY < (int)settings.height && y >= 0 && y < (int)height)
+                {
+                    size_t i = (size_t)y * width + (x - roi.offsetX);
+                    int v = offBase[(size_t)sceneY * settings.width + x] + noise[i] + bias;
+                    out[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+                }
+            }
+        }
+    }
+
+    frame->width = width;
+    frame->height = height;
+    frame->offsetX = roi.offsetX;
+    frame->offsetY = roi.offsetY;
+    frame->stride = width;
+    frame->dataSize = pixels;
+    frame->format = LF_PIXEL_MONO8;
+    frame->nativeFormat = 0;
+    frame->timestamp = timestamp;
+    frame->seq = n;
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Synthetic camera for laser fence application.
+
+#ifndef LFSYNTH_H
+#define LFSYNTH_H
+
+#include "stdafx.h"
+#include "lfbuf.h"
+#include "lfsrc.h"
+
+// Scene parameters for LfSynthCam
+struct LfSynthSettings {
+    unsigned int width;
+    unsigned int height;
+    double triggerRate;         // Triggers (frame pairs) per second, 0 = unpaced
+    unsigned int intraPairUs;   // Gap between the two frames of a trigger
+    unsigned int laserRow;      // Row of the laser line at column 0
+    double laserSlope;          // Rows per column
+    unsigned int laserIntensity;
+    double laserSigma;          // Line thickness in rows
+    unsigned int noise;         // Peak per-pixel noise
+    unsigned int flicker;       // Peak frame-to-frame brightness change
+    double intrusionRate;       // Chance a trigger starts an intrusion
+    unsigned int intrusionPairs;    // Triggers an intrusion lasts
+    unsigned int intrusionWidth;    // Columns the intruder blocks
+    double dropRate;            // Chance a frame is lost before delivery
+    double drift;               // Rows the scene moves per trigger, as a sagging mount would
+    unsigned int seed;
+};
+
+void lfSynthDefaults(LfSynthSettings *settings);
+
+// Generates laser-on/laser-off frame pairs without hardware.  Frames
+// alternate strictly by sequence number (even = laser on), so a dropped
+// frame shifts the pairing exactly as a lost camera frame would.  Noise is
+// drawn from a precomputed table at a random offset, so generating a frame
+// costs about one pass over it.
+class LfSynthCam: public LfFrameSource {
+protected:
+    LfSynthSettings settings;
+    unsigned char *onBase;      // Scene with the laser line
+    unsigned char *offBase;     // Scene without it
+    unsigned char *noiseTable;
+    size_t noiseBytes;
+    unsigned long long rng;
+    unsigned long long startTime;
+    unsigned int seq;           // Sequence number of the next sensor frame
+    unsigned int intrusionLeft;
+    unsigned int intrusionStart;
+    unsigned long framesDropped;
+    unsigned long intrusions;
+    bool running;
+    LfRoi roi;
+    int shift;                  // Current drift in rows
+    unsigned int random();
+    void buildScene();
+    double sceneRow(unsigned int x) const;
+    int lineRow(unsigned int x) const;
+public:
+    LfSynthCam(const LfSynthSettings &settings);
+    virtual ~LfSynthCam();
+    virtual int connect(int cameraIndex);
+    virtual int start();
+    virtual int retrieveImage(LfFrame *frame);
+    virtual int stop();
+    virtual int disconnect();
+    virtual unsigned int getFrameWidth() const { return roi.width; }
+    virtual unsigned int getFrameHeight() const { return roi.height; }
+    virtual LfPixelFormat getFrameFormat() const { return LF_PIXEL_MONO8; }
+    virtual unsigned int getSensorWidth() const { return settings.width; }
+    virtual unsigned int getSensorHeight() const { return settings.height; }
+    virtual int setRoi(const LfRoi &roi);
+    // seq counts lost frames too, and even frames are laser-on
+    virtual bool hasFrameCounter() const { return true; }
+    virtual int getOnParity() const { return 0; }
+    const LfRoi &getRoi() const { return roi; }
+    // True laser row (sensor coordinates) at column x in the last frame,
+    // for checking detection accuracy
+    double getLaserRow(unsigned int x) const;
+    bool isIntruding() const { return intrusionLeft > 0; }
+    unsigned long getFramesDropped() const { return framesDropped; }
+    unsigned long getIntrusions() const { return intrusions; }
+};
+
+#endif
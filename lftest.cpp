@@ -0,0 +1,2343 @@
+// Unit tests for laser fence application.
+//
+// Checks every SIMD kernel against its scalar reference on synthetic
+// frames, at each instruction set level the running CPU supports, and
+// runs the lock-free and ring-buffer components against concurrent
+// writers.  Needs no camera library.  Exits non-zero if any check fails, so make test fails too.
+//
+// Usage: lftest [-v]
+
+#include "stdafx.h"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include <thread>
+#include <limits.h>
+#include <new>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lfalarm.h"
+#include "lfalg.h"
+#include "lfbg.h"
+#include "lfbuf.h"
+#include "lfbus.h"
+#include "lfclip.h"
+#include "lfcodec.h"
+#include "lfconv.h"
+#include "lflog.h"
+#include "lfmetrics.h"
+#include "lfmulti.h"
+#include "lfpar.h"
+#include "lfpipe.h"
+#include "lfrec.h"
+#include "lfroi.h"
+#include "lfsrc.h"
+#include "lfsynth.h"
+
+using namespace std;
+
+static unsigned int checks = 0;
+static unsigned int failures = 0;
+static bool verbose = false;
+
+// Records a check; a failure prints where it was and what was compared
+#define LF_CHECK(cond, what) lfCheck((cond), #cond, (what), __FILE__, __LINE__)
+
+static bool lfCheck(bool ok, const char *cond, const string &what, const char *file, int line)
+{
+    checks++;
+    if (!ok)
+    {
+        failures++;
+        cout << file << ":" << line << ": FAILED " << cond << " (" << what << ")" << endl;
+    }
+    return ok;
+}
+
+// Reproducible noise, so a failure can be rerun
+static unsigned int testRandom(unsigned int *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static void fillRandom(unsigned char *p, size_t n, unsigned int *state)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        p[i] = (unsigned char)testRandom(state);
+    }
+}
+
+// Heap allocations made by the test and the objects it links: the Makefile
+// wraps the malloc family at link time, and operator new goes through
+// malloc, so containers and strings are counted too
+static atomic<unsigned long> heapAllocs(0);
+
+extern "C" {
+void *__real_malloc(size_t bytes);
+void *__real_calloc(size_t count, size_t bytes);
+void *__real_realloc(void *p, size_t bytes);
+int __real_posix_memalign(void **p, size_t alignment, size_t bytes);
+
+void *__wrap_malloc(size_t bytes)
+{
+    heapAllocs.fetch_add(1, memory_order_relaxed);
+    return __real_malloc(bytes);
+}
+
+void *__wrap_calloc(size_t count, size_t bytes)
+{
+    heapAllocs.fetch_add(1, memory_order_relaxed);
+    return __real_calloc(count, bytes);
+}
+
+void *__wrap_realloc(void *p, size_t bytes)
+{
+    heapAllocs.fetch_add(1, memory_order_relaxed);
+    return __real_realloc(p, bytes);
+}
+
+int __wrap_posix_memalign(void **p, size_t alignment, size_t bytes)
+{
+    heapAllocs.fetch_add(1, memory_order_relaxed);
+    return __real_posix_memalign(p, alignment, bytes);
+}
+}
+
+void *operator new(size_t bytes)
+{
+    void *p = malloc(bytes ? bytes : 1);
+    if (p == NULL)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t bytes)
+{
+    return operator new(bytes);
+}
+
+void *operator new(size_t bytes, const nothrow_t &) noexcept
+{
+    return malloc(bytes ? bytes : 1);
+}
+
+void *operator new[](size_t bytes, const nothrow_t &) noexcept
+{
+    return malloc(bytes ? bytes : 1);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, const nothrow_t &) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, const nothrow_t &) noexcept
+{
+    free(p);
+}
+
+static string levelLabel(const char *kernel, LfCpuLevel level, size_t n)
+{
+    char label[96];
+    snprintf(label, sizeof(label), "%s %s n=%lu", kernel, lfCpuLevelName(level), (unsigned long)n);
+    return label;
+}
+
+// Scratch file removed when the test is done
+static string tempPath(const char *name)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lftest_%d_%s", (int)getpid(), name);
+    return path;
+}
+
+
+
+// Lengths around every vector width, so heads, bodies and tails are all
+// covered, and a few whole rows
+static const size_t k_testLengths[] = { 0, 1, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 129, 255, 641, 1283 };
+
+static void testDiffKernels(LfCpuLevel maxLevel)
+{
+    unsigned int seed = 1;
+    const size_t maxN = 1283;
+    // Off by one from the aligned allocation, so kernels see unaligned rows
+    vector<unsigned char> on(maxN + 1), off(maxN + 1), diff(maxN + 2), mask(maxN + 2);
+    vector<unsigned char> refDiff(maxN), refMask(maxN);
+    for (int level = LF_CPU_SCALAR; level <= maxLevel; level++)
+    {
+        LfDiffKernel kernel = lfGetDiffKernel((LfCpuLevel)level);
+        for (size_t l = 0; l < sizeof(k_testLengths) / sizeof(k_testLengths[0]); l++)
+        {
+            size_t n = k_testLengths[l];
+            for (unsigned int round = 0; round < 4; round++)
+            {
+                fillRandom(&on[1], n, &seed);
+                fillRandom(&off[1], n, &seed);
+                unsigned char threshold = (unsigned char)(round == 0 ? 0 : round == 1 ? 255 : testRandom(&seed));
+                // A sentinel past the end catches kernels writing too far
+                diff[n + 1] = 0xa5;
+                size_t refCount = lfDiffScalar(&on[1], &off[1], &refDiff[0], &refMask[0], n, threshold);
+                size_t count = kernel(&on[1], &off[1], &diff[1], &mask[1], n, threshold);
+                string what = levelLabel("diff", (LfCpuLevel)level, n);
+                LF_CHECK(count == refCount, what);
+                LF_CHECK(n == 0 || memcmp(&diff[1], &refDiff[0], n) == 0, what);
+                LF_CHECK(n == 0 || memcmp(&mask[1], &refMask[0], n) == 0, what);
+                LF_CHECK(diff[n + 1] == 0xa5, what + " overrun");
+            }
+        }
+    }
+}
+
+// Model planes with a quarter of the pixels at the ends of their range,
+// where saturating the deviation and the up and down steps matters
+static void fillModel(unsigned short *mean, unsigned short *variance, size_t n, unsigned int *state)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned int r = testRandom(state);
+        mean[i] = (r & 3) == 0 ? ((r & 4) ? 65535 : 0) : (unsigned short)(r >> 3);
+        r = testRandom(state);
+        variance[i] = (r & 3) == 0 ? ((r & 4) ? 65535 : 0) : (unsigned short)((r >> 3) & 0x3ff);
+    }
+}
+
+static void testBackgroundKernels(LfCpuLevel maxLevel)
+{
+    unsigned int seed = 12;
+    const size_t maxN = 1283;
+    // Off by one from the aligned allocation, with a sentinel past the end
+    vector<unsigned char> in(maxN + 1), mask(maxN + 2), refMask(maxN);
+    vector<unsigned short> mean(maxN + 2), variance(maxN + 2), refMean(maxN), refVariance(maxN);
+    for (int level = LF_CPU_SSE41; level <= maxLevel; level++)
+    {
+        LfBackgroundKernel kernel = lfGetBackgroundKernel((LfCpuLevel)level);
+        for (size_t l = 0; l < sizeof(k_testLengths) / sizeof(k_testLengths[0]); l++)
+        {
+            size_t n = k_testLengths[l];
+            for (unsigned int round = 0; round < 4; round++)
+            {
+                unsigned int shift = round == 0 ? 1 : round == 1 ? 8 : 1 + testRandom(&seed) % 8;
+                unsigned short factor = (unsigned short)(round == 0 ? 65535 : round == 1 ? 7282 : testRandom(&seed));
+                unsigned short minVariance = (unsigned short)(round == 0 ? 0 : testRandom(&seed) & 0x3ff);
+                fillRandom(&in[1], n, &seed);
+                fillModel(&refMean[0], &refVariance[0], n, &seed);
+                copy(refMean.begin(), refMean.begin() + n, mean.begin() + 1);
+                copy(refVariance.begin(), refVariance.begin() + n, variance.begin() + 1);
+                mean[n + 1] = 0xa5a5;
+                variance[n + 1] = 0xa5a5;
+                mask[n + 1] = 0xa5;
+                size_t refCount = lfBackgroundScalar(&in[1], &refMean[0], &refVariance[0], &refMask[0], n,
+                                                     shift, factor, minVariance);
+                size_t count = kernel(&in[1], &mean[1], &variance[1], &mask[1], n, shift, factor, minVariance);
+                string what = levelLabel("background", (LfCpuLevel)level, n);
+                LF_CHECK(count == refCount, what + " count");
+                LF_CHECK(n == 0 || equal(refMean.begin(), refMean.begin() + n, mean.begin() + 1), what + " mean");
+                LF_CHECK(n == 0 || equal(refVariance.begin(), refVariance.begin() + n, variance.begin() + 1),
+                         what + " variance");
+                LF_CHECK(n == 0 || memcmp(&mask[1], &refMask[0], n) == 0, what + " mask");
+                LF_CHECK(mean[n + 1] == 0xa5a5 && variance[n + 1] == 0xa5a5 && mask[n + 1] == 0xa5,
+                         what + " overrun");
+            }
+        }
+    }
+}
+
+// Runs one random pair through the engine at the given window and checks
+// the model against the scalar kernel, row by row: rows listed in fresh
+// must have restarted from the sample, the rest of the window must have
+// learned from it, and everything outside the window must be untouched.
+static void checkBackgroundStep(LfBackground &background, LfDiffEngine &engine, unsigned int offsetY,
+                                unsigned int rows, unsigned int freshFirst, unsigned int freshLast,
+                                unsigned int *seed, const string &what)
+{
+    const unsigned int sensorWidth = 48;
+    const unsigned int sensorHeight = 30;
+    const unsigned int offsetX = 5;
+    const unsigned int width = 37;
+    const unsigned int shift = 1;
+    vector<unsigned char> onData(width * rows), offData(width * rows, 0);
+    fillRandom(&onData[0], onData.size(), seed);
+    LfFrame on, off;
+    memset(&on, 0, sizeof(on));
+    on.data = &onData[0];
+    on.dataSize = onData.size();
+    on.width = width;
+    on.height = rows;
+    on.stride = width;
+    on.offsetX = offsetX;
+    on.offsetY = offsetY;
+    on.format = LF_PIXEL_MONO8;
+    off = on;
+    off.data = &offData[0];
+    engine.process(&on, &off);
+
+    size_t pixels = (size_t)sensorWidth * sensorHeight;
+    vector<unsigned short> mean(background.getMean(), background.getMean() + pixels);
+    vector<unsigned short> variance(background.getVariance(), background.getVariance() + pixels);
+    LF_CHECK(background.update(engine) == 0, what + " update");
+    bool learned = true, restarted = true, kept = true;
+    for (unsigned int y = 0; y < sensorHeight; y++)
+    {
+        size_t at = (size_t)y * sensorWidth;
+        if (y < offsetY || y >= offsetY + rows)
+        {
+            kept = kept && equal(mean.begin() + at, mean.begin() + at + sensorWidth, background.getMean() + at) &&
+                   equal(variance.begin() + at, variance.begin() + at + sensorWidth, background.getVariance() + at);
+            continue;
+        }
+        const unsigned char *in = engine.getDiff() + (size_t)(y - offsetY) * width;
+        const unsigned char *mask = background.getMask() + (size_t)(y - offsetY) * width;
+        vector<unsigned char> refMask(width);
+        if (y >= freshFirst && y < freshLast)
+        {
+            for (unsigned int x = 0; x < width; x++)
+            {
+                mean[at + offsetX + x] = in[x] << 8;
+                variance[at + offsetX + x] = 16 * k_lfBgVarianceOne;
+            }
+        }
+        else
+        {
+            // The sigmas and minimum deviation left at their defaults
+            lfBackgroundScalar(in, &mean[at + offsetX], &variance[at + offsetX], &refMask[0], width,
+                               shift, 7282, 64);
+        }
+        bool same = equal(mean.begin() + at, mean.begin() + at + sensorWidth, background.getMean() + at) &&
+                    equal(variance.begin() + at, variance.begin() + at + sensorWidth, background.getVariance() + at) &&
+                    memcmp(mask, &refMask[0], width) == 0;
+        if (y >= freshFirst && y < freshLast)
+        {
+            restarted = restarted && same;
+        }
+        else
+        {
+            learned = learned && same;
+        }
+    }
+    LF_CHECK(restarted, what + " rows restarted");
+    LF_CHECK(learned, what + " rows learned");
+    LF_CHECK(kept, what + " rows outside the window kept");
+}
+
+// An ROI moving over the model: rows it has not seen, or has not seen for
+// more than 8 << shift updates, restart from the sample; rows seen since
+// go on learning through the kernel.
+static void testBackgroundRestart(LfCpuLevel maxLevel)
+{
+    unsigned int seed = 13;
+    for (int level = LF_CPU_SCALAR; level <= maxLevel; level++)
+    {
+        LfBackground background(48, 30);
+        background.setCpuLevel((LfCpuLevel)level);
+        background.setLearningShift(1);
+        LfDiffEngine engine(48, 30, 40);
+        string what = levelLabel("background restart", (LfCpuLevel)level, 37);
+        // Updates 1 and 2 on rows 0-9, then 3 moves down to rows 5-14
+        checkBackgroundStep(background, engine, 0, 10, 0, 10, &seed, what + " first");
+        checkBackgroundStep(background, engine, 0, 10, 0, 0, &seed, what + " still");
+        checkBackgroundStep(background, engine, 5, 10, 10, 15, &seed, what + " moved");
+        // Away on rows 20-29 for 15 updates: rows 5-9 come back 16 updates
+        // on and carry on, rows 0-4 come back 17 on and are stale
+        for (unsigned int i = 0; i < 15; i++)
+        {
+            checkBackgroundStep(background, engine, 20, 10, i == 0 ? 20 : 0, i == 0 ? 30 : 0, &seed, what + " away");
+        }
+        checkBackgroundStep(background, engine, 0, 10, 0, 5, &seed, what + " back");
+    }
+}
+
+static void testDiffEngine(LfCpuLevel maxLevel)
+{
+    // Odd sizes leave a tail on every row
+    const unsigned int width = 333;
+    const unsigned int height = 17;
+    unsigned int seed = 2;
+    vector<unsigned char> on(width * height), off(width * height);
+    fillRandom(&on[0], on.size(), &seed);
+    fillRandom(&off[0], off.size(), &seed);
+
+    LfDiffEngine reference(width, height, 40);
+    reference.setCpuLevel(LF_CPU_SCALAR);
+    size_t refCount = reference.process(&on[0], &off[0], width);
+    for (int level = LF_CPU_SSE41; level <= maxLevel; level++)
+    {
+        LfDiffEngine engine(width, height, 40);
+        engine.setCpuLevel((LfCpuLevel)level);
+        size_t count = engine.process(&on[0], &off[0], width);
+        string what = levelLabel("engine", (LfCpuLevel)level, width * height);
+        LF_CHECK(count == refCount, what);
+        LF_CHECK(memcmp(engine.getDiff(), reference.getDiff(), width * height) == 0, what);
+        LF_CHECK(memcmp(engine.getMask(), reference.getMask(), width * height) == 0, what);
+    }
+}
+
+
+
+static void testFrameDiffKernels(LfCpuLevel maxLevel)
+{
+    // The widths with builds of their own, and others that take the
+    // any-width build
+    const unsigned int widths[] = { 1, 17, 63, 64, 333, 640, 1280, 1281, 1920, 2048 };
+    const unsigned int height = 3;
+    unsigned int seed = 6;
+    for (int level = LF_CPU_SCALAR; level <= maxLevel; level++)
+    {
+        for (unsigned int w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+        {
+            unsigned int width = widths[w];
+            for (int f = 0; f < 2; f++)
+            {
+                LfPixelFormat format = f == 0 ? LF_PIXEL_MONO8 : LF_PIXEL_MONO16;
+                LfFrameDiffKernel kernel = lfGetFrameDiffKernel((LfCpuLevel)level, format, width);
+                // Padded rows, as cameras and ROIs deliver them
+                unsigned int stride = (unsigned int)lfRowBytes(format, width) + 6;
+                vector<unsigned char> on(stride * height), off(stride * height);
+                vector<unsigned char> on8(width * height), off8(width * height);
+                vector<unsigned char> diff(width * height + 1), mask(width * height + 1);
+                vector<unsigned char> refDiff(width * height), refMask(width * height);
+                for (unsigned int shift = 0; shift <= 4; shift += 2)
+                {
+                    fillRandom(&on[0], on.size(), &seed);
+                    fillRandom(&off[0], off.size(), &seed);
+                    // Reference: take the samples to 8 bits, then the scalar diff
+                    for (unsigned int y = 0; y < height; y++)
+                    {
+                        for (unsigned int x = 0; x < width; x++)
+                        {
+                            const unsigned char *a = &on[y * stride];
+                            const unsigned char *b = &off[y * stride];
+                            if (format == LF_PIXEL_MONO8)
+                            {
+                                on8[y * width + x] = a[x];
+                                off8[y * width + x] = b[x];
+                            }
+                            else
+                            {
+                                unsigned int sa = (a[2 * x] | a[2 * x + 1] << 8) >> (4 + shift);
+                                unsigned int sb = (b[2 * x] | b[2 * x + 1] << 8) >> (4 + shift);
+                                on8[y * width + x] = (unsigned char)min(255u, sa);
+                                off8[y * width + x] = (unsigned char)min(255u, sb);
+                            }
+                        }
+                    }
+                    unsigned char threshold = (unsigned char)testRandom(&seed);
+                    size_t refCount = lfDiffScalar(&on8[0], &off8[0], &refDiff[0], &refMask[0],
+                                                   width * height, threshold);
+                    diff[width * height] = 0xa5;
+                    size_t count = kernel(&on[0], &off[0], stride, width, height, shift, &diff[0], &mask[0],
+                                          threshold);
+                    char what[96];
+                    snprintf(what, sizeof(what), "frame diff %s %s width=%u shift=%u",
+                             lfCpuLevelName((LfCpuLevel)level), f == 0 ? "mono8" : "mono16", width, shift);
+                    LF_CHECK(count == refCount, what);
+                    LF_CHECK(memcmp(&diff[0], &refDiff[0], width * height) == 0, what);
+                    LF_CHECK(memcmp(&mask[0], &refMask[0], width * height) == 0, what);
+                    LF_CHECK(diff[width * height] == 0xa5, string(what) + " overrun");
+                }
+            }
+        }
+    }
+}
+
+// Rewrites a random rectangle of a frame, or none at all one time in four
+static void editFrame(unsigned char *frame, unsigned int width, unsigned int height, unsigned int *seed)
+{
+    if (testRandom(seed) % 4 == 0)
+    {
+        return;
+    }
+    unsigned int w = 1 + testRandom(seed) % 40;
+    unsigned int h = 1 + testRandom(seed) % 20;
+    unsigned int x0 = testRandom(seed) % width;
+    unsigned int y0 = testRandom(seed) % height;
+    for (unsigned int y = y0; y < y0 + h && y < height; y++)
+    {
+        fillRandom(frame + (size_t)y * width + x0, min(w, width - x0), seed);
+    }
+}
+
+static void testChangeMap(LfCpuLevel maxLevel)
+{
+    unsigned int seed = 5;
+    const unsigned int maxN = 1283;
+    vector<unsigned char> a(maxN + 1), b(maxN + 1);
+    vector<unsigned int> sums(maxN / k_lfTileWidth + 1), refSums(maxN / k_lfTileWidth + 1);
+    for (int level = LF_CPU_SSE41; level <= maxLevel; level++)
+    {
+        LfTileSadKernel kernel = lfGetTileSadKernel((LfCpuLevel)level);
+        for (size_t l = 0; l < sizeof(k_testLengths) / sizeof(k_testLengths[0]); l++)
+        {
+            unsigned int n = k_testLengths[l];
+            for (unsigned int round = 0; round < 3; round++)
+            {
+                fillRandom(&a[1], n, &seed);
+                fillRandom(&b[1], n, &seed);
+                unsigned char noise = (unsigned char)(round == 0 ? 0 : round == 1 ? 16 : testRandom(&seed));
+                // Kernels add to the sums rather than set them
+                for (size_t k = 0; k < sums.size(); k++)
+                {
+                    sums[k] = refSums[k] = testRandom(&seed) % 1000;
+                }
+                lfTileSadScalar(&a[1], &b[1], n, noise, &refSums[0]);
+                kernel(&a[1], &b[1], n, noise, &sums[0]);
+                LF_CHECK(sums == refSums, levelLabel("tile sad", (LfCpuLevel)level, n));
+            }
+        }
+    }
+
+    // With no noise floor and any change enough, skipping tiles must give
+    // exactly the planes and blobs of differencing every pixel.  The size
+    // leaves partial tiles on the right and at the bottom.
+    const unsigned int width = 200;
+    const unsigned int height = 40;
+    for (int level = LF_CPU_SCALAR; level <= maxLevel; level++)
+    {
+        vector<unsigned char> on(width * height), off(width * height);
+        fillRandom(&on[0], on.size(), &seed);
+        fillRandom(&off[0], off.size(), &seed);
+        LfDiffEngine full(width, height, 60);
+        LfDiffEngine tiled(width, height, 60);
+        full.setCpuLevel((LfCpuLevel)level);
+        tiled.setCpuLevel((LfCpuLevel)level);
+        LF_CHECK(tiled.setChangeMap(true, 0, 1) == 0, "change map");
+        LfBlobLabeler fullBlobs(width, height, width * height, width * height);
+        LfBlobLabeler tiledBlobs(width, height, width * height, width * height);
+        bool same = true;
+        for (unsigned int pair = 0; pair < 100; pair++)
+        {
+            editFrame(&on[0], width, height, &seed);
+            editFrame(&off[0], width, height, &seed);
+            if (pair == 50)
+            {
+                full.setThreshold(90);
+                tiled.setThreshold(90);
+            }
+            size_t count = full.process(&on[0], &off[0], width);
+            same = same && tiled.process(&on[0], &off[0], width) == count;
+            same = same && memcmp(tiled.getDiff(), full.getDiff(), width * height) == 0;
+            same = same && memcmp(tiled.getMask(), full.getMask(), width * height) == 0;
+
+            int blobs = fullBlobs.label(full);
+            same = same && tiledBlobs.label(tiled) == blobs;
+            for (int k = 0; same && k < blobs; k++)
+            {
+                const LfBlob &x = fullBlobs.getBlobs()[k];
+                const LfBlob &y = tiledBlobs.getBlobs()[k];
+                same = x.area == y.area && x.left == y.left && x.top == y.top && x.right == y.right &&
+                       x.bottom == y.bottom;
+            }
+        }
+        string what = levelLabel("change map", (LfCpuLevel)level, width * height);
+        LF_CHECK(same, what);
+        LF_CHECK(tiled.getTilesSkipped() > 0 && tiledBlobs.getReused() > 0, what + " skips");
+    }
+}
+
+
+
+static void testUnpackKernels(LfCpuLevel maxLevel)
+{
+    unsigned int seed = 3;
+    const unsigned int maxN = 1283;
+    // MONO12 packs two samples in three bytes, MONO16 takes two per sample
+    vector<unsigned char> in(maxN * 2 + 2), out(maxN + 2), ref(maxN);
+    for (int level = LF_CPU_SSE41; level <= maxLevel; level++)
+    {
+        LfUnpackKernel kernels[2] = { lfGetUnpack12Kernel((LfCpuLevel)level), lfGetUnpack16Kernel((LfCpuLevel)level) };
+        LfUnpackKernel scalars[2] = { lfUnpack12Scalar, lfUnpack16Scalar };
+        const char *names[2] = { "unpack12", "unpack16" };
+        for (int k = 0; k < 2; k++)
+        {
+            for (size_t l = 0; l < sizeof(k_testLengths) / sizeof(k_testLengths[0]); l++)
+            {
+                unsigned int n = k_testLengths[l];
+                for (unsigned int shift = 0; shift <= 4; shift++)
+                {
+                    // MONO16 samples are whole shorts; MONO12 rows start anywhere
+                    const unsigned char *src = &in[k == 0 ? 1 : 2];
+                    fillRandom(&in[0], in.size(), &seed);
+                    out[n + 1] = 0xa5;
+                    scalars[k](src, &ref[0], n, shift);
+                    kernels[k](src, &out[1], n, shift);
+                    string what = levelLabel(names[k], (LfCpuLevel)level, n);
+                    LF_CHECK(n == 0 || memcmp(&out[1], &ref[0], n) == 0, what);
+                    LF_CHECK(out[n + 1] == 0xa5, what + " overrun");
+                }
+            }
+        }
+    }
+}
+
+static void testConverterView(LfCpuLevel)
+{
+    // A MONO8 conversion leaves dst a view of the source; unpacking into
+    // it next must land in dst's own buffer, not the MONO8 source
+    const unsigned int width = 48;
+    const unsigned int height = 4;
+    LfFramePool out(1, width, height, LF_PIXEL_MONO8);
+    LfFrame *dst = out.lease();
+    unsigned char *own = dst->data;
+    LfFramePool mono8(1, width, height, LF_PIXEL_MONO8);
+    LfFrame *src8 = mono8.lease();
+    memset(src8->data, 7, src8->capacity);
+    LfFramePool mono16(1, width, height, LF_PIXEL_MONO16);
+    LfFrame *src16 = mono16.lease();
+    memset(src16->data, 0xff, src16->capacity);
+
+    LfConverter converter;
+    LF_CHECK(converter.convert(src8, dst) == 0 && dst->data == src8->data, "mono8 view");
+    LF_CHECK(converter.convert(src16, dst) == 0 && dst->data == own, "unpack after view");
+    LF_CHECK(src8->data[0] == 7 && dst->data[0] == 255, "unpack after view");
+    mono8.release(src8);
+    mono16.release(src16);
+    out.release(dst);
+}
+
+// Reference labelling: blob areas and boxes by flood fill, sorted so the
+// order blobs are found in doesn't matter
+static vector<vector<unsigned int> > floodBlobs(const vector<unsigned char> &mask, unsigned int width,
+                                                unsigned int height, bool eight)
+{
+    vector<vector<unsigned int> > found;
+    vector<unsigned char> seen(mask.size(), 0);
+    vector<unsigned int> stack;
+    for (unsigned int start = 0; start < mask.size(); start++)
+    {
+        if (mask[start] == 0 || seen[start])
+        {
+            continue;
+        }
+        unsigned int area = 0;
+        unsigned int left = width, top = height, right = 0, bottom = 0;
+        stack.push_back(start);
+        seen[start] = 1;
+        while (!stack.empty())
+        {
+            unsigned int p = stack.back();
+            stack.pop_back();
+            unsigned int x = p % width;
+            unsigned int y = p / width;
+            area++;
+            left = min(left, x);
+            right = max(right, x);
+            top = min(top, y);
+            bottom = max(bottom, y);
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int nx = (int)x + dx;
+                    int ny = (int)y + dy;
+                    if ((dx == 0 && dy == 0) || (!eight && dx != 0 && dy != 0) ||
+                        nx < 0 || ny < 0 || nx >= (int)width || ny >= (int)height)
+                    {
+                        continue;
+                    }
+                    unsigned int q = ny * width + nx;
+                    if (mask[q] != 0 && !seen[q])
+                    {
+                        seen[q] = 1;
+                        stack.push_back(q);
+                    }
+                }
+            }
+        }
+        vector<unsigned int> blob(5);
+        blob[0] = area;
+        blob[1] = left;
+        blob[2] = top;
+        blob[3] = right;
+        blob[4] = bottom;
+        found.push_back(blob);
+    }
+    sort(found.begin(), found.end());
+    return found;
+}
+
+static void testBlobLabeler(LfCpuLevel maxLevel)
+{
+    // Masks down to fewer rows than bands, where some bands get no rows
+    // and the bands either side of them must still be joined
+    unsigned int seed = 4;
+    for (int level = LF_CPU_SSE41; level <= maxLevel; level++)
+    {
+        LfMaskBitsKernel kernel = lfGetMaskBitsKernel((LfCpuLevel)level);
+        for (unsigned int t = 0; t < sizeof(k_testLengths) / sizeof(k_testLengths[0]); t++)
+        {
+            unsigned int n = k_testLengths[t];
+            vector<unsigned char> row(n + 1);
+            for (unsigned int i = 0; i < n + 1; i++)
+            {
+                row[i] = testRandom(&seed) % 3 == 0 ? 255 : 0;
+            }
+            vector<uint64_t> expected(n / 64 + 1, 0);
+            vector<uint64_t> got(n / 64 + 1, 0);
+            lfMaskBitsScalar(&row[1], n, &expected[0]);
+            kernel(&row[1], n, &got[0]);
+            LF_CHECK(got == expected, levelLabel("mask bits", (LfCpuLevel)level, n).c_str());
+        }
+    }
+
+    const unsigned int sizes[][2] = { { 1, 1 }, { 70, 2 }, { 64, 3 }, { 130, 5 }, { 200, 37 }, { 333, 64 } };
+    for (unsigned int helpers = 0; helpers <= 3; helpers++)
+    {
+        LfWorkers workers(helpers);
+        for (int level = LF_CPU_SCALAR; level <= maxLevel; level++)
+        {
+            for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+            {
+                unsigned int width = sizes[s][0];
+                unsigned int height = sizes[s][1];
+                for (unsigned int round = 0; round < 6; round++)
+                {
+                    vector<unsigned char> mask(width * height);
+                    unsigned int density = 20 + 15 * round;
+                    for (size_t i = 0; i < mask.size(); i++)
+                    {
+                        mask[i] = testRandom(&seed) % 100 < density ? 255 : 0;
+                    }
+                    bool eight = round % 2 == 0;
+                    LfBlobLabeler labeler(width, height, width * height, width * height);
+                    labeler.setCpuLevel((LfCpuLevel)level);
+                    labeler.setWorkers(helpers > 0 ? &workers : NULL);
+                    labeler.setMinArea(1);
+                    labeler.setConnectivity(eight ? 8 : 4);
+                    int count = labeler.label(&mask[0], width, height, width, 0, 0);
+
+                    vector<vector<unsigned int> > expected = floodBlobs(mask, width, height, eight);
+                    vector<vector<unsigned int> > got;
+                    for (int k = 0; k < count; k++)
+                    {
+                        const LfBlob &blob = labeler.getBlobs()[k];
+                        vector<unsigned int> b(5);
+                        b[0] = blob.area;
+                        b[1] = blob.left;
+                        b[2] = blob.top;
+                        b[3] = blob.right;
+                        b[4] = blob.bottom;
+                        got.push_back(b);
+                    }
+                    sort(got.begin(), got.end());
+                    char what[96];
+                    snprintf(what, sizeof(what), "labeler %s %ux%u, %u bands, %d blobs, %u expected",
+                             lfCpuLevelName((LfCpuLevel)level), width, height, helpers + 1, count,
+                             (unsigned int)expected.size());
+                    LF_CHECK(!labeler.isTruncated() && got == expected, what);
+                }
+            }
+        }
+    }
+}
+
+// The memory policy the kernel reports for the mapping starting at p, or
+// "" without NUMA support
+static string numaPolicy(const void *p)
+{
+    char start[32];
+    snprintf(start, sizeof(start), "%lx ", (unsigned long)(uintptr_t)p);
+    FILE *file = fopen("/proc/self/numa_maps", "r");
+    if (file == NULL)
+    {
+        return "";
+    }
+    string policy;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, start, strlen(start)) == 0)
+        {
+            char word[64];
+            if (sscanf(line + strlen(start), "%63s", word) == 1)
+            {
+                policy = word;
+            }
+            break;
+        }
+    }
+    fclose(file);
+    return policy;
+}
+
+// Profile rows, peaks and counts must match the scalar reference exactly,
+// at every level and split over workers, and the line found must lie on
+// the synthetic camera's true line.  The widths leave part-filled peak
+// stripes, and the last camera reads an ROI, so rows are offset.
+static void testProfiler(LfCpuLevel maxLevel)
+{
+    const unsigned int widths[] = { 1283, 700, 700 };
+    const unsigned int height = 240;
+    const LfProfileMethod methods[] = { LF_PROFILE_CENTROID, LF_PROFILE_GAUSSIAN };
+    const char *names[] = { "centroid", "gaussian" };
+    // Worst RMS error allowed against the true line, in rows
+    const double maxRms[] = { 0.1, 0.15 };
+    LfWorkers workers(3);
+    for (unsigned int w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+    {
+        unsigned int width = widths[w];
+        LfSynthSettings settings;
+        lfSynthDefaults(&settings);
+        settings.width = width;
+        settings.height = height;
+        settings.triggerRate = 0;
+        settings.laserRow = 100;
+        settings.laserSlope = 0.03;
+        settings.seed = 11 + w;
+        LfSynthCam synth(settings);
+        if (w == 2)
+        {
+            LfRoi roi = { 0, 60, width, 120 };
+            synth.setRoi(roi);
+        }
+        LfFramePool pool(2, width, height, LF_PIXEL_MONO8);
+        LfFrame *on = pool.lease();
+        LfFrame *off = pool.lease();
+        synth.connect(0);
+        synth.start();
+        LfDiffEngine engine(width, height, 32);
+        LfProfiler reference(width);
+        reference.setCpuLevel(LF_CPU_SCALAR);
+        for (unsigned int pair = 0; pair < 3; pair++)
+        {
+            synth.retrieveImage(on);
+            synth.retrieveImage(off);
+            engine.process(on, off);
+            for (int m = 0; m < 2; m++)
+            {
+                reference.setMethod(methods[m]);
+                int found = reference.extract(engine);
+                const float *rows = reference.getRows();
+                double squares = 0;
+                unsigned int counted = 0;
+                for (unsigned int x = 0; x < width; x++)
+                {
+                    if (rows[x] != k_lfNoLine)
+                    {
+                        double e = rows[x] - synth.getLaserRow(x);
+                        squares += e * e;
+                        counted++;
+                    }
+                }
+                char label[96];
+                snprintf(label, sizeof(label), "%s profile w=%u offset=%u", names[m], width, on->offsetY);
+                double rms = counted > 0 ? sqrt(squares / counted) : 1e9;
+                LF_CHECK(found == (int)width && counted == width, string(label) + " line found in every column");
+                LF_CHECK(rms < maxRms[m], string(label) + " rms " + to_string(rms));
+
+                for (int level = LF_CPU_SCALAR; level <= maxLevel + 1; level++)
+                {
+                    // One extra round at the best level split over the workers.
+                    // A fresh profiler each time, so no rows are left over.
+                    bool banded = level > maxLevel;
+                    LfProfiler profiler(width);
+                    profiler.setMethod(methods[m]);
+                    profiler.setCpuLevel(banded ? maxLevel : (LfCpuLevel)level);
+                    profiler.setWorkers(banded ? &workers : NULL);
+                    string variant = string(label) + (banded ? " banded " : " ") +
+                                     lfCpuLevelName(profiler.getCpuLevel());
+                    LF_CHECK(profiler.extract(engine) == found &&
+                             memcmp(profiler.getRows(), rows, width * sizeof(float)) == 0 &&
+                             memcmp(profiler.getIntensity(), reference.getIntensity(), width) == 0,
+                             variant + " matches scalar");
+                }
+            }
+        }
+        pool.release(on);
+        pool.release(off);
+    }
+}
+
+static void testNodeAlloc(LfCpuLevel)
+{
+    // Every machine has node 0, so its preference must show on the pages
+    const size_t bytes = 2 * k_lfHugeThreshold;
+    LfAllocStats before, after;
+    lfGetAllocStats(&before);
+    unsigned char *p = (unsigned char *)lfAlignedAllocOnNode(bytes, 0);
+    LF_CHECK(p != NULL, "node alloc");
+    if (p == NULL)
+    {
+        return;
+    }
+    memset(p, 1, bytes);
+    lfGetAllocStats(&after);
+    LF_CHECK(after.nodeBound == before.nodeBound + 1, "node alloc bound");
+    string policy = numaPolicy(p);
+    LF_CHECK(policy == "" || policy == "prefer:0", "node alloc policy " + policy);
+    lfAlignedFree(p);
+
+    // A node that isn't there is a fallback, not an error
+    p = (unsigned char *)lfAlignedAllocOnNode(bytes, lfNumaNodes());
+    lfGetAllocStats(&before);
+    LF_CHECK(p != NULL && before.nodeFallbacks == after.nodeFallbacks + 1, "node alloc fallback");
+    lfAlignedFree(p);
+}
+
+// Replays path, reading every byte of every frame it hands out, so one
+// pointing outside the mapping crashes the test.  Returns the frames
+// replayed, or -1 if the recording was refused.
+static long replayAll(const string &path)
+{
+    try
+    {
+        LfReplay replay(path.c_str());
+        replay.start();
+        LfFrame frame;
+        memset(&frame, 0, sizeof(frame));
+        long frames = 0;
+        volatile unsigned int sum = 0;
+        while (replay.retrieveImage(&frame) == 0)
+        {
+            for (size_t i = 0; i < frame.dataSize; i++)
+            {
+                sum += frame.data[i];
+            }
+            frames++;
+        }
+        return frames;
+    }
+    catch (const runtime_error &)
+    {
+        return -1;
+    }
+}
+
+static void rewriteAt(const string &path, long offset, const void *data, size_t bytes)
+{
+    FILE *file = fopen(path.c_str(), "r+b");
+    if (file == NULL)
+    {
+        return;
+    }
+    if (offset < 0)
+    {
+        fseek(file, offset, SEEK_END);
+    }
+    else
+    {
+        fseek(file, offset, SEEK_SET);
+    }
+    fwrite(data, 1, bytes, file);
+    fclose(file);
+}
+
+static void testReplayDamaged(LfCpuLevel)
+{
+    const unsigned int width = 64;
+    const unsigned int height = 8;
+    const unsigned int frames = 6;
+    string path = tempPath("replay.lfr");
+    vector<unsigned char> pixels(width * height);
+    LfFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.data = &pixels[0];
+    frame.capacity = frame.dataSize = pixels.size();
+    frame.width = width;
+    frame.height = height;
+    frame.stride = width;
+    frame.format = LF_PIXEL_MONO8;
+    frame.camera = 3;
+
+    LfRecorder recorder;
+    LF_CHECK(recorder.open(path.c_str(), width, height, width, LF_PIXEL_MONO8, 15, 2) == 0, "open");
+    for (unsigned int i = 0; i < frames; i++)
+    {
+        frame.seq = i;
+        recorder.append(&frame);
+    }
+    recorder.close();
+    FILE *file = fopen(path.c_str(), "rb");
+    fseek(file, 0, SEEK_END);
+    long fileBytes = ftell(file);
+    fclose(file);
+
+    {
+        LfReplay replay(path.c_str());
+        replay.start();
+        LfFrame out;
+        memset(&out, 0, sizeof(out));
+        LF_CHECK(replay.retrieveImage(&out) == 0 && out.camera == 3 && out.seq == 0, "camera from the index");
+        LF_CHECK(replay.getCameraCount() == 4, "cameras counted from the index");
+    }
+    {
+        LfReplay replay(path.c_str());
+        LfFramePool pool(2, width, height, LF_PIXEL_MONO8);
+        LfPairCapture capture(&replay, &pool);
+        replay.start();
+        LfFrame *on = NULL;
+        LF_CHECK(capture.capture(&on) == 0 && on->camera == 3 && on->pair->camera == 3,
+                 "replayed pairs keep their camera");
+        if (on != NULL)
+        {
+            pool.release(on->pair);
+            pool.release(on);
+        }
+    }
+    LF_CHECK(replayAll(path) == (long)frames, "intact");
+
+    // A frame count that wraps the size check
+    LfrTrailer trailer;
+    file = fopen(path.c_str(), "rb");
+    fseek(file, -(long)sizeof(trailer), SEEK_END);
+    LF_CHECK(fread(&trailer, sizeof(trailer), 1, file) == 1, "read trailer");
+    fclose(file);
+    LfrTrailer bad = trailer;
+    bad.frameCount = ~0ULL / sizeof(LfrIndexEntry) + 2;
+    rewriteAt(path, -(long)sizeof(bad), &bad, sizeof(bad));
+    LF_CHECK(replayAll(path) <= (long)frames, "huge frame count");
+
+    // An entry pointing past the end of the file
+    rewriteAt(path, -(long)sizeof(trailer), &trailer, sizeof(trailer));
+    uint64_t past = fileBytes;
+    rewriteAt(path, (long)trailer.indexOffset + sizeof(LfrIndexEntry), &past, sizeof(past));
+    LF_CHECK(replayAll(path) <= (long)frames, "bad offset");
+
+    // Cut off in the middle of a frame
+    LF_CHECK(truncate(path.c_str(), k_lfrAlignment + pixels.size() * 3 / 2) == 0, "truncate");
+    LF_CHECK(replayAll(path) == 1, "truncated");
+    remove(path.c_str());
+}
+
+
+
+static void testLatencyHistogram(LfCpuLevel)
+{
+    LfLatencyHistogram histogram;
+    for (unsigned long long v = 1; v <= 1000; v++)
+    {
+        histogram.record(v);
+    }
+    LF_CHECK(histogram.getCount() == 1000 && histogram.getMax() == 1000, "histogram count");
+    LF_CHECK(histogram.getMean() == 500.5, "histogram mean");
+    // Percentiles are bucket upper bounds, within 12.5% above the value
+    unsigned long long p50 = histogram.getPercentile(0.5);
+    unsigned long long p99 = histogram.getPercentile(0.99);
+    LF_CHECK(p50 > 500 && p50 <= 501 + 501 / 8, "histogram p50");
+    LF_CHECK(p99 > 990 && p99 <= 991 + 991 / 8, "histogram p99");
+    // Small counts, such as register reads, get a bucket each
+    LfLatencyHistogram reads;
+    reads.record(3);
+    LF_CHECK(reads.getPercentile(0.99) == 4, "histogram small values");
+
+    // Threads record into their own shards; nothing may be lost
+    histogram.reset();
+    LF_CHECK(histogram.getCount() == 0 && histogram.getMax() == 0, "histogram reset");
+    vector<thread> threads;
+    for (unsigned int t = 0; t < 4; t++)
+    {
+        threads.push_back(thread([&histogram, t]() {
+            for (unsigned long long v = 0; v < 20000; v++)
+            {
+                histogram.record(v * 4 + t);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+    LF_CHECK(histogram.getCount() == 80000 && histogram.getMax() == 79999, "histogram threads");
+    LF_CHECK(histogram.getMean() == 39999.5, "histogram threads mean");
+}
+
+// Bytes of each text record the logger test writes
+static const unsigned int k_logTextBytes = 300;
+
+// Logs from several threads much faster than the writer drains, so rings
+// fill up: every record must be either written, whole and once, or
+// counted as dropped
+static void testLogDrops(LfCpuLevel)
+{
+    const unsigned int threadCount = 4;
+    const unsigned int records = 20000;
+    string path = tempPath("log.txt");
+    FILE *file = fopen(path.c_str(), "w+");
+    LF_CHECK(file != NULL, "log file");
+    if (file == NULL)
+    {
+        return;
+    }
+    unsigned long writtenBefore = lfLogWritten();
+    unsigned long droppedBefore = lfLogDropped();
+    LF_CHECK(lfLogStart(fileno(file)) == 0, "log start");
+
+    vector<thread> threads;
+    for (unsigned int t = 0; t < threadCount; t++)
+    {
+        threads.push_back(thread([t, records]() {
+            for (unsigned int r = 0; r < records; r++)
+            {
+                // Filtered out; neither written nor dropped
+                lfLog(LF_LOG_DEBUG, "worker %u debug %u", t, r);
+                if (r % 100 == 0)
+                {
+                    // Text spans several slots and may wrap the ring
+                    char text[k_logTextBytes + 1];
+                    int n = snprintf(text, sizeof(text), "worker %u text %u ", t, r);
+                    memset(text + n, 'x', k_logTextBytes - n);
+                    text[k_logTextBytes] = '\0';
+                    lfLogText(LF_LOG_INFO, text);
+                }
+                else
+                {
+                    lfLog(LF_LOG_INFO, "worker %u record %u", t, r);
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+    lfLogStop();
+    unsigned long written = lfLogWritten() - writtenBefore;
+    unsigned long dropped = lfLogDropped() - droppedBefore;
+    LF_CHECK(written + dropped == threadCount * records, "log written + dropped");
+    LF_CHECK(dropped > 0, "log rings filled");
+
+    // Each thread's records in the order it logged them, none twice, and
+    // text records whole.  Lines start with a 22 character time and level.
+    vector<long> last(threadCount, -1);
+    unsigned long lines = 0;
+    bool ordered = true;
+    bool whole = true;
+    char line[512];
+    rewind(file);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lines++;
+        unsigned int t, r;
+        char kind[8];
+        size_t length = strlen(line);
+        if (length < 23 || sscanf(line + 22, "worker %u %7s %u", &t, kind, &r) != 3 || t >= threadCount)
+        {
+            whole = false;
+            continue;
+        }
+        bool text = strcmp(kind, "text") == 0;
+        if (text ? r % 100 != 0 || length != 22 + k_logTextBytes + 1 : strcmp(kind, "record") != 0)
+        {
+            whole = false;
+        }
+        ordered = ordered && (long)r > last[t];
+        last[t] = r;
+    }
+    fclose(file);
+    remove(path.c_str());
+    LF_CHECK(lines == written, "log lines written");
+    LF_CHECK(ordered, "log order per thread");
+    LF_CHECK(whole, "log records whole");
+}
+
+// Counted frames for the pair test: even counts are laser-on, with a bright
+// laser row, and each frame carries its count in its last row.  A share of
+// frames is lost on the way, as on a busy link.  Like a real camera the
+// source can't say which parity is on, and the first frame may be an off
+// one.
+static const unsigned int k_lossyWidth = 64;
+static const unsigned int k_lossyHeight = 4;
+
+class LfLossySource: public LfFrameSource {
+protected:
+    unsigned int next;
+    unsigned int first;
+    unsigned int lossPercent;
+    bool counted;
+    unsigned int seed;
+public:
+    unsigned long lost;
+    LfLossySource(unsigned int lossPercent, unsigned int first = 0, bool counted = true)
+        : next(first), first(first), lossPercent(lossPercent), counted(counted), seed(7), lost(0) {}
+    virtual int connect(int) { return 0; }
+    virtual int start() { return 0; }
+    virtual int stop() { return 0; }
+    virtual int disconnect() { return 0; }
+    virtual int retrieveImage(LfFrame *frame)
+    {
+        // The first frame always arrives, to anchor the parity
+        while (next > first && testRandom(&seed) % 100 < lossPercent)
+        {
+            next++;
+            lost++;
+        }
+        frame->seq = next;
+        frame->timestamp = 1000000ULL + next * 100ULL;
+        memset(frame->data, 20, (size_t)frame->stride * k_lossyHeight);
+        if (next % 2 == 0)
+        {
+            memset(frame->data + frame->stride, 200, k_lossyWidth);
+        }
+        memcpy(frame->data + (size_t)frame->stride * (k_lossyHeight - 1), &next, sizeof(next));
+        next++;
+        return 0;
+    }
+    virtual unsigned int getFrameWidth() const { return k_lossyWidth; }
+    virtual unsigned int getFrameHeight() const { return k_lossyHeight; }
+    virtual LfPixelFormat getFrameFormat() const { return LF_PIXEL_MONO8; }
+    virtual bool hasFrameCounter() const { return counted; }
+};
+
+// Captures triggers pairs, counting failed captures and pairs that aren't
+// an on frame and the one after it
+static unsigned long capturePairs(LfPairCapture &capture, LfFramePool &pool, unsigned int triggers,
+                                  unsigned long *errors, unsigned long *wrong)
+{
+    unsigned long pairs = 0;
+    for (unsigned int trigger = 0; trigger < triggers; trigger++)
+    {
+        LfFrame *on = NULL;
+        if (capture.capture(&on) != 0)
+        {
+            (*errors)++;
+            continue;
+        }
+        unsigned int onCount, offCount;
+        const size_t last = (size_t)on->stride * (k_lossyHeight - 1);
+        memcpy(&onCount, on->data + last, sizeof(onCount));
+        memcpy(&offCount, on->pair->data + last, sizeof(offCount));
+        if (onCount % 2 != 0 || offCount != onCount + 1 || on->seq != onCount)
+        {
+            (*wrong)++;
+        }
+        pairs++;
+        pool.release(on->pair);
+        pool.release(on);
+    }
+    return pairs;
+}
+
+static void testPairResync(LfCpuLevel)
+{
+    LfFramePool pool(4, k_lossyWidth, k_lossyHeight, LF_PIXEL_MONO8);
+    {
+        LfLossySource source(5);
+        LfPairCapture capture(&source, &pool);
+        unsigned long errors = 0;
+        unsigned long wrong = 0;
+        unsigned long pairs = capturePairs(capture, pool, 20000, &errors, &wrong);
+        LF_CHECK(wrong == 0, "pairs are an on frame and the one after it");
+        LF_CHECK(pool.getInUse() == 0, "pair buffers released");
+        // Runs of more lost frames than a capture retries over fail it
+        LF_CHECK(pairs > 18000 && errors < 100, "pairs captured");
+        LF_CHECK(capture.getFramesLost() == source.lost, "lost frames counted");
+        LF_CHECK(capture.getResyncs() > 0 && capture.getReordered() == 0, "resyncs counted");
+        LF_CHECK(capture.getReanchors() == 0, "no re-anchor when the first frame is on");
+    }
+
+    // Starting on an off frame swaps the first pairs, until their
+    // brightness moves the pairing over; after that none may be swapped
+    for (int counted = 1; counted >= 0; counted--)
+    {
+        LfLossySource source(counted ? 5 : 0, 1, counted != 0);
+        LfPairCapture capture(&source, &pool);
+        string label = counted ? "counted" : "uncounted";
+        unsigned long errors = 0;
+        unsigned long wrong = 0;
+        capturePairs(capture, pool, 20, &errors, &wrong);
+        LF_CHECK(capture.getReanchors() == 1, label + " frames re-anchored");
+        LF_CHECK(wrong > 0 && wrong < 20, label + " pairs swapped until re-anchored");
+        errors = 0;
+        wrong = 0;
+        unsigned long pairs = capturePairs(capture, pool, 5000, &errors, &wrong);
+        LF_CHECK(wrong == 0, label + " pairs right after re-anchoring");
+        LF_CHECK(pairs > 4500 && capture.getReanchors() == 1, label + " pairs stay anchored");
+        LF_CHECK(pool.getInUse() == 0, label + " pair buffers released");
+    }
+}
+
+// Synthetic camera that rounds ROIs out to whole blocks of rows, as GigE
+// cameras do to their unit sizes, and whose laser line can be hidden
+class LfRoundingSynth: public LfSynthCam {
+protected:
+    unsigned int rowUnit;
+public:
+    LfRoundingSynth(const LfSynthSettings &settings, unsigned int rowUnit)
+        : LfSynthCam(settings), rowUnit(rowUnit)
+    {
+    }
+    virtual int setRoi(const LfRoi &request)
+    {
+        LfRoi rounded = request;
+        rounded.offsetY = request.offsetY / rowUnit * rowUnit;
+        rounded.height = (request.offsetY + request.height + rowUnit - 1) / rowUnit * rowUnit - rounded.offsetY;
+        return LfSynthCam::setRoi(rounded);
+    }
+    // An intruder as wide as the sensor blocks the line for the next pairs
+    void hideLine(unsigned int pairs)
+    {
+        intrusionLeft = pairs + 1;
+        intrusionStart = 0;
+    }
+};
+
+// The synthetic camera, a pair capture forwarding the tracker's windows to
+// it, and a diff engine feeding the tracker, run one pair at a time
+struct LfRoiRig {
+    LfRoundingSynth &synth;
+    LfPairCapture &capture;
+    LfFramePool &pool;
+    LfDiffEngine &engine;
+    LfRoiTracker &tracker;
+    bool framed;        // Every frame's window held the line
+    bool requested;     // Every window asked for held it
+    bool captured;
+
+    // Whether rows [top, top + height) hold the line across the sensor
+    bool holdsLine(unsigned int top, unsigned int height)
+    {
+        for (unsigned int x = 0; x < synth.getSensorWidth(); x += 8)
+        {
+            double row = synth.getLaserRow(x);
+            if (row - 4 < top || row + 4 >= top + height)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    void run(unsigned int pairs)
+    {
+        for (unsigned int p = 0; p < pairs; p++)
+        {
+            LfFrame *on = NULL;
+            if (capture.capture(&on) != 0)
+            {
+                captured = false;
+                continue;
+            }
+            framed = holdsLine(on->offsetY, on->height) && framed;
+            engine.process(on, on->pair);
+            if (tracker.update(engine))
+            {
+                requested = holdsLine(tracker.getRoi().offsetY, tracker.getRoi().height) && requested;
+                capture.requestRoi(tracker.getRoi());
+            }
+            pool.release(on->pair);
+            pool.release(on);
+        }
+    }
+    // Tracking a band, in the window the camera settled on
+    bool settled()
+    {
+        const LfRoi &asked = tracker.getRoi();
+        const LfRoi &got = synth.getRoi();
+        return tracker.getState() == LF_ROI_TRACK && asked.offsetY == got.offsetY &&
+               asked.height == got.height && got.height < synth.getSensorHeight();
+    }
+};
+
+static void testRoiTracker(LfCpuLevel)
+{
+    const unsigned int rowUnits[] = { 1, 16 };
+    for (unsigned int u = 0; u < sizeof(rowUnits) / sizeof(rowUnits[0]); u++)
+    {
+        const unsigned int size = 512;
+        LfSynthSettings settings;
+        lfSynthDefaults(&settings);
+        settings.width = size;
+        settings.height = size;
+        settings.triggerRate = 0;
+        settings.laserRow = 160;
+        settings.laserSlope = 0.05;
+        settings.drift = 0.25;
+        settings.intrusionWidth = size;
+        settings.seed = 3;
+        LfRoundingSynth synth(settings, rowUnits[u]);
+        LfRoiSettings roiSettings;
+        lfRoiDefaults(&roiSettings);
+        LfRoiTracker tracker(size, size, roiSettings);
+        LfFramePool pool(4, size, size, LF_PIXEL_MONO8);
+        LfPairCapture capture(&synth, &pool);
+        LfDiffEngine engine(size, size, 32);
+        LfRoiRig rig = { synth, capture, pool, engine, tracker, true, true, true };
+        synth.connect(0);
+        synth.start();
+        char label[32];
+        snprintf(label, sizeof(label), "rows in %u ", rowUnits[u]);
+        string units = label;
+
+        // Acquire on the full sensor, then track a band
+        rig.run(roiSettings.acquirePairs - 1);
+        LF_CHECK(tracker.getState() == LF_ROI_ACQUIRE && synth.getRoi().height == size, units + "acquiring");
+        rig.run(10);
+        LF_CHECK(rig.settled(), units + "band tracked after acquiring");
+        LF_CHECK(synth.getRoi().offsetY % rowUnits[u] == 0, units + "window rounded by the camera");
+        unsigned int bandHeight = synth.getRoi().height;
+
+        // The line drifts 100 rows, and the band is re-centred along with it
+        unsigned long changes = tracker.getChanges();
+        unsigned int top = synth.getRoi().offsetY;
+        rig.run(400);
+        LF_CHECK(rig.settled() && synth.getRoi().offsetY > top + 50, units + "band follows drift");
+        LF_CHECK(tracker.getChanges() > changes + 1 && tracker.getChanges() < changes + 40,
+                 units + "re-centred, without asking every pair");
+
+        // A short loss widens the band, and the line showing again narrows it
+        synth.hideLine(roiSettings.lostPairs + 5);
+        rig.run(roiSettings.lostPairs);
+        // Windows asked for take effect from the next pair
+        LF_CHECK(tracker.getState() == LF_ROI_WIDEN && tracker.getRoi().height > bandHeight, units + "widened");
+        rig.run(15);
+        LF_CHECK(rig.settled() && synth.getRoi().height <= bandHeight + rowUnits[u] &&
+                 tracker.getReacquisitions() == 0, units + "narrowed after widening");
+
+        // A long one goes back to the full sensor, and acquires again
+        synth.hideLine(3 * roiSettings.lostPairs);
+        rig.run(2 * roiSettings.lostPairs);
+        LF_CHECK(tracker.getState() == LF_ROI_ACQUIRE && tracker.getReacquisitions() == 1 &&
+                 tracker.getRoi().height == size, units + "full sensor after a long loss");
+        rig.run(roiSettings.lostPairs + roiSettings.acquirePairs + 5);
+        LF_CHECK(rig.settled(), units + "band tracked after reacquiring");
+
+        LF_CHECK(rig.captured, units + "pairs captured");
+        LF_CHECK(rig.framed, units + "every frame held the line");
+        LF_CHECK(rig.requested, units + "every window asked for held the line");
+        LF_CHECK(capture.getRoiFailures() == 0 && pool.getInUse() == 0, units + "windows applied, buffers released");
+    }
+}
+
+// What the live processing stage does with a pair: difference, profile,
+// judge, score against the background and label
+class LfSteadyStage: public LfFrameHandler {
+protected:
+    LfDiffEngine engine;
+    LfProfiler profiler;
+    LfBackground background;
+    LfBlobLabeler labeler;
+    LfAlarmDetector detector;
+public:
+    atomic<unsigned long> pairs;
+    LfSteadyStage(unsigned int width, unsigned int height, const LfAlarmSettings &alarmSettings)
+        : engine(width, height, 32), profiler(width), background(width, height), labeler(width, height, 256),
+          detector(width, alarmSettings), pairs(0)
+    {
+    }
+    void addSink(LfAlarmSink *sink) { detector.addSink(sink); }
+    unsigned long getAlarms() const { return detector.getAlarms(); }
+    virtual bool handleFrames(LfFrame *on, LfFrame *off)
+    {
+        engine.process(on, off);
+        if (profiler.extract(engine) >= 0)
+        {
+            detector.check(profiler, on->camera, on->seq, on->timestamp);
+        }
+        background.update(engine);
+        labeler.label(background.getMask(), background.getWidth(), background.getHeight(), background.getWidth(),
+                      background.getOffsetX(), background.getOffsetY());
+        pairs.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+};
+
+static void countAlarm(const LfAlarmEvent &, void *context)
+{
+    (*(unsigned long *)context)++;
+}
+
+static bool waitForPairs(const LfSteadyStage &stage, unsigned long pairs)
+{
+    for (unsigned int ms = 0; ms < 20000; ms++)
+    {
+        if (stage.pairs.load(memory_order_relaxed) >= pairs)
+        {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+// Synthetic pairs through LfMultiCam and LfPipeline as lfapp runs them,
+// with lost frames and intrusions that raise and clear alarms.  Once the
+// alarm has learned its baseline, nothing may touch the heap or allocate
+// a frame buffer.
+static void testSteadyAllocs(LfCpuLevel)
+{
+    const unsigned int width = 320;
+    const unsigned int height = 240;
+    LfSynthSettings settings;
+    lfSynthDefaults(&settings);
+    settings.width = width;
+    settings.height = height;
+    settings.triggerRate = 0;
+    settings.laserRow = 120;
+    settings.intrusionRate = 0.05;
+    settings.dropRate = 0.01;
+    LfSynthCam synth(settings);
+    LfAlarmSettings alarmSettings;
+    lfAlarmDefaults(&alarmSettings);
+    LfSteadyStage stage(width, height, alarmSettings);
+    unsigned long alarms = 0;
+    LfCallbackSink sink(countAlarm, &alarms);
+    stage.addSink(&sink);
+
+    const unsigned int queueDepth = 4;
+    LfFramePool pool(2 * (3 * queueDepth + 4), width, height, LF_PIXEL_MONO8);
+    LfMultiCam multiCam(queueDepth);
+    multiCam.addCamera(&synth, &pool, -1);
+    LfPipeline pipeline(NULL, queueDepth);
+    pipeline.setFeed(&multiCam);
+    pipeline.setProcessor(&stage, LF_QUEUE_DROP_OLDEST);
+    synth.connect(0);
+    synth.start();
+    multiCam.start();
+    pipeline.start();
+
+    bool warm = waitForPairs(stage, 2 * alarmSettings.learnPairs);
+    unsigned long heapBefore = heapAllocs.load();
+    unsigned long buffersBefore = lfAllocCount();
+    unsigned long alarmsBefore = stage.getAlarms();
+    bool ran = warm && waitForPairs(stage, 2 * alarmSettings.learnPairs + 2000);
+    unsigned long heapDuring = heapAllocs.load() - heapBefore;
+    unsigned long buffersDuring = lfAllocCount() - buffersBefore;
+    unsigned long alarmsDuring = stage.getAlarms() - alarmsBefore;
+
+    pipeline.stop();
+    multiCam.stop();
+    synth.stop();
+    LF_CHECK(ran, "steady pairs processed");
+    unsigned long probeBefore = heapAllocs.load();
+    int *volatile probe = new int(0);
+    delete probe;
+    string text(64, 'x');
+    LF_CHECK(heapAllocs.load() >= probeBefore + 2, "heap allocations are counted");
+    LF_CHECK(heapDuring == 0, "no heap allocation in steady state, " + to_string(heapDuring) + " made");
+    LF_CHECK(buffersDuring == 0, "no frame buffer allocated in steady state");
+    LF_CHECK(alarmsDuring > 0 && synth.getFramesDropped() > 0, "alarms and lost frames on the way");
+    LF_CHECK(pool.getInUse() == 0, "steady pairs released");
+}
+
+static void testCodecRows(LfCpuLevel maxLevel)
+{
+    // Residuals across the whole signed range, -128 and 127 included, and
+    // rows of small ones, as noise gives
+    unsigned int seed = 8;
+    const unsigned int maxN = 1283;
+    vector<unsigned char> cur(maxN), ref(maxN), out(maxN), decoded(maxN);
+    vector<unsigned char> stream(2 * maxN + 64), refStream(2 * maxN + 64);
+    for (int level = LF_CPU_SCALAR; level <= maxLevel; level++)
+    {
+        LfEncodeRowKernel encode = lfGetEncodeRowKernel((LfCpuLevel)level);
+        LfDecodeRowKernel decode = lfGetDecodeRowKernel((LfCpuLevel)level);
+        for (size_t l = 0; l < sizeof(k_testLengths) / sizeof(k_testLengths[0]); l++)
+        {
+            unsigned int n = k_testLengths[l];
+            for (unsigned int round = 0; round < 4; round++)
+            {
+                fillRandom(&cur[0], n, &seed);
+                for (unsigned int i = 0; i < n; i++)
+                {
+                    ref[i] = round == 0 ? (unsigned char)(cur[i] + 128) : round == 1 ? (unsigned char)(cur[i] - 127)
+                           : round == 2 ? (unsigned char)(cur[i] + testRandom(&seed) % 5 - 2)
+                           : (unsigned char)testRandom(&seed);
+                }
+                const unsigned char *rowRef = round == 3 && n % 2 ? NULL : &ref[0];
+                unsigned int refRun = 0;
+                unsigned int run = 0;
+                size_t refBytes = lfEncodeRowScalar(&cur[0], rowRef, n, &refStream[0], &refRun);
+                refBytes += lfFlushZeroRun(&refStream[refBytes], &refRun);
+                size_t bytes = encode(&cur[0], rowRef, n, &stream[0], &run);
+                bytes += lfFlushZeroRun(&stream[bytes], &run);
+                string what = levelLabel("codec", (LfCpuLevel)level, n);
+                LF_CHECK(bytes == refBytes && memcmp(&stream[0], &refStream[0], bytes) == 0, what + " stream");
+
+                run = 0;
+                const unsigned char *end = decode(&stream[0], &stream[bytes], rowRef, n, &decoded[0], &run);
+                LF_CHECK(end == &stream[bytes] && (n == 0 || memcmp(&decoded[0], &cur[0], n) == 0),
+                         what + " round trip");
+            }
+        }
+    }
+}
+
+// Bytes ending right at an inaccessible page, so a decoder reading even
+// one byte past the image it was given crashes the test
+class LfGuardedImage {
+protected:
+    unsigned char *map;
+    size_t mapBytes;
+    size_t page;
+public:
+    LfGuardedImage(size_t capacity)
+    {
+        page = sysconf(_SC_PAGESIZE);
+        mapBytes = (capacity + page - 1) / page * page + page;
+        void *p = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            throw runtime_error("Can't map guarded image");
+        }
+        map = (unsigned char *)p;
+        mprotect(map + mapBytes - page, page, PROT_NONE);
+    }
+    ~LfGuardedImage() { munmap(map, mapBytes); }
+    // Copies bytes of image so that they end at the guard page
+    const unsigned char *place(const unsigned char *image, size_t bytes)
+    {
+        unsigned char *at = map + mapBytes - page - bytes;
+        memcpy(at, image, bytes);
+        return at;
+    }
+};
+
+// Test frame of any format at a padded stride.  Alternate rows repeat the
+// one above, so key frames have zero runs, and with a first frame given
+// the pixels are it plus small noise, as the other frame of a pair is.
+static void codecFrame(LfFrame *frame, vector<unsigned char> &data, LfPixelFormat format, unsigned int width,
+                       unsigned int height, const LfFrame *first, unsigned int *seed)
+{
+    size_t rowBytes = lfRowBytes(format, width);
+    unsigned int stride = rowBytes + 5;
+    data.assign((size_t)stride * height, 0);
+    for (unsigned int y = 0; y < height; y++)
+    {
+        unsigned char *row = &data[(size_t)y * stride];
+        for (size_t i = 0; i < rowBytes; i++)
+        {
+            if (first != NULL)
+            {
+                unsigned char was = first->data[(size_t)y * first->stride + i];
+                row[i] = i % 7 < 3 ? was : (unsigned char)(was + testRandom(seed) % 5 - 2);
+            }
+            else
+            {
+                row[i] = y % 2 ? row[i - stride] : (unsigned char)testRandom(seed);
+            }
+        }
+    }
+    memset(frame, 0, sizeof(*frame));
+    frame->data = &data[0];
+    frame->capacity = data.size();
+    frame->dataSize = data.size();
+    frame->width = width;
+    frame->height = height;
+    frame->stride = stride;
+    frame->offsetX = 8;
+    frame->offsetY = 4;
+    frame->format = format;
+    frame->nativeFormat = 0x1234 + format;
+    frame->timestamp = 1234567890123ULL + (first != NULL);
+    frame->seq = 77 + (first != NULL);
+    frame->camera = 2;
+}
+
+static bool sameFrame(const LfFrame *decoded, const LfFrame *frame)
+{
+    size_t rowBytes = lfRowBytes(frame->format, frame->width);
+    if (decoded->width != frame->width || decoded->height != frame->height || decoded->stride != rowBytes ||
+        decoded->format != frame->format || decoded->nativeFormat != frame->nativeFormat ||
+        decoded->timestamp != frame->timestamp || decoded->seq != frame->seq ||
+        decoded->camera != frame->camera || decoded->offsetX != frame->offsetX ||
+        decoded->offsetY != frame->offsetY)
+    {
+        return false;
+    }
+    for (unsigned int y = 0; y < frame->height; y++)
+    {
+        if (memcmp(decoded->data + (size_t)y * rowBytes, frame->data + (size_t)y * frame->stride, rowBytes) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Frame to decode into, with exactly the room given
+static void decodeTarget(LfFrame *frame, vector<unsigned char> &data, size_t capacity)
+{
+    data.assign(capacity, 0);
+    memset(frame, 0, sizeof(*frame));
+    frame->data = &data[0];
+    frame->capacity = capacity;
+}
+
+// Whole .lfc images: single frames and pairs of every codable format at
+// odd sizes, sliced and coded on workers, must round trip and code to the
+// same bytes either way.  Cut short or damaged, an image must be refused
+// without the decoder reading past it.
+static void testFrameCodec(LfCpuLevel maxLevel)
+{
+    struct Size {
+        unsigned int width;
+        unsigned int height;
+    };
+    const Size sizes[] = { { 1, 1 }, { 37, 5 }, { 333, 17 }, { 641, 3 } };
+    const LfPixelFormat formats[] = { LF_PIXEL_MONO8, LF_PIXEL_MONO12, LF_PIXEL_MONO16 };
+    const char *formatNames[] = { "mono8", "mono12", "mono16" };
+    const unsigned int sliceCounts[] = { 1, 3, 64 };
+    unsigned int seed = 14;
+    LfWorkers workers(3);
+    for (size_t fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++)
+    {
+        for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++)
+        {
+            LfPixelFormat format = formats[fi];
+            unsigned int width = sizes[si].width;
+            unsigned int height = sizes[si].height;
+            LfFrame frame, pair, decoded, decodedPair;
+            vector<unsigned char> frameData, pairData, decodedData, decodedPairData;
+            codecFrame(&frame, frameData, format, width, height, NULL, &seed);
+            codecFrame(&pair, pairData, format, width, height, &frame, &seed);
+            size_t frameBytes = lfRowBytes(format, width) * height;
+            char label[64];
+            snprintf(label, sizeof(label), "lfc %s %ux%u", formatNames[fi], width, height);
+
+            for (size_t sc = 0; sc < sizeof(sliceCounts) / sizeof(sliceCounts[0]); sc++)
+            {
+                vector<unsigned char> reference;
+                for (int level = LF_CPU_SCALAR; level <= maxLevel + 1; level++)
+                {
+                    // One extra round at the best level on the workers
+                    bool banded = level > maxLevel;
+                    LfFrameCodec codec;
+                    codec.setCpuLevel(banded ? maxLevel : (LfCpuLevel)level);
+                    codec.setWorkers(banded ? &workers : NULL);
+                    codec.setSlices(sliceCounts[sc]);
+                    string what = string(label) + " slices " + to_string(sliceCounts[sc]) +
+                                  (banded ? " banded " : " ") + lfCpuLevelName(codec.getCpuLevel());
+                    vector<unsigned char> image(codec.maxEncodedSize(width, height, format, 2));
+                    size_t bytes = codec.encode(&frame, &pair, &image[0], image.size());
+                    image.resize(bytes);
+                    if (reference.empty())
+                    {
+                        reference = image;
+                    }
+                    LF_CHECK(bytes > 0 && image == reference, what + " codes as scalar");
+
+                    decodeTarget(&decoded, decodedData, frameBytes);
+                    decodeTarget(&decodedPair, decodedPairData, frameBytes);
+                    LF_CHECK(codec.decode(&image[0], bytes, &decoded, &decodedPair) == 0 &&
+                             sameFrame(&decoded, &frame) && sameFrame(&decodedPair, &pair), what + " pair round trip");
+                    decodeTarget(&decoded, decodedData, frameBytes);
+                    LF_CHECK(codec.decode(&image[0], bytes, &decoded, NULL) == 0 && sameFrame(&decoded, &frame),
+                             what + " first frame alone");
+
+                    vector<unsigned char> single(codec.maxEncodedSize(width, height, format, 1));
+                    bytes = codec.encode(&frame, NULL, &single[0], single.size());
+                    decodeTarget(&decoded, decodedData, frameBytes);
+                    LF_CHECK(bytes > 0 && codec.decode(&single[0], bytes, &decoded, NULL) == 0 &&
+                             sameFrame(&decoded, &frame), what + " single round trip");
+                    LF_CHECK(codec.encode(&frame, &pair, &image[0], codec.maxEncodedSize(width, height, format, 2) - 1) == 0,
+                             what + " too little room refused");
+                }
+            }
+
+            // Damage a three slice pair image, or one slice per row
+            LfFrameCodec codec;
+            codec.setCpuLevel(maxLevel);
+            codec.setSlices(3);
+            vector<unsigned char> image(codec.maxEncodedSize(width, height, format, 2));
+            size_t bytes = codec.encode(&frame, &pair, &image[0], image.size());
+            image.resize(bytes);
+            LfGuardedImage guarded(bytes);
+            LfcHeader header;
+            LfcFrameInfo info[2];
+            size_t head = sizeof(LfcHeader) + 2 * sizeof(LfcFrameInfo);
+            unsigned int streams = 2 * (height < 3 ? height : 3);
+            size_t streamsAt = head + streams * sizeof(uint32_t);
+
+            bool refused = true, headerRefused = true;
+            for (size_t cut = 0; cut < bytes; cut += cut < streamsAt + 64 ? 1 : 7)
+            {
+                const unsigned char *in = guarded.place(&image[0], cut);
+                decodeTarget(&decoded, decodedData, frameBytes);
+                decodeTarget(&decodedPair, decodedPairData, frameBytes);
+                refused = refused && codec.decode(in, cut, &decoded, &decodedPair) == -1;
+                if (cut < streamsAt)
+                {
+                    headerRefused = headerRefused && LfFrameCodec::readHeader(in, cut, &header, info) == -1;
+                }
+            }
+            LF_CHECK(refused, string(label) + " truncated images refused");
+            LF_CHECK(headerRefused, string(label) + " truncated headers refused");
+
+            // A slice cut short with the sizes made to agree: the row decoder
+            // runs out of stream partway through
+            bool shortRefused = true;
+            for (unsigned int k = 0; k < streams; k++)
+            {
+                vector<unsigned char> damaged(image);
+                uint32_t sliceBytes;
+                memcpy(&sliceBytes, &damaged[head + k * sizeof(uint32_t)], sizeof(sliceBytes));
+                sliceBytes--;
+                memcpy(&damaged[head + k * sizeof(uint32_t)], &sliceBytes, sizeof(sliceBytes));
+                size_t end = streamsAt;
+                for (unsigned int j = 0; j <= k; j++)
+                {
+                    uint32_t b;
+                    memcpy(&b, &damaged[head + j * sizeof(uint32_t)], sizeof(b));
+                    end += b;
+                }
+                damaged.erase(damaged.begin() + end);
+                const unsigned char *in = guarded.place(&damaged[0], damaged.size());
+                decodeTarget(&decoded, decodedData, frameBytes);
+                decodeTarget(&decodedPair, decodedPairData, frameBytes);
+                shortRefused = shortRefused && codec.decode(in, damaged.size(), &decoded, &decodedPair) == -1;
+            }
+            LF_CHECK(shortRefused, string(label) + " short slices refused");
+
+            // Headers that don't describe a valid image
+            for (unsigned int c = 0; c < 11; c++)
+            {
+                vector<unsigned char> damaged(image);
+                LfcHeader *h = (LfcHeader *)&damaged[0];
+                uint32_t *sliceBytes = (uint32_t *)&damaged[head];
+                switch (c)
+                {
+                case 0: h->magic[3] = '2'; break;
+                case 1: h->version = 2; break;
+                case 2: h->frames = 3; break;
+                case 3: h->slices = 0; break;
+                case 4: h->slices = k_lfcMaxSlices + 1; break;
+                case 5: h->slices = height + 1; break;
+                case 6: h->width = 0; break;
+                case 7: h->pixelFormat = 99; break;
+                case 8: sliceBytes[0] = 0xffffffffu; break;
+                case 9: sliceBytes[streams - 1]++; break;
+                default: h->height = 1 << 20; break;
+                }
+                const unsigned char *in = guarded.place(&damaged[0], damaged.size());
+                decodeTarget(&decoded, decodedData, frameBytes);
+                decodeTarget(&decodedPair, decodedPairData, frameBytes);
+                LF_CHECK(codec.decode(in, damaged.size(), &decoded, &decodedPair) == -1,
+                         string(label) + " bad header " + to_string(c) + " refused");
+                // Slice sizes are only checked against the image by decode()
+                LF_CHECK(c == 8 || c == 9 || LfFrameCodec::readHeader(in, damaged.size(), &header, info) == -1,
+                         string(label) + " bad header " + to_string(c) + " refused by readHeader");
+            }
+
+            // A frame buffer too small for the image
+            decodeTarget(&decoded, decodedData, frameBytes);
+            decodeTarget(&decodedPair, decodedPairData, frameBytes - 1);
+            LF_CHECK(codec.decode(&image[0], bytes, &decoded, &decodedPair) == -1,
+                     string(label) + " small buffer refused");
+
+            // Random damage to the streams may decode to other pixels, but
+            // must never run the decoder off the image
+            for (unsigned int round = 0; round < 200; round++)
+            {
+                vector<unsigned char> damaged(image);
+                size_t at = streamsAt + testRandom(&seed) % (bytes - streamsAt);
+                damaged[at] ^= (unsigned char)(1 + testRandom(&seed) % 255);
+                const unsigned char *in = guarded.place(&damaged[0], damaged.size());
+                decodeTarget(&decoded, decodedData, frameBytes);
+                decodeTarget(&decodedPair, decodedPairData, frameBytes);
+                codec.decode(in, damaged.size(), &decoded, &decodedPair);
+            }
+        }
+    }
+}
+
+// Clip buffer whose test can pin pairs as a dump in progress would
+class LfPinnedClip: public LfClipBuffer {
+public:
+    LfPinnedClip(size_t arenaBytes)
+        : LfClipBuffer(0, 64, 16, LF_PIXEL_MONO8, 1000.0, arenaBytes)
+    {
+    }
+    void pin(bool on)
+    {
+        lock_guard<mutex> guard(lock);
+        pinFrom = on ? first : ULONG_MAX;
+    }
+    unsigned long getFirst()
+    {
+        lock_guard<mutex> guard(lock);
+        return first;
+    }
+};
+
+// Frame of clip test pair p: flat, with a noisy block that moves, so pairs
+// code to different sizes
+static void clipFrame(unsigned int p, bool laserOn, unsigned char *data)
+{
+    unsigned int seed = 2 * p + (laserOn ? 0 : 1) + 1;
+    memset(data, laserOn ? 40 : 20, 64 * 16);
+    unsigned int x0 = p * 5 % 48;
+    unsigned int size = 4 + p % 12;
+    for (unsigned int y = 0; y < 16 && y < size; y++)
+    {
+        fillRandom(data + y * 64 + x0, 16, &seed);
+    }
+}
+
+static void testClipBuffer(LfCpuLevel)
+{
+    string directory = tempPath("clips");
+    mkdir(directory.c_str(), 0700);
+    LfPinnedClip clip(16 * 1024);
+    clip.setDirectory(directory.c_str());
+    clip.setKeyInterval(8);
+    LF_CHECK(clip.start() == 0, "clip start");
+
+    LfFrame frames[2];
+    vector<unsigned char> pixels(2 * 64 * 16);
+    memset(frames, 0, sizeof(frames));
+    for (unsigned int k = 0; k < 2; k++)
+    {
+        frames[k].data = &pixels[k * 64 * 16];
+        frames[k].width = 64;
+        frames[k].height = 16;
+        frames[k].stride = 64;
+        frames[k].format = LF_PIXEL_MONO8;
+        frames[k].index = -1;
+    }
+
+    // Far more pairs than the arena holds: the ring wraps and evicts
+    const unsigned int wrapPairs = 300;
+    const unsigned int totalPairs = 600;
+    unsigned int failures = 0;
+    unsigned int lastKept = 0;
+    unsigned long pinned = 0;
+    for (unsigned int p = 0; p < totalPairs; p++)
+    {
+        if (p == wrapPairs)
+        {
+            LF_CHECK(failures == 0 && clip.getBufferedBytes() <= 16 * 1024, "clip ring wraps");
+            // From here the oldest pairs are pinned, so a full ring drops
+            // new pairs instead of evicting them
+            clip.pin(true);
+            pinned = clip.getFirst();
+        }
+        for (unsigned int k = 0; k < 2; k++)
+        {
+            clipFrame(p, k == 0, frames[k].data);
+            frames[k].seq = 2 * p + k;
+            frames[k].timestamp = 1000000ULL + 1000ULL * p + k;
+        }
+        if (clip.append(&frames[0], &frames[1]) == 0)
+        {
+            lastKept = p;
+        }
+        else
+        {
+            failures++;
+        }
+    }
+    LF_CHECK(failures > 0 && clip.getDropped() == failures, "clip drops when pinned");
+    LF_CHECK(clip.getFirst() == pinned, "clip keeps pinned pairs");
+
+    clip.pin(false);
+    clip.requestDump(1);
+    clip.stop();
+    LF_CHECK(clip.getDumps() == 1, "clip dumped");
+
+    // Every frame of the clip decodes to exactly what was appended, and
+    // the clip runs up to the last pair kept
+    string path = directory + "/clip_cam0_1.lfr";
+    unsigned long frameCount = 0;
+    bool same = true;
+    unsigned int lastSeq = 0;
+    try
+    {
+        LfReplay replay(path.c_str());
+        replay.start();
+        LfFrame frame;
+        memset(&frame, 0, sizeof(frame));
+        vector<unsigned char> expected(64 * 16);
+        while (replay.retrieveImage(&frame) == 0)
+        {
+            clipFrame(frame.seq / 2, frame.seq % 2 == 0, &expected[0]);
+            same = same && frame.dataSize == expected.size() && memcmp(frame.data, &expected[0], expected.size()) == 0;
+            lastSeq = frame.seq;
+            frameCount++;
+        }
+    }
+    catch (const runtime_error &)
+    {
+        same = false;
+    }
+    LF_CHECK(same && frameCount > 0, "clip frames decode");
+    LF_CHECK(lastSeq == 2 * lastKept + 1, "clip ends at the last pair kept");
+    remove(path.c_str());
+    rmdir(directory.c_str());
+}
+
+// Pixel value of a bus test frame, so a reader can tell which pair, and
+// which frame of it, any byte came from
+static unsigned char busPixel(unsigned int seq, bool laserOn)
+{
+    unsigned char v = (unsigned char)(seq * 7 + 1);
+    return laserOn ? v : (unsigned char)~v;
+}
+
+static bool uniform(const unsigned char *p, size_t n, unsigned char v)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (p[i] != v)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Profile the alarm test writes by hand, in place of one extracted from a
+// difference plane
+class LfTestProfile: public LfProfiler {
+public:
+    LfTestProfile(unsigned int maxWidth) : LfProfiler(maxWidth) {}
+    // The line at lineRow in every column of [offset, offset + w), except
+    // those set afterwards through at()
+    void set(unsigned int offset, unsigned int w, float lineRow)
+    {
+        offsetX = offset;
+        width = w;
+        for (unsigned int x = 0; x < w; x++)
+        {
+            row[x] = lineRow;
+        }
+    }
+    float &at(unsigned int x) { return row[x]; }
+};
+
+struct LfAlarmLog {
+    vector<LfAlarmEvent> events;
+};
+
+static void logAlarm(const LfAlarmEvent &event, void *context)
+{
+    ((LfAlarmLog *)context)->events.push_back(event);
+}
+
+static const unsigned int k_alarmWidth = 256;
+static const float k_alarmRow = 100.0f;
+
+// Arms a detector on a line at k_alarmRow.  Columns 40-49 show the line in
+// 4 of the 10 learning pairs and columns 50-59 in 5, so only the first
+// are dropped.
+static void armAlarm(LfAlarmDetector &detector, LfTestProfile &profile, unsigned int *seq)
+{
+    for (unsigned int p = 0; p < 10; p++)
+    {
+        profile.set(0, k_alarmWidth, k_alarmRow + (p % 3) * 0.25f);
+        for (unsigned int c = 40; c < 60; c++)
+        {
+            if (p >= (c < 50 ? 4u : 5u))
+            {
+                profile.at(c) = k_lfNoLine;
+            }
+        }
+        detector.check(profile, 0, (*seq)++, lfTimestampUs());
+    }
+}
+
+// Whole line, with columns [first, first + n) missing from it
+static bool checkBroken(LfAlarmDetector &detector, LfTestProfile &profile, unsigned int *seq,
+                        unsigned int first, unsigned int n)
+{
+    profile.set(0, k_alarmWidth, k_alarmRow);
+    for (unsigned int c = first; c < first + n; c++)
+    {
+        profile.at(c) = k_lfNoLine;
+    }
+    return detector.check(profile, 3, (*seq)++, lfTimestampUs());
+}
+
+static void testAlarm(LfCpuLevel)
+{
+    LfAlarmSettings settings;
+    lfAlarmDefaults(&settings);
+    settings.learnPairs = 10;
+    settings.minRun = 8;
+    settings.clearPairs = 5;
+    LfTestProfile profile(k_alarmWidth);
+
+    // Learning, and which columns it keeps
+    {
+        LfAlarmDetector detector(k_alarmWidth, settings);
+        LfAlarmLog log;
+        LfCallbackSink sink(logAlarm, &log);
+        detector.addSink(&sink);
+        unsigned int seq = 0;
+        armAlarm(detector, profile, &seq);
+        LF_CHECK(detector.isArmed() && log.events.empty(), "alarm armed after learning");
+        LF_CHECK(!checkBroken(detector, profile, &seq, 0, 0), "whole line passes");
+        LF_CHECK(!checkBroken(detector, profile, &seq, 40, 10), "columns seen in under half the pairs ignored");
+        profile.set(0, k_alarmWidth, k_alarmRow + (float)settings.tolerance - 0.5f);
+        LF_CHECK(!detector.check(profile, 0, seq++, lfTimestampUs()), "move within tolerance passes");
+        LF_CHECK(checkBroken(detector, profile, &seq, 50, 8), "columns seen in half the pairs judged");
+        LF_CHECK(log.events.size() == 1 && log.events[0].column == 50, "break in judged columns raised");
+    }
+    {
+        LfAlarmDetector detector(k_alarmWidth, settings);
+        unsigned int seq = 0;
+        armAlarm(detector, profile, &seq);
+        profile.set(0, k_alarmWidth, k_alarmRow);
+        for (unsigned int c = 120; c < 128; c++)
+        {
+            profile.at(c) = k_alarmRow + (float)settings.tolerance + 1.0f;
+        }
+        LF_CHECK(detector.check(profile, 0, seq++, lfTimestampUs()), "line moved past tolerance breaks");
+    }
+
+    // minRun broken columns raise one event however long the break; one
+    // fewer, or two short runs, raise none
+    {
+        LfAlarmDetector detector(k_alarmWidth, settings);
+        LfAlarmLog log;
+        LfCallbackSink sink(logAlarm, &log);
+        detector.addSink(&sink);
+        unsigned int seq = 0;
+        armAlarm(detector, profile, &seq);
+        LF_CHECK(!checkBroken(detector, profile, &seq, 100, settings.minRun - 1), "minRun - 1 columns pass");
+        profile.set(0, k_alarmWidth, k_alarmRow);
+        for (unsigned int c = 100; c < 114; c++)
+        {
+            profile.at(c) = c == 107 ? k_alarmRow : k_lfNoLine;
+        }
+        LF_CHECK(!detector.check(profile, 0, seq++, lfTimestampUs()), "two short runs pass");
+        LF_CHECK(log.events.empty(), "no event for short runs");
+        unsigned int raisedSeq = seq;
+        for (unsigned int p = 0; p < 4; p++)
+        {
+            LF_CHECK(checkBroken(detector, profile, &seq, 100, settings.minRun), "minRun columns break");
+        }
+        LF_CHECK(detector.getAlarms() == 1 && log.events.size() == 1, "one event per break");
+        LF_CHECK(log.events.size() == 1 && log.events[0].type == LF_ALARM_RAISED && log.events[0].column == 100
+                 && log.events[0].run == settings.minRun && log.events[0].camera == 3
+                 && log.events[0].seq == raisedSeq, "raised event");
+
+        // Clears after clearPairs whole pairs in a row, and a break on the
+        // way starts the count again
+        for (unsigned int p = 0; p + 1 < settings.clearPairs; p++)
+        {
+            checkBroken(detector, profile, &seq, 0, 0);
+        }
+        LF_CHECK(checkBroken(detector, profile, &seq, 100, 20), "break before clearPairs keeps the alarm");
+        for (unsigned int p = 0; p + 1 < settings.clearPairs; p++)
+        {
+            LF_CHECK(checkBroken(detector, profile, &seq, 0, 0), "alarm held until clearPairs");
+        }
+        LF_CHECK(log.events.size() == 1, "no clear before clearPairs");
+        LF_CHECK(!checkBroken(detector, profile, &seq, 0, 0), "alarm cleared after clearPairs");
+        LF_CHECK(log.events.size() == 2 && log.events[1].type == LF_ALARM_CLEARED && log.events[1].seq == seq - 1,
+                 "cleared event");
+        LF_CHECK(checkBroken(detector, profile, &seq, 200, settings.minRun) && detector.getAlarms() == 2,
+                 "next break raised again");
+    }
+
+    // A profile of an ROI maps onto the sensor columns it covers
+    {
+        LfAlarmDetector detector(k_alarmWidth, settings);
+        LfAlarmLog log;
+        LfCallbackSink sink(logAlarm, &log);
+        detector.addSink(&sink);
+        unsigned int seq = 0;
+        armAlarm(detector, profile, &seq);
+        profile.set(36, 20, k_alarmRow);
+        for (unsigned int x = 4; x < 14; x++)
+        {
+            profile.at(x) = k_lfNoLine;
+        }
+        LF_CHECK(!detector.check(profile, 0, seq++, lfTimestampUs()), "ROI over ignored columns passes");
+        profile.set(100, 64, k_alarmRow);
+        for (unsigned int x = 10; x < 18; x++)
+        {
+            profile.at(x) = k_lfNoLine;
+        }
+        LF_CHECK(detector.check(profile, 0, seq++, lfTimestampUs()), "ROI break raised");
+        LF_CHECK(log.events.size() == 1 && log.events[0].column == 110, "ROI break at its sensor column");
+    }
+
+    // Whole columns follow at 1 / 2^adaptShift per pair, so a line sagging
+    // by half that share of the tolerance per pair stays half the tolerance
+    // behind and is followed far past the tolerance; a step isn't
+    {
+        LfAlarmDetector detector(k_alarmWidth, settings);
+        unsigned int seq = 0;
+        armAlarm(detector, profile, &seq);
+        float drift = (float)settings.tolerance / (2 << settings.adaptShift);
+        float lineRow = k_alarmRow;
+        bool quiet = true;
+        for (unsigned int p = 0; p < 3000; p++)
+        {
+            lineRow += drift;
+            profile.set(0, k_alarmWidth, lineRow);
+            quiet = !detector.check(profile, 0, seq++, lfTimestampUs()) && quiet;
+        }
+        LF_CHECK(quiet && detector.getAlarms() == 0 && lineRow > k_alarmRow + 10 * settings.tolerance,
+                 "slow drift followed");
+        profile.set(0, k_alarmWidth, lineRow + 2 * (float)settings.tolerance);
+        LF_CHECK(detector.check(profile, 0, seq++, lfTimestampUs()), "step after drift breaks");
+    }
+}
+
+static void testBusTornReads(LfCpuLevel)
+{
+    // A two-slot ring and a publisher that never waits, so the reader is
+    // lapped constantly; whatever it accepts must be one whole pair
+    const unsigned int width = 64;
+    const unsigned int height = 64;
+    const unsigned int pairs = 20000;
+    char name[32];
+    snprintf(name, sizeof(name), "/lftest_%d", (int)getpid());
+    LfBusPublisher publisher;
+    LfBusReader reader;
+    if (!LF_CHECK(publisher.open(name, 2, width * height) == 0, "publisher open") ||
+        !LF_CHECK(reader.open(name) == 0, "reader open"))
+    {
+        return;
+    }
+
+    thread writer([&]() {
+        LfFramePool pool(2, width, height, LF_PIXEL_MONO8);
+        LfFrame *on = pool.lease();
+        LfFrame *off = pool.lease();
+        on->pair = off;
+        on->dataSize = off->dataSize = width * height;
+        for (unsigned int i = 0; i < pairs; i++)
+        {
+            on->seq = off->seq = i;
+            memset(on->data, busPixel(i, true), on->dataSize);
+            memset(off->data, busPixel(i, false), off->dataSize);
+            publisher.publish(on);
+            if (i % 64 == 0)
+            {
+                sched_yield();
+            }
+        }
+        on->pair = NULL;
+        pool.release(on);
+        pool.release(off);
+        publisher.close();
+    });
+
+    LfFramePool copies(2, width, height, LF_PIXEL_MONO8);
+    LfFrame *onCopy = copies.lease();
+    LfFrame *offCopy = copies.lease();
+    unsigned long accepted = 0;
+    unsigned long rejected = 0;
+    unsigned long bad = 0;
+    LfBusView view;
+    int result;
+    while ((result = reader.next(&view, 1000000)) >= 0)
+    {
+        if (result != 0)
+        {
+            continue;
+        }
+        if ((accepted + rejected) % 2 == 0)
+        {
+            // Copied out: both frames and their info must match the pair
+            if (reader.copyOut(view, true, onCopy) == 0 && reader.copyOut(view, false, offCopy) == 0)
+            {
+                accepted++;
+                bad += onCopy->seq != view.number || offCopy->seq != view.number ||
+                       !uniform(onCopy->data, onCopy->dataSize, busPixel(view.number, true)) ||
+                       !uniform(offCopy->data, offCopy->dataSize, busPixel(view.number, false));
+            }
+            else
+            {
+                rejected++;
+            }
+        }
+        else
+        {
+            // Read in place, giving the publisher the CPU in the middle
+            unsigned char first = view.onData[0];
+            sched_yield();
+            unsigned char last = view.offData[width * height - 1];
+            if (reader.validate(view))
+            {
+                accepted++;
+                bad += first != busPixel(view.number, true) || last != busPixel(view.number, false);
+            }
+            else
+            {
+                rejected++;
+            }
+        }
+    }
+    writer.join();
+    copies.release(onCopy);
+    copies.release(offCopy);
+
+    char what[96];
+    snprintf(what, sizeof(what), "%lu accepted, %lu torn, %lu skipped", accepted, rejected, reader.getSkipped());
+    LF_CHECK(bad == 0, what);
+    LF_CHECK(accepted > 0, what);
+    LF_CHECK(reader.getReceived() + reader.getSkipped() == pairs, what);
+    LF_CHECK(reader.getTorn() >= rejected, what);
+    if (verbose)
+    {
+        cout << "  bus: " << what << endl;
+    }
+    reader.close();
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (string(argv[i]) == "-v")
+        {
+            verbose = true;
+        }
+    }
+
+    LfCpuLevel maxLevel = lfDetectCpuLevel();
+    cout << "Testing kernels up to " << lfCpuLevelName(maxLevel) << endl;
+
+    struct {
+        const char *name;
+        void (*run)(LfCpuLevel);
+    } tests[] = {
+        { "diff kernels", testDiffKernels },
+        { "diff engine", testDiffEngine },
+        { "background kernels", testBackgroundKernels },
+        { "background restart", testBackgroundRestart },
+        { "frame diff kernels", testFrameDiffKernels },
+        { "change map", testChangeMap },
+        { "unpack kernels", testUnpackKernels },
+        { "converter views", testConverterView },
+        { "blob labeler", testBlobLabeler },
+        { "profiler", testProfiler },
+        { "node allocation", testNodeAlloc },
+        { "damaged recordings", testReplayDamaged },
+        { "codec rows", testCodecRows },
+        { "frame codec", testFrameCodec },
+        { "clip buffer", testClipBuffer },
+        { "alarm", testAlarm },
+        { "latency histogram", testLatencyHistogram },
+        { "log drops", testLogDrops },
+        { "pair resync", testPairResync },
+        { "ROI tracker", testRoiTracker },
+        { "steady-state allocations", testSteadyAllocs },
+        { "bus torn reads", testBusTornReads },
+    };
+    for (unsigned int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        unsigned int failedBefore = failures;
+        tests[i].run(maxLevel);
+        if (verbose || failures != failedBefore)
+        {
+            cout << tests[i].name << ": " << (failures == failedBefore ? "ok" : "FAILED") << endl;
+        }
+    }
+    cout << checks << " checks, " << failures << " failed" << endl;
+    return failures > 0 ? 1 : 0;
+}
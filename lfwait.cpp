@@ -0,0 +1,136 @@
+// Trigger-ready wait strategies for laser fence application.
+
+#include "lfwait.h"
+#include <iostream>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+using namespace std;
+
+static unsigned long long nowNs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *lfWaitModeName(LfWaitMode mode)
+{
+    switch (mode)
+    {
+    case LF_WAIT_SPIN:
+        return "spin";
+    case LF_WAIT_SPIN_YIELD:
+        return "spin-yield";
+    default:
+        return "backoff";
+    }
+}
+
+
+
+LfTriggerWait::LfTriggerWait()
+    : mode(LF_WAIT_SPIN_YIELD), spinReads(64), maxBackoffUs(500), cpuTime(0), errors(0), readyMetric(NULL)
+{
+}
+
+void LfTriggerWait::setMode(LfWaitMode mode, unsigned int spinReads, unsigned int maxBackoffUs)
+{
+    this->mode = mode;
+    this->spinReads = spinReads;
+    this->maxBackoffUs = maxBackoffUs ? maxBackoffUs : 1;
+}
+
+int LfTriggerWait::wait(LfRegisterSource *source, unsigned int address)
+{
+    unsigned long long start = nowNs(CLOCK_MONOTONIC);
+    unsigned long long cpuStart = nowNs(CLOCK_THREAD_CPUTIME_ID);
+    unsigned int regVal = 0;
+    unsigned int reads = 0;
+    unsigned int backoffUs = 1;
+
+    while (true)
+    {
+        if (source->readRegister(address, &regVal) != 0)
+        {
+            errors++;
+            return -1;
+        }
+        reads++;
+        if ((regVal >> 31) == 0)
+        {
+            break;
+        }
+
+        if (mode == LF_WAIT_SPIN || reads < spinReads)
+        {
+            continue;
+        }
+        if (mode == LF_WAIT_SPIN_YIELD)
+        {
+            sched_yield();
+            continue;
+        }
+
+        usleep(backoffUs);
+        if (backoffUs < maxBackoffUs)
+        {
+            backoffUs = backoffUs * 2 < maxBackoffUs ? backoffUs * 2 : maxBackoffUs;
+        }
+    }
+
+    unsigned long long ready = nowNs(CLOCK_MONOTONIC) - start;
+    readyTime.record(ready);
+    if (readyMetric != NULL)
+    {
+        readyMetric->record(ready);
+    }
+    readCount.record(reads);
+    cpuTime += nowNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+    return 0;
+}
+
+void LfTriggerWait::resetStats()
+{
+    readyTime.reset();
+    readCount.reset();
+    cpuTime = 0;
+    errors = 0;
+}
+
+void LfTriggerWait::printStats()
+{
+    cout << "Trigger wait (" << lfWaitModeName(mode) << "), " << errors << " read errors, "
+         << cpuTime / 1000 << " us CPU" << endl;
+    readyTime.print(cout, "  time to ready", "ns");
+    readCount.print(cout, "  reads per trigger", "");
+}
+
+
+
+LfScriptedRegister::LfScriptedRegister(unsigned int readCostUs)
+    : readyAt(0), readCostUs(readCostUs), reads(0)
+{
+}
+
+void LfScriptedRegister::arm(unsigned int delayUs)
+{
+    readyAt = nowNs(CLOCK_MONOTONIC) + delayUs * 1000ULL;
+}
+
+int LfScriptedRegister::readRegister(unsigned int /*address*/, unsigned int *value)
+{
+    // Burn the link round trip without sleeping, as a register read would
+    if (readCostUs)
+    {
+        unsigned long long until = nowNs(CLOCK_MONOTONIC) + readCostUs * 1000ULL;
+        while (nowNs(CLOCK_MONOTONIC) < until)
+        {
+        }
+    }
+
+    reads++;
+    *value = nowNs(CLOCK_MONOTONIC) < readyAt ? 0x80000000 : 0;
+    return 0;
+}
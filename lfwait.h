@@ -0,0 +1,67 @@
+// Trigger-ready wait strategies for laser fence application.
+
+#ifndef LFWAIT_H
+#define LFWAIT_H
+
+#include "stdafx.h"
+#include "lfmetrics.h"
+
+// Register reads used while waiting for the trigger.  LfCam reads the
+// camera; LfScriptedRegister stands in for one when there is no hardware.
+class LfRegisterSource {
+public:
+    virtual ~LfRegisterSource() {}
+    // Returns 0 on success, -1 on failure
+    virtual int readRegister(unsigned int address, unsigned int *value) = 0;
+};
+
+enum LfWaitMode {
+    LF_WAIT_SPIN = 0,       // Read the register back to back
+    LF_WAIT_SPIN_YIELD,     // Spin, then yield the CPU between reads
+    LF_WAIT_BACKOFF         // Spin, then sleep with exponential backoff
+};
+
+const char *lfWaitModeName(LfWaitMode mode);
+
+// Waits for the software trigger register to report ready (bit 31 clear)
+// and keeps statistics so the modes can be compared on latency and CPU.
+class LfTriggerWait {
+protected:
+    LfWaitMode mode;
+    unsigned int spinReads;     // Reads before yielding or sleeping
+    unsigned int maxBackoffUs;  // Upper bound on one backoff sleep
+    LfLatencyHistogram readyTime;   // ns from start of wait to ready
+    LfLatencyHistogram readCount;   // Register reads per trigger
+    unsigned long long cpuTime; // ns of thread CPU time spent waiting
+    unsigned long errors;
+    LfLatencyHistogram *readyMetric;
+public:
+    LfTriggerWait();
+    void setMode(LfWaitMode mode, unsigned int spinReads = 64, unsigned int maxBackoffUs = 500);
+    LfWaitMode getMode() const { return mode; }
+    // Returns 0 when ready, -1 if a register read failed
+    int wait(LfRegisterSource *source, unsigned int address);
+    // Also record each wait's ready time here, NULL to stop
+    void setMetrics(LfLatencyHistogram *readyTime) { readyMetric = readyTime; }
+    void resetStats();
+    const LfLatencyHistogram &getReadyTime() const { return readyTime; }
+    const LfLatencyHistogram &getReadCount() const { return readCount; }
+    unsigned long long getCpuTime() const { return cpuTime; }
+    void printStats();
+};
+
+// Register source that reports busy until a scripted delay has passed
+// since arm(), optionally costing some time per read like a real link.
+class LfScriptedRegister: public LfRegisterSource {
+protected:
+    unsigned long long readyAt;
+    unsigned int readCostUs;
+    unsigned long reads;
+public:
+    LfScriptedRegister(unsigned int readCostUs = 0);
+    void arm(unsigned int delayUs);
+    virtual int readRegister(unsigned int address, unsigned int *value);
+    unsigned long getReads() const { return reads; }
+};
+
+#endif
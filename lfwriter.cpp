@@ -0,0 +1,473 @@
+// Asynchronous frame writer for laser fence application.
+
+#include "lfwriter.h"
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+using namespace std;
+
+static const size_t k_directAlign = 4096;
+
+static size_t roundUp(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+static void releaseWithPair(LfFrame *frame)
+{
+    LfFrame *pair = frame->pair;
+    frame->pair = NULL;
+    LfFramePool::releaseFrame(pair);
+    LfFramePool::releaseFrame(frame);
+}
+
+// writev() until everything is out, resuming after partial writes
+static int writeAll(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+LfFrameWriter::LfFrameWriter(const char *directory, const char *prefix, LfWriteFormat format,
+                             unsigned int numWorkers, unsigned int queueDepth)
+    : directory(directory), prefix(prefix), format(format),
+      numWorkers(numWorkers ? numWorkers : 1), batchSize(4), directIo(false), preallocate(false),
+      maxFrameBytes(0), capacity(queueDepth ? queueDepth : 1), head(0), queued(0), highWater(0),
+      running(false), nextNumber(0), startTime(0), bytesWritten(0), writeTime(0),
+      framesWritten(0), writeErrors(0), dropped(0), saveTime(NULL)
+{
+    jobs = new Job[capacity];
+}
+
+LfFrameWriter::~LfFrameWriter()
+{
+    stop();
+    delete[] jobs;
+}
+
+int LfFrameWriter::start(size_t maxBytes)
+{
+    if (running)
+    {
+        return -1;
+    }
+    maxFrameBytes = maxBytes;
+
+    // 12-bit frames grow by a third when unpacked to 16-bit samples
+    size_t pixelBytes = maxFrameBytes / 3 * 4 + 4;
+
+    // Room for the header plus the larger of the raw and compressed image,
+    // padded so O_DIRECT can write it in whole blocks
+    size_t encodedBytes = compressBound(pixelBytes + 64);
+    if (encodedBytes < pixelBytes + 64)
+    {
+        encodedBytes = pixelBytes + 64;
+    }
+    // A coded pair's worst case: every block at full width, plus the part
+    // blocks and slice rounding, at most 3.2 times a frame at least 64
+    // bytes wide
+    if (format == LF_WRITE_LFC && encodedBytes < 7 * maxFrameBytes + 4096)
+    {
+        encodedBytes = 7 * maxFrameBytes + 4096;
+    }
+    scratch.resize(numWorkers);
+    for (unsigned int i = 0; i < numWorkers; i++)
+    {
+        Scratch &s = scratch[i];
+        s.bounceSize = roundUp(encodedBytes, k_directAlign);
+        s.pixelsSize = pixelBytes;
+        s.bounce = NULL;
+        s.pixels = NULL;
+        if (posix_memalign((void **)&s.bounce, k_directAlign, s.bounceSize) != 0 ||
+            posix_memalign((void **)&s.pixels, k_directAlign, roundUp(s.pixelsSize, k_directAlign)) != 0)
+        {
+            cout << "Failed to allocate writer buffers" << endl;
+            return -1;
+        }
+        z_stream *zs = new z_stream();
+        // Level 1 with a gzip wrapper: speed over ratio
+        if (deflateInit2(zs, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            delete zs;
+            zs = NULL;
+        }
+        s.zstream = zs;
+        s.codec = format == LF_WRITE_LFC ? new LfFrameCodec() : NULL;
+    }
+
+    startTime = lfTimestampUs();
+    running = true;
+    for (unsigned int i = 0; i < numWorkers; i++)
+    {
+        workers.push_back(thread(&LfFrameWriter::workerLoop, this, i));
+    }
+    return 0;
+}
+
+void LfFrameWriter::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if (!running)
+        {
+            return;
+        }
+        running = false;
+    }
+    notEmpty.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    workers.clear();
+
+    for (size_t i = 0; i < scratch.size(); i++)
+    {
+        if (scratch[i].zstream != NULL)
+        {
+            deflateEnd((z_stream *)scratch[i].zstream);
+            delete (z_stream *)scratch[i].zstream;
+        }
+        delete scratch[i].codec;
+        free(scratch[i].bounce);
+        free(scratch[i].pixels);
+    }
+    scratch.clear();
+}
+
+bool LfFrameWriter::submit(LfFrame *frame)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        if (running && queued < capacity)
+        {
+            Job &job = jobs[(head + queued) % capacity];
+            job.frame = frame;
+            job.number = nextNumber++;
+            queued++;
+            if (queued > highWater)
+            {
+                highWater = queued;
+            }
+            notEmpty.notify_one();
+            return true;
+        }
+    }
+
+    // Never make the caller wait for the disk
+    dropped.fetch_add(1, memory_order_relaxed);
+    releaseWithPair(frame);
+    return false;
+}
+
+void LfFrameWriter::setMetrics(LfMetricsRegistry &registry)
+{
+    saveTime = registry.addHistogram("lf_save_seconds", "Time to encode and write one frame");
+    registry.addValue("lf_frames_written_total", "Frames written to disk", "", LF_METRIC_COUNTER, &framesWritten);
+    registry.addValue("lf_write_errors_total", "Frames that failed to write", "", LF_METRIC_COUNTER, &writeErrors);
+    registry.addCallback("lf_queue_depth", "Items waiting in a queue", "queue=\"writer\"", LF_METRIC_GAUGE,
+                         readDepth, this);
+    registry.addValue("lf_queue_dropped_total", "Items dropped by a full queue", "queue=\"writer\"",
+                      LF_METRIC_COUNTER, &dropped);
+}
+
+double LfFrameWriter::readDepth(void *context)
+{
+    LfFrameWriter *writer = (LfFrameWriter *)context;
+    lock_guard<mutex> guard(writer->lock);
+    return writer->queued;
+}
+
+void LfFrameWriter::workerLoop(unsigned int worker)
+{
+    Job batch[64];
+    unsigned int maxBatch = batchSize < 64 ? batchSize : 64;
+
+    while (true)
+    {
+        unsigned int n = 0;
+        {
+            unique_lock<mutex> guard(lock);
+            while (running && queued == 0)
+            {
+                notEmpty.wait(guard);
+            }
+            // Drain what is left before exiting
+            if (!running && queued == 0)
+            {
+                break;
+            }
+            // Take several jobs per wake-up to amortize the lock
+            while (queued > 0 && n < maxBatch)
+            {
+                batch[n++] = jobs[head];
+                head = (head + 1) % capacity;
+                queued--;
+            }
+        }
+
+        for (unsigned int i = 0; i < n; i++)
+        {
+            unsigned long long begin = lfTimestampUs();
+            if (writeFrame(batch[i], scratch[worker]) != 0)
+            {
+                writeErrors.fetch_add(1, memory_order_relaxed);
+            }
+            else
+            {
+                framesWritten.fetch_add(1, memory_order_relaxed);
+            }
+            unsigned long long elapsed = lfTimestampUs() - begin;
+            writeTime.fetch_add(elapsed, memory_order_relaxed);
+            if (saveTime != NULL)
+            {
+                saveTime->record(elapsed * 1000);
+            }
+            releaseWithPair(batch[i].frame);
+        }
+    }
+}
+
+int LfFrameWriter::writeFrame(const Job &job, Scratch &s)
+{
+    const LfFrame *frame = job.frame;
+    char path[512];
+    struct iovec iov[2];
+
+    // Coded in memory, padded rows and all, and written in one go
+    if (format == LF_WRITE_LFC)
+    {
+        size_t bytes = s.codec->encode(frame, frame->pair, s.bounce, s.bounceSize);
+        if (bytes == 0)
+        {
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/%s-c%u-%08lu.lfc", directory.c_str(), prefix.c_str(),
+                 frame->camera, job.number);
+        iov[0].iov_base = s.bounce;
+        iov[0].iov_len = bytes;
+        return writeFile(path, iov, 1, bytes, s);
+    }
+
+    unsigned int bytesPerPixel;
+    unsigned int maxVal;
+
+    switch (frame->format)
+    {
+    case LF_PIXEL_MONO8:
+        bytesPerPixel = 1;
+        maxVal = 255;
+        break;
+    case LF_PIXEL_MONO12:
+        bytesPerPixel = 2;
+        maxVal = 4095;
+        break;
+    case LF_PIXEL_MONO16:
+        bytesPerPixel = 2;
+        maxVal = 65535;
+        break;
+    default:
+        return -1;
+    }
+
+    size_t rowBytes = (size_t)frame->width * bytesPerPixel;
+    size_t payloadBytes = rowBytes * frame->height;
+    if (payloadBytes > s.pixelsSize)
+    {
+        return -1;
+    }
+
+    char header[64];
+    int headerBytes = snprintf(header, sizeof(header), "P5\n%u %u\n%u\n",
+                               frame->width, frame->height, maxVal);
+
+    // Raw frames go out as-is; padded rows are packed, 16-bit samples
+    // swapped to the big-endian order PGM requires and 12-bit pairs
+    // unpacked to one sample each
+    const unsigned char *payload = frame->data;
+    if (frame->format == LF_PIXEL_MONO12)
+    {
+        for (unsigned int y = 0; y < frame->height; y++)
+        {
+            const unsigned char *in = frame->data + (size_t)y * frame->stride;
+            unsigned char *out = s.pixels + y * rowBytes;
+            for (unsigned int x = 0; x < frame->width; x += 2, in += 3, out += 4)
+            {
+                out[0] = in[0] >> 4;
+                out[1] = in[0] << 4 | (in[1] & 0x0f);
+                if (x + 1 < frame->width)
+                {
+                    out[2] = in[2] >> 4;
+                    out[3] = in[2] << 4 | in[1] >> 4;
+                }
+            }
+        }
+        payload = s.pixels;
+    }
+    else if (bytesPerPixel == 2)
+    {
+        for (unsigned int y = 0; y < frame->height; y++)
+        {
+            const unsigned char *in = frame->data + (size_t)y * frame->stride;
+            unsigned char *out = s.pixels + y * rowBytes;
+            for (size_t x = 0; x < rowBytes; x += 2)
+            {
+                out[x] = in[x + 1];
+                out[x + 1] = in[x];
+            }
+        }
+        payload = s.pixels;
+    }
+    else if (frame->stride != rowBytes)
+    {
+        for (unsigned int y = 0; y < frame->height; y++)
+        {
+            memcpy(s.pixels + y * rowBytes, frame->data + (size_t)y * frame->stride, rowBytes);
+        }
+        payload = s.pixels;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s-c%u-%08lu.pgm%s", directory.c_str(), prefix.c_str(),
+             frame->camera, job.number, format == LF_WRITE_PGM_GZ ? ".gz" : "");
+
+    if (format == LF_WRITE_PGM_GZ)
+    {
+        z_stream *zs = (z_stream *)s.zstream;
+        if (zs == NULL || deflateReset(zs) != Z_OK)
+        {
+            return -1;
+        }
+        zs->next_out = s.bounce;
+        zs->avail_out = s.bounceSize;
+        zs->next_in = (Bytef *)header;
+        zs->avail_in = headerBytes;
+        deflate(zs, Z_NO_FLUSH);
+        zs->next_in = (Bytef *)payload;
+        zs->avail_in = payloadBytes;
+        if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        {
+            return -1;
+        }
+        iov[0].iov_base = s.bounce;
+        iov[0].iov_len = zs->total_out;
+        return writeFile(path, iov, 1, zs->total_out, s);
+    }
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerBytes;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payloadBytes;
+    return writeFile(path, iov, 2, headerBytes + payloadBytes, s);
+}
+
+int LfFrameWriter::writeFile(const char *path, const struct iovec *iov, int iovcnt, size_t total,
+                             Scratch &s)
+{
+    bool direct = directIo;
+    int fd = -1;
+#ifdef O_DIRECT
+    if (direct)
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    }
+#endif
+    if (fd < 0)
+    {
+        // Not every file system supports O_DIRECT
+        direct = false;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    size_t fileBytes = direct ? roundUp(total, k_directAlign) : total;
+    if (preallocate)
+    {
+        posix_fallocate(fd, 0, fileBytes);
+    }
+
+    struct iovec out[2];
+    int outcnt = iovcnt;
+    if (direct)
+    {
+        // O_DIRECT needs one aligned buffer in whole blocks
+        if (iov[0].iov_base != s.bounce)
+        {
+            size_t offset = 0;
+            for (int i = 0; i < iovcnt; i++)
+            {
+                memcpy(s.bounce + offset, iov[i].iov_base, iov[i].iov_len);
+                offset += iov[i].iov_len;
+            }
+        }
+        memset(s.bounce + total, 0, fileBytes - total);
+        out[0].iov_base = s.bounce;
+        out[0].iov_len = fileBytes;
+        outcnt = 1;
+    }
+    else
+    {
+        for (int i = 0; i < iovcnt; i++)
+        {
+            out[i] = iov[i];
+        }
+    }
+
+    int result = writeAll(fd, out, outcnt);
+    if (result == 0 && (direct || preallocate) && ftruncate(fd, total) != 0)
+    {
+        result = -1;
+    }
+    if (close(fd) != 0)
+    {
+        result = -1;
+    }
+    if (result == 0)
+    {
+        bytesWritten.fetch_add(total, memory_order_relaxed);
+    }
+    return result;
+}
+
+void LfFrameWriter::printStats()
+{
+    unsigned long long elapsed = lfTimestampUs() - startTime;
+    unsigned long long bytes = bytesWritten.load();
+    unsigned long frames = framesWritten.load();
+    cout << "Writer: " << frames << " frames, " << bytes / (1024 * 1024) << " MB, "
+         << (elapsed ? (double)bytes / elapsed : 0.0) << " MB/s, "
+         << (frames ? writeTime.load() / frames : 0) << " us/frame, "
+         << dropped.load() << " dropped, " << writeErrors.load() << " errors, "
+         << "queue high water " << highWater << "/" << capacity << endl;
+}
@@ -0,0 +1,98 @@
+// Asynchronous frame writer for laser fence application.
+
+#ifndef LFWRITER_H
+#define LFWRITER_H
+
+#include "stdafx.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lfbuf.h"
+#include "lfcodec.h"
+#include "lfmetrics.h"
+
+enum LfWriteFormat {
+    LF_WRITE_PGM = 0,   // Raw binary PGM, written straight from the frame
+    LF_WRITE_PGM_GZ,    // Gzip-compressed PGM
+    LF_WRITE_LFC        // Frame and its pair in one lossless .lfc image
+};
+
+// Writes frames to disk on a pool of worker threads so that encoding and
+// file I/O never run on the capture path.  submit() takes ownership of the
+// frame and returns it to its pool once written; when the queue is full
+// the frame is dropped instead of blocking the caller.
+class LfFrameWriter {
+protected:
+    struct Job {
+        LfFrame *frame;
+        unsigned long number;
+    };
+    // Per-worker scratch, allocated once at start()
+    struct Scratch {
+        unsigned char *bounce;      // Encoded file image, O_DIRECT aligned
+        size_t bounceSize;
+        unsigned char *pixels;      // Packed or byte-swapped pixels
+        size_t pixelsSize;
+        void *zstream;
+        LfFrameCodec *codec;
+    };
+    std::string directory;
+    std::string prefix;
+    LfWriteFormat format;
+    unsigned int numWorkers;
+    unsigned int batchSize;
+    bool directIo;
+    bool preallocate;
+    size_t maxFrameBytes;
+    Job *jobs;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int queued;
+    unsigned int highWater;
+    bool running;
+    std::mutex lock;
+    std::condition_variable notEmpty;
+    std::vector<std::thread> workers;
+    std::vector<Scratch> scratch;
+    unsigned long nextNumber;
+    unsigned long long startTime;
+    std::atomic<unsigned long long> bytesWritten;
+    std::atomic<unsigned long long> writeTime;
+    std::atomic<unsigned long> framesWritten;
+    std::atomic<unsigned long> writeErrors;
+    std::atomic<unsigned long> dropped;
+    LfLatencyHistogram *saveTime;
+    static double readDepth(void *context);
+    void workerLoop(unsigned int worker);
+    int writeFrame(const Job &job, Scratch &scratch);
+    int writeFile(const char *path, const struct iovec *iov, int iovcnt, size_t total, Scratch &scratch);
+public:
+    LfFrameWriter(const char *directory, const char *prefix, LfWriteFormat format,
+                  unsigned int numWorkers, unsigned int queueDepth);
+    ~LfFrameWriter();
+    // Jobs a worker takes per wake-up
+    void setBatchSize(unsigned int n) { batchSize = n ? n : 1; }
+    // O_DIRECT bypasses the page cache; writes go through an aligned
+    // bounce buffer padded to the block size
+    void setDirectIo(bool on) { directIo = on; }
+    // Reserve each file's blocks before writing
+    void setPreallocate(bool on) { preallocate = on; }
+    // Largest frame that will be submitted, used to size worker scratch
+    int start(size_t maxFrameBytes);
+    void stop();
+    // Takes the frame's pair along with it when it keeps pairs; otherwise
+    // the caller unlinks and releases the pair before submitting
+    bool submit(LfFrame *frame);
+    bool takesPairs() const { return format == LF_WRITE_LFC; }
+    unsigned long getFramesWritten() const { return framesWritten.load(std::memory_order_relaxed); }
+    unsigned long getDropped() const { return dropped.load(std::memory_order_relaxed); }
+    unsigned int getHighWater() const { return highWater; }
+    // Export save latency, frames written and dropped, and queue depth
+    void setMetrics(LfMetricsRegistry &registry);
+    void printStats();
+};
+
+#endif
@@ -0,0 +1,477 @@
+// FlyCapture2 stand-in for laser fence application.
+//
+// Just enough of the FlyCapture2 API for lfapp to build and start without
+// the SDK or any cameras, to time and debug camera bring-up.  Calls take
+// about as long as they do on a GigE link:
+//   register read or write          3 ms
+//   Connect()                       40 ms
+//   camera power-up                 300 ms after the power register write
+//   SetGigEImageSettings()          80 ms
+//   DiscoverGigECameras()           1 s
+// RetrieveBuffer() always times out, so no frames are ever captured.
+//
+// Environment:
+//   STUB_CAMS=n     cameras on the bus, serials 1000 up (default 1)
+//   STUB_WARM=1     cameras are already powered and configured as lfapp
+//                   leaves them, as after a restart of lfapp alone
+//   STUB_DEAD=n     camera n never reports power-up
+//
+// Build with make lfapp-stub.
+
+#ifndef FLYCAPTURE2_STUB_H
+#define FLYCAPTURE2_STUB_H
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace FlyCapture2 {
+
+enum ErrorType {
+    PGRERROR_OK,
+    PGRERROR_FAILED,
+    PGRERROR_TIMEOUT,
+    PGRERROR_IMAGE_CONSISTENCY_ERROR
+};
+
+class Error {
+protected:
+    ErrorType type;
+public:
+    Error() : type(PGRERROR_OK) {}
+    Error(ErrorType type) : type(type) {}
+    bool operator==(ErrorType t) const { return type == t; }
+    bool operator!=(ErrorType t) const { return type != t; }
+    ErrorType GetType() const { return type; }
+    const char *GetDescription() const { return type == PGRERROR_TIMEOUT ? "Timeout (stub)" : "Failed (stub)"; }
+    void PrintErrorTrace() const {}
+};
+
+struct PGRGuid {
+    unsigned int value[4];
+};
+
+enum InterfaceType {
+    INTERFACE_GIGE,
+    INTERFACE_USB2
+};
+
+enum PixelFormat {
+    PIXEL_FORMAT_MONO8 = 0x80000000,
+    PIXEL_FORMAT_MONO12 = 0x00100000,
+    PIXEL_FORMAT_MONO16 = 0x04000000,
+    PIXEL_FORMAT_RAW8 = 0x00400000,
+    PIXEL_FORMAT_RAW16 = 0x00040000
+};
+
+enum BayerTileFormat {
+    NONE
+};
+
+struct TimeStamp {
+    long long seconds;
+    unsigned int microSeconds;
+    unsigned int cycleSeconds;
+    unsigned int cycleCount;
+    unsigned int cycleOffset;
+};
+
+struct ImageMetadata {
+    unsigned int embeddedTimeStamp;
+    unsigned int embeddedGain;
+    unsigned int embeddedShutter;
+    unsigned int embeddedBrightness;
+    unsigned int embeddedExposure;
+    unsigned int embeddedWhiteBalance;
+    unsigned int embeddedFrameCounter;
+    unsigned int embeddedStrobePattern;
+    unsigned int embeddedGPIOPinState;
+    unsigned int embeddedROIPosition;
+};
+
+class Image {
+public:
+    Image() {}
+    Image(unsigned int, unsigned int, unsigned int, unsigned char *, unsigned int, PixelFormat,
+          BayerTileFormat = NONE)
+    {
+    }
+    Error Convert(PixelFormat, Image *) const { return Error(); }
+    Error Save(const char *) { return Error(); }
+    unsigned char *GetData() const { return NULL; }
+    unsigned int GetRows() const { return 0; }
+    unsigned int GetCols() const { return 0; }
+    unsigned int GetStride() const { return 0; }
+    unsigned int GetDataSize() const { return 0; }
+    PixelFormat GetPixelFormat() const { return PIXEL_FORMAT_MONO8; }
+    TimeStamp GetTimeStamp() const
+    {
+        TimeStamp t;
+        memset(&t, 0, sizeof(t));
+        return t;
+    }
+    ImageMetadata GetMetadata() const
+    {
+        ImageMetadata m;
+        memset(&m, 0, sizeof(m));
+        return m;
+    }
+    Error SetData(const unsigned char *, unsigned int) { return Error(); }
+    Error SetDimensions(unsigned int, unsigned int, unsigned int, PixelFormat, BayerTileFormat) { return Error(); }
+};
+
+struct FC2Version {
+    unsigned int major;
+    unsigned int minor;
+    unsigned int type;
+    unsigned int build;
+};
+
+struct Utilities {
+    static Error GetLibraryVersion(FC2Version *version)
+    {
+        memset(version, 0, sizeof(*version));
+        return Error();
+    }
+};
+
+struct TriggerModeInfo {
+    bool present;
+};
+
+struct TriggerMode {
+    bool onOff;
+    unsigned int polarity;
+    unsigned int source;
+    unsigned int mode;
+    unsigned int parameter;
+};
+
+struct FC2Config {
+    int grabTimeout;
+    unsigned int numBuffers;
+};
+
+struct IPAddress {
+    unsigned char octets[4];
+};
+
+struct MACAddress {
+    unsigned char octets[6];
+};
+
+struct CameraInfo {
+    unsigned int serialNumber;
+    char modelName[512];
+    char vendorName[512];
+    char sensorInfo[512];
+    char sensorResolution[512];
+    char firmwareVersion[512];
+    char firmwareBuildTime[512];
+    char userDefinedName[512];
+    char xmlURL1[512];
+    char xmlURL2[512];
+    unsigned int gigEMajorVersion;
+    unsigned int gigEMinorVersion;
+    MACAddress macAddress;
+    IPAddress ipAddress;
+    IPAddress subnetMask;
+    IPAddress defaultGateway;
+};
+
+struct GigEStreamChannel {
+    unsigned int networkInterfaceIndex;
+    unsigned int hostPort;
+    bool doNotFragment;
+    unsigned int packetSize;
+    unsigned int interPacketDelay;
+    IPAddress destinationIpAddress;
+    unsigned int sourcePort;
+};
+
+struct GigEImageSettingsInfo {
+    unsigned int maxWidth;
+    unsigned int maxHeight;
+    unsigned int offsetHStepSize;
+    unsigned int offsetVStepSize;
+    unsigned int imageHStepSize;
+    unsigned int imageVStepSize;
+    unsigned int pixelFormatBitField;
+};
+
+struct GigEImageSettings {
+    unsigned int offsetX;
+    unsigned int offsetY;
+    unsigned int width;
+    unsigned int height;
+    PixelFormat pixelFormat;
+};
+
+struct EmbeddedImageInfoProperty {
+    bool available;
+    bool onOff;
+};
+
+struct EmbeddedImageInfo {
+    EmbeddedImageInfoProperty timestamp;
+    EmbeddedImageInfoProperty gain;
+    EmbeddedImageInfoProperty shutter;
+    EmbeddedImageInfoProperty brightness;
+    EmbeddedImageInfoProperty exposure;
+    EmbeddedImageInfoProperty whiteBalance;
+    EmbeddedImageInfoProperty frameCounter;
+    EmbeddedImageInfoProperty strobePattern;
+    EmbeddedImageInfoProperty GPIOPinState;
+    EmbeddedImageInfoProperty ROIPosition;
+};
+
+// Camera power register, and its bit reading back as powered up
+static const unsigned int k_stubPowerRegister = 0x610;
+static const unsigned int k_stubPowered = 0x80000000;
+static const unsigned int k_stubFirstSerial = 1000;
+
+inline void stubWait(unsigned int ms)
+{
+    usleep(ms * 1000);
+}
+
+inline long long stubNowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+inline bool stubWarm()
+{
+    return getenv("STUB_WARM") != NULL;
+}
+
+inline bool stubDead(unsigned int serial)
+{
+    const char *dead = getenv("STUB_DEAD");
+    return dead != NULL && serial == k_stubFirstSerial + (unsigned int)atoi(dead);
+}
+
+inline unsigned int stubCameras()
+{
+    const char *count = getenv("STUB_CAMS");
+    return count != NULL ? (unsigned int)atoi(count) : 1;
+}
+
+class Camera {
+protected:
+    unsigned int serial;
+    bool powered;
+    long long poweredAt;            // ms when the power register reads back
+    TriggerMode trigger;
+    FC2Config config;
+    GigEImageSettings image;
+    IPAddress destination;
+public:
+    Camera() : serial(0), powered(stubWarm()), poweredAt(0)
+    {
+        memset(&trigger, 0, sizeof(trigger));
+        memset(&image, 0, sizeof(image));
+        memset(&destination, 0, sizeof(destination));
+        config.grabTimeout = 100;
+        config.numBuffers = 4;
+        if (stubWarm())
+        {
+            // What lfapp configures, so a warm start finds nothing to write
+            trigger.onOff = true;
+            trigger.polarity = 1;
+            trigger.mode = 15;
+            trigger.parameter = 2;
+            config.grabTimeout = 5000;
+            image.width = 640;
+            image.height = 480;
+            image.pixelFormat = PIXEL_FORMAT_MONO8;
+            destination.octets[0] = 224;
+            destination.octets[3] = 1;
+        }
+    }
+    virtual ~Camera() {}
+    Error Connect(PGRGuid *guid)
+    {
+        stubWait(40);
+        serial = guid->value[0];
+        return Error();
+    }
+    Error Disconnect() { return Error(); }
+    bool IsConnected() { return true; }
+    Error StartCapture()
+    {
+        stubWait(20);
+        return Error();
+    }
+    Error StopCapture() { return Error(); }
+    Error RetrieveBuffer(Image *)
+    {
+        stubWait(5);
+        return Error(PGRERROR_TIMEOUT);
+    }
+    Error ReadRegister(unsigned int address, unsigned int *value)
+    {
+        stubWait(3);
+        *value = 0;
+        if (address == k_stubPowerRegister && powered && stubNowMs() >= poweredAt && !stubDead(serial))
+        {
+            *value = k_stubPowered;
+        }
+        return Error();
+    }
+    Error WriteRegister(unsigned int address, unsigned int, bool = false)
+    {
+        stubWait(3);
+        if (address == k_stubPowerRegister && !powered)
+        {
+            powered = true;
+            poweredAt = stubNowMs() + 300;
+        }
+        return Error();
+    }
+    Error GetTriggerModeInfo(TriggerModeInfo *info)
+    {
+        stubWait(3);
+        info->present = true;
+        return Error();
+    }
+    Error GetTriggerMode(TriggerMode *mode)
+    {
+        stubWait(3);
+        *mode = trigger;
+        return Error();
+    }
+    Error SetTriggerMode(TriggerMode *mode, bool = false)
+    {
+        stubWait(15);
+        trigger = *mode;
+        return Error();
+    }
+    Error GetConfiguration(FC2Config *c)
+    {
+        *c = config;
+        return Error();
+    }
+    Error SetConfiguration(const FC2Config *c)
+    {
+        stubWait(10);
+        config = *c;
+        return Error();
+    }
+    Error GetCameraInfo(CameraInfo *info)
+    {
+        memset(info, 0, sizeof(*info));
+        info->serialNumber = serial;
+        return Error();
+    }
+    Error GetEmbeddedImageInfo(EmbeddedImageInfo *info)
+    {
+        stubWait(3);
+        memset(info, 0, sizeof(*info));
+        return Error();
+    }
+    Error SetEmbeddedImageInfo(EmbeddedImageInfo *)
+    {
+        stubWait(6);
+        return Error();
+    }
+    Error SetUserBuffers(unsigned char *, int, int) { return Error(); }
+};
+
+class GigECamera: public Camera {
+public:
+    Error GetNumStreamChannels(unsigned int *count)
+    {
+        stubWait(3);
+        *count = 1;
+        return Error();
+    }
+    Error GetGigEStreamChannelInfo(unsigned int, GigEStreamChannel *channel)
+    {
+        stubWait(3);
+        memset(channel, 0, sizeof(*channel));
+        channel->destinationIpAddress = destination;
+        return Error();
+    }
+    Error SetGigEStreamChannelInfo(unsigned int, GigEStreamChannel *channel)
+    {
+        stubWait(10);
+        destination = channel->destinationIpAddress;
+        return Error();
+    }
+    Error GetGigEImageSettingsInfo(GigEImageSettingsInfo *info)
+    {
+        stubWait(12);
+        memset(info, 0, sizeof(*info));
+        info->maxWidth = 640;
+        info->maxHeight = 480;
+        info->offsetHStepSize = 4;
+        info->offsetVStepSize = 4;
+        info->imageHStepSize = 4;
+        info->imageVStepSize = 4;
+        return Error();
+    }
+    Error GetGigEImageSettings(GigEImageSettings *settings)
+    {
+        stubWait(3);
+        *settings = image;
+        return Error();
+    }
+    Error SetGigEImageSettings(const GigEImageSettings *settings)
+    {
+        stubWait(80);
+        image = *settings;
+        return Error();
+    }
+};
+
+class BusManager {
+public:
+    Error GetNumOfCameras(unsigned int *count)
+    {
+        stubWait(5);
+        *count = stubCameras();
+        return Error();
+    }
+    Error GetCameraFromIndex(unsigned int index, PGRGuid *guid)
+    {
+        memset(guid, 0, sizeof(*guid));
+        guid->value[0] = k_stubFirstSerial + index;
+        return Error();
+    }
+    Error GetInterfaceTypeFromGuid(PGRGuid *, InterfaceType *type)
+    {
+        *type = INTERFACE_GIGE;
+        return Error();
+    }
+    Error GetCameraFromSerialNumber(unsigned int serial, PGRGuid *guid)
+    {
+        stubWait(2);
+        if (serial < k_stubFirstSerial || serial >= k_stubFirstSerial + stubCameras())
+        {
+            return Error(PGRERROR_FAILED);
+        }
+        memset(guid, 0, sizeof(*guid));
+        guid->value[0] = serial;
+        return Error();
+    }
+    static Error DiscoverGigECameras(CameraInfo *info, unsigned int *count)
+    {
+        // *count holds the room in info on the way in
+        stubWait(1000);
+        *count = stubCameras() < *count ? stubCameras() : *count;
+        for (unsigned int i = 0; i < *count; i++)
+        {
+            memset(&info[i], 0, sizeof(info[i]));
+            info[i].serialNumber = k_stubFirstSerial + i;
+        }
+        return Error();
+    }
+};
+
+}
+
+#endif